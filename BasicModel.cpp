@@ -3,10 +3,16 @@
 #include <fstream>
 #include <string>
 
-#include "Triangle.h"
+#include "MeshCache.h"
+#include "MeshOptimizer.h"
+#include "MeshParser.h"
+#include "MeshSimplifier.h"
 
 using namespace std;
 
+// setLOD stops simplifying before a level would have fewer faces than this
+#define MIN_LOD_FACES 256
+
 BasicModel::BasicModel(string filename)
 {
    max_x = max_y = max_z = 1.1754E-38F;
@@ -22,10 +28,6 @@ BasicModel::BasicModel(string filename)
    {
       max_extent = max_y - min_y;
    }
-   center.x = center.x/Vertices.size();
-   center.y = center.y/Vertices.size();
-   center.z = center.z/Vertices.size();
-
    // adjust min/max x and y so that they'll be correct
    // when the bunny is centered at the origin
    min_x = min_x + (0 - center.x);
@@ -38,205 +40,136 @@ BasicModel::BasicModel(string filename)
 
 BasicModel::~BasicModel()
 {
+}
 
-   // Delete vector<Vector3 *> Vertices
-   for ( vector<Vector3 *>::iterator i = Vertices.begin(); 
-         i != Vertices.end(); 
-         i++)
+//open the file for reading
+void BasicModel::ReadFile(string filename) 
+{
+   // a pre-baked binary copy of this file is much faster to load than
+   // parsing the text again
+   MeshCache cache;
+   bool cached = cache.open(filename);
+   if (cached)
    {
-      Vector3* temp = *i;
-      delete temp; // delete all objects newed into the vector
+      cache.copyTo(mesh);
+      optimizeStats = cache.optimizeStats;
    }
-
-   // Delete vector<Vector3 *> VerticesNormals
-   for ( vector<Vector3 *>::iterator i = VerticesNormals.begin(); 
-         i != VerticesNormals.end(); 
-         i++)
+   else
    {
-      Vector3* temp = *i;
-      delete temp; // delete all objects newed into the vector
+      parseMeshFile(filename, mesh);
    }
 
-   // Delete vector<Tri *> Triangles
-   for ( vector<Tri *>::iterator i = Triangles.begin(); 
-         i != Triangles.end(); 
-         i++)
+   // a cache streamMeshFile wrote holds the file's order
+   if (!cached || !cache.optimized)
    {
-      Tri* temp = *i;
-      delete temp; // delete all objects newed into the vector
+      optimizeStats = optimizeMesh(mesh);
+      MeshCache::write(filename, mesh, optimizeStats);
    }
-}
-
-void BasicModel::createTriangleStructs(float xOffset, float yOffset, float scaleFactor)
-{
-	TriangleStructs.clear();
-
-	for (int i = 0; i < Triangles.size(); ++i)
-	{
-		Tri* t = Triangles[i];
 
-		// Vertex labels in the file start at 1, but vector uses 0-based indices.
-		// Vertices are listed in order of label, though, so <vector pos> + 1 = label.
-		Vector3 v1 = normalizeVertexCoords(*Vertices.at(t->v1 - 1), xOffset, yOffset, scaleFactor);
-		Vector3 v2 = normalizeVertexCoords(*Vertices.at(t->v2 - 1), xOffset, yOffset, scaleFactor);
-		Vector3 v3 = normalizeVertexCoords(*Vertices.at(t->v3 - 1), xOffset, yOffset, scaleFactor);
-			 
-		Triangle triangle;
-			 
-		triangle.normal = t->normal;
-		triangle.v1.position = v1;
-		triangle.v1.rgb = t->color;
-			 
-		triangle.v2.position = v2;
-		triangle.v2.rgb = t->color;
-
-		triangle.v3.position = v3;
-		triangle.v3.rgb = t->color;
-
-		TriangleStructs.push_back(triangle);
-	}
+   computeBounds();
 }
 
-//open the file for reading
-void BasicModel::ReadFile(string filename) 
+//house keeping to display in center of the scene
+void BasicModel::computeBounds()
 {
-   string line;
-   streampos linestart;
-
-   ifstream infile(filename.c_str());
-   Vector3 *v = 0;
-   if (infile.is_open())  
+   // summed in double so the center doesn't depend on the order of the
+   // vertices, which optimizeMesh changes
+   double sumX = 0, sumY = 0, sumZ = 0;
+   unsigned int n = mesh.vertexCount();
+   for (unsigned int i = 0; i < n; ++i)
    {
-      while (!infile.eof())
-      {
-         int start;
-
-         linestart = infile.tellg();
-         getline(infile,line);
+      float x = mesh.x[i];
+      float y = mesh.y[i];
+      float z = mesh.z[i];
 
-         // Ignore commented lines
-         if (line.find("#") == 0)
-            continue;
+      sumX += x;
+      sumY += y;
+      sumZ += z;
 
-         if (!(start = line.find("Vertex"))) // we found a vertex
-         {
-            v = parseCoords(line);
+      if (x > max_x) max_x = x; 
+      if (x < min_x) min_x = x;
 
-            //house keeping to display in center of the scene
-            center.x += v->x;
-            center.y += v->y;
-            center.z += v->z;
+      if (y > max_y) max_y = y; 
+      if (y < min_y) min_y = y;
 
-            if (v->x > max_x) max_x = v->x; 
-            if (v->x < min_x) min_x = v->x;
-
-            if (v->y > max_y) max_y = v->y; 
-            if (v->y < min_y) min_y = v->y;
+      if (z > max_z) max_z = z; 
+      if (z < min_z) min_z = z;
+   }
 
-            if (v->z > max_z) max_z = v->z; 
-            if (v->z < min_z) min_z = v->z;
+   center.x = sumX / n;
+   center.y = sumY / n;
+   center.z = sumZ / n;
 
-            Vertices.push_back(v);
-            VerticesNormals.push_back(new Vector3(0.0,0.0,0.0));
-         }
-         else if (!(start = line.find("Face"))) // we found a face
-         {
-			 Triangles.push_back(parseTri(line));
-         }
-      }
-      infile.close();
-   } 
-   else
-   {
-      throw("Could not open file " /*<< filename << endl*/);
-   }
+   turn_radius = 0;
+   for (unsigned int i = 0; i < n; ++i)
+      turn_radius = fmaxf(turn_radius, hypotf(mesh.x[i] - center.x, mesh.z[i] - center.z));
 }
 
-
-BasicModel::Tri* BasicModel::parseTri(string line)
+void BasicModel::draw(float rx, float ry, float rz)
 {
-   Tri* t = new Tri();
-
-   size_t start;
+   //glCallList(id);
+}
 
-   start = line.find("  ");
+void BasicModel::setLOD(int levels)
+{
+   simplifyMesh(mesh, levels, MIN_LOD_FACES, lods, lodErrors);
+   for (size_t i = 0; i < lods.size(); ++i)
+      optimizeMesh(lods[i]);
+}
 
-   start += 2;
-   line = line.substr(start);
-   t->v1 = static_cast<int>(parseFloat(line));
+// Applies normalizeVertexCoords to every vertex of the mesh, writing the
+// results to outX, outY and outZ (each mesh.vertexCount() floats long).
+void BasicModel::transformVertices(const Instance &instance,
+                                   float *outX, float *outY, float *outZ) const
+{
+   transformVertices(instance, 0, outX, outY, outZ);
+}
 
-   start = line.find(" ");
-   line = line.substr(++start);
-   t->v2 = static_cast<int>(parseFloat(line));
+// Likewise for the vertices of one level of detail (see setLOD)
+void BasicModel::transformVertices(const Instance &instance, int level,
+                                   float *outX, float *outY, float *outZ) const
+{
+   transformMesh(getLOD(level), center, instance, outX, outY, outZ);
+}
 
-   start = line.find(" ");
-   line = line.substr(++start);
-   t->v3 = static_cast<int>(parseFloat(line));
-   
-   if ((start = line.find("{")) != string::npos) // there is a color
+void BasicModel::transformMesh(const Mesh &mesh, Vector3 center, const Instance &instance,
+                               float *outX, float *outY, float *outZ)
+{
+   float xOffset = instance.xOffset;
+   float yOffset = instance.yOffset;
+   float scaleFactor = instance.scale;
+   const float *inX = mesh.x.data();
+   const float *inY = mesh.y.data();
+   const float *inZ = mesh.z.data();
+   float cx = 0 - center.x;
+   float cy = 0 - center.y;
+   unsigned int n = mesh.vertexCount();
+
+   // same arithmetic as normalizeVertexCoords, written as plain array
+   // loops so the compiler can vectorize them
+   if (instance.turn == 0)
    {
-      start = line.find("rgb=(");
-      start += 5; // rgb=( is 5 characters
-
-      line = line.substr(start);
-      t->color.x = parseFloat(line);
-
-      start = line.find(" ");
-      line = line.substr(start);
-      t->color.y = parseFloat(line);
-
-      start = line.find(" ");
-      line = line.substr(start);
-      t->color.z = parseFloat(line);
+      for (unsigned int i = 0; i < n; ++i)
+         outX[i] = (inX[i] + cx) * scaleFactor + xOffset;
+      for (unsigned int i = 0; i < n; ++i)
+         outZ[i] = inZ[i];
    }
    else
    {
-      t->color = Vector3(1.0,1.0,1.0);
+      // x and z turn about the center; y is the axis
+      float c = cosf(instance.turn);
+      float s = sinf(instance.turn);
+      float cz = 0 - center.z;
+      for (unsigned int i = 0; i < n; ++i)
+      {
+         float dx = inX[i] + cx;
+         float dz = inZ[i] + cz;
+         outX[i] = (dx * c + dz * s) * scaleFactor + xOffset;
+         outZ[i] = (dz * c - dx * s) + center.z;
+      }
    }
-         
-
-   //Calculate the normal for this triangle
-   Vector3* v1 = Vertices[t->v1 - 1];
-   Vector3* v2 = Vertices[t->v2 - 1];
-   Vector3* v3 = Vertices[t->v3 - 1];
-
-   Vector3 vCp1(v2->x - v1->x,v2->y - v1->y,v2->z - v1->z);
-   Vector3 vCp2(v3->x - v1->x,v3->y - v1->y,v3->z - v1->z);
-   Vector3 normalV = vCp1.crossP(vCp2);
-
-   float normalizingFactor = sqrtf(normalV.dotP(normalV));
-   normalV.x = normalV.x/normalizingFactor;
-   normalV.y = normalV.y/normalizingFactor;
-   normalV.z = normalV.z/normalizingFactor;
-
-   t->normal = normalV;
-
-   v1 = VerticesNormals[t->v1 - 1];
-   v2 = VerticesNormals[t->v2 - 1];
-   v3 = VerticesNormals[t->v3 - 1];
-
-   v1->x += normalV.x;
-   v1->y += normalV.y;
-   v1->z += normalV.z;
-
-   v2->x += normalV.x;
-   v2->y += normalV.y;
-   v2->z += normalV.z;
-
-   v3->x += normalV.x;
-   v3->y += normalV.y;
-   v3->z += normalV.z;
-
-   return t;
-}
-
-void BasicModel::draw(float rx, float ry, float rz)
-{
-   //glCallList(id);
-}
-
-void BasicModel::setLOD(int lvl)
-{
+   for (unsigned int i = 0; i < n; ++i)
+      outY[i] = (inY[i] + cy) * scaleFactor + yOffset;
 }
 
 Vector3 BasicModel::normalizeVertexCoords(Vector3 v, float xOffset, float yOffset, float scaleFactor)
@@ -6,8 +6,24 @@
 #include <vector>
 #include <stdio.h>
 #include "Model.h"
+#include "Mesh.h"
+#include "MeshOptimizer.h"
 
-#include "Triangle.h"
+// Placement of one copy (instance) of a model in the world. The model is
+// moved so its center is at the origin, turned by turn radians about the
+// vertical (y) axis, x and y are scaled by scale, and the result is shifted
+// by the offsets (see normalizeVertexCoords). Turning moves z too, keeping
+// the center's depth. Instances written as {x, y, scale} don't turn. Only
+// the CPU renderer turns instances, and as the model is shaded once for all
+// of them, the instances drawn together must share one turn (see
+// turnLighting).
+struct Instance
+{
+   float xOffset;
+   float yOffset;
+   float scale;
+   float turn;
+};
 
 class BasicModel : virtual public Model
 {
@@ -15,25 +31,44 @@ public:
    BasicModel(std::string filename);
    ~BasicModel();
 
-   //stl vector to store all the triangles in the mesh
-   std::vector<Tri *> Triangles;
-   //stl vector to store all the vertices in the mesh
-   std::vector<Vector3 *> Vertices;
-   //stl vector to store all the vertices normals in the mesh
-   std::vector<Vector3 *> VerticesNormals;
-
-   // stores triangle data as C-style structs (for rasterization)
-   std::vector<Triangle> TriangleStructs;
+   // vertices, faces and normals as an indexed struct of arrays (see Mesh.h),
+   // optimized for the vertex cache when it was loaded (see optimizeMesh)
+   Mesh mesh;
 
    void draw(float,float,float);
-   void setLOD(int);
-   void createTriangleStructs(float, float, float);
+   // Builds up to levels simplified copies of mesh, each with about half
+   // the faces of the one before (see simplifyMesh). 0 drops them.
+   void setLOD(int levels);
+   // level 0 is mesh itself
+   int getLODCount() const { return 1 + lods.size(); }
+   const Mesh &getLOD(int level) const { return level == 0 ? mesh : lods[level - 1]; }
+   // how far, in model units, a level's surface strays from mesh's
+   float getLODError(int level) const { return level == 0 ? 0 : lodErrors[level - 1]; }
+   // what optimizeMesh did to the file's mesh
+   const MeshOptimizeStats &getOptimizeStats() const { return optimizeStats; }
+   // widest of the model's width and height
+   float getExtent() const { return max_extent; }
+   void transformVertices(const Instance &, float *, float *, float *) const;
+   void transformVertices(const Instance &, int level, float *, float *, float *) const;
+   // likewise for any mesh whose center is center (see MeshStream)
+   static void transformMesh(const Mesh &, Vector3 center, const Instance &, float *, float *, float *);
+   Vector3 getCenter() const { return center; }
+   // depth range of the model; transformVertices leaves z alone
+   float getMinZ() const { return min_z; }
+   float getMaxZ() const { return max_z; }
+   // how far the farthest vertex is from the vertical axis through the
+   // center, so how far from the center's depth a turned instance reaches
+   float getTurnRadius() const { return turn_radius; }
 
 protected:
    GLuint id;
+   std::vector<Mesh> lods;
+   std::vector<float> lodErrors;
+   MeshOptimizeStats optimizeStats;
+   float turn_radius;
 
-   Tri* parseTri(std::string line);
    void ReadFile(std::string filename);
+   void computeBounds();
    GLuint createDL();
    Vector3 normalizeVertexCoords(Vector3, float, float, float);
   
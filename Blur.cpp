@@ -0,0 +1,278 @@
+#include "Blur.h"
+
+#include <math.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include "RasterizerSIMD.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_X86_SIMD 1
+#endif
+
+using namespace std;
+
+// The lanes the filters work on. GCC vector extensions turn the same
+// arithmetic into SSE or AVX instructions depending on where it is inlined,
+// so one filter body serves every width (and plain float is the scalar
+// version).
+typedef float Float4 __attribute__((vector_size(16)));
+typedef float Float8 __attribute__((vector_size(32)));
+
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+
+// The lane helpers are always inlined, so how vectors would be passed to
+// them out of line does not matter
+#pragma GCC diagnostic ignored "-Wpsabi"
+
+// Either the collapsed kernel or a cascade of boxes; see Blur.h
+typedef struct BlurFilter
+{
+	vector<float> weights;	// collapsed kernel, offsets 0..radius; empty for boxes
+	int boxRadius[BLUR_BOX_COUNT];
+} BlurFilter;
+
+int collapsedBlurKernel(int passes, vector<float> &weights)
+{
+	// binomial of order n: C(n, n/2 + k) / 2^n, with variance n/4
+	int n = 8 * passes;
+	double sigma = sqrt(n / 4.0);
+	int radius = min(n / 2, (int)ceil(4 * sigma));
+
+	vector<double> w(radius + 1);
+	double total = 0;
+	for (int k = 0; k <= radius; ++k)
+	{
+		w[k] = exp(lgamma(n + 1.0) - lgamma(n / 2 + k + 1.0) - lgamma(n / 2 - k + 1.0) - n * log(2.0));
+		total += k == 0 ? w[k] : 2 * w[k];
+	}
+
+	weights.resize(radius + 1);
+	for (int k = 0; k <= radius; ++k)
+		weights[k] = (float)(w[k] / total);
+
+	return radius;
+}
+
+/*
+* The blur for a number of passes: the collapsed kernel if it is narrow
+* enough, otherwise BLUR_BOX_COUNT boxes with (nearly) the same variance.
+* The box widths are the odd widths around the ideal one that come closest
+* to the variance (see Kovesi, "Fast almost-Gaussian filtering").
+*/
+static void makeBlurFilter(int passes, BlurFilter &f)
+{
+	if (collapsedBlurKernel(passes, f.weights) <= BLUR_MAX_DIRECT_RADIUS)
+		return;
+
+	f.weights.clear();
+
+	double variance = 2.0 * passes;
+	int n = BLUR_BOX_COUNT;
+	int lower = (int)floor(sqrt(12 * variance / n + 1));
+	if (lower % 2 == 0)
+		--lower;
+	int upper = lower + 2;
+	int lowerCount = (int)floor((12 * variance - n*lower*lower - 4*n*lower - 3*n) / (-4*lower - 4) + 0.5);
+
+	for (int i = 0; i < n; ++i)
+		f.boxRadius[i] = ((i < lowerCount ? lower : upper) - 1) / 2;
+}
+
+template <typename V>
+static ALWAYS_INLINE V loadLanes(const float *p)
+{
+	V v;
+	memcpy(&v, p, sizeof(V));
+	return v;
+}
+
+template <typename V>
+static ALWAYS_INLINE void storeLanes(float *p, const V &v)
+{
+	memcpy(p, &v, sizeof(V));
+}
+
+/*
+* Box filter one block of lanes: element i is at in[i*inStride], and is
+* replaced by the mean of elements i - radius .. i + radius (those past the
+* ends count as 0). A sliding window: one add and one subtract per element
+* whatever the radius.
+*/
+template <typename V>
+static ALWAYS_INLINE void boxLanes(const float *in, int inStride, float *out, int outStride, int length, int radius)
+{
+	V sum = V();
+	for (int j = 0; j <= radius && j < length; ++j)
+		sum += loadLanes<V>(in + (size_t)j * inStride);
+
+	float scale = 1.0f / (2 * radius + 1);
+	for (int i = 0; i < length; ++i)
+	{
+		storeLanes<V>(out + (size_t)i * outStride, sum * scale);
+		if (i + radius + 1 < length)
+			sum += loadLanes<V>(in + (size_t)(i + radius + 1) * inStride);
+		if (i - radius >= 0)
+			sum -= loadLanes<V>(in + (size_t)(i - radius) * inStride);
+	}
+}
+
+/*
+* Convolve one block of lanes with a symmetric kernel (weights for offsets
+* 0..radius). Elements past the ends count as 0.
+*/
+template <typename V>
+static ALWAYS_INLINE void convolveLanes(const float *in, int inStride, float *out, int outStride, int length,
+	const float *w, int radius)
+{
+	for (int i = 0; i < length; ++i)
+	{
+		int before = min(radius, i);
+		int after = min(radius, length - 1 - i);
+		const float *center = in + (size_t)i * inStride;
+
+		V acc = loadLanes<V>(center) * w[0];
+		int k = 1;
+		for (; k <= before && k <= after; ++k)
+			acc += (loadLanes<V>(center - (size_t)k * inStride) + loadLanes<V>(center + (size_t)k * inStride)) * w[k];
+		for (int j = k; j <= before; ++j)
+			acc += loadLanes<V>(center - (size_t)j * inStride) * w[j];
+		for (int j = k; j <= after; ++j)
+			acc += loadLanes<V>(center + (size_t)j * inStride) * w[j];
+
+		storeLanes<V>(out + (size_t)i * outStride, acc);
+	}
+}
+
+/*
+* Filter one block of sizeof(V) / sizeof(float) lanes. in and out may be the
+* same: the input is read completely before the output is written.
+*
+* scratch: 2 * length blocks of lanes
+*/
+template <typename V>
+static ALWAYS_INLINE void filterBlock(const BlurFilter &f, const float *in, int inStride, float *out, int outStride,
+	int length, float *scratch)
+{
+	const int lanes = sizeof(V) / sizeof(float);
+	float *s[2] = {scratch, scratch + (size_t)length * lanes};
+
+	if (!f.weights.empty())
+	{
+		convolveLanes<V>(in, inStride, s[0], lanes, length, f.weights.data(), (int)f.weights.size() - 1);
+		for (int i = 0; i < length; ++i)
+			storeLanes<V>(out + (size_t)i * outStride, loadLanes<V>(s[0] + (size_t)i * lanes));
+		return;
+	}
+
+	// in -> s[0] -> s[1] -> ... -> out
+	for (int box = 0; box < BLUR_BOX_COUNT; ++box)
+	{
+		const float *from = box == 0 ? in : s[(box - 1) % 2];
+		int fromStride = box == 0 ? inStride : lanes;
+		bool last = box == BLUR_BOX_COUNT - 1;
+		boxLanes<V>(from, fromStride, last ? out : s[box % 2], last ? outStride : lanes, length, f.boxRadius[box]);
+	}
+}
+
+#if HAVE_X86_SIMD
+
+/*
+* Filter lanes 1-D signals of length elements each: element i of signal l
+* is at in[i*inStride + l]. Blocks of 4 lanes, then single lanes.
+*/
+static void filterLanesSSE2(const BlurFilter &f, const float *in, int inStride, float *out, int outStride,
+	int length, int lanes, float *scratch)
+{
+	int l = 0;
+	for (; l + 4 <= lanes; l += 4)
+		filterBlock<Float4>(f, in + l, inStride, out + l, outStride, length, scratch);
+	for (; l < lanes; ++l)
+		filterBlock<float>(f, in + l, inStride, out + l, outStride, length, scratch);
+}
+
+// Blocks of 8 lanes, then the rest like filterLanesSSE2
+__attribute__((target("avx2")))
+static void filterLanesAVX2(const BlurFilter &f, const float *in, int inStride, float *out, int outStride,
+	int length, int lanes, float *scratch)
+{
+	int l = 0;
+	for (; l + 8 <= lanes; l += 8)
+		filterBlock<Float8>(f, in + l, inStride, out + l, outStride, length, scratch);
+	filterLanesSSE2(f, in + l, inStride, out + l, outStride, length, lanes - l, scratch);
+}
+
+#endif
+
+static void filterLanesScalar(const BlurFilter &f, const float *in, int inStride, float *out, int outStride,
+	int length, int lanes, float *scratch)
+{
+	for (int l = 0; l < lanes; ++l)
+		filterBlock<float>(f, in + l, inStride, out + l, outStride, length, scratch);
+}
+
+void blurImage(float *r, float *g, float *b, int width, int height, int passes, ThreadPool &pool)
+{
+	if (passes <= 0 || width <= 0 || height <= 0)
+		return;
+
+	BlurFilter filter;
+	makeBlurFilter(passes, filter);
+
+	// same level switch as the rasterizer
+	void (*filterLanes)(const BlurFilter&, const float*, int, float*, int, int, int, float*) = filterLanesScalar;
+#if HAVE_X86_SIMD
+	if (getSimdLevel() >= SIMD_AVX2)
+		filterLanes = filterLanesAVX2;
+	else if (getSimdLevel() == SIMD_SSE2)
+		filterLanes = filterLanesSSE2;
+#endif
+
+	float *planes[3] = {r, g, b};
+	int rowTiles = (height + BLUR_ROW_TILE - 1) / BLUR_ROW_TILE;
+	int columnStrips = (width + BLUR_COLUMN_STRIP - 1) / BLUR_COLUMN_STRIP;
+	size_t scratchSize = 2 * (size_t)max(width, height) * 8;
+
+	// Rows: transpose a tile so each x is BLUR_ROW_TILE contiguous lanes,
+	// filter along x and transpose back
+	pool.parallelFor(3 * rowTiles, [&](int task)
+	{
+		static thread_local vector<float> tile;
+		static thread_local vector<float> scratch;
+		tile.resize((size_t)width * BLUR_ROW_TILE);
+		scratch.resize(scratchSize);
+
+		float *plane = planes[task % 3];
+		int y0 = (task / 3) * BLUR_ROW_TILE;
+		int rows = min(BLUR_ROW_TILE, height - y0);
+
+		for (int x = 0; x < width; ++x)
+		{
+			for (int l = 0; l < rows; ++l)
+				tile[(size_t)x * BLUR_ROW_TILE + l] = plane[(size_t)(y0 + l) * width + x];
+		}
+
+		filterLanes(filter, tile.data(), BLUR_ROW_TILE, tile.data(), BLUR_ROW_TILE, width, rows, scratch.data());
+
+		for (int l = 0; l < rows; ++l)
+		{
+			float *row = &plane[(size_t)(y0 + l) * width];
+			for (int x = 0; x < width; ++x)
+				row[x] = tile[(size_t)x * BLUR_ROW_TILE + l];
+		}
+	});
+
+	// Columns: a strip's rows are already contiguous lanes
+	pool.parallelFor(3 * columnStrips, [&](int task)
+	{
+		static thread_local vector<float> scratch;
+		scratch.resize(scratchSize);
+
+		float *plane = planes[task % 3];
+		int x0 = (task / 3) * BLUR_COLUMN_STRIP;
+		int columns = min(BLUR_COLUMN_STRIP, width - x0);
+
+		filterLanes(filter, plane + x0, width, plane + x0, width, height, columns, scratch.data());
+	});
+}
@@ -0,0 +1,60 @@
+#ifndef BLUR_H
+#define BLUR_H
+
+#include <vector>
+
+#include "ThreadPool.h"
+
+// Post-process Gaussian blur.
+//
+// A blur "pass" is the renderer's original 9-tap binomial kernel
+// (1 8 28 56 70 56 28 8 1)/256, run horizontally and then vertically, with
+// pixels outside the image counting as black. N passes are one blur with
+// the binomial kernel of order 8N, a Gaussian with sigma^2 = 2N, so the
+// blur is done in a single horizontal and vertical sweep whatever N is:
+//
+// - Narrow blurs (radius up to BLUR_MAX_DIRECT_RADIUS) convolve with the
+//   collapsed kernel itself.
+// - Wider ones run BLUR_BOX_COUNT box filters whose variances add up to the
+//   kernel's. Each box is a sliding window sum, so a pixel costs the same
+//   for 10 passes as for 1000.
+//
+// Rows are blurred BLUR_ROW_TILE at a time: the tile is transposed so that
+// each step along x is one contiguous run of BLUR_ROW_TILE floats, which is
+// what the SIMD lanes work on, and a tile of an 8K-wide image still fits
+// in L2. Columns are blurred in strips of BLUR_COLUMN_STRIP. Tiles and
+// strips are spread over the thread pool.
+
+// One pass of the original kernel reaches this far
+#define BLUR_PASS_RADIUS 4
+
+// Wider collapsed kernels are approximated by box filters
+#define BLUR_MAX_DIRECT_RADIUS 16
+
+#define BLUR_BOX_COUNT 3
+
+#define BLUR_ROW_TILE 16
+#define BLUR_COLUMN_STRIP 64
+
+/*
+* The kernel of passes blur passes collapsed into one, cut off where its
+* weights become negligible (4 sigma) and renormalized.
+*
+* passes: Number of passes (> 0)
+* weights: Receives the weights for offsets 0 to the radius (the kernel is
+*          symmetric)
+*
+* returns: The kernel's radius
+*/
+int collapsedBlurKernel(int passes, std::vector<float> &weights);
+
+/*
+* Blur an image as much as passes passes of the original kernel would.
+*
+* r, g, b: Row-major color planes, width * height pixels, blurred in place
+* passes: Number of passes; 0 leaves the image alone
+* pool: Threads to run on
+*/
+void blurImage(float *r, float *g, float *b, int width, int height, int passes, ThreadPool &pool);
+
+#endif
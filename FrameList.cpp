@@ -0,0 +1,107 @@
+#include "FrameList.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+using namespace std;
+
+static FramePose unposedFrame()
+{
+	FramePose frame;
+	frame.hasWindow = false;
+	frame.window = makeViewport(1, 1);
+	frame.turn = 0;
+	frame.hasCamera = false;
+	frame.camera = makeCamera();
+	return frame;
+}
+
+// Read the items of one line into frame
+static bool parseFrame(const char *line, FramePose &frame)
+{
+	char word[32];
+	int used = 0;
+	while (sscanf(line, " %31s%n", word, &used) == 1)
+	{
+		line += used;
+		Viewport &w = frame.window;
+		Camera &c = frame.camera;
+		float x, y, scale, degrees;
+		if (strcmp(word, "turn") == 0 && sscanf(line, "%f%n", &degrees, &used) == 1)
+			frame.turn = degrees * (float)M_PI / 180;
+		else if (strcmp(word, "window") == 0 &&
+			sscanf(line, "%f %f %f %f%n", &w.xMinWorld, &w.xMaxWorld, &w.yMinWorld, &w.yMaxWorld, &used) == 4 &&
+			w.xMaxWorld > w.xMinWorld && w.yMaxWorld > w.yMinWorld)
+			frame.hasWindow = true;
+		else if (strcmp(word, "instance") == 0 && sscanf(line, "%f %f %f%n", &x, &y, &scale, &used) == 3)
+		{
+			Instance instance = {x, y, scale, 0};
+			frame.instances.push_back(instance);
+		}
+		else if (strcmp(word, "camera") == 0 &&
+			sscanf(line, "%f %f %f %f %f %f%n", &c.eye.x, &c.eye.y, &c.eye.z, &c.target.x, &c.target.y, &c.target.z,
+			&used) == 6)
+			frame.hasCamera = true;
+		else
+			return false;
+		line += used;
+	}
+	return true;
+}
+
+bool loadFrameList(const char *filename, vector<FramePose> &frames)
+{
+	FILE *fp = fopen(filename, "r");
+	if (fp == NULL)
+	{
+		printf("Could not open frame list %s\n", filename);
+		return false;
+	}
+
+	vector<FramePose> loaded;
+	char line[1024];
+	int lineNumber = 0;
+	bool ok = true;
+	while (ok && fgets(line, sizeof(line), fp) != NULL)
+	{
+		++lineNumber;
+		line[strcspn(line, "\r\n")] = '\0';
+		char *comment = strchr(line, '#');
+		if (comment != NULL)
+			*comment = '\0';
+		if (line[strspn(line, " \t")] == '\0')
+			continue;
+
+		FramePose frame = unposedFrame();
+		ok = parseFrame(line, frame);
+		if (ok)
+			loaded.push_back(frame);
+	}
+	fclose(fp);
+
+	if (!ok)
+	{
+		printf("Bad line %d in frame list %s: %s\n", lineNumber, filename, line);
+		return false;
+	}
+	if (loaded.empty())
+	{
+		printf("No frames in frame list %s\n", filename);
+		return false;
+	}
+
+	frames.swap(loaded);
+	return true;
+}
+
+void turntableFrames(int count, vector<FramePose> &frames)
+{
+	frames.clear();
+	for (int i = 0; i < count; ++i)
+	{
+		FramePose frame = unposedFrame();
+		frame.turn = (float)(2 * M_PI * i / count);
+		frames.push_back(frame);
+	}
+}
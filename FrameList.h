@@ -0,0 +1,45 @@
+#ifndef FRAME_LIST_H
+#define FRAME_LIST_H
+
+#include <vector>
+
+#include "BasicModel.h"
+#include "Rasterizer.h"
+
+// The frames of a batch (animation) run: the model is loaded and shaded
+// once and drawn frame after frame, each frame with its own poses.
+
+typedef struct FramePose
+{
+	std::vector<Instance> instances;	// empty for the run's layout (see layoutBunnies)
+	bool hasWindow;		// whether to show window rather than the run's part of the world
+	Viewport window;	// only the world box is used
+	float turn;			// radians about the vertical axis, for every instance (see Instance)
+	bool hasCamera;		// whether to look through camera rather than the run's camera or window
+	Camera camera;		// fovY, zNear and zFar are the run's
+} FramePose;
+
+/*
+* Read a list of frames: one frame per line, '#' starts a comment. A line is
+* a list of items, any of
+*
+*   turn <degrees>                          (turn every instance)
+*   window <xmin> <xmax> <ymin> <ymax>      (the part of the world shown)
+*   instance <x> <y> <scale>                (any number of them)
+*   camera <ex> <ey> <ez> <tx> <ty> <tz>    (look from eye e at target t
+*                                           through a perspective camera)
+*
+* Blank lines are skipped.
+*
+* returns: false if the file can't be read, a line is bad (the line is
+*          printed) or it has no frames; frames is then left alone
+*/
+bool loadFrameList(const char *filename, std::vector<FramePose> &frames);
+
+/*
+* A turntable: count frames of the run's layout turning a whole turn, a
+* count-th of it from each frame to the next, starting unturned.
+*/
+void turntableFrames(int count, std::vector<FramePose> &frames);
+
+#endif
@@ -0,0 +1,426 @@
+#include "Framebuffer.h"
+
+#include <math.h>
+#include <string.h>
+
+#include <algorithm>
+
+using namespace std;
+
+// Largest DEPTH_24 value; 0 is reserved for the viewport's minZ
+#define DEPTH_24_MAX 0xFFFFFF
+
+/*
+* Convert a float to a half float (IEEE 754 binary16), rounding to nearest
+* even. Too large values become infinity; NaN stays NaN.
+*/
+static unsigned short floatToHalf(float f)
+{
+	unsigned int x;
+	memcpy(&x, &f, sizeof(x));
+
+	unsigned int sign = (x >> 16) & 0x8000;
+	int exponent = (x >> 23) & 0xff;
+	unsigned int mantissa = x & 0x7fffff;
+
+	if (exponent == 0xff)
+		return sign | 0x7c00 | (mantissa ? 0x200 : 0);
+
+	int e = exponent - 127 + 15;
+	if (e >= 31)
+		return sign | 0x7c00;
+
+	unsigned int h;
+	unsigned int rest;
+	unsigned int half;
+	if (e > 0)
+	{
+		h = sign | (e << 10) | (mantissa >> 13);
+		rest = mantissa & 0x1fff;
+		half = 0x1000;
+	}
+	else
+	{
+		// subnormal: count in units of 2^-24
+		int shift = 14 - e;
+		if (shift > 24)
+			return sign;
+		mantissa |= 0x800000;
+		h = sign | (mantissa >> shift);
+		rest = mantissa & ((1u << shift) - 1);
+		half = 1u << (shift - 1);
+	}
+
+	// a carry out of the mantissa correctly bumps the exponent
+	if (rest > half || (rest == half && (h & 1)))
+		++h;
+
+	return (unsigned short)h;
+}
+
+static float halfToFloat(unsigned short h)
+{
+	unsigned int sign = (unsigned int)(h & 0x8000) << 16;
+	int exponent = (h >> 10) & 0x1f;
+	unsigned int mantissa = h & 0x3ff;
+	unsigned int x;
+
+	if (exponent == 0)
+	{
+		float f = mantissa * (1.0f / 16777216.0f);
+		return sign ? -f : f;
+	}
+
+	if (exponent == 31)
+		x = sign | 0x7f800000 | (mantissa << 13);
+	else
+		x = sign | ((exponent + 112) << 23) | (mantissa << 13);
+
+	float f;
+	memcpy(&f, &x, sizeof(f));
+	return f;
+}
+
+// 0..1 to 0..255, truncating like WriteTga does so 8-bit storage loses
+// nothing the written image would have kept
+static unsigned char floatToByte(float v)
+{
+	if (!(v > 0))
+		return 0;
+	if (v >= 1)
+		return 255;
+	return (unsigned char)(v * 255.0f);
+}
+
+Framebuffer::Framebuffer(const Viewport &viewport, ColorFormat colorFormat, DepthFormat depthFormat, int samples) :
+	viewport(viewport), width(viewport.width), height(viewport.height),
+	tilesX((viewport.width + FRAMEBUFFER_TILE_SIZE - 1) / FRAMEBUFFER_TILE_SIZE),
+	tilesY((viewport.height + FRAMEBUFFER_TILE_SIZE - 1) / FRAMEBUFFER_TILE_SIZE),
+	colorFormat(colorFormat), depthFormat(depthFormat), samples(samples),
+	samplePattern(makeSamplePattern(samples)), clearedMinZ(viewport.minZ)
+{
+	if (samplePattern.count != samples)
+		throw("Framebuffer: samples must be 1, 2, 4 or 8");
+
+	switch (colorFormat)
+	{
+	case COLOR_RGB32F: colorBytes = 3 * sizeof(float); break;
+	case COLOR_RGBA8: colorBytes = 4; break;
+	case COLOR_RGB16F: colorBytes = 3 * sizeof(unsigned short); break;
+	}
+	depthBytes = depthFormat == DEPTH_24 ? 3 : sizeof(float);
+
+	// every tile is stored whole, even the ones hanging off the edges
+	size_t pixels = (size_t)tilesX * tilesY * FRAMEBUFFER_TILE_PIXELS * samples;
+	color.resize(pixels * colorBytes);
+	depth.resize(pixels * depthBytes);
+	dirty.assign((size_t)tilesX * tilesY, 1);
+
+	setDepthRange(-1, 1);
+	clear();
+}
+
+void Framebuffer::setViewport(const Viewport &newViewport)
+{
+	if (newViewport.width != width || newViewport.height != height)
+		throw("Framebuffer::setViewport: the size can't change");
+
+	viewport = newViewport;
+}
+
+void Framebuffer::setDepthRange(float zNear, float zFar)
+{
+	if (!(zFar > zNear))
+		zFar = zNear + 1;
+
+	depthNear = zNear;
+	depthStep = ((double)zFar - zNear) / (DEPTH_24_MAX - 1);
+}
+
+void Framebuffer::clear()
+{
+	// a new minZ is a new depth for every tile
+	bool all = depthFormat == DEPTH_32F && memcmp(&clearedMinZ, &viewport.minZ, sizeof(float)) != 0;
+	for (size_t tile = 0; tile < dirty.size(); ++tile)
+	{
+		if (dirty[tile] || all)
+			clearTile(tile);
+		dirty[tile] = 0;
+	}
+	clearedMinZ = viewport.minZ;
+}
+
+void Framebuffer::clearTile(int tile)
+{
+	size_t first = (size_t)tile * samples * FRAMEBUFFER_TILE_PIXELS;
+	size_t count = (size_t)samples * FRAMEBUFFER_TILE_PIXELS;
+
+	unsigned char *c = &color[first * colorBytes];
+	memset(c, 0, count * colorBytes);
+	if (colorFormat == COLOR_RGBA8)
+	{
+		for (size_t i = 3; i < count * colorBytes; i += 4)
+			c[i] = 255;
+	}
+
+	unsigned char *d = &depth[first * depthBytes];
+	if (depthFormat == DEPTH_24)
+	{
+		// 0 is minZ
+		memset(d, 0, count * depthBytes);
+	}
+	else
+	{
+		float minZ = viewport.minZ;
+		for (size_t i = 0; i < count * depthBytes; i += sizeof(float))
+			memcpy(&d[i], &minZ, sizeof(float));
+	}
+}
+
+void Framebuffer::packColor(size_t offset, const float *r, const float *g, const float *b, int count)
+{
+	unsigned char *p = &color[offset * colorBytes];
+
+	switch (colorFormat)
+	{
+	case COLOR_RGB32F:
+		for (int i = 0; i < count; ++i, p += 12)
+		{
+			memcpy(p, &r[i], 4);
+			memcpy(p + 4, &g[i], 4);
+			memcpy(p + 8, &b[i], 4);
+		}
+		break;
+
+	case COLOR_RGBA8:
+		for (int i = 0; i < count; ++i, p += 4)
+		{
+			p[0] = floatToByte(r[i]);
+			p[1] = floatToByte(g[i]);
+			p[2] = floatToByte(b[i]);
+		}
+		break;
+
+	case COLOR_RGB16F:
+		for (int i = 0; i < count; ++i, p += 6)
+		{
+			unsigned short h[3] = {floatToHalf(r[i]), floatToHalf(g[i]), floatToHalf(b[i])};
+			memcpy(p, h, 6);
+		}
+		break;
+	}
+}
+
+void Framebuffer::unpackColor(size_t offset, float *r, float *g, float *b, int count) const
+{
+	const unsigned char *p = &color[offset * colorBytes];
+
+	switch (colorFormat)
+	{
+	case COLOR_RGB32F:
+		for (int i = 0; i < count; ++i, p += 12)
+		{
+			memcpy(&r[i], p, 4);
+			memcpy(&g[i], p + 4, 4);
+			memcpy(&b[i], p + 8, 4);
+		}
+		break;
+
+	case COLOR_RGBA8:
+		for (int i = 0; i < count; ++i, p += 4)
+		{
+			r[i] = p[0] / 255.0f;
+			g[i] = p[1] / 255.0f;
+			b[i] = p[2] / 255.0f;
+		}
+		break;
+
+	case COLOR_RGB16F:
+		for (int i = 0; i < count; ++i, p += 6)
+		{
+			unsigned short h[3];
+			memcpy(h, p, 6);
+			r[i] = halfToFloat(h[0]);
+			g[i] = halfToFloat(h[1]);
+			b[i] = halfToFloat(h[2]);
+		}
+		break;
+	}
+}
+
+void Framebuffer::packDepth(size_t offset, const float *z, int count)
+{
+	unsigned char *p = &depth[offset * depthBytes];
+
+	if (depthFormat == DEPTH_32F)
+	{
+		memcpy(p, z, count * sizeof(float));
+		return;
+	}
+
+	for (int i = 0; i < count; ++i, p += 3)
+	{
+		// A depth read back as a float doesn't always quantize to the value
+		// it came from, so leave untouched pixels alone
+		unsigned int old = p[0] | (p[1] << 8) | (p[2] << 16);
+		if (z[i] == depth24ToFloat(old))
+			continue;
+
+		unsigned int q = 0;
+		if (z[i] > viewport.minZ)
+		{
+			double steps = floor((z[i] - depthNear) / depthStep + 0.5) + 1;
+			if (steps < 1)
+				steps = 1;
+			if (steps > DEPTH_24_MAX)
+				steps = DEPTH_24_MAX;
+			q = (unsigned int)steps;
+		}
+
+		p[0] = q & 0xff;
+		p[1] = (q >> 8) & 0xff;
+		p[2] = (q >> 16) & 0xff;
+	}
+}
+
+void Framebuffer::unpackDepth(size_t offset, float *z, int count) const
+{
+	const unsigned char *p = &depth[offset * depthBytes];
+
+	if (depthFormat == DEPTH_32F)
+	{
+		memcpy(z, p, count * sizeof(float));
+		return;
+	}
+
+	for (int i = 0; i < count; ++i, p += 3)
+		z[i] = depth24ToFloat(p[0] | (p[1] << 8) | (p[2] << 16));
+}
+
+void Framebuffer::loadTile(int tileX, int tileY, FramebufferTile &tile) const
+{
+	tile.x0 = tileX * FRAMEBUFFER_TILE_SIZE;
+	tile.y0 = tileY * FRAMEBUFFER_TILE_SIZE;
+	tile.width = min(FRAMEBUFFER_TILE_SIZE, width - tile.x0);
+	tile.height = min(FRAMEBUFFER_TILE_SIZE, height - tile.y0);
+	tile.samples = samples;
+
+	size_t planeSize = (size_t)FRAMEBUFFER_TILE_PIXELS * samples;
+	tile.r.resize(planeSize);
+	tile.g.resize(planeSize);
+	tile.b.resize(planeSize);
+	tile.z.resize(planeSize);
+
+	for (int sample = 0; sample < samples; ++sample)
+	{
+		for (int row = 0; row < tile.height; ++row)
+		{
+			size_t offset = pixelOffset(tile.x0, tile.y0 + row, sample);
+			int i = sample * FRAMEBUFFER_TILE_PIXELS + row * FRAMEBUFFER_TILE_SIZE;
+			unpackColor(offset, &tile.r[i], &tile.g[i], &tile.b[i], tile.width);
+			unpackDepth(offset, &tile.z[i], tile.width);
+		}
+	}
+}
+
+void Framebuffer::storeTile(const FramebufferTile &tile)
+{
+	dirty[(tile.y0 / FRAMEBUFFER_TILE_SIZE) * tilesX + tile.x0 / FRAMEBUFFER_TILE_SIZE] = 1;
+	for (int sample = 0; sample < samples; ++sample)
+	{
+		for (int row = 0; row < tile.height; ++row)
+		{
+			size_t offset = pixelOffset(tile.x0, tile.y0 + row, sample);
+			int i = sample * FRAMEBUFFER_TILE_PIXELS + row * FRAMEBUFFER_TILE_SIZE;
+			packColor(offset, &tile.r[i], &tile.g[i], &tile.b[i], tile.width);
+			packDepth(offset, &tile.z[i], tile.width);
+		}
+	}
+}
+
+void Framebuffer::readColor(float *r, float *g, float *b) const
+{
+	// one tile row of every sample, to resolve from
+	vector<float> sr, sg, sb;
+	if (samples > 1)
+	{
+		sr.resize(FRAMEBUFFER_TILE_SIZE * samples);
+		sg.resize(FRAMEBUFFER_TILE_SIZE * samples);
+		sb.resize(FRAMEBUFFER_TILE_SIZE * samples);
+	}
+
+	for (int y = 0; y < height; ++y)
+	{
+		for (int x = 0; x < width; x += FRAMEBUFFER_TILE_SIZE)
+		{
+			size_t i = (size_t)y * width + x;
+			int count = min(FRAMEBUFFER_TILE_SIZE, width - x);
+			if (samples == 1)
+			{
+				unpackColor(pixelOffset(x, y), &r[i], &g[i], &b[i], count);
+				continue;
+			}
+
+			for (int sample = 0; sample < samples; ++sample)
+			{
+				int k = sample * FRAMEBUFFER_TILE_SIZE;
+				unpackColor(pixelOffset(x, y, sample), &sr[k], &sg[k], &sb[k], count);
+			}
+			resolveSamples(sr.data(), sg.data(), sb.data(), samples, FRAMEBUFFER_TILE_SIZE, count,
+				&r[i], &g[i], &b[i]);
+		}
+	}
+}
+
+void Framebuffer::readDepth(float *z) const
+{
+	float sz[FRAMEBUFFER_TILE_SIZE];
+
+	for (int y = 0; y < height; ++y)
+	{
+		for (int x = 0; x < width; x += FRAMEBUFFER_TILE_SIZE)
+		{
+			float *row = &z[(size_t)y * width + x];
+			int count = min(FRAMEBUFFER_TILE_SIZE, width - x);
+			unpackDepth(pixelOffset(x, y), row, count);
+
+			for (int sample = 1; sample < samples; ++sample)
+			{
+				unpackDepth(pixelOffset(x, y, sample), sz, count);
+				for (int n = 0; n < count; ++n)
+					row[n] = max(row[n], sz[n]);
+			}
+		}
+	}
+}
+
+void Framebuffer::writeColor(const float *r, const float *g, const float *b)
+{
+	dirty.assign(dirty.size(), 1);
+	for (int y = 0; y < height; ++y)
+	{
+		for (int x = 0; x < width; x += FRAMEBUFFER_TILE_SIZE)
+		{
+			size_t i = (size_t)y * width + x;
+			for (int sample = 0; sample < samples; ++sample)
+				packColor(pixelOffset(x, y, sample), &r[i], &g[i], &b[i], min(FRAMEBUFFER_TILE_SIZE, width - x));
+		}
+	}
+}
+
+bool Framebuffer::parseColorFormat(const char *name, ColorFormat &format)
+{
+	if (strcmp(name, "rgb32f") == 0) format = COLOR_RGB32F;
+	else if (strcmp(name, "rgba8") == 0) format = COLOR_RGBA8;
+	else if (strcmp(name, "rgb16f") == 0) format = COLOR_RGB16F;
+	else return false;
+	return true;
+}
+
+bool Framebuffer::parseDepthFormat(const char *name, DepthFormat &format)
+{
+	if (strcmp(name, "32f") == 0) format = DEPTH_32F;
+	else if (strcmp(name, "24") == 0) format = DEPTH_24;
+	else return false;
+	return true;
+}
@@ -0,0 +1,160 @@
+#ifndef FRAMEBUFFER_H
+#define FRAMEBUFFER_H
+
+#include <vector>
+
+#include "Rasterizer.h"
+
+// Color and depth storage for the CPU renderer.
+//
+// The image is stored in FRAMEBUFFER_TILE_SIZE x FRAMEBUFFER_TILE_SIZE tiles,
+// one after the other, with the pixels of a tile in row-major order. A tile
+// is one contiguous block of memory, so rasterizing a tile or walking a
+// scanline of it never strides across the whole image.
+//
+// Color and depth are separate planes, each in one of a few formats. Pixels
+// are not rasterized in place: a tile is unpacked into a FramebufferTile of
+// plain floats, rasterized, and packed again. The float tile of 64x64
+// pixels is 64 KB, small enough to stay in L2 while it is worked on.
+//
+// A multisampled framebuffer stores every sample of every pixel: a tile is
+// one plane of FRAMEBUFFER_TILE_PIXELS per sample, sample after sample.
+// Reading the colors back averages each pixel's samples (the resolve).
+
+#define FRAMEBUFFER_TILE_SIZE 64
+#define FRAMEBUFFER_TILE_PIXELS (FRAMEBUFFER_TILE_SIZE * FRAMEBUFFER_TILE_SIZE)
+
+enum ColorFormat
+{
+	COLOR_RGB32F,	// 3 floats per pixel (12 bytes)
+	COLOR_RGBA8,	// 4 bytes per pixel, 0..1 stored as 0..255 (alpha is always 255)
+	COLOR_RGB16F	// 3 half floats per pixel (6 bytes)
+};
+
+enum DepthFormat
+{
+	DEPTH_32F,		// float (4 bytes)
+	DEPTH_24		// 24-bit fixed point over the depth range (3 bytes)
+};
+
+// One tile unpacked to floats. The planes are row-major with a stride of
+// FRAMEBUFFER_TILE_SIZE, one FRAMEBUFFER_TILE_PIXELS plane per sample;
+// tiles at the right and bottom edges of the image only use their first
+// width x height pixels. loadTile sizes the planes, so a tile reused for
+// tile after tile only allocates once.
+typedef struct FramebufferTile
+{
+	int x0;		// pixel position of the tile's top left corner
+	int y0;
+	int width;
+	int height;
+	int samples;
+	std::vector<float> r;
+	std::vector<float> g;
+	std::vector<float> b;
+	std::vector<float> z;
+
+	// The tile as something to rasterize into
+	PixelPlanes planes()
+	{
+		PixelPlanes p = {r.data(), g.data(), b.data(), z.data(), x0, y0, FRAMEBUFFER_TILE_SIZE,
+			FRAMEBUFFER_TILE_PIXELS};
+		return p;
+	}
+} FramebufferTile;
+
+class Framebuffer
+{
+public:
+	// samples: 1, or 2, 4 or 8 for MSAA (see makeSamplePattern)
+	Framebuffer(const Viewport &viewport, ColorFormat colorFormat = COLOR_RGB32F, DepthFormat depthFormat = DEPTH_32F,
+		int samples = 1);
+
+	const Viewport &getViewport() const { return viewport; }
+	int getWidth() const { return width; }
+	int getHeight() const { return height; }
+	ColorFormat getColorFormat() const { return colorFormat; }
+	DepthFormat getDepthFormat() const { return depthFormat; }
+	int getSamples() const { return samples; }
+	const SamplePattern &getSamplePattern() const { return samplePattern; }
+	int getTilesX() const { return tilesX; }
+	int getTilesY() const { return tilesY; }
+
+	// Bytes of color plus depth storage
+	size_t sizeInBytes() const { return color.size() + depth.size(); }
+
+	// Show a different part of the world (or change the empty depth) without
+	// reallocating. The new viewport must be the same size; throws a string
+	// if it isn't. Call clear() afterwards.
+	void setViewport(const Viewport &viewport);
+
+	// The depths DEPTH_24 can tell apart; others are clamped into the range.
+	// The viewport's minZ (nothing drawn) is always kept. Ignored by DEPTH_32F.
+	void setDepthRange(float zNear, float zFar);
+
+	// Black, with every depth at the viewport's minZ. Only the tiles stored
+	// (or written) since the last clear are cleared again, so clearing a
+	// framebuffer that is drawn into frame after frame costs as much as the
+	// part of the image that was drawn rather than the whole 64 MB of it.
+	void clear();
+
+	// Unpack tile (tileX, tileY) into tile / pack it back
+	void loadTile(int tileX, int tileY, FramebufferTile &tile) const;
+	void storeTile(const FramebufferTile &tile);
+
+	// Copy the whole image to or from row-major float planes of
+	// width * height pixels. Multisampled framebuffers read back the average
+	// of each pixel's samples and the depth of its nearest sample, and
+	// writing a color sets all of a pixel's samples to it.
+	void readColor(float *r, float *g, float *b) const;
+	void readDepth(float *z) const;
+	void writeColor(const float *r, const float *g, const float *b);
+
+	// Names used on the command line: "rgb32f", "rgba8", "rgb16f" and "32f", "24"
+	static bool parseColorFormat(const char *name, ColorFormat &format);
+	static bool parseDepthFormat(const char *name, DepthFormat &format);
+
+private:
+	// Offset of a sample of pixel (x, y) in samples from the start of the planes
+	size_t pixelOffset(int x, int y, int sample = 0) const
+	{
+		int tile = (y / FRAMEBUFFER_TILE_SIZE) * tilesX + x / FRAMEBUFFER_TILE_SIZE;
+		return ((size_t)tile * samples + sample) * FRAMEBUFFER_TILE_PIXELS +
+			(y % FRAMEBUFFER_TILE_SIZE) * FRAMEBUFFER_TILE_SIZE + x % FRAMEBUFFER_TILE_SIZE;
+	}
+
+	float depth24ToFloat(unsigned int q) const
+	{
+		return q == 0 ? viewport.minZ : (float)(depthNear + (q - 1) * depthStep);
+	}
+
+	void packColor(size_t offset, const float *r, const float *g, const float *b, int count);
+	void unpackColor(size_t offset, float *r, float *g, float *b, int count) const;
+	void packDepth(size_t offset, const float *z, int count);
+	void clearTile(int tile);
+	void unpackDepth(size_t offset, float *z, int count) const;
+
+	Viewport viewport;
+	int width;
+	int height;
+	int tilesX;
+	int tilesY;
+	ColorFormat colorFormat;
+	DepthFormat depthFormat;
+	int samples;
+	SamplePattern samplePattern;
+	int colorBytes;		// per sample
+	int depthBytes;
+	double depthNear;
+	double depthStep;	// depth per DEPTH_24 step
+	float clearedMinZ;	// depth the clean tiles hold
+
+	// Per tile, whether it has been stored since the last clear. Threads
+	// storing different tiles set different bytes.
+	std::vector<unsigned char> dirty;
+
+	std::vector<unsigned char> color;
+	std::vector<unsigned char> depth;
+};
+
+#endif
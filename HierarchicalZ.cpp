@@ -0,0 +1,245 @@
+#include "HierarchicalZ.h"
+
+#include <float.h>
+#include <math.h>
+#include <string.h>
+
+#include <algorithm>
+
+using namespace std;
+
+// Four depths at a time; plain SSE on x86-64
+typedef float Float4 __attribute__((vector_size(16)));
+
+void HierarchicalZ::reset(const FramebufferTile &tile)
+{
+	this->tile = &tile;
+	for (int block = 0; block < HIZ_BLOCKS; ++block)
+	{
+		blockZ[block] = farthestDepth(block);
+		blockDraws[block] = 0;
+	}
+	updateTile();
+}
+
+/*
+* A block's farthest depth over all its samples. Blocks past the edge of a
+* partial tile have no pixels and don't limit anything.
+*/
+float HierarchicalZ::farthestDepth(int block) const
+{
+	int bx0 = (block % HIZ_BLOCKS_PER_ROW) * HIZ_BLOCK_SIZE;
+	int by0 = (block / HIZ_BLOCKS_PER_ROW) * HIZ_BLOCK_SIZE;
+	int bx1 = min(bx0 + HIZ_BLOCK_SIZE, tile->width);
+	int by1 = min(by0 + HIZ_BLOCK_SIZE, tile->height);
+
+	float farthest = FLT_MAX;
+	if (bx1 - bx0 == HIZ_BLOCK_SIZE)
+	{
+		// whole rows of the block, HIZ_BLOCK_SIZE / 4 vectors each
+		Float4 m = {FLT_MAX, FLT_MAX, FLT_MAX, FLT_MAX};
+		for (int k = 0; k < tile->samples; ++k)
+		{
+			const float *z = &tile->z[(size_t)k * FRAMEBUFFER_TILE_PIXELS];
+			for (int y = by0; y < by1; ++y)
+			{
+				for (int x = bx0; x < bx1; x += 4)
+				{
+					Float4 v;
+					memcpy(&v, &z[y * FRAMEBUFFER_TILE_SIZE + x], sizeof(v));
+					m = v < m ? v : m;
+				}
+			}
+		}
+		for (int i = 0; i < 4; ++i)
+			farthest = min(farthest, m[i]);
+		return farthest;
+	}
+
+	for (int k = 0; k < tile->samples; ++k)
+	{
+		const float *z = &tile->z[(size_t)k * FRAMEBUFFER_TILE_PIXELS];
+		for (int y = by0; y < by1; ++y)
+		{
+			for (int x = bx0; x < bx1; ++x)
+				farthest = min(farthest, z[y * FRAMEBUFFER_TILE_SIZE + x]);
+		}
+	}
+
+	return farthest;
+}
+
+void HierarchicalZ::updateTile()
+{
+	Float4 m;
+	memcpy(&m, &blockZ[0], sizeof(m));
+	for (int block = 4; block < HIZ_BLOCKS; block += 4)
+	{
+		Float4 v;
+		memcpy(&v, &blockZ[block], sizeof(v));
+		m = v < m ? v : m;
+	}
+
+	tileZ = min(min(m[0], m[1]), min(m[2], m[3]));
+	tileStale = false;
+}
+
+/*
+* A block's pixel rectangle, clipped to the tile
+*/
+static inline void blockRect(const FramebufferTile &tile, int bx, int by, int &x0, int &y0, int &x1, int &y1)
+{
+	x0 = tile.x0 + bx * HIZ_BLOCK_SIZE;
+	y0 = tile.y0 + by * HIZ_BLOCK_SIZE;
+	x1 = min(x0 + HIZ_BLOCK_SIZE, tile.x0 + tile.width);
+	y1 = min(y0 + HIZ_BLOCK_SIZE, tile.y0 + tile.height);
+}
+
+/*
+* The nearest depth the current triangle can have at a pixel or sample of
+* pixels x0 <= x < x1, y0 <= y < y1: that of its plane at the rectangle's
+* nearest corner, but never nearer than its nearest vertex.
+*/
+float HierarchicalZ::nearestIn(int x0, int y0, int x1, int y1) const
+{
+	const TriangleSetup &s = setup;
+	float x = s.attrDx[0] > 0 ? x1 - 1 + reach : x0 - reach;
+	float y = s.attrDy[0] > 0 ? y1 - 1 + reach : y0 - reach;
+	float z = s.attr0[0] + s.attrDx[0]*(x - s.refX) + s.attrDy[0]*(y - s.refY);
+	return min(z, vertexNearest) + depthRounding;
+}
+
+// Likewise the farthest depth
+float HierarchicalZ::farthestIn(int x0, int y0, int x1, int y1) const
+{
+	const TriangleSetup &s = setup;
+	float x = s.attrDx[0] > 0 ? x0 - reach : x1 - 1 + reach;
+	float y = s.attrDy[0] > 0 ? y0 - reach : y1 - 1 + reach;
+	float z = s.attr0[0] + s.attrDx[0]*(x - s.refX) + s.attrDy[0]*(y - s.refY);
+	return max(z, vertexFarthest) - depthRounding;
+}
+
+/*
+* Whether the current triangle covers every pixel and sample of a rectangle:
+* the edge functions are linear, so it does if all its corners are safely
+* inside all three edges.
+*/
+bool HierarchicalZ::covers(int x0, int y0, int x1, int y1) const
+{
+	const TriangleSetup &s = setup;
+	float xs[2] = {x0 - reach - s.refX, x1 - 1 + reach - s.refX};
+	float ys[2] = {y0 - reach - s.refY, y1 - 1 + reach - s.refY};
+
+	for (int i = 0; i < 3; ++i)
+	{
+		float x = s.A[i] > 0 ? xs[0] : xs[1];
+		float y = s.B[i] > 0 ? ys[0] : ys[1];
+		if (!(s.A[i]*x + s.B[i]*y + s.E0[i] > edgeRounding[i]))
+			return false;
+	}
+	return true;
+}
+
+bool HierarchicalZ::test(const Triangle &t, bool multisampled, int &x0, int &y0, int &x1, int &y1, HiZStats &stats)
+{
+	if (!setupTriangle(t, setup))
+		return false;
+
+	// the pixels rasterizeTriangleClipped / rasterizeTriangleMSAA can write
+	int xStart = x0, yStart = y0, xEnd = x1, yEnd = y1;
+	pixelBounds(t, multisampled ? 1 : 0, xStart, yStart, xEnd, yEnd);
+	if (xStart >= xEnd || yStart >= yEnd)
+		return false;
+
+	// The rasterizer evaluates the depth plane in floats at points up to the
+	// bounding box away from the first vertex, and covers() the edge
+	// functions; allow for their rounding.
+	const TriangleSetup &s = setup;
+	float span = (t.maxX - t.minX) + (t.maxY - t.minY) + 4;
+	vertexNearest = max(t.v1.position.z, max(t.v2.position.z, t.v3.position.z));
+	vertexFarthest = min(t.v1.position.z, min(t.v2.position.z, t.v3.position.z));
+	depthRounding = 8 * FLT_EPSILON * (fabsf(s.attr0[0]) + (fabsf(s.attrDx[0]) + fabsf(s.attrDy[0])) * span);
+	for (int i = 0; i < 3; ++i)
+		edgeRounding[i] = 8 * FLT_EPSILON * (fabsf(s.E0[i]) + (fabsf(s.A[i]) + fabsf(s.B[i])) * span);
+	reach = multisampled ? 0.5f : 0;
+
+	long long pixels = (long long)(xEnd - xStart) * (yEnd - yStart);
+	++stats.tested;
+
+	if (tileStale)
+		updateTile();
+	if (nearestIn(xStart, yStart, xEnd, yEnd) <= tileZ)
+	{
+		++stats.tileCulled;
+		stats.tileCulledPixels += pixels;
+		return false;
+	}
+
+	// the blocks the triangle may show in
+	int visibleY0 = yEnd;
+	int visibleY1 = yStart;
+	int visibleX1 = xStart;
+	for (int by = (yStart - tile->y0) / HIZ_BLOCK_SIZE; by <= (yEnd - 1 - tile->y0) / HIZ_BLOCK_SIZE; ++by)
+	{
+		for (int bx = (xStart - tile->x0) / HIZ_BLOCK_SIZE; bx <= (xEnd - 1 - tile->x0) / HIZ_BLOCK_SIZE; ++bx)
+		{
+			int block = by * HIZ_BLOCKS_PER_ROW + bx;
+			if (blockDraws[block] >= HIZ_RESCAN_DRAWS)
+			{
+				float old = blockZ[block];
+				blockZ[block] = farthestDepth(block);
+				blockDraws[block] = 0;
+				tileStale |= old == tileZ && blockZ[block] != old;
+			}
+
+			int bx0, by0, bx1, by1;
+			blockRect(*tile, bx, by, bx0, by0, bx1, by1);
+			if (nearestIn(max(bx0, xStart), max(by0, yStart), min(bx1, xEnd), min(by1, yEnd)) <= blockZ[block])
+				continue;
+
+			visibleY0 = min(visibleY0, by0);
+			visibleY1 = max(visibleY1, by1);
+			visibleX1 = max(visibleX1, bx1);
+		}
+	}
+
+	if (visibleY0 >= visibleY1)
+	{
+		++stats.blockCulled;
+		stats.blockCulledPixels += pixels;
+		return false;
+	}
+
+	// Trimming rows anywhere, or columns on the right, leaves the first pixel
+	// of every remaining row, which the row's values are evaluated at, alone.
+	rectX0 = x0 = xStart;
+	rectY0 = y0 = max(yStart, visibleY0);
+	rectX1 = x1 = min(xEnd, visibleX1);
+	rectY1 = y1 = min(yEnd, visibleY1);
+	stats.blockCulledPixels += pixels - (long long)(x1 - x0) * (y1 - y0);
+	return true;
+}
+
+void HierarchicalZ::drawn()
+{
+	for (int by = (rectY0 - tile->y0) / HIZ_BLOCK_SIZE; by <= (rectY1 - 1 - tile->y0) / HIZ_BLOCK_SIZE; ++by)
+	{
+		for (int bx = (rectX0 - tile->x0) / HIZ_BLOCK_SIZE; bx <= (rectX1 - 1 - tile->x0) / HIZ_BLOCK_SIZE; ++bx)
+		{
+			int block = by * HIZ_BLOCKS_PER_ROW + bx;
+			int bx0, by0, bx1, by1;
+			blockRect(*tile, bx, by, bx0, by0, bx1, by1);
+
+			if (bx0 < rectX0 || by0 < rectY0 || bx1 > rectX1 || by1 > rectY1 || !covers(bx0, by0, bx1, by1))
+			{
+				++blockDraws[block];
+				continue;
+			}
+
+			// every pixel passed the depth test or was already nearer
+			float old = blockZ[block];
+			blockZ[block] = max(old, farthestIn(bx0, by0, bx1, by1));
+			tileStale |= old == tileZ && blockZ[block] != old;
+		}
+	}
+}
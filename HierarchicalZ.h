@@ -0,0 +1,93 @@
+#ifndef HIERARCHICAL_Z_H
+#define HIERARCHICAL_Z_H
+
+#include "Framebuffer.h"
+#include "Rasterizer.h"
+
+// Coarse depths for occlusion culling while a framebuffer tile is rasterized.
+//
+// Every HIZ_BLOCK_SIZE x HIZ_BLOCK_SIZE block of the tile keeps the farthest
+// depth (the smallest z) of its pixels and samples, and the tile keeps the
+// farthest of its blocks. A triangle that can't come nearer than that fails
+// the depth test everywhere in the block, so it is tested against the whole
+// tile first and then block by block, before any pixel is touched.
+//
+// Depths only ever get nearer, so an out of date farthest depth is still a
+// safe bound, and the blocks are kept up to date cheaply:
+//
+// - A triangle that covers a whole block leaves no pixel of it farther than
+//   the triangle's own farthest depth there, which is known from its plane.
+// - Blocks a triangle only partly covers are counted, and rescanned once
+//   HIZ_RESCAN_DRAWS triangles have been drawn into them and another
+//   triangle is tested against them.
+
+#define HIZ_BLOCK_SIZE 8
+#define HIZ_BLOCKS_PER_ROW (FRAMEBUFFER_TILE_SIZE / HIZ_BLOCK_SIZE)
+#define HIZ_BLOCKS (HIZ_BLOCKS_PER_ROW * HIZ_BLOCKS_PER_ROW)
+#define HIZ_RESCAN_DRAWS 4
+
+// What was culled at each level, counted in triangle / tile pairs and in the
+// bounding box pixels the rasterizer would have walked for them
+typedef struct HiZStats
+{
+	long long tested;				// triangle / tile pairs tested
+	long long tileCulled;			// hidden behind the whole tile
+	long long tileCulledPixels;
+	long long blockCulled;			// hidden behind every block they touch
+	long long blockCulledPixels;	// also counts rows and columns of hidden blocks trimmed off drawn triangles
+} HiZStats;
+
+class HierarchicalZ
+{
+public:
+	// Start over on a tile that was just loaded
+	void reset(const FramebufferTile &tile);
+
+	/*
+	* Test a triangle against the tile's depths and trim the rectangle it is
+	* rasterized in to the blocks it may show in. Only whole rows, and
+	* columns on the right, are trimmed, so the pixels drawn and their values
+	* don't change.
+	*
+	* t: The triangle, in screen coordinates
+	* multisampled: The triangle is drawn with rasterizeTriangleMSAA, which
+	*               reaches a pixel further
+	* x0, y0, x1, y1: The clip rectangle, inside the tile. Receives the part
+	*                 still to rasterize.
+	* stats: Culled triangles are counted in it
+	*
+	* returns: false if nothing of the triangle can be visible
+	*/
+	bool test(const Triangle &t, bool multisampled, int &x0, int &y0, int &x1, int &y1, HiZStats &stats);
+
+	// The triangle test last let through has been drawn in the rectangle
+	// test returned
+	void drawn();
+
+private:
+	float farthestDepth(int block) const;
+	void updateTile();
+	float nearestIn(int x0, int y0, int x1, int y1) const;
+	float farthestIn(int x0, int y0, int x1, int y1) const;
+	bool covers(int x0, int y0, int x1, int y1) const;
+
+	const FramebufferTile *tile;
+	float blockZ[HIZ_BLOCKS];
+	int blockDraws[HIZ_BLOCKS];		// partly covering triangles drawn since the last scan
+	float tileZ;
+	bool tileStale;			// a block that held tileZ has moved on
+
+	// the triangle last tested, and the rectangle test returned
+	TriangleSetup setup;
+	float vertexNearest;
+	float vertexFarthest;
+	float depthRounding;	// allowances for the rasterizer's rounding
+	float edgeRounding[3];
+	float reach;			// how far from its pixel a sample can be
+	int rectX0;
+	int rectY0;
+	int rectX1;
+	int rectY1;
+};
+
+#endif
@@ -0,0 +1,569 @@
+#include "ImageWriter.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include <zlib.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_X86_SIMD 1
+#include <emmintrin.h>
+#endif
+
+using namespace std;
+
+static const char *imageFormatNames[] = {"tga", "tgarle", "qoi", "png"};
+static const char *imageFormatExtensions[] = {"tga", "tga", "qoi", "png"};
+
+bool parseImageFormat(const char *name, ImageFormat &format)
+{
+	for (int i = 0; i <= IMAGE_PNG; ++i)
+	{
+		if (strcmp(name, imageFormatNames[i]) == 0)
+		{
+			format = (ImageFormat)i;
+			return true;
+		}
+	}
+	return false;
+}
+
+const char *imageFormatExtension(ImageFormat format)
+{
+	return imageFormatExtensions[format];
+}
+
+// 0..255 for a color, in double precision like the original WriteTga
+static inline unsigned char toByte(float c)
+{
+	double d = (c > 1.0) ? 1.0 : c;
+	d = (d < 0.0) ? 0.0 : d;
+	return (unsigned char)(d * 255);
+}
+
+#if HAVE_X86_SIMD
+// The same for four colors at once, as 32 bit integers
+static inline __m128i toBytes(__m128 c)
+{
+	const __m128d one = _mm_set1_pd(1.0);
+	const __m128d zero = _mm_setzero_pd();
+	const __m128d scale = _mm_set1_pd(255.0);
+	__m128d lo = _mm_cvtps_pd(c);
+	__m128d hi = _mm_cvtps_pd(_mm_movehl_ps(c, c));
+	lo = _mm_mul_pd(_mm_max_pd(_mm_min_pd(lo, one), zero), scale);
+	hi = _mm_mul_pd(_mm_max_pd(_mm_min_pd(hi, one), zero), scale);
+	return _mm_unpacklo_epi64(_mm_cvttpd_epi32(lo), _mm_cvttpd_epi32(hi));
+}
+#endif
+
+void convertRow(const float *r, const float *g, const float *b, int width, bool bgr, unsigned char *out)
+{
+	const float *first = bgr ? b : r;
+	const float *last = bgr ? r : b;
+
+	int x = 0;
+#if HAVE_X86_SIMD
+	for (; x + 4 <= width; x += 4)
+	{
+		// first0..3 g0..3 last0..3 as bytes
+		__m128i c0 = toBytes(_mm_loadu_ps(first + x));
+		__m128i c1 = toBytes(_mm_loadu_ps(g + x));
+		__m128i c2 = toBytes(_mm_loadu_ps(last + x));
+		__m128i bytes = _mm_packus_epi16(_mm_packs_epi32(c0, c1), _mm_packs_epi32(c2, _mm_setzero_si128()));
+		unsigned char planar[16];
+		_mm_storeu_si128((__m128i *)planar, bytes);
+
+		unsigned char *p = out + 3 * x;
+		for (int i = 0; i < 4; ++i)
+		{
+			p[3*i] = planar[i];
+			p[3*i + 1] = planar[4 + i];
+			p[3*i + 2] = planar[8 + i];
+		}
+	}
+#endif
+	for (; x < width; ++x)
+	{
+		out[3*x] = toByte(first[x]);
+		out[3*x + 1] = toByte(g[x]);
+		out[3*x + 2] = toByte(last[x]);
+	}
+}
+
+/*
+* Convert every row of an image, in parallel.
+*
+* topDown: Store the top row (the last in the planes) first
+* out: Receives 3 * width bytes per row, rows stride bytes apart
+*/
+static void convertImage(const float *r, const float *g, const float *b, int width, int height, bool bgr,
+	bool topDown, unsigned char *out, size_t stride, ThreadPool &pool)
+{
+	int blocks = min(height, pool.size() * 4);
+	pool.parallelFor(blocks, [&](int block)
+	{
+		int y0 = (long long)height * block / blocks;
+		int y1 = (long long)height * (block + 1) / blocks;
+		for (int y = y0; y < y1; ++y)
+		{
+			size_t row = (size_t)y * width;
+			int outRow = topDown ? height - 1 - y : y;
+			convertRow(r + row, g + row, b + row, width, bgr, out + (size_t)outRow * stride);
+		}
+	});
+}
+
+static void putTgaHeader(int width, int height, bool rle, unsigned char *header)
+{
+	// thanks to Paul Bourke (http://local.wasp.uwa.edu.au/~pbourke/dataformats/tga/)
+	memset(header, 0, 18);
+	header[2] = rle ? 10 : 2;	// run-length encoded or uncompressed RGB
+	header[12] = width & 0xff;
+	header[13] = (width & 0xff00) >> 8;
+	header[14] = height & 0xff;
+	header[15] = (height & 0xff00) >> 8;
+	header[16] = 24;	// 24-bit color depth
+}
+
+/*
+* Run-length encode a row of Targa pixels: a packet is a count byte, with
+* the top bit set for a run of one pixel repeated, or clear for that many
+* literal pixels, up to 128 either way.
+*/
+static void encodeTgaRow(const unsigned char *pixels, int width, vector<unsigned char> &out)
+{
+	int x = 0;
+	while (x < width)
+	{
+		int run = 1;
+		while (x + run < width && run < 128 && memcmp(pixels + 3*(x + run), pixels + 3*x, 3) == 0)
+			++run;
+		if (run > 1)
+		{
+			out.push_back(0x80 | (run - 1));
+			out.insert(out.end(), pixels + 3*x, pixels + 3*x + 3);
+			x += run;
+			continue;
+		}
+
+		// literals, up to the next pair of equal pixels
+		int count = 1;
+		while (x + count < width && count < 128 &&
+			!(x + count + 1 < width && memcmp(pixels + 3*(x + count), pixels + 3*(x + count + 1), 3) == 0))
+			++count;
+		out.push_back(count - 1);
+		out.insert(out.end(), pixels + 3*x, pixels + 3*(x + count));
+		x += count;
+	}
+}
+
+static void encodeTga(const float *r, const float *g, const float *b, int width, int height, bool rle,
+	ThreadPool &pool, vector<unsigned char> &file)
+{
+	size_t stride = (size_t)width * 3;
+	if (!rle)
+	{
+		file.resize(18 + stride * height);
+		putTgaHeader(width, height, false, file.data());
+		convertImage(r, g, b, width, height, true, false, file.data() + 18, stride, pool);
+		return;
+	}
+
+	vector<unsigned char> pixels(stride * height);
+	convertImage(r, g, b, width, height, true, false, pixels.data(), stride, pool);
+
+	// each block of rows is encoded on its own, then they are joined
+	int blocks = max(1, min(height, pool.size() * 4));
+	vector<vector<unsigned char> > encoded(blocks);
+	pool.parallelFor(blocks, [&](int block)
+	{
+		int y0 = (long long)height * block / blocks;
+		int y1 = (long long)height * (block + 1) / blocks;
+		for (int y = y0; y < y1; ++y)
+			encodeTgaRow(&pixels[y * stride], width, encoded[block]);
+	});
+
+	file.resize(18);
+	putTgaHeader(width, height, true, file.data());
+	for (int block = 0; block < blocks; ++block)
+		file.insert(file.end(), encoded[block].begin(), encoded[block].end());
+}
+
+static void putBigEndian(unsigned int v, vector<unsigned char> &out)
+{
+	out.push_back(v >> 24);
+	out.push_back((v >> 16) & 0xff);
+	out.push_back((v >> 8) & 0xff);
+	out.push_back(v & 0xff);
+}
+
+/*
+* QOI encoding (https://qoiformat.org/qoi-specification.pdf): each pixel is
+* a run of the previous one, an index into the 64 pixels seen last with the
+* same hash, a small difference from the previous pixel, or itself.
+* Inherently serial, but a pass over bytes in cache.
+*/
+static void encodeQoi(const float *r, const float *g, const float *b, int width, int height,
+	ThreadPool &pool, vector<unsigned char> &file)
+{
+	size_t pixelCount = (size_t)width * height;
+	vector<unsigned char> pixels(pixelCount * 3);
+	convertImage(r, g, b, width, height, false, true, pixels.data(), (size_t)width * 3, pool);
+
+	file.clear();
+	file.reserve(14 + pixelCount + 8);
+	const char magic[] = "qoif";
+	file.insert(file.end(), magic, magic + 4);
+	putBigEndian(width, file);
+	putBigEndian(height, file);
+	file.push_back(3);	// RGB
+	file.push_back(0);	// sRGB with linear alpha
+
+	unsigned char seen[64][4] = {};
+	unsigned char previous[3] = {0, 0, 0};
+	int run = 0;
+	for (size_t i = 0; i < pixelCount; ++i)
+	{
+		const unsigned char *p = &pixels[3 * i];
+		if (p[0] == previous[0] && p[1] == previous[1] && p[2] == previous[2])
+		{
+			if (++run == 62)
+			{
+				file.push_back(0xc0 | (run - 1));
+				run = 0;
+			}
+			continue;
+		}
+		if (run > 0)
+		{
+			file.push_back(0xc0 | (run - 1));
+			run = 0;
+		}
+
+		// alpha is always 255; the table starts out with alpha 0, so nothing
+		// matches an entry that was never set
+		int hash = (p[0] * 3 + p[1] * 5 + p[2] * 7 + 255 * 11) % 64;
+		if (memcmp(seen[hash], p, 3) == 0 && seen[hash][3] == 255)
+		{
+			file.push_back(hash);
+		}
+		else
+		{
+			memcpy(seen[hash], p, 3);
+			seen[hash][3] = 255;
+			signed char dr = p[0] - previous[0];
+			signed char dg = p[1] - previous[1];
+			signed char db = p[2] - previous[2];
+			signed char drg = dr - dg;
+			signed char dbg = db - dg;
+			if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1)
+			{
+				file.push_back(0x40 | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2));
+			}
+			else if (dg >= -32 && dg <= 31 && drg >= -8 && drg <= 7 && dbg >= -8 && dbg <= 7)
+			{
+				file.push_back(0x80 | (dg + 32));
+				file.push_back((drg + 8) << 4 | (dbg + 8));
+			}
+			else
+			{
+				file.push_back(0xfe);
+				file.insert(file.end(), p, p + 3);
+			}
+		}
+		memcpy(previous, p, 3);
+	}
+	if (run > 0)
+		file.push_back(0xc0 | (run - 1));
+
+	static const unsigned char end[8] = {0, 0, 0, 0, 0, 0, 0, 1};
+	file.insert(file.end(), end, end + 8);
+}
+
+// The Paeth predictor: whichever of a (left), b (up) and c (up left) is
+// closest to a + b - c, as selects rather than branches
+static inline unsigned char paeth(int a, int b, int c)
+{
+	int pa = abs(b - c);
+	int pb = abs(a - c);
+	int pc = abs(a + b - 2 * c);
+	int bc = pb <= pc ? b : c;
+	return (pa <= pb && pa <= pc) ? a : bc;
+}
+
+// What PNG filter type filter predicts a byte to be from the bytes to its
+// left, above it and above and to the left
+template <int filter>
+static inline unsigned char predict(int left, int up, int upLeft)
+{
+	switch (filter)
+	{
+	case 1: return left;
+	case 2: return up;
+	case 3: return (left + up) / 2;
+	case 4: return paeth(left, up, upLeft);
+	default: return 0;
+	}
+}
+
+// The filter's output bytes, taken as signed, added up. The first pixel
+// has nothing to its left, so the loop over the rest needs no tests.
+template <int filter>
+static long filterCost(const unsigned char *row, const unsigned char *above, int bytes)
+{
+	long sum = 0;
+	for (int i = 0; i < 3 && i < bytes; ++i)
+		sum += abs((signed char)(row[i] - predict<filter>(0, above[i], 0)));
+	for (int i = 3; i < bytes; ++i)
+		sum += abs((signed char)(row[i] - predict<filter>(row[i - 3], above[i], above[i - 3])));
+	return sum;
+}
+
+template <int filter>
+static void applyFilter(const unsigned char *row, const unsigned char *above, int bytes, unsigned char *out)
+{
+	for (int i = 0; i < 3 && i < bytes; ++i)
+		out[i] = row[i] - predict<filter>(0, above[i], 0);
+	for (int i = 3; i < bytes; ++i)
+		out[i] = row[i] - predict<filter>(row[i - 3], above[i], above[i - 3]);
+}
+
+/*
+* Filter a row of a PNG with the filter whose output bytes, taken as
+* signed, add up to the least (the usual heuristic for what deflates best).
+*
+* row, above: The row and the one above it (zeros for the top row)
+* out: Receives the filter type and the filtered row
+*/
+static void filterPngRow(const unsigned char *row, const unsigned char *above, int bytes, unsigned char *out)
+{
+	long costs[5] = {
+		filterCost<0>(row, above, bytes), filterCost<1>(row, above, bytes), filterCost<2>(row, above, bytes),
+		filterCost<3>(row, above, bytes), filterCost<4>(row, above, bytes)
+	};
+	int best = min_element(costs, costs + 5) - costs;
+
+	out[0] = best;
+	switch (best)
+	{
+	case 0: memcpy(out + 1, row, bytes); break;
+	case 1: applyFilter<1>(row, above, bytes, out + 1); break;
+	case 2: applyFilter<2>(row, above, bytes, out + 1); break;
+	case 3: applyFilter<3>(row, above, bytes, out + 1); break;
+	default: applyFilter<4>(row, above, bytes, out + 1); break;
+	}
+}
+
+static void putPngChunk(const char *type, const unsigned char *data, size_t length, vector<unsigned char> &out)
+{
+	putBigEndian(length, out);
+	size_t start = out.size();
+	out.insert(out.end(), type, type + 4);
+	out.insert(out.end(), data, data + length);
+	putBigEndian(crc32(0, &out[start], length + 4), out);
+}
+
+/*
+* PNG encoding: strips of rows are filtered and deflated in parallel, each
+* strip into raw deflate blocks of its own. A sync flush ends each one but
+* the last on a byte boundary without ending the stream, so the strips
+* joined up, between a zlib header and the Adler-32 of all of them
+* (combined from the strips'), are one valid zlib stream.
+*/
+static void encodePng(const float *r, const float *g, const float *b, int width, int height,
+	ThreadPool &pool, vector<unsigned char> &file)
+{
+	size_t stride = (size_t)width * 3;
+	vector<unsigned char> pixels(stride * height);
+	convertImage(r, g, b, width, height, false, true, pixels.data(), stride, pool);
+
+	int strips = max(1, min(pool.size() * 2, height / IMAGE_PNG_STRIP_ROWS));
+	vector<vector<unsigned char> > deflated(strips);
+	vector<uLong> adlers(strips);
+	vector<size_t> lengths(strips);
+	pool.parallelFor(strips, [&](int strip)
+	{
+		int y0 = (long long)height * strip / strips;
+		int y1 = (long long)height * (strip + 1) / strips;
+		vector<unsigned char> filtered((stride + 1) * (y1 - y0));
+		vector<unsigned char> zeros(stride, 0);
+		for (int y = y0; y < y1; ++y)
+		{
+			const unsigned char *row = &pixels[y * stride];
+			filterPngRow(row, y > 0 ? row - stride : zeros.data(), stride, &filtered[(y - y0) * (stride + 1)]);
+		}
+		adlers[strip] = adler32(adler32(0, NULL, 0), filtered.data(), filtered.size());
+		lengths[strip] = filtered.size();
+
+		z_stream z;
+		memset(&z, 0, sizeof(z));
+		deflateInit2(&z, IMAGE_PNG_LEVEL, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY);
+		vector<unsigned char> &out = deflated[strip];
+		out.resize(deflateBound(&z, filtered.size()) + 16);
+		z.next_in = filtered.data();
+		z.avail_in = filtered.size();
+		z.next_out = out.data();
+		z.avail_out = out.size();
+		deflate(&z, strip + 1 < strips ? Z_SYNC_FLUSH : Z_FINISH);
+		out.resize(z.total_out);
+		deflateEnd(&z);
+	});
+
+	vector<unsigned char> zlib;
+	zlib.push_back(0x78);	// deflate, 32K window
+	zlib.push_back(0x01);	// fastest compression, header check
+	uLong adler = adler32(0, NULL, 0);
+	for (int strip = 0; strip < strips; ++strip)
+	{
+		zlib.insert(zlib.end(), deflated[strip].begin(), deflated[strip].end());
+		adler = adler32_combine(adler, adlers[strip], lengths[strip]);
+	}
+	putBigEndian(adler, zlib);
+
+	static const unsigned char signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+	file.assign(signature, signature + 8);
+
+	vector<unsigned char> header;
+	putBigEndian(width, header);
+	putBigEndian(height, header);
+	header.push_back(8);	// bits per channel
+	header.push_back(2);	// RGB
+	header.push_back(0);	// deflate
+	header.push_back(0);	// adaptive filtering
+	header.push_back(0);	// not interlaced
+	putPngChunk("IHDR", header.data(), header.size(), file);
+	putPngChunk("IDAT", zlib.data(), zlib.size(), file);
+	putPngChunk("IEND", NULL, 0, file);
+}
+
+void encodeImage(const float *r, const float *g, const float *b, int width, int height, ImageFormat format,
+	ThreadPool &pool, vector<unsigned char> &file)
+{
+	switch (format)
+	{
+	case IMAGE_TGA:
+	case IMAGE_TGA_RLE:
+		encodeTga(r, g, b, width, height, format == IMAGE_TGA_RLE, pool, file);
+		break;
+	case IMAGE_QOI:
+		encodeQoi(r, g, b, width, height, pool, file);
+		break;
+	case IMAGE_PNG:
+		encodePng(r, g, b, width, height, pool, file);
+		break;
+	}
+}
+
+bool writeFile(const char *path, const vector<unsigned char> &file)
+{
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd < 0)
+	{
+		perror(path);
+		return false;
+	}
+
+	size_t done = 0;
+	while (done < file.size())
+	{
+		ssize_t n = write(fd, file.data() + done, file.size() - done);
+		if (n <= 0)
+		{
+			perror(path);
+			close(fd);
+			return false;
+		}
+		done += n;
+	}
+
+	if (close(fd) != 0)
+	{
+		perror(path);
+		return false;
+	}
+	return true;
+}
+
+bool writeImage(const char *path, const float *r, const float *g, const float *b, int width, int height,
+	ImageFormat format, ThreadPool &pool)
+{
+	vector<unsigned char> file;
+	encodeImage(r, g, b, width, height, format, pool, file);
+	return writeFile(path, file);
+}
+
+BackgroundImageWriter::BackgroundImageWriter(ImageFormat format, int threadCount) :
+	format(format), pool(threadCount), queued(false), busy(false), failed(false), stopping(false)
+{
+	thread = std::thread(&BackgroundImageWriter::run, this);
+}
+
+BackgroundImageWriter::~BackgroundImageWriter()
+{
+	finish();
+	{
+		lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	changed.notify_all();
+	thread.join();
+}
+
+void BackgroundImageWriter::write(const string &path, int width, int height, vector<float> &r, vector<float> &g,
+	vector<float> &b)
+{
+	unique_lock<std::mutex> lock(mutex);
+	changed.wait(lock, [this] { return !queued; });
+
+	waiting.path = path;
+	waiting.width = width;
+	waiting.height = height;
+	waiting.r.swap(r);
+	waiting.g.swap(g);
+	waiting.b.swap(b);
+	queued = true;
+	lock.unlock();
+	changed.notify_all();
+}
+
+bool BackgroundImageWriter::finish()
+{
+	unique_lock<std::mutex> lock(mutex);
+	changed.wait(lock, [this] { return !queued && !busy; });
+	bool ok = !failed;
+	failed = false;
+	return ok;
+}
+
+void BackgroundImageWriter::run()
+{
+	Image image;
+
+	unique_lock<std::mutex> lock(mutex);
+	while (true)
+	{
+		changed.wait(lock, [this] { return queued || stopping; });
+		if (!queued)
+			break;
+
+		// take the image and leave the planes of the last one for write() to hand back
+		swap(image, waiting);
+		queued = false;
+		busy = true;
+		lock.unlock();
+		changed.notify_all();
+
+		encodeImage(image.r.data(), image.g.data(), image.b.data(), image.width, image.height, format, pool, file);
+		bool ok = writeFile(image.path.c_str(), file);
+
+		lock.lock();
+		busy = false;
+		failed = failed || !ok;
+		changed.notify_all();
+	}
+}
@@ -0,0 +1,141 @@
+#ifndef IMAGE_WRITER_H
+#define IMAGE_WRITER_H
+
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "ThreadPool.h"
+
+// Image file output.
+//
+// The color planes are converted to 8 bits a row at a time, with SSE2, in
+// memory order, and the whole file is encoded into one buffer that is
+// written with a single write call. Rows are spread over the thread pool.
+// Colors are clamped to 1 and scaled to 0..255 rounding down, in double
+// precision, as the renderer always has, so every format holds the same
+// pixels.
+//
+// - IMAGE_TGA: uncompressed 24 bit Targa
+// - IMAGE_TGA_RLE: run-length encoded Targa, each packet within a row
+// - IMAGE_QOI: the "Quite OK Image" format, about as fast to encode as RLE
+//   but several times smaller on rendered images
+// - IMAGE_PNG: the image is split into strips of rows that are filtered and
+//   deflated in parallel; every strip but the last ends in a sync flush, so
+//   the strips join into one zlib stream any PNG reader can read
+//
+// The planes are stored bottom row first, as the framebuffer is. Targa
+// files are too; QOI and PNG files are top row first, so their rows are
+// written in reverse.
+enum ImageFormat
+{
+	IMAGE_TGA,
+	IMAGE_TGA_RLE,
+	IMAGE_QOI,
+	IMAGE_PNG
+};
+
+// Rows PNG strips have at least
+#define IMAGE_PNG_STRIP_ROWS 32
+
+// zlib level the PNG strips are deflated at; speed matters more than size
+#define IMAGE_PNG_LEVEL 1
+
+/*
+* Convert a row of float colors to 8 bits per channel.
+*
+* r, g, b: The row's color planes
+* width: Pixels in the row
+* bgr: Store blue, green, red (Targa) rather than red, green, blue
+* out: Receives 3 * width bytes
+*/
+void convertRow(const float *r, const float *g, const float *b, int width, bool bgr, unsigned char *out);
+
+/*
+* Encode an image file into memory.
+*
+* r, g, b: Row-major color planes, width * height pixels, bottom row first
+* format: The file format
+* pool: Threads to run on
+* file: Receives the whole file
+*/
+void encodeImage(const float *r, const float *g, const float *b, int width, int height, ImageFormat format,
+	ThreadPool &pool, std::vector<unsigned char> &file);
+
+/*
+* Write a file with a single write call (or as few as the system allows).
+*
+* returns: false, having printed why, if it can't be written
+*/
+bool writeFile(const char *path, const std::vector<unsigned char> &file);
+
+/*
+* Encode an image (see encodeImage) and write it to path.
+*
+* returns: false, having printed why, if it can't be written
+*/
+bool writeImage(const char *path, const float *r, const float *g, const float *b, int width, int height,
+	ImageFormat format, ThreadPool &pool);
+
+// Encodes and writes images on a thread of its own, so the next image can
+// be drawn while the last one is written out.
+//
+// One image is encoded at a time and one more can wait for it; write()
+// blocks while both places are taken. The images' planes are swapped in
+// rather than copied, and the planes of an image already written are
+// swapped back out, so a caller that writes frame after frame of one size
+// ends up passing the same few planes around and allocates nothing.
+class BackgroundImageWriter
+{
+public:
+	// threadCount: threads to encode with (see ThreadPool)
+	BackgroundImageWriter(ImageFormat format, int threadCount = 1);
+	~BackgroundImageWriter();
+
+	// Queue an image to be written to path. r, g and b (width * height
+	// pixels, see encodeImage) are taken; they are left holding planes to
+	// reuse, or nothing.
+	void write(const std::string &path, int width, int height, std::vector<float> &r, std::vector<float> &g,
+		std::vector<float> &b);
+
+	// Wait until every queued image is written.
+	//
+	// returns: false if any couldn't be (see writeFile)
+	bool finish();
+
+private:
+	struct Image
+	{
+		std::string path;
+		int width;
+		int height;
+		std::vector<float> r;
+		std::vector<float> g;
+		std::vector<float> b;
+	};
+
+	void run();
+
+	ImageFormat format;
+	ThreadPool pool;
+	std::vector<unsigned char> file;
+
+	std::mutex mutex;
+	std::condition_variable changed;
+	Image waiting;		// the image write() queued, if queued
+	bool queued;
+	bool busy;			// encoding or writing an image
+	bool failed;
+	bool stopping;
+	std::thread thread;
+};
+
+// "tga", "tgarle", "qoi" or "png"
+bool parseImageFormat(const char *name, ImageFormat &format);
+
+// The file name extension of a format, without the dot
+const char *imageFormatExtension(ImageFormat format);
+
+#endif
@@ -0,0 +1,434 @@
+#include "Lighting.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include <math.h>
+
+// plain SSE on x86; elsewhere each point is lit on its own
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_X86_SIMD 1
+#include <xmmintrin.h>
+#endif
+
+using namespace std;
+
+Lighting defaultLighting()
+{
+	Lighting lighting;
+	lighting.ambient = Vector3(0, 0, 0);
+	lighting.specular = 0;
+	lighting.shininess = 1;
+	lighting.viewer = Vector3(0, 0, 1);
+
+	Light light;
+	light.type = LIGHT_DIRECTIONAL;
+	light.vector = Vector3(0, 0, 1);
+	light.color = Vector3(1, 1, 1);
+	lighting.lights.push_back(light);
+
+	return lighting;
+}
+
+bool loadLighting(const char *filename, Lighting &lighting)
+{
+	FILE *fp = fopen(filename, "r");
+	if (fp == NULL)
+	{
+		printf("Could not open lights file %s\n", filename);
+		return false;
+	}
+
+	Lighting loaded;
+	loaded.ambient = Vector3(0, 0, 0);
+	loaded.specular = 0;
+	loaded.shininess = 1;
+	loaded.viewer = Vector3(0, 0, 1);
+
+	char line[256];
+	int lineNumber = 0;
+	bool ok = true;
+	while (ok && fgets(line, sizeof(line), fp) != NULL)
+	{
+		++lineNumber;
+		line[strcspn(line, "\r\n")] = '\0';
+		char *comment = strchr(line, '#');
+		if (comment != NULL)
+			*comment = '\0';
+
+		char word[32];
+		int used = 0;
+		if (sscanf(line, " %31s%n", word, &used) != 1)
+			continue;
+		const char *rest = line + used;
+
+		Light light;
+		float x, y, z, r, g, b;
+		char extra;
+		if (strcmp(word, "ambient") == 0)
+			ok = sscanf(rest, "%f %f %f %c", &r, &g, &b, &extra) == 3;
+		else if (strcmp(word, "directional") == 0 || strcmp(word, "point") == 0)
+			ok = sscanf(rest, "%f %f %f %f %f %f %c", &x, &y, &z, &r, &g, &b, &extra) == 6;
+		else if (strcmp(word, "specular") == 0)
+			ok = sscanf(rest, "%f %d %c", &loaded.specular, &loaded.shininess, &extra) == 2 && loaded.shininess >= 0;
+		else
+			ok = false;
+		if (!ok || strcmp(word, "specular") == 0)
+			continue;
+
+		if (strcmp(word, "ambient") == 0)
+		{
+			loaded.ambient = Vector3(r, g, b);
+			continue;
+		}
+
+		light.type = strcmp(word, "point") == 0 ? LIGHT_POINT : LIGHT_DIRECTIONAL;
+		light.vector = Vector3(x, y, z);
+		light.color = Vector3(r, g, b);
+		if (light.type == LIGHT_DIRECTIONAL)
+		{
+			float length = sqrtf(x*x + y*y + z*z);
+			ok = length > 0;
+			if (!ok)
+				continue;
+			light.vector = Vector3(x / length, y / length, z / length);
+		}
+		loaded.lights.push_back(light);
+	}
+	fclose(fp);
+
+	if (!ok)
+	{
+		printf("Bad line %d in lights file %s: %s\n", lineNumber, filename, line);
+		return false;
+	}
+
+	lighting = loaded;
+	return true;
+}
+
+// v turned by the angle whose cosine and sine are c and s about the y axis,
+// the way BasicModel::transformMesh turns vertices
+static Vector3 turnVector(Vector3 v, float c, float s)
+{
+	return Vector3(v.x * c + v.z * s, v.y, v.z * c - v.x * s);
+}
+
+Lighting turnLighting(const Lighting &lighting, float turn, Vector3 center)
+{
+	Lighting turned = lighting;
+	float c = cosf(turn);
+	float s = -sinf(turn);
+	turned.viewer = turnVector(lighting.viewer, c, s);
+	for (size_t i = 0; i < turned.lights.size(); ++i)
+	{
+		Light &light = turned.lights[i];
+		if (light.type == LIGHT_DIRECTIONAL)
+			light.vector = turnVector(light.vector, c, s);
+		else
+		{
+			Vector3 offset = turnVector(Vector3(light.vector.x - center.x, light.vector.y - center.y,
+				light.vector.z - center.z), c, s);
+			light.vector = Vector3(offset.x + center.x, offset.y + center.y, offset.z + center.z);
+		}
+	}
+	return turned;
+}
+
+// Point lights are no nearer than this to what they light, so a point at
+// the light gets a bright but finite falloff and a direction of 0
+#define POINT_LIGHT_MIN_DISTANCE 1e-3f
+
+#if HAVE_X86_SIMD
+
+static inline __m128 dot3(__m128 ax, __m128 ay, __m128 az, __m128 bx, __m128 by, __m128 bz)
+{
+	return _mm_add_ps(_mm_add_ps(_mm_mul_ps(ax, bx), _mm_mul_ps(ay, by)), _mm_mul_ps(az, bz));
+}
+
+// x to the n-th power, by squaring
+static inline __m128 power(__m128 x, int n)
+{
+	__m128 result = _mm_set1_ps(1);
+	while (n > 0)
+	{
+		if (n & 1)
+			result = _mm_mul_ps(result, x);
+		x = _mm_mul_ps(x, x);
+		n >>= 1;
+	}
+	return result;
+}
+
+/*
+* Light four points. The directional terms are the same arithmetic as
+* nDotL * lightColor in the scalar shaders this replaced, so one white light
+* from +z still gives exactly the same colors. The highlights go to sr, sg
+* and sb.
+*/
+static inline void lightBatch(const Lighting &lighting, const Vector3 *halfVectors,
+	__m128 px, __m128 py, __m128 pz, __m128 nx, __m128 ny, __m128 nz, __m128 &r, __m128 &g, __m128 &b,
+	__m128 &sr, __m128 &sg, __m128 &sb)
+{
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 one = _mm_set1_ps(1);
+	bool highlights = lighting.specular > 0;
+
+	r = _mm_set1_ps(lighting.ambient.x);
+	g = _mm_set1_ps(lighting.ambient.y);
+	b = _mm_set1_ps(lighting.ambient.z);
+	sr = zero;
+	sg = zero;
+	sb = zero;
+
+	for (size_t i = 0; i < lighting.lights.size(); ++i)
+	{
+		const Light &light = lighting.lights[i];
+		__m128 lx, ly, lz;
+		__m128 falloff = one;
+		if (light.type == LIGHT_DIRECTIONAL)
+		{
+			lx = _mm_set1_ps(light.vector.x);
+			ly = _mm_set1_ps(light.vector.y);
+			lz = _mm_set1_ps(light.vector.z);
+		}
+		else
+		{
+			lx = _mm_sub_ps(_mm_set1_ps(light.vector.x), px);
+			ly = _mm_sub_ps(_mm_set1_ps(light.vector.y), py);
+			lz = _mm_sub_ps(_mm_set1_ps(light.vector.z), pz);
+			__m128 squared = _mm_max_ps(dot3(lx, ly, lz, lx, ly, lz),
+				_mm_set1_ps(POINT_LIGHT_MIN_DISTANCE * POINT_LIGHT_MIN_DISTANCE));
+			__m128 length = _mm_sqrt_ps(squared);
+			lx = _mm_div_ps(lx, length);
+			ly = _mm_div_ps(ly, length);
+			lz = _mm_div_ps(lz, length);
+			falloff = _mm_div_ps(one, squared);
+		}
+
+		__m128 nDotL = _mm_max_ps(dot3(nx, ny, nz, lx, ly, lz), zero);
+		__m128 diffuse = light.type == LIGHT_DIRECTIONAL ? nDotL : _mm_mul_ps(nDotL, falloff);
+		r = _mm_add_ps(r, _mm_mul_ps(diffuse, _mm_set1_ps(light.color.x)));
+		g = _mm_add_ps(g, _mm_mul_ps(diffuse, _mm_set1_ps(light.color.y)));
+		b = _mm_add_ps(b, _mm_mul_ps(diffuse, _mm_set1_ps(light.color.z)));
+
+		if (!highlights)
+			continue;
+
+		// halfway between the light and the viewer
+		__m128 hx, hy, hz;
+		if (light.type == LIGHT_DIRECTIONAL)
+		{
+			hx = _mm_set1_ps(halfVectors[i].x);
+			hy = _mm_set1_ps(halfVectors[i].y);
+			hz = _mm_set1_ps(halfVectors[i].z);
+		}
+		else
+		{
+			hx = _mm_add_ps(lx, _mm_set1_ps(lighting.viewer.x));
+			hy = _mm_add_ps(ly, _mm_set1_ps(lighting.viewer.y));
+			hz = _mm_add_ps(lz, _mm_set1_ps(lighting.viewer.z));
+			__m128 length = _mm_sqrt_ps(dot3(hx, hy, hz, hx, hy, hz));
+			hx = _mm_div_ps(hx, length);
+			hy = _mm_div_ps(hy, length);
+			hz = _mm_div_ps(hz, length);
+		}
+		__m128 nDotH = _mm_max_ps(dot3(nx, ny, nz, hx, hy, hz), zero);
+		__m128 lit = _mm_cmpgt_ps(nDotL, zero);
+		__m128 specular = _mm_and_ps(lit, _mm_mul_ps(power(nDotH, lighting.shininess), _mm_set1_ps(lighting.specular)));
+		specular = _mm_mul_ps(specular, falloff);
+		sr = _mm_add_ps(sr, _mm_mul_ps(specular, _mm_set1_ps(light.color.x)));
+		sg = _mm_add_ps(sg, _mm_mul_ps(specular, _mm_set1_ps(light.color.y)));
+		sb = _mm_add_ps(sb, _mm_mul_ps(specular, _mm_set1_ps(light.color.z)));
+	}
+}
+
+#else
+
+static inline float dot3(float ax, float ay, float az, float bx, float by, float bz)
+{
+	return (ax * bx + ay * by) + az * bz;
+}
+
+// x to the n-th power, by squaring
+static inline float power(float x, int n)
+{
+	float result = 1;
+	while (n > 0)
+	{
+		if (n & 1)
+			result = result * x;
+		x = x * x;
+		n >>= 1;
+	}
+	return result;
+}
+
+/*
+* Light one point, with the same arithmetic as the SSE lightBatch does for
+* each of its four.
+*/
+static inline void lightPoint(const Lighting &lighting, const Vector3 *halfVectors,
+	float px, float py, float pz, float nx, float ny, float nz, float &r, float &g, float &b,
+	float &sr, float &sg, float &sb)
+{
+	bool highlights = lighting.specular > 0;
+
+	r = lighting.ambient.x;
+	g = lighting.ambient.y;
+	b = lighting.ambient.z;
+	sr = 0;
+	sg = 0;
+	sb = 0;
+
+	for (size_t i = 0; i < lighting.lights.size(); ++i)
+	{
+		const Light &light = lighting.lights[i];
+		float lx, ly, lz;
+		float falloff = 1;
+		if (light.type == LIGHT_DIRECTIONAL)
+		{
+			lx = light.vector.x;
+			ly = light.vector.y;
+			lz = light.vector.z;
+		}
+		else
+		{
+			lx = light.vector.x - px;
+			ly = light.vector.y - py;
+			lz = light.vector.z - pz;
+			float squared = fmaxf(dot3(lx, ly, lz, lx, ly, lz), POINT_LIGHT_MIN_DISTANCE * POINT_LIGHT_MIN_DISTANCE);
+			float length = sqrtf(squared);
+			lx = lx / length;
+			ly = ly / length;
+			lz = lz / length;
+			falloff = 1 / squared;
+		}
+
+		float nDotL = fmaxf(dot3(nx, ny, nz, lx, ly, lz), 0);
+		float diffuse = light.type == LIGHT_DIRECTIONAL ? nDotL : nDotL * falloff;
+		r = r + diffuse * light.color.x;
+		g = g + diffuse * light.color.y;
+		b = b + diffuse * light.color.z;
+
+		if (!highlights)
+			continue;
+
+		// halfway between the light and the viewer
+		float hx, hy, hz;
+		if (light.type == LIGHT_DIRECTIONAL)
+		{
+			hx = halfVectors[i].x;
+			hy = halfVectors[i].y;
+			hz = halfVectors[i].z;
+		}
+		else
+		{
+			hx = lx + lighting.viewer.x;
+			hy = ly + lighting.viewer.y;
+			hz = lz + lighting.viewer.z;
+			float length = sqrtf(dot3(hx, hy, hz, hx, hy, hz));
+			hx = hx / length;
+			hy = hy / length;
+			hz = hz / length;
+		}
+		float nDotH = fmaxf(dot3(nx, ny, nz, hx, hy, hz), 0);
+		float specular = nDotL > 0 ? power(nDotH, lighting.shininess) * lighting.specular : 0;
+		specular = specular * falloff;
+		sr = sr + specular * light.color.x;
+		sg = sg + specular * light.color.y;
+		sb = sb + specular * light.color.z;
+	}
+}
+
+#endif
+
+void lightPoints(const Lighting &lighting, int count, const float *x, const float *y, const float *z,
+	const float *nx, const float *ny, const float *nz, float *r, float *g, float *b,
+	float *sr, float *sg, float *sb)
+{
+	// a directional light's half vector is the same everywhere
+	vector<Vector3> halfVectors(lighting.lights.size());
+	for (size_t i = 0; i < lighting.lights.size(); ++i)
+	{
+		Vector3 l = lighting.lights[i].vector;
+		Vector3 v = lighting.viewer;
+		Vector3 h(l.x + v.x, l.y + v.y, l.z + v.z);
+		float length = h.length();
+		halfVectors[i] = length > 0 ? Vector3(h.x / length, h.y / length, h.z / length) : v;
+	}
+
+#if HAVE_X86_SIMD
+	int i = 0;
+	for (; i + 4 <= count; i += 4)
+	{
+		__m128 vr, vg, vb, vsr, vsg, vsb;
+		lightBatch(lighting, halfVectors.data(),
+			_mm_loadu_ps(&x[i]), _mm_loadu_ps(&y[i]), _mm_loadu_ps(&z[i]),
+			_mm_loadu_ps(&nx[i]), _mm_loadu_ps(&ny[i]), _mm_loadu_ps(&nz[i]), vr, vg, vb, vsr, vsg, vsb);
+		_mm_storeu_ps(&r[i], vr);
+		_mm_storeu_ps(&g[i], vg);
+		_mm_storeu_ps(&b[i], vb);
+		if (sr != NULL)
+		{
+			_mm_storeu_ps(&sr[i], vsr);
+			_mm_storeu_ps(&sg[i], vsg);
+			_mm_storeu_ps(&sb[i], vsb);
+		}
+	}
+
+	if (i < count)
+	{
+		// the last few points, padded out to a batch
+		float in[6][4] = {};
+		float out[6][4];
+		for (int k = 0; i + k < count; ++k)
+		{
+			in[0][k] = x[i + k];
+			in[1][k] = y[i + k];
+			in[2][k] = z[i + k];
+			in[3][k] = nx[i + k];
+			in[4][k] = ny[i + k];
+			in[5][k] = nz[i + k];
+		}
+
+		__m128 vr, vg, vb, vsr, vsg, vsb;
+		lightBatch(lighting, halfVectors.data(),
+			_mm_loadu_ps(in[0]), _mm_loadu_ps(in[1]), _mm_loadu_ps(in[2]),
+			_mm_loadu_ps(in[3]), _mm_loadu_ps(in[4]), _mm_loadu_ps(in[5]), vr, vg, vb, vsr, vsg, vsb);
+		_mm_storeu_ps(out[0], vr);
+		_mm_storeu_ps(out[1], vg);
+		_mm_storeu_ps(out[2], vb);
+		_mm_storeu_ps(out[3], vsr);
+		_mm_storeu_ps(out[4], vsg);
+		_mm_storeu_ps(out[5], vsb);
+		for (int k = 0; i + k < count; ++k)
+		{
+			r[i + k] = out[0][k];
+			g[i + k] = out[1][k];
+			b[i + k] = out[2][k];
+			if (sr != NULL)
+			{
+				sr[i + k] = out[3][k];
+				sg[i + k] = out[4][k];
+				sb[i + k] = out[5][k];
+			}
+		}
+	}
+#else
+	for (int i = 0; i < count; ++i)
+	{
+		float pr, pg, pb, psr, psg, psb;
+		lightPoint(lighting, halfVectors.data(), x[i], y[i], z[i], nx[i], ny[i], nz[i], pr, pg, pb, psr, psg, psb);
+		r[i] = pr;
+		g[i] = pg;
+		b[i] = pb;
+		if (sr != NULL)
+		{
+			sr[i] = psr;
+			sg[i] = psg;
+			sb[i] = psb;
+		}
+	}
+#endif
+}
@@ -0,0 +1,77 @@
+#ifndef LIGHTING_H
+#define LIGHTING_H
+
+#include <vector>
+
+#include "utils.h"
+
+// The lights a model is shaded with. Normals are in the model's own
+// coordinates, so positions and directions are too: those of the model file.
+// The viewer looks down -z, so surfaces facing +z face it; for an instance
+// that turns (see Instance), the lights and the viewer turn the other way
+// instead (see turnLighting).
+
+enum LightType
+{
+	LIGHT_DIRECTIONAL,
+	LIGHT_POINT
+};
+
+typedef struct Light
+{
+	LightType type;
+	Vector3 vector;		// unit direction to the light, or its position
+	Vector3 color;		// for a point light, the color at distance 1; it falls off with the square of the distance
+} Light;
+
+typedef struct Lighting
+{
+	Vector3 ambient;
+	std::vector<Light> lights;
+	float specular;		// strength of the (Blinn-Phong) highlights, 0 for none
+	int shininess;		// exponent of the highlights
+	Vector3 viewer;		// unit direction to the viewer, +z
+} Lighting;
+
+// One white light coming from +z, no ambient and no highlights
+Lighting defaultLighting();
+
+/*
+* Read a scene description: one item per line, '#' starts a comment.
+*
+*   ambient <r> <g> <b>
+*   directional <x> <y> <z> <r> <g> <b>   (x y z: the direction to the light)
+*   point <x> <y> <z> <r> <g> <b>
+*   specular <strength> <shininess>
+*
+* returns: false if the file can't be read or a line is bad (the line is
+*          printed); lighting is then left alone
+*/
+bool loadLighting(const char *filename, Lighting &lighting);
+
+/*
+* The lights as a model turned by turn radians about the vertical axis
+* through center sees them (see Instance): directions, the viewer and point
+* lights about center all turn by -turn, so the model can be shaded in its
+* own coordinates as before.
+*/
+Lighting turnLighting(const Lighting &lighting, float turn, Vector3 center);
+
+/*
+* Calculate the light reaching each of count points: the ambient light plus
+* every light's diffuse term, for a white surface, and apart from it the
+* lights' specular terms. A surface's color tints the first but not the
+* highlights: its color is color * (r, g, b) + (sr, sg, sb). Points are done
+* four at a time with every light applied to each batch.
+*
+* x, y, z: The points (only used by point lights and highlights)
+* nx, ny, nz: Their unit normals
+* r, g, b: Receive the diffuse light
+* sr, sg, sb: Receive the highlights. May be NULL if there are none
+*             (specular is 0).
+*/
+void lightPoints(const Lighting &lighting, int count, const float *x, const float *y, const float *z,
+	const float *nx, const float *ny, const float *nz, float *r, float *g, float *b,
+	float *sr, float *sg, float *sb);
+
+#endif
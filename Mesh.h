@@ -0,0 +1,64 @@
+#if !defined MESH_H
+#define MESH_H
+
+#include <stddef.h>
+
+#include <vector>
+
+// Indexed triangle mesh stored as a struct of arrays.
+//
+// Every per-vertex and per-face attribute lives in its own contiguous float
+// array, so the transform and shading loops stream through memory and can be
+// vectorized by the compiler. Faces refer to vertices through a 0-based index
+// buffer (three indices per face).
+struct Mesh
+{
+   // vertex positions
+   std::vector<float> x;
+   std::vector<float> y;
+   std::vector<float> z;
+
+   // vertex normals: the sum of the unit normals of the adjacent faces
+   // (not normalized)
+   std::vector<float> nx;
+   std::vector<float> ny;
+   std::vector<float> nz;
+
+   // three vertex indices per face
+   std::vector<unsigned int> indices;
+
+   // per-face diffuse color, (1, 1, 1) when the file doesn't give one
+   std::vector<float> red;
+   std::vector<float> green;
+   std::vector<float> blue;
+
+   // per-face unit normal
+   std::vector<float> faceNx;
+   std::vector<float> faceNy;
+   std::vector<float> faceNz;
+
+   unsigned int vertexCount() const { return x.size(); }
+   unsigned int faceCount() const { return indices.size() / 3; }
+
+   // Sizes every array for the given counts (contents are zeroed).
+   void resize(unsigned int vertexCount, unsigned int faceCount)
+   {
+      x.assign(vertexCount, 0.0f);
+      y.assign(vertexCount, 0.0f);
+      z.assign(vertexCount, 0.0f);
+      nx.assign(vertexCount, 0.0f);
+      ny.assign(vertexCount, 0.0f);
+      nz.assign(vertexCount, 0.0f);
+
+      indices.assign((size_t)faceCount * 3, 0);
+
+      red.assign(faceCount, 0.0f);
+      green.assign(faceCount, 0.0f);
+      blue.assign(faceCount, 0.0f);
+      faceNx.assign(faceCount, 0.0f);
+      faceNy.assign(faceCount, 0.0f);
+      faceNz.assign(faceCount, 0.0f);
+   }
+};
+
+#endif
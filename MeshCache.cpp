@@ -0,0 +1,374 @@
+#include "MeshCache.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+
+using namespace std;
+
+// Pointers to the arrays of mesh, in cache order
+static void meshArrays(Mesh &mesh, vector<float> *vertexArrays[], vector<float> *faceArrays[])
+{
+   vertexArrays[0] = &mesh.x;
+   vertexArrays[1] = &mesh.y;
+   vertexArrays[2] = &mesh.z;
+   vertexArrays[3] = &mesh.nx;
+   vertexArrays[4] = &mesh.ny;
+   vertexArrays[5] = &mesh.nz;
+
+   faceArrays[0] = &mesh.red;
+   faceArrays[1] = &mesh.green;
+   faceArrays[2] = &mesh.blue;
+   faceArrays[3] = &mesh.faceNx;
+   faceArrays[4] = &mesh.faceNy;
+   faceArrays[5] = &mesh.faceNz;
+}
+
+// Size in bytes of the arrays that follow the header
+static size_t payloadSize(unsigned int vertexCount, unsigned int faceCount)
+{
+   return (size_t)vertexCount * MESH_CACHE_VERTEX_ARRAYS * sizeof(float) +
+          (size_t)faceCount * 3 * sizeof(unsigned int) +
+          (size_t)faceCount * MESH_CACHE_FACE_ARRAYS * sizeof(float);
+}
+
+// Points vertexArrays, indices and faceArrays at the arrays that follow the
+// header at mapping
+template <typename Float, typename Index>
+static void mappedArrays(void *mapping, unsigned int vertexCount, unsigned int faceCount,
+                         Float *vertexArrays[], Index *&indices, Float *faceArrays[])
+{
+   char *p = (char *)mapping + sizeof(MeshCacheHeader);
+   for (int i = 0; i < MESH_CACHE_VERTEX_ARRAYS; ++i)
+   {
+      vertexArrays[i] = (Float *)p;
+      p += (size_t)vertexCount * sizeof(float);
+   }
+   indices = (Index *)p;
+   p += (size_t)faceCount * 3 * sizeof(unsigned int);
+   for (int i = 0; i < MESH_CACHE_FACE_ARRAYS; ++i)
+   {
+      faceArrays[i] = (Float *)p;
+      p += (size_t)faceCount * sizeof(float);
+   }
+}
+
+// Fills in the source fields of header from sourceFile
+static bool statSource(const string &sourceFile, MeshCacheHeader &header)
+{
+   struct stat st;
+   if (stat(sourceFile.c_str(), &st) != 0)
+      return false;
+
+   header.sourceSize = (long long)st.st_size;
+   header.sourceMtime = (long long)st.st_mtim.tv_sec;
+   header.sourceMtimeNsec = (long long)st.st_mtim.tv_nsec;
+   header.sourceInode = (long long)st.st_ino;
+   return true;
+}
+
+// Creates a new file next to path to write it under, named uniquely so
+// writers of the same cache don't share it. Returns its descriptor, or -1.
+static int createTemp(const string &path, string &tmpPath)
+{
+   vector<char> name(path.begin(), path.end());
+   const char suffix[] = ".tmp.XXXXXX";
+   name.insert(name.end(), suffix, suffix + sizeof(suffix));
+   int fd = mkstemp(name.data());
+   if (fd < 0)
+      return -1;
+
+   // mkstemp makes it private to its owner; caches are for everyone who
+   // can read the model
+   fchmod(fd, 0644);
+   tmpPath = name.data();
+   return fd;
+}
+
+MeshCache::MeshCache() :
+   vertexCount(0), faceCount(0), optimized(false), indices(0),
+   mapping(0), mappingSize(0)
+{
+   memset(&optimizeStats, 0, sizeof(optimizeStats));
+   for (int i = 0; i < MESH_CACHE_VERTEX_ARRAYS; ++i)
+      vertexArrays[i] = 0;
+   for (int i = 0; i < MESH_CACHE_FACE_ARRAYS; ++i)
+      faceArrays[i] = 0;
+}
+
+MeshCache::~MeshCache()
+{
+   close();
+}
+
+string MeshCache::cachePath(const string &sourceFile)
+{
+   return sourceFile + ".cache";
+}
+
+bool MeshCache::open(const string &sourceFile)
+{
+   close();
+
+   MeshCacheHeader source;
+   if (!statSource(sourceFile, source))
+      return false;
+
+   int fd = ::open(cachePath(sourceFile).c_str(), O_RDONLY);
+   if (fd < 0)
+      return false;
+
+   struct stat st;
+   if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(MeshCacheHeader))
+   {
+      ::close(fd);
+      return false;
+   }
+
+   void *m = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+   ::close(fd); // the mapping stays valid after the descriptor is closed
+   if (m == MAP_FAILED)
+      return false;
+
+   mapping = m;
+   mappingSize = st.st_size;
+
+   const MeshCacheHeader *header = (const MeshCacheHeader *)mapping;
+   if (memcmp(header->magic, MESH_CACHE_MAGIC, 4) != 0 ||
+       header->version != MESH_CACHE_VERSION ||
+       header->sourceSize != source.sourceSize ||
+       header->sourceMtime != source.sourceMtime ||
+       header->sourceMtimeNsec != source.sourceMtimeNsec ||
+       header->sourceInode != source.sourceInode ||
+       mappingSize != sizeof(MeshCacheHeader) + payloadSize(header->vertexCount, header->faceCount))
+   {
+      close();
+      return false;
+   }
+
+   // we are about to stream through the whole file once
+   madvise(mapping, mappingSize, MADV_SEQUENTIAL);
+
+   vertexCount = header->vertexCount;
+   faceCount = header->faceCount;
+   optimized = header->optimized != 0;
+   optimizeStats = header->optimizeStats;
+   mappedArrays(mapping, vertexCount, faceCount, vertexArrays, indices, faceArrays);
+
+   // A damaged file can still be the right size. Every later stage indexes
+   // the vertex arrays with these, so one out of range rejects the cache.
+   unsigned int largest = 0;
+   for (size_t i = 0; i < (size_t)faceCount * 3; ++i)
+      largest = max(largest, indices[i]);
+   if (faceCount > 0 && largest >= vertexCount)
+   {
+      close();
+      return false;
+   }
+
+   return true;
+}
+
+void MeshCache::copyTo(Mesh &mesh) const
+{
+   vector<float> *meshVertexArrays[MESH_CACHE_VERTEX_ARRAYS];
+   vector<float> *meshFaceArrays[MESH_CACHE_FACE_ARRAYS];
+   meshArrays(mesh, meshVertexArrays, meshFaceArrays);
+
+   for (int i = 0; i < MESH_CACHE_VERTEX_ARRAYS; ++i)
+      meshVertexArrays[i]->assign(vertexArrays[i], vertexArrays[i] + vertexCount);
+   mesh.indices.assign(indices, indices + (size_t)faceCount * 3);
+   for (int i = 0; i < MESH_CACHE_FACE_ARRAYS; ++i)
+      meshFaceArrays[i]->assign(faceArrays[i], faceArrays[i] + faceCount);
+}
+
+// Advises the system it can drop the whole pages in [begin, end)
+static void dropPages(const void *begin, const void *end)
+{
+   size_t pageSize = sysconf(_SC_PAGESIZE);
+   uintptr_t first = ((uintptr_t)begin + pageSize - 1) / pageSize * pageSize;
+   uintptr_t last = (uintptr_t)end / pageSize * pageSize;
+   if (first < last)
+      madvise((void *)first, last - first, MADV_DONTNEED);
+}
+
+void MeshCache::dropFaces(unsigned int first, unsigned int last) const
+{
+   if (!mapping || first >= last)
+      return;
+
+   dropPages(indices + (size_t)first * 3, indices + (size_t)last * 3);
+   for (int i = 0; i < MESH_CACHE_FACE_ARRAYS; ++i)
+      dropPages(faceArrays[i] + first, faceArrays[i] + last);
+}
+
+void MeshCache::close()
+{
+   if (mapping)
+      munmap(mapping, mappingSize);
+
+   mapping = 0;
+   mappingSize = 0;
+   vertexCount = faceCount = 0;
+   optimized = false;
+   memset(&optimizeStats, 0, sizeof(optimizeStats));
+   indices = 0;
+   for (int i = 0; i < MESH_CACHE_VERTEX_ARRAYS; ++i)
+      vertexArrays[i] = 0;
+   for (int i = 0; i < MESH_CACHE_FACE_ARRAYS; ++i)
+      faceArrays[i] = 0;
+}
+
+bool MeshCache::write(const string &sourceFile, const Mesh &mesh, const MeshOptimizeStats &optimizeStats)
+{
+   unsigned int vertexCount = mesh.vertexCount();
+   unsigned int faceCount = mesh.faceCount();
+
+   MeshCacheHeader header;
+   memset(&header, 0, sizeof(header));
+   memcpy(header.magic, MESH_CACHE_MAGIC, 4);
+   header.version = MESH_CACHE_VERSION;
+   header.vertexCount = vertexCount;
+   header.faceCount = faceCount;
+   header.optimized = 1;
+   header.optimizeStats = optimizeStats;
+   if (!statSource(sourceFile, header))
+      return false;
+
+   vector<float> *meshVertexArrays[MESH_CACHE_VERTEX_ARRAYS];
+   vector<float> *meshFaceArrays[MESH_CACHE_FACE_ARRAYS];
+   meshArrays(const_cast<Mesh &>(mesh), meshVertexArrays, meshFaceArrays);
+
+   // write to a temporary file and rename it into place so a concurrent
+   // reader never maps a half-written cache
+   string path = cachePath(sourceFile);
+   string tmpPath;
+   int fd = createTemp(path, tmpPath);
+   if (fd < 0)
+      return false;
+   FILE *fp = fdopen(fd, "wb");
+   if (fp == NULL)
+   {
+      ::close(fd);
+      remove(tmpPath.c_str());
+      return false;
+   }
+
+   bool ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+   for (int i = 0; i < MESH_CACHE_VERTEX_ARRAYS; ++i)
+      ok = ok && fwrite(meshVertexArrays[i]->data(), sizeof(float), vertexCount, fp) == vertexCount;
+   ok = ok && fwrite(mesh.indices.data(), sizeof(unsigned int), (size_t)faceCount * 3, fp) == (size_t)faceCount * 3;
+   for (int i = 0; i < MESH_CACHE_FACE_ARRAYS; ++i)
+      ok = ok && fwrite(meshFaceArrays[i]->data(), sizeof(float), faceCount, fp) == faceCount;
+   ok = (fclose(fp) == 0) && ok;
+
+   if (!ok || rename(tmpPath.c_str(), path.c_str()) != 0)
+   {
+      remove(tmpPath.c_str());
+      return false;
+   }
+
+   return true;
+}
+
+MeshCacheWriter::MeshCacheWriter() :
+   vertexCount(0), faceCount(0), indices(0),
+   mapping(0), mappingSize(0)
+{
+   for (int i = 0; i < MESH_CACHE_VERTEX_ARRAYS; ++i)
+      vertexArrays[i] = 0;
+   for (int i = 0; i < MESH_CACHE_FACE_ARRAYS; ++i)
+      faceArrays[i] = 0;
+}
+
+MeshCacheWriter::~MeshCacheWriter()
+{
+   abandon();
+}
+
+bool MeshCacheWriter::create(const string &sourceFile, unsigned int vertexCount, unsigned int faceCount)
+{
+   abandon();
+
+   this->sourceFile = sourceFile;
+   int fd = createTemp(MeshCache::cachePath(sourceFile), tmpPath);
+   if (fd < 0)
+      return false;
+
+   // a new file reads as zeros, so the arrays start out zeroed
+   size_t size = sizeof(MeshCacheHeader) + payloadSize(vertexCount, faceCount);
+   void *m = MAP_FAILED;
+   if (ftruncate(fd, size) == 0)
+      m = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+   ::close(fd);
+   if (m == MAP_FAILED)
+   {
+      remove(tmpPath.c_str());
+      return false;
+   }
+
+   mapping = m;
+   mappingSize = size;
+   this->vertexCount = vertexCount;
+   this->faceCount = faceCount;
+   mappedArrays(mapping, vertexCount, faceCount, vertexArrays, indices, faceArrays);
+   return true;
+}
+
+bool MeshCacheWriter::finish()
+{
+   if (!mapping)
+      return false;
+
+   // the header goes in last, so a file that isn't finished is never valid
+   MeshCacheHeader header;
+   memset(&header, 0, sizeof(header));
+   memcpy(header.magic, MESH_CACHE_MAGIC, 4);
+   header.version = MESH_CACHE_VERSION;
+   header.vertexCount = vertexCount;
+   header.faceCount = faceCount;
+   if (!statSource(sourceFile, header))
+   {
+      abandon();
+      return false;
+   }
+   memcpy(mapping, &header, sizeof(header));
+
+   string path = MeshCache::cachePath(sourceFile);
+   bool ok = msync(mapping, mappingSize, MS_SYNC) == 0;
+   munmap(mapping, mappingSize);
+   mapping = 0;
+   mappingSize = 0;
+
+   if (!ok || rename(tmpPath.c_str(), path.c_str()) != 0)
+   {
+      remove(tmpPath.c_str());
+      return false;
+   }
+   return true;
+}
+
+void MeshCacheWriter::abandon()
+{
+   if (mapping)
+   {
+      munmap(mapping, mappingSize);
+      remove(tmpPath.c_str());
+   }
+
+   mapping = 0;
+   mappingSize = 0;
+   vertexCount = faceCount = 0;
+   indices = 0;
+   for (int i = 0; i < MESH_CACHE_VERTEX_ARRAYS; ++i)
+      vertexArrays[i] = 0;
+   for (int i = 0; i < MESH_CACHE_FACE_ARRAYS; ++i)
+      faceArrays[i] = 0;
+}
@@ -0,0 +1,133 @@
+#if !defined MESH_CACHE_H
+#define MESH_CACHE_H
+
+#include <string>
+
+#include "Mesh.h"
+#include "MeshOptimizer.h"
+
+// Binary cache for parsed .m meshes.
+//
+// The first time a .m file is parsed (and optimized, see optimizeMesh),
+// BasicModel writes <file>.cache next to it. The cache is a fixed header,
+// which also keeps what the optimization did, followed by the arrays of a
+// Mesh, in the order they are declared in Mesh.h:
+//
+//    float x, y, z, nx, ny, nz [vertexCount]        (position, vertex normal)
+//    unsigned int indices[3 * faceCount]             (0-based)
+//    float red, green, blue, faceNx, faceNy, faceNz [faceCount]
+//
+// On later runs the cache is memory-mapped and used instead of the text file,
+// as long as the source file's size, modification time and inode still match.
+//
+// Caches are written under a temporary name unique to the writer and renamed
+// into place, so processes caching the same file at once don't write into
+// each other's, and a reader never maps one half written.
+//
+// A mesh too large to hold in memory is instead converted by
+// streamMeshFile, which writes the cache through a MeshCacheWriter without
+// optimizing it (optimized is false). MeshStream then reads it a chunk of
+// faces at a time.
+
+#define MESH_CACHE_MAGIC "BMC1"
+#define MESH_CACHE_VERSION 5
+
+#define MESH_CACHE_VERTEX_ARRAYS 6
+#define MESH_CACHE_FACE_ARRAYS 6
+
+struct MeshCacheHeader
+{
+   char magic[4];
+   unsigned int version;
+   long long sourceSize;   // size of the .m file the cache was built from
+   long long sourceMtime;  // modification time of that .m file, seconds
+   long long sourceMtimeNsec; // and nanoseconds, so an edit within the second shows
+   long long sourceInode;  // the file replaced by another of the same size and time shows too
+   unsigned int vertexCount;
+   unsigned int faceCount;
+   unsigned int optimized; // 1 if the mesh was optimized (see optimizeMesh), 0 if it is in the file's order
+   MeshOptimizeStats optimizeStats;
+};
+
+// Read-only view of a memory-mapped cache file. The array pointers point
+// straight into the mapping and are only valid while the MeshCache is alive.
+class MeshCache
+{
+public:
+   MeshCache();
+   ~MeshCache();
+
+   // Maps the cache for sourceFile. Returns false (and leaves the object
+   // empty) if there is no cache or it is stale or malformed, down to an
+   // index past the vertices.
+   bool open(const std::string &sourceFile);
+
+   // Copies the mapped arrays into mesh.
+   void copyTo(Mesh &mesh) const;
+
+   // Tells the system the pages that hold only faces first to last - 1 won't
+   // be needed soon, so it can drop them. Reading them again is still fine.
+   void dropFaces(unsigned int first, unsigned int last) const;
+
+   unsigned int vertexCount;
+   unsigned int faceCount;
+   bool optimized;
+   MeshOptimizeStats optimizeStats;    // all zero unless optimized
+
+   // x, y, z, nx, ny, nz
+   const float *vertexArrays[MESH_CACHE_VERTEX_ARRAYS];
+   const unsigned int *indices;
+   // red, green, blue, faceNx, faceNy, faceNz
+   const float *faceArrays[MESH_CACHE_FACE_ARRAYS];
+
+   // Writes the cache for sourceFile, of a mesh optimizeMesh has been
+   // through. Failing to write (e.g. a read-only directory) is not an error;
+   // the next run just parses the text again.
+   static bool write(const std::string &sourceFile, const Mesh &mesh, const MeshOptimizeStats &optimizeStats);
+
+   static std::string cachePath(const std::string &sourceFile);
+
+private:
+   void close();
+
+   void *mapping;
+   size_t mappingSize;
+};
+
+// Writes a cache file in place through a writable memory mapping, so the
+// mesh never has to be in memory as a whole. Fill in the arrays (they start
+// out zeroed), then call finish(). Until then the file has a temporary name,
+// which is removed if the writer is destroyed unfinished.
+class MeshCacheWriter
+{
+public:
+   MeshCacheWriter();
+   ~MeshCacheWriter();
+
+   // Creates and maps the cache for sourceFile, sized for the given counts.
+   // Returns false if the file can't be created.
+   bool create(const std::string &sourceFile, unsigned int vertexCount, unsigned int faceCount);
+
+   // Writes the header and moves the file into place. Returns false (and
+   // removes the file) if that fails.
+   bool finish();
+
+   unsigned int vertexCount;
+   unsigned int faceCount;
+
+   // x, y, z, nx, ny, nz
+   float *vertexArrays[MESH_CACHE_VERTEX_ARRAYS];
+   unsigned int *indices;
+   // red, green, blue, faceNx, faceNy, faceNz
+   float *faceArrays[MESH_CACHE_FACE_ARRAYS];
+
+private:
+   void abandon();
+
+   std::string sourceFile;
+   std::string tmpPath;
+   void *mapping;
+   size_t mappingSize;
+};
+
+#endif
@@ -0,0 +1,329 @@
+#include "MeshOptimizer.h"
+
+#include <math.h>
+#include <string.h>
+
+#include <algorithm>
+#include <vector>
+
+using namespace std;
+
+// Forsyth's scoring constants
+#define CACHE_DECAY_POWER 1.5f
+#define LAST_FACE_SCORE 0.75f
+#define VALENCE_BOOST_SCALE 2.0f
+#define VALENCE_BOOST_POWER 0.5f
+
+float computeACMR(const Mesh &mesh)
+{
+   unsigned int faceCount = mesh.faceCount();
+   if (faceCount == 0)
+      return 0;
+
+   // a vertex is in the cache if fewer than MESH_ACMR_CACHE_SIZE misses
+   // came after the one that loaded it
+   vector<long long> loadedAt(mesh.vertexCount(), -MESH_ACMR_CACHE_SIZE - 1);
+   long long misses = 0;
+   for (size_t i = 0; i < mesh.indices.size(); ++i)
+   {
+      unsigned int v = mesh.indices[i];
+      if (misses - loadedAt[v] >= MESH_ACMR_CACHE_SIZE)
+      {
+         ++misses;
+         loadedAt[v] = misses - 1;
+      }
+   }
+
+   return (float)misses / faceCount;
+}
+
+// Bit patterns of a vertex's position, for finding exact duplicates
+struct PositionKey
+{
+   unsigned int bits[3];
+   unsigned int vertex;
+
+   bool operator<(const PositionKey &o) const
+   {
+      if (bits[0] != o.bits[0]) return bits[0] < o.bits[0];
+      if (bits[1] != o.bits[1]) return bits[1] < o.bits[1];
+      if (bits[2] != o.bits[2]) return bits[2] < o.bits[2];
+      return vertex < o.vertex;
+   }
+   bool samePosition(const PositionKey &o) const
+   {
+      return bits[0] == o.bits[0] && bits[1] == o.bits[1] && bits[2] == o.bits[2];
+   }
+};
+
+// Keep the faces listed in order, in that order, and drop the others
+static void reorderFaces(Mesh &mesh, const vector<unsigned int> &order)
+{
+   vector<unsigned int> indices(order.size() * 3);
+   for (size_t f = 0; f < order.size(); ++f)
+   {
+      for (int k = 0; k < 3; ++k)
+         indices[3*f + k] = mesh.indices[3*order[f] + k];
+   }
+   mesh.indices.swap(indices);
+
+   vector<float> *arrays[] = {&mesh.red, &mesh.green, &mesh.blue, &mesh.faceNx, &mesh.faceNy, &mesh.faceNz};
+   vector<float> moved(order.size());
+   for (int a = 0; a < 6; ++a)
+   {
+      for (size_t f = 0; f < order.size(); ++f)
+         moved[f] = (*arrays[a])[order[f]];
+      arrays[a]->assign(moved.begin(), moved.end());
+   }
+}
+
+/*
+* Merge vertices with bit for bit the same position into the first of them,
+* and drop the faces that leaves with two corners the same.
+*/
+static void weldVertices(Mesh &mesh, MeshOptimizeStats &stats)
+{
+   unsigned int vertexCount = mesh.vertexCount();
+   vector<PositionKey> keys(vertexCount);
+   for (unsigned int v = 0; v < vertexCount; ++v)
+   {
+      memcpy(&keys[v].bits[0], &mesh.x[v], sizeof(float));
+      memcpy(&keys[v].bits[1], &mesh.y[v], sizeof(float));
+      memcpy(&keys[v].bits[2], &mesh.z[v], sizeof(float));
+      keys[v].vertex = v;
+   }
+   sort(keys.begin(), keys.end());
+
+   vector<unsigned int> weldTo(vertexCount);
+   for (size_t i = 0; i < keys.size(); )
+   {
+      size_t j = i;
+      while (j < keys.size() && keys[j].samePosition(keys[i]))
+      {
+         weldTo[keys[j].vertex] = keys[i].vertex;
+         ++j;
+      }
+      i = j;
+   }
+
+   for (unsigned int v = 0; v < vertexCount; ++v)
+   {
+      unsigned int to = weldTo[v];
+      if (to == v)
+         continue;
+      mesh.nx[to] += mesh.nx[v];
+      mesh.ny[to] += mesh.ny[v];
+      mesh.nz[to] += mesh.nz[v];
+      ++stats.weldedVertices;
+   }
+   if (stats.weldedVertices == 0)
+      return;
+
+   vector<unsigned int> kept;
+   unsigned int faceCount = mesh.faceCount();
+   for (unsigned int f = 0; f < faceCount; ++f)
+   {
+      unsigned int *index = &mesh.indices[3*f];
+      for (int k = 0; k < 3; ++k)
+         index[k] = weldTo[index[k]];
+      if (index[0] != index[1] && index[1] != index[2] && index[0] != index[2])
+         kept.push_back(f);
+   }
+   stats.droppedFaces = faceCount - kept.size();
+   if (stats.droppedFaces > 0)
+      reorderFaces(mesh, kept);
+}
+
+// Score of a vertex for Forsyth's algorithm: higher the more recently it was
+// used and the fewer faces it still has to be drawn with
+static float vertexScore(int cachePosition, unsigned int valence)
+{
+   if (valence == 0)
+      return -1;
+
+   float score = 0;
+   if (cachePosition >= 0)
+   {
+      if (cachePosition < 3)
+      {
+         // the last face's vertices; don't favor using them again right away
+         score = LAST_FACE_SCORE;
+      }
+      else
+      {
+         float scale = 1.0f / (MESH_FORSYTH_CACHE_SIZE - 3);
+         score = powf(1.0f - (cachePosition - 3) * scale, CACHE_DECAY_POWER);
+      }
+   }
+
+   // finish off vertices with few faces left, so they leave the cache for good
+   return score + VALENCE_BOOST_SCALE * powf((float)valence, -VALENCE_BOOST_POWER);
+}
+
+/*
+* Forsyth's linear-speed vertex cache optimization: repeatedly draw the face
+* with the best score among the faces of the vertices in a simulated LRU
+* cache, falling back to the first face not drawn yet.
+*
+* returns: The faces in their new order
+*/
+static vector<unsigned int> forsythOrder(const Mesh &mesh)
+{
+   unsigned int vertexCount = mesh.vertexCount();
+   unsigned int faceCount = mesh.faceCount();
+   const unsigned int *indices = mesh.indices.data();
+
+   // the faces of every vertex; the first valence[v] are the ones still to draw
+   vector<unsigned int> valence(vertexCount, 0);
+   for (size_t i = 0; i < mesh.indices.size(); ++i)
+      ++valence[indices[i]];
+   vector<unsigned int> firstFace(vertexCount + 1, 0);
+   for (unsigned int v = 0; v < vertexCount; ++v)
+      firstFace[v + 1] = firstFace[v] + valence[v];
+   vector<unsigned int> vertexFaces(mesh.indices.size());
+   vector<unsigned int> filled(vertexCount, 0);
+   for (unsigned int f = 0; f < faceCount; ++f)
+   {
+      for (int k = 0; k < 3; ++k)
+      {
+         unsigned int v = indices[3*f + k];
+         vertexFaces[firstFace[v] + filled[v]++] = f;
+      }
+   }
+
+   vector<int> cachePosition(vertexCount, -1);
+   vector<float> score(vertexCount);
+   for (unsigned int v = 0; v < vertexCount; ++v)
+      score[v] = vertexScore(-1, valence[v]);
+   vector<float> faceScore(faceCount);
+   for (unsigned int f = 0; f < faceCount; ++f)
+      faceScore[f] = score[indices[3*f]] + score[indices[3*f + 1]] + score[indices[3*f + 2]];
+
+   vector<bool> drawn(faceCount, false);
+   vector<unsigned int> order;
+   order.reserve(faceCount);
+   vector<unsigned int> cache;
+   vector<unsigned int> newCache;
+   unsigned int nextUndrawn = 0;
+   int best = faceCount > 0 ? 0 : -1;
+
+   while (best >= 0)
+   {
+      drawn[best] = true;
+      order.push_back(best);
+
+      // the face's vertices go to the front of the cache
+      newCache.clear();
+      for (int k = 0; k < 3; ++k)
+      {
+         unsigned int v = indices[3*best + k];
+         newCache.push_back(v);
+
+         unsigned int *faces = &vertexFaces[firstFace[v]];
+         for (unsigned int n = 0; n < valence[v]; ++n)
+         {
+            if (faces[n] == (unsigned int)best)
+            {
+               swap(faces[n], faces[valence[v] - 1]);
+               --valence[v];
+               break;
+            }
+         }
+      }
+      for (size_t n = 0; n < cache.size(); ++n)
+      {
+         unsigned int v = cache[n];
+         if (v != newCache[0] && v != newCache[1] && v != newCache[2])
+            newCache.push_back(v);
+      }
+
+      // rescore the vertices in the cache, and those pushed out of it
+      for (size_t n = 0; n < newCache.size(); ++n)
+      {
+         unsigned int v = newCache[n];
+         cachePosition[v] = n < MESH_FORSYTH_CACHE_SIZE ? (int)n : -1;
+         score[v] = vertexScore(cachePosition[v], valence[v]);
+      }
+
+      // and their faces; the best of them is drawn next
+      best = -1;
+      float bestScore = -1;
+      for (size_t n = 0; n < newCache.size(); ++n)
+      {
+         unsigned int v = newCache[n];
+         const unsigned int *faces = &vertexFaces[firstFace[v]];
+         for (unsigned int m = 0; m < valence[v]; ++m)
+         {
+            unsigned int f = faces[m];
+            faceScore[f] = score[indices[3*f]] + score[indices[3*f + 1]] + score[indices[3*f + 2]];
+            if (faceScore[f] > bestScore)
+            {
+               bestScore = faceScore[f];
+               best = f;
+            }
+         }
+      }
+
+      if (newCache.size() > MESH_FORSYTH_CACHE_SIZE)
+         newCache.resize(MESH_FORSYTH_CACHE_SIZE);
+      cache.swap(newCache);
+
+      if (best < 0)
+      {
+         while (nextUndrawn < faceCount && drawn[nextUndrawn])
+            ++nextUndrawn;
+         if (nextUndrawn < faceCount)
+            best = nextUndrawn;
+      }
+   }
+
+   return order;
+}
+
+/*
+* Number the vertices in the order the faces first use them, dropping the
+* ones no face uses (those welded into another).
+*/
+static void reorderVertices(Mesh &mesh, MeshOptimizeStats &stats)
+{
+   unsigned int vertexCount = mesh.vertexCount();
+   const unsigned int unused = 0xffffffffu;
+   vector<unsigned int> newIndex(vertexCount, unused);
+   unsigned int next = 0;
+   for (size_t i = 0; i < mesh.indices.size(); ++i)
+   {
+      unsigned int v = mesh.indices[i];
+      if (newIndex[v] == unused)
+         newIndex[v] = next++;
+      mesh.indices[i] = newIndex[v];
+   }
+
+   vector<float> *arrays[] = {&mesh.x, &mesh.y, &mesh.z, &mesh.nx, &mesh.ny, &mesh.nz};
+   stats.droppedVertices = vertexCount - next;
+
+   vector<float> moved(next);
+   for (int a = 0; a < 6; ++a)
+   {
+      for (unsigned int v = 0; v < vertexCount; ++v)
+      {
+         if (newIndex[v] != unused)
+            moved[newIndex[v]] = (*arrays[a])[v];
+      }
+      arrays[a]->assign(moved.begin(), moved.end());
+   }
+}
+
+MeshOptimizeStats optimizeMesh(Mesh &mesh)
+{
+   MeshOptimizeStats stats;
+   stats.weldedVertices = 0;
+   stats.droppedFaces = 0;
+   stats.acmrBefore = computeACMR(mesh);
+
+   weldVertices(mesh, stats);
+   reorderFaces(mesh, forsythOrder(mesh));
+   reorderVertices(mesh, stats);
+
+   stats.acmrAfter = computeACMR(mesh);
+   return stats;
+}
@@ -0,0 +1,634 @@
+#include "MeshParser.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <float.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <thread>
+
+#include "MeshCache.h"
+#include "utils.h"
+
+using namespace std;
+
+// don't bother splitting the file into ranges smaller than this
+#define MIN_BYTES_PER_THREAD (256 * 1024)
+
+// streamMeshFile reads the file this much at a time
+#define STREAM_BLOCK_BYTES (16 * 1024 * 1024)
+
+// Exact powers of ten that fit in a double
+static const double powersOf10[] = {
+   1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+   1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+// Where parsed vertices and faces go: the arrays of a Mesh, or of a cache
+// file being written (see streamMeshFile)
+struct MeshArrays
+{
+   float *x;
+   float *y;
+   float *z;
+   float *nx;
+   float *ny;
+   float *nz;
+   unsigned int *indices;
+   float *red;
+   float *green;
+   float *blue;
+   float *faceNx;
+   float *faceNy;
+   float *faceNz;
+   unsigned int vertexCount;
+   unsigned int faceCount;
+};
+
+// Line range [begin, end) handled by one thread, plus where its
+// vertices and faces go in the output arrays
+struct ParseRange
+{
+   const char *begin;
+   const char *end;
+   unsigned int vertexCount;
+   unsigned int faceCount;
+   unsigned int firstVertex;
+   unsigned int firstFace;
+   bool badLine;
+};
+
+static inline bool isDigit(char c)
+{
+   return c >= '0' && c <= '9';
+}
+
+static inline const char *skipSpaces(const char *p)
+{
+   while (*p == ' ' || *p == '\t' || *p == '\r')
+      ++p;
+   return p;
+}
+
+/*
+* Scans a float starting at p (leading blanks are skipped, like %g).
+*
+* Plain decimals with up to 15 significant digits and a small exponent are
+* converted with one exact multiply or divide in double precision, which is
+* correctly rounded. Rounding that double to float gives the same answer as
+* strtof unless the double lands exactly halfway between two floats; that
+* case, and anything unusual (hex, inf, nan, long mantissas), goes through
+* strtof so the result always matches what sscanf("%g") produced.
+*
+* returns: a pointer just past the number, or 0 if there was no number.
+*/
+static const char *scanFloat(const char *p, float &out)
+{
+   p = skipSpaces(p);
+   const char *start = p;
+
+   bool negative = false;
+   if (*p == '-' || *p == '+')
+   {
+      negative = (*p == '-');
+      ++p;
+   }
+
+   unsigned long long mantissa = 0;
+   int significantDigits = 0;
+   int exponent = 0;
+   bool anyDigits = false;
+
+   for (; isDigit(*p); ++p)
+   {
+      anyDigits = true;
+      if (mantissa == 0 && *p == '0')
+         continue;
+      if (significantDigits < 19)
+      {
+         mantissa = mantissa * 10 + (*p - '0');
+      }
+      else
+      {
+         ++exponent;
+      }
+      ++significantDigits;
+   }
+   if (*p == '.')
+   {
+      for (++p; isDigit(*p); ++p)
+      {
+         anyDigits = true;
+         if (mantissa == 0 && *p == '0')
+         {
+            --exponent;
+            continue;
+         }
+         if (significantDigits < 19)
+         {
+            mantissa = mantissa * 10 + (*p - '0');
+            --exponent;
+         }
+         ++significantDigits;
+      }
+   }
+   if (anyDigits && (*p == 'e' || *p == 'E'))
+   {
+      const char *e = p + 1;
+      bool negativeExp = false;
+      if (*e == '-' || *e == '+')
+      {
+         negativeExp = (*e == '-');
+         ++e;
+      }
+      if (isDigit(*e))
+      {
+         int expValue = 0;
+         for (; isDigit(*e); ++e)
+         {
+            if (expValue < 10000)
+               expValue = expValue * 10 + (*e - '0');
+         }
+         exponent += negativeExp ? -expValue : expValue;
+         p = e;
+      }
+   }
+
+   if (anyDigits && significantDigits <= 15 && exponent >= -22 && exponent <= 22)
+   {
+      double d = (double)mantissa;
+      if (exponent < 0)
+         d /= powersOf10[-exponent];
+      else
+         d *= powersOf10[exponent];
+
+      if (d == 0.0 || (d >= FLT_MIN && d <= FLT_MAX))
+      {
+         float f = (float)d;
+         bool halfway = false;
+         if ((double)f != d)
+         {
+            float other = nextafterf(f, d > f ? FLT_MAX : 0.0f);
+            halfway = (d == ((double)f + (double)other) * 0.5);
+         }
+         if (!halfway)
+         {
+            out = negative ? -f : f;
+            return p;
+         }
+      }
+   }
+
+   // slow path
+   char *end;
+   out = strtof(start, &end);
+   return end == start ? 0 : end;
+}
+
+static inline bool startsWith(const char *p, const char *end, const char *word, size_t len)
+{
+   return (size_t)(end - p) >= len && memcmp(p, word, len) == 0;
+}
+
+// Returns the first line start at or after p, where p is somewhere in buf
+static const char *nextLineStart(const char *buf, const char *bufEnd, const char *p)
+{
+   if (p == buf)
+      return p;
+   const char *nl = (const char *)memchr(p - 1, '\n', bufEnd - (p - 1));
+   return nl ? nl + 1 : bufEnd;
+}
+
+// First pass: count the Vertex and Face lines in a range
+static void countLines(ParseRange *range)
+{
+   unsigned int vertexCount = 0;
+   unsigned int faceCount = 0;
+
+   const char *line = range->begin;
+   while (line < range->end)
+   {
+      const char *lineEnd = (const char *)memchr(line, '\n', range->end - line);
+      if (!lineEnd)
+         lineEnd = range->end;
+
+      if (startsWith(line, lineEnd, "Vertex", 6))
+         ++vertexCount;
+      else if (startsWith(line, lineEnd, "Face", 4))
+         ++faceCount;
+
+      line = lineEnd + 1;
+   }
+
+   range->vertexCount = vertexCount;
+   range->faceCount = faceCount;
+}
+
+// Second pass: parse the lines in a range into the output arrays.
+//
+// Vertex lines look like
+//    Vertex <label> <x> <y> <z>
+// and face lines like
+//    Face <label>  <v1> <v2> <v3> [{rgb=(<r> <g> <b>)}]
+static void parseLines(ParseRange *range, const MeshArrays *mesh)
+{
+   unsigned int vertex = range->firstVertex;
+   unsigned int face = range->firstFace;
+
+   const char *line = range->begin;
+   while (line < range->end)
+   {
+      const char *lineEnd = (const char *)memchr(line, '\n', range->end - line);
+      if (!lineEnd)
+         lineEnd = range->end;
+
+      if (startsWith(line, lineEnd, "Vertex", 6))
+      {
+         float label;
+         const char *p = line + 6;
+         if (!(p = scanFloat(p, label)) ||
+             !(p = scanFloat(p, mesh->x[vertex])) ||
+             !(p = scanFloat(p, mesh->y[vertex])) ||
+             !(p = scanFloat(p, mesh->z[vertex])) ||
+             p > lineEnd)
+         {
+            printf("error reading coords\n");
+         }
+         ++vertex;
+      }
+      else if (startsWith(line, lineEnd, "Face", 4))
+      {
+         // indices are read as floats and truncated, like Model::parseFloat.
+         // Vertex labels start at 1.
+         unsigned int *index = &mesh->indices[3 * face];
+         float label, v1, v2, v3;
+         const char *p = line + 4;
+         if (!(p = scanFloat(p, label)) ||
+             !(p = scanFloat(p, v1)) ||
+             !(p = scanFloat(p, v2)) ||
+             !(p = scanFloat(p, v3)) ||
+             p > lineEnd)
+         {
+            printf("error reading float\n");
+            range->badLine = true;
+         }
+         else
+         {
+            index[0] = static_cast<int>(v1) - 1;
+            index[1] = static_cast<int>(v2) - 1;
+            index[2] = static_cast<int>(v3) - 1;
+         }
+
+         float *r = &mesh->red[face];
+         float *g = &mesh->green[face];
+         float *b = &mesh->blue[face];
+         *r = *g = *b = 1.0f;
+         const char *brace = p ? (const char *)memchr(p, '{', lineEnd - p) : 0;
+         if (brace) // there is a color
+         {
+            const char *rgb = brace;
+            while (rgb < lineEnd && !startsWith(rgb, lineEnd, "rgb=(", 5))
+               ++rgb;
+
+            if (rgb < lineEnd)
+            {
+               p = rgb + 5; // rgb=( is 5 characters
+               if (!(p = scanFloat(p, *r)) ||
+                   !(p = scanFloat(p, *g)) ||
+                   !(p = scanFloat(p, *b)))
+               {
+                  printf("error reading float\n");
+               }
+            }
+         }
+
+         ++face;
+      }
+
+      line = lineEnd + 1;
+   }
+}
+
+// Third pass: check the indices and calculate the face normals
+static void computeFaceNormals(const MeshArrays *mesh, unsigned int firstFace, unsigned int lastFace, bool *badIndex)
+{
+   unsigned int vertexCount = mesh->vertexCount;
+
+   for (unsigned int f = firstFace; f < lastFace; ++f)
+   {
+      const unsigned int *index = &mesh->indices[3 * f];
+      if (index[0] >= vertexCount || index[1] >= vertexCount || index[2] >= vertexCount)
+      {
+         *badIndex = true;
+         continue;
+      }
+
+      //Calculate the normal for this triangle
+      Vector3 v1(mesh->x[index[0]], mesh->y[index[0]], mesh->z[index[0]]);
+      Vector3 v2(mesh->x[index[1]], mesh->y[index[1]], mesh->z[index[1]]);
+      Vector3 v3(mesh->x[index[2]], mesh->y[index[2]], mesh->z[index[2]]);
+
+      Vector3 vCp1(v2.x - v1.x,v2.y - v1.y,v2.z - v1.z);
+      Vector3 vCp2(v3.x - v1.x,v3.y - v1.y,v3.z - v1.z);
+      Vector3 normalV = vCp1.crossP(vCp2);
+
+      float normalizingFactor = sqrtf(normalV.dotP(normalV));
+      mesh->faceNx[f] = normalV.x/normalizingFactor;
+      mesh->faceNy[f] = normalV.y/normalizingFactor;
+      mesh->faceNz[f] = normalV.z/normalizingFactor;
+   }
+}
+
+// Reads the whole file into buf, followed by a terminating '\0' so the
+// scanners can never run off the end.
+static bool readWholeFile(const string &filename, vector<char> &buf)
+{
+   int fd = open(filename.c_str(), O_RDONLY);
+   if (fd < 0)
+      return false;
+
+   struct stat st;
+   if (fstat(fd, &st) != 0)
+   {
+      close(fd);
+      return false;
+   }
+
+   buf.resize((size_t)st.st_size + 1);
+   size_t done = 0;
+   while (done < (size_t)st.st_size)
+   {
+      ssize_t n = read(fd, &buf[done], (size_t)st.st_size - done);
+      if (n <= 0)
+         break;
+      done += n;
+   }
+   close(fd);
+
+   buf.resize(done + 1);
+   buf[done] = '\0';
+   return true;
+}
+
+// Number of threads to parse bytes of text with
+static int parseThreads(size_t bytes, int numThreads)
+{
+   if (numThreads <= 0)
+      numThreads = thread::hardware_concurrency();
+   if (numThreads <= 0)
+      numThreads = 1;
+   size_t maxThreads = bytes / MIN_BYTES_PER_THREAD + 1;
+   if ((size_t)numThreads > maxThreads)
+      numThreads = maxThreads;
+   return numThreads;
+}
+
+// Splits [begin, end) into one line range per thread and counts the Vertex
+// and Face lines of every range in parallel
+static void countRanges(const char *begin, const char *end, int numThreads, vector<ParseRange> &ranges)
+{
+   ranges.resize(numThreads);
+   for (int i = 0; i < numThreads; ++i)
+   {
+      ranges[i].begin = nextLineStart(begin, end, begin + (end - begin) * i / numThreads);
+      ranges[i].badLine = false;
+   }
+   for (int i = 0; i < numThreads; ++i)
+      ranges[i].end = (i + 1 < numThreads) ? ranges[i + 1].begin : end;
+
+   vector<thread> threads;
+   for (int i = 1; i < numThreads; ++i)
+      threads.push_back(thread(countLines, &ranges[i]));
+   countLines(&ranges[0]);
+   for (size_t i = 0; i < threads.size(); ++i)
+      threads[i].join();
+}
+
+// Gives each counted range its slice of the output, the first starting at
+// vertex and face, and advances vertex and face past the last
+static void placeRanges(vector<ParseRange> &ranges, unsigned long long &vertex, unsigned long long &face)
+{
+   for (size_t i = 0; i < ranges.size(); ++i)
+   {
+      ranges[i].firstVertex = vertex;
+      ranges[i].firstFace = face;
+      vertex += ranges[i].vertexCount;
+      face += ranges[i].faceCount;
+   }
+}
+
+// Parses the placed ranges into mesh in parallel. Sets badLine if a face
+// line couldn't be read.
+static void parseRanges(vector<ParseRange> &ranges, const MeshArrays &mesh, bool &badLine)
+{
+   vector<thread> threads;
+   for (size_t i = 1; i < ranges.size(); ++i)
+      threads.push_back(thread(parseLines, &ranges[i], &mesh));
+   parseLines(&ranges[0], &mesh);
+   for (size_t i = 0; i < threads.size(); ++i)
+      threads[i].join();
+
+   for (size_t i = 0; i < ranges.size(); ++i)
+      badLine = badLine || ranges[i].badLine;
+}
+
+// Calculates the face normals and sums them into the vertex normals, which
+// must start out zeroed
+static void computeNormals(const MeshArrays &mesh, int numThreads)
+{
+   unsigned int faceCount = mesh.faceCount;
+
+   // face normals are independent of each other...
+   vector<thread> threads;
+   vector<char> badIndex(numThreads, 0);
+   for (int i = 1; i < numThreads; ++i)
+   {
+      threads.push_back(thread(computeFaceNormals, &mesh,
+                               (unsigned int)((unsigned long long)faceCount * i / numThreads),
+                               (unsigned int)((unsigned long long)faceCount * (i + 1) / numThreads),
+                               (bool *)&badIndex[i]));
+   }
+   computeFaceNormals(&mesh, 0, (unsigned int)((unsigned long long)faceCount / numThreads), (bool *)&badIndex[0]);
+   for (size_t i = 0; i < threads.size(); ++i)
+      threads[i].join();
+
+   for (int i = 0; i < numThreads; ++i)
+   {
+      if (badIndex[i])
+         throw("Face refers to a missing vertex in file ");
+   }
+
+   // ...but the vertex normals are summed in file order, so the floating
+   // point result is the same as adding them up one face at a time
+   for (unsigned int f = 0; f < faceCount; ++f)
+   {
+      for (int k = 0; k < 3; ++k)
+      {
+         unsigned int v = mesh.indices[3 * f + k];
+         mesh.nx[v] += mesh.faceNx[f];
+         mesh.ny[v] += mesh.faceNy[f];
+         mesh.nz[v] += mesh.faceNz[f];
+      }
+   }
+}
+
+void parseMeshFile(const string &filename, Mesh &mesh, int numThreads)
+{
+   vector<char> buf;
+   if (!readWholeFile(filename, buf))
+      throw("Could not open file ");
+
+   const char *begin = &buf[0];
+   const char *end = begin + buf.size() - 1;
+
+   // split the buffer into one line range per thread
+   numThreads = parseThreads(end - begin, numThreads);
+   vector<ParseRange> ranges;
+   countRanges(begin, end, numThreads, ranges);
+
+   // size the output once and give each range its slice
+   unsigned long long vertexCount = 0;
+   unsigned long long faceCount = 0;
+   placeRanges(ranges, vertexCount, faceCount);
+   if (vertexCount > 0xffffffffu || faceCount * 3 > 0xffffffffu)
+      throw("Too many vertices or faces in file ");
+   mesh.resize(vertexCount, faceCount);
+
+   MeshArrays arrays = {
+      mesh.x.data(), mesh.y.data(), mesh.z.data(),
+      mesh.nx.data(), mesh.ny.data(), mesh.nz.data(),
+      mesh.indices.data(),
+      mesh.red.data(), mesh.green.data(), mesh.blue.data(),
+      mesh.faceNx.data(), mesh.faceNy.data(), mesh.faceNz.data(),
+      mesh.vertexCount(), mesh.faceCount()
+   };
+   bool badLine = false;
+   parseRanges(ranges, arrays, badLine);
+   if (badLine)
+      throw("Bad face in file ");
+
+   computeNormals(arrays, numThreads);
+}
+
+/*
+* Calls parse(begin, end) on the lines of a file, about STREAM_BLOCK_BYTES
+* at a time. A block always ends at the end of a line, and is followed by a
+* '\0' so the scanners can never run off it.
+*
+* returns: false if the file couldn't be read
+*/
+template <typename Parse>
+static bool forEachBlock(const string &filename, Parse parse)
+{
+   int fd = open(filename.c_str(), O_RDONLY);
+   if (fd < 0)
+      return false;
+
+   struct stat st;
+   if (fstat(fd, &st) != 0)
+   {
+      close(fd);
+      return false;
+   }
+   size_t blockBytes = STREAM_BLOCK_BYTES;
+   if ((size_t)st.st_size < blockBytes)
+      blockBytes = st.st_size + 1;
+   vector<char> buf(blockBytes + 1);
+   size_t carried = 0;  // the start of a line the last block cut off
+   bool ok = true;
+   for (;;)
+   {
+      ssize_t n = read(fd, &buf[carried], buf.size() - 1 - carried);
+      if (n < 0)
+      {
+         ok = false;
+         break;
+      }
+      size_t filled = carried + n;
+      bool atEnd = (n == 0);
+
+      size_t end = filled;
+      if (!atEnd)
+      {
+         while (end > 0 && buf[end - 1] != '\n')
+            --end;
+         if (end == 0)
+         {
+            // a line longer than the buffer
+            buf.resize(buf.size() * 2);
+            carried = filled;
+            continue;
+         }
+      }
+
+      buf[filled] = '\0';
+      if (end > 0)
+         parse((const char *)&buf[0], (const char *)&buf[end]);
+
+      if (atEnd)
+         break;
+      carried = filled - end;
+      memmove(&buf[0], &buf[end], carried);
+   }
+
+   close(fd);
+   return ok;
+}
+
+void streamMeshFile(const string &filename, int numThreads)
+{
+   numThreads = parseThreads(STREAM_BLOCK_BYTES, numThreads);
+   vector<ParseRange> ranges;
+
+   // first pass: count the vertices and faces to size the cache...
+   unsigned long long vertexCount = 0;
+   unsigned long long faceCount = 0;
+   bool read = forEachBlock(filename, [&](const char *begin, const char *end)
+   {
+      countRanges(begin, end, numThreads, ranges);
+      placeRanges(ranges, vertexCount, faceCount);
+   });
+   if (!read)
+      throw("Could not open file ");
+   if (vertexCount > 0xffffffffu || faceCount * 3 > 0xffffffffu)
+      throw("Too many vertices or faces in file ");
+
+   MeshCacheWriter writer;
+   if (!writer.create(filename, vertexCount, faceCount))
+      throw("Could not write the mesh cache of file ");
+
+   float **v = writer.vertexArrays;
+   float **f = writer.faceArrays;
+   MeshArrays arrays = {
+      v[0], v[1], v[2], v[3], v[4], v[5],
+      writer.indices,
+      f[0], f[1], f[2], f[3], f[4], f[5],
+      writer.vertexCount, writer.faceCount
+   };
+
+   // ...second pass: parse straight into it
+   unsigned long long vertex = 0;
+   unsigned long long face = 0;
+   bool badLine = false;
+   read = forEachBlock(filename, [&](const char *begin, const char *end)
+   {
+      countRanges(begin, end, numThreads, ranges);
+      placeRanges(ranges, vertex, face);
+      if (vertex > vertexCount || face > faceCount)
+         return;  // the file grew; caught below
+      parseRanges(ranges, arrays, badLine);
+   });
+   if (!read || vertex != vertexCount || face != faceCount)
+      throw("File changed while it was read ");
+   if (badLine)
+      throw("Bad face in file ");
+
+   computeNormals(arrays, numThreads);
+
+   if (!writer.finish())
+      throw("Could not write the mesh cache of file ");
+}
@@ -0,0 +1,32 @@
+#if !defined MESH_PARSER_H
+#define MESH_PARSER_H
+
+#include <string>
+
+#include "Mesh.h"
+
+// Parses a .m file into mesh.
+//
+// The file is read into one buffer and split into line ranges that are
+// parsed in parallel (numThreads <= 0 uses one thread per core). A first
+// pass counts the Vertex and Face lines in each range so every range can
+// write straight into its slice of the output arrays.
+//
+// Vertex labels in the file start at 1; the indices in mesh are 0-based.
+// Throws a string (like BasicModel) if the file can't be read or a face
+// refers to a vertex that doesn't exist.
+void parseMeshFile(const std::string &filename, Mesh &mesh, int numThreads = 0);
+
+// Parses a .m file into its cache file (see MeshCache) without ever holding
+// the text or the mesh in memory as a whole, for meshes larger than memory.
+//
+// The file is read twice, a block at a time: once to count the vertices
+// and faces, so the cache can be sized, and once to parse each block, as
+// parseMeshFile would, straight into the memory-mapped cache. The normals
+// are then calculated in the mapping. The cache holds exactly the mesh
+// parseMeshFile would give, in the file's order (not optimized).
+//
+// Throws a string like parseMeshFile, or if the cache can't be written.
+void streamMeshFile(const std::string &filename, int numThreads = 0);
+
+#endif
@@ -0,0 +1,511 @@
+#include "MeshSimplifier.h"
+
+#include <math.h>
+
+#include <algorithm>
+#include <queue>
+#include <vector>
+
+#include "utils.h"
+
+using namespace std;
+
+// how much more an open edge's plane counts than a face's
+#define BOUNDARY_WEIGHT 100.0
+
+// Symmetric 4x4 matrix of a sum of planes: the squared distance to all of
+// them is v^T Q v for v = (x, y, z, 1)
+struct Quadric
+{
+   // aa ab ac ad bb bc bd cc cd dd
+   double q[10];
+   double weight;   // of all the planes
+
+   Quadric()
+   {
+      for (int i = 0; i < 10; ++i)
+         q[i] = 0;
+      weight = 0;
+   }
+
+   void addPlane(double a, double b, double c, double d, double weight)
+   {
+      q[0] += weight * a * a; q[1] += weight * a * b; q[2] += weight * a * c; q[3] += weight * a * d;
+      q[4] += weight * b * b; q[5] += weight * b * c; q[6] += weight * b * d;
+      q[7] += weight * c * c; q[8] += weight * c * d;
+      q[9] += weight * d * d;
+      this->weight += weight;
+   }
+
+   void add(const Quadric &o)
+   {
+      for (int i = 0; i < 10; ++i)
+         q[i] += o.q[i];
+      weight += o.weight;
+   }
+
+   double error(double x, double y, double z) const
+   {
+      return q[0]*x*x + 2*q[1]*x*y + 2*q[2]*x*z + 2*q[3]*x
+           + q[4]*y*y + 2*q[5]*y*z + 2*q[6]*y
+           + q[7]*z*z + 2*q[8]*z
+           + q[9];
+   }
+
+   // The point of least error, if there is only one
+   bool minimum(double &x, double &y, double &z) const
+   {
+      // solve A v = -(ad, bd, cd) by Cramer's rule
+      double a[3][3] = {{q[0], q[1], q[2]}, {q[1], q[4], q[5]}, {q[2], q[5], q[7]}};
+      double r[3] = {-q[3], -q[6], -q[8]};
+      double det = det3(a);
+      if (!(fabs(det) > 1e-12 * fabs(q[0] * q[4] * q[7])))
+         return false;
+
+      double v[3];
+      for (int col = 0; col < 3; ++col)
+      {
+         double m[3][3];
+         for (int i = 0; i < 3; ++i)
+         {
+            for (int j = 0; j < 3; ++j)
+               m[i][j] = j == col ? r[i] : a[i][j];
+         }
+         v[col] = det3(m) / det;
+      }
+      x = v[0];
+      y = v[1];
+      z = v[2];
+      return true;
+   }
+
+   static double det3(const double m[3][3])
+   {
+      return m[0][0] * (m[1][1]*m[2][2] - m[1][2]*m[2][1])
+           - m[0][1] * (m[1][0]*m[2][2] - m[1][2]*m[2][0])
+           + m[0][2] * (m[1][0]*m[2][1] - m[1][1]*m[2][0]);
+   }
+};
+
+// A candidate collapse. It is out of date once either vertex has changed
+// since it was queued.
+struct Collapse
+{
+   double cost;
+   double distance;   // root mean square distance to the planes
+   unsigned int keep;
+   unsigned int remove;
+   unsigned int keepStamp;
+   unsigned int removeStamp;
+   double x, y, z;
+
+   bool operator>(const Collapse &o) const { return cost > o.cost; }
+};
+
+class Simplifier
+{
+public:
+   Simplifier(const Mesh &mesh);
+   // collapse edges until there are targetFaces faces or no more can go;
+   // returns the error so far (see simplifyMesh)
+   float run(unsigned int targetFaces);
+   void output(Mesh &out) const;
+
+private:
+   void planeOf(unsigned int f, double &a, double &b, double &c, double &d) const;
+   void push(unsigned int u, unsigned int v);
+   bool flips(unsigned int moved, unsigned int other, double x, double y, double z) const;
+   bool manifold(unsigned int u, unsigned int v) const;
+   void neighbors(unsigned int v, vector<unsigned int> &out) const;
+
+   const Mesh &mesh;
+   vector<double> px, py, pz;
+   vector<unsigned int> indices;
+   vector<bool> faceAlive;
+   unsigned int faceCount;
+   vector<Quadric> quadrics;
+   vector<vector<unsigned int> > vertexFaces;
+   vector<unsigned int> stamps;
+   double worst;   // largest distance collapsed so far
+   priority_queue<Collapse, vector<Collapse>, greater<Collapse> > queue;
+};
+
+Simplifier::Simplifier(const Mesh &mesh) : mesh(mesh)
+{
+   unsigned int vertexCount = mesh.vertexCount();
+   faceCount = mesh.faceCount();
+   px.assign(mesh.x.begin(), mesh.x.end());
+   py.assign(mesh.y.begin(), mesh.y.end());
+   pz.assign(mesh.z.begin(), mesh.z.end());
+   indices = mesh.indices;
+   faceAlive.assign(faceCount, true);
+   quadrics.resize(vertexCount);
+   vertexFaces.resize(vertexCount);
+   stamps.assign(vertexCount, 0);
+   worst = 0;
+
+   for (unsigned int f = 0; f < faceCount; ++f)
+   {
+      double a, b, c, d;
+      planeOf(f, a, b, c, d);
+      for (int k = 0; k < 3; ++k)
+      {
+         quadrics[indices[3*f + k]].addPlane(a, b, c, d, 1);
+         vertexFaces[indices[3*f + k]].push_back(f);
+      }
+   }
+
+   // every edge once, smaller vertex first, with how many faces share it
+   vector<pair<unsigned int, unsigned int> > edges;
+   edges.reserve((size_t)faceCount * 3);
+   for (unsigned int f = 0; f < faceCount; ++f)
+   {
+      for (int k = 0; k < 3; ++k)
+      {
+         unsigned int u = indices[3*f + k];
+         unsigned int v = indices[3*f + (k + 1) % 3];
+         edges.push_back(make_pair(min(u, v), max(u, v)));
+      }
+   }
+   sort(edges.begin(), edges.end());
+
+   for (size_t i = 0; i < edges.size(); )
+   {
+      size_t j = i;
+      while (j < edges.size() && edges[j] == edges[i])
+         ++j;
+
+      if (j - i == 1)
+      {
+         // an open edge: hold it in place with a plane through it, at right
+         // angles to its face
+         unsigned int u = edges[i].first;
+         unsigned int v = edges[i].second;
+         for (size_t n = 0; n < vertexFaces[u].size(); ++n)
+         {
+            unsigned int f = vertexFaces[u][n];
+            const unsigned int *index = &indices[3*f];
+            if (index[0] != v && index[1] != v && index[2] != v)
+               continue;
+
+            double a, b, c, d;
+            planeOf(f, a, b, c, d);
+            double ex = px[v] - px[u], ey = py[v] - py[u], ez = pz[v] - pz[u];
+            double qa = ey*c - ez*b, qb = ez*a - ex*c, qc = ex*b - ey*a;
+            double length = sqrt(qa*qa + qb*qb + qc*qc);
+            if (length > 0)
+            {
+               qa /= length; qb /= length; qc /= length;
+               double qd = -(qa*px[u] + qb*py[u] + qc*pz[u]);
+               quadrics[u].addPlane(qa, qb, qc, qd, BOUNDARY_WEIGHT);
+               quadrics[v].addPlane(qa, qb, qc, qd, BOUNDARY_WEIGHT);
+            }
+            break;
+         }
+      }
+      i = j;
+   }
+
+   for (size_t i = 0; i < edges.size(); ++i)
+   {
+      if (i == 0 || edges[i] != edges[i - 1])
+         push(edges[i].first, edges[i].second);
+   }
+}
+
+// A face's plane: unit normal (a, b, c) and offset d, zero if it has no area
+void Simplifier::planeOf(unsigned int f, double &a, double &b, double &c, double &d) const
+{
+   unsigned int i1 = indices[3*f], i2 = indices[3*f + 1], i3 = indices[3*f + 2];
+   double ux = px[i2] - px[i1], uy = py[i2] - py[i1], uz = pz[i2] - pz[i1];
+   double vx = px[i3] - px[i1], vy = py[i3] - py[i1], vz = pz[i3] - pz[i1];
+   a = uy*vz - uz*vy;
+   b = uz*vx - ux*vz;
+   c = ux*vy - uy*vx;
+   double length = sqrt(a*a + b*b + c*c);
+   if (length > 0)
+   {
+      a /= length; b /= length; c /= length;
+   }
+   d = -(a*px[i1] + b*py[i1] + c*pz[i1]);
+}
+
+// Queue the collapse of edge u-v at its best point
+void Simplifier::push(unsigned int u, unsigned int v)
+{
+   Quadric q = quadrics[u];
+   q.add(quadrics[v]);
+
+   Collapse c;
+   c.keep = u;
+   c.remove = v;
+   c.keepStamp = stamps[u];
+   c.removeStamp = stamps[v];
+
+   // the minimum if there is one, else the best of the ends and the middle
+   double candidates[4][3] = {
+      {px[u], py[u], pz[u]},
+      {px[v], py[v], pz[v]},
+      {(px[u] + px[v]) / 2, (py[u] + py[v]) / 2, (pz[u] + pz[v]) / 2},
+   };
+   int count = 3;
+   if (q.minimum(candidates[3][0], candidates[3][1], candidates[3][2]))
+      count = 4;
+
+   c.cost = -1;
+   for (int i = 0; i < count; ++i)
+   {
+      double cost = q.error(candidates[i][0], candidates[i][1], candidates[i][2]);
+      if (c.cost < 0 || cost < c.cost)
+      {
+         c.cost = max(cost, 0.0);
+         c.x = candidates[i][0];
+         c.y = candidates[i][1];
+         c.z = candidates[i][2];
+      }
+   }
+   c.distance = q.weight > 0 ? sqrt(c.cost / q.weight) : 0;
+   queue.push(c);
+}
+
+// Whether moving vertex moved to (x, y, z) turns over one of its faces that
+// doesn't also hold other (those go away)
+bool Simplifier::flips(unsigned int moved, unsigned int other, double x, double y, double z) const
+{
+   const vector<unsigned int> &faces = vertexFaces[moved];
+   for (size_t n = 0; n < faces.size(); ++n)
+   {
+      const unsigned int *index = &indices[3*faces[n]];
+      if (index[0] == other || index[1] == other || index[2] == other)
+         continue;
+
+      double p[3][3];
+      double q[3][3];
+      for (int k = 0; k < 3; ++k)
+      {
+         unsigned int i = index[k];
+         p[k][0] = q[k][0] = px[i];
+         p[k][1] = q[k][1] = py[i];
+         p[k][2] = q[k][2] = pz[i];
+         if (i == moved)
+         {
+            q[k][0] = x;
+            q[k][1] = y;
+            q[k][2] = z;
+         }
+      }
+
+      double before[3], after[3];
+      double (*points[2])[3] = {p, q};
+      double *normals[2] = {before, after};
+      for (int s = 0; s < 2; ++s)
+      {
+         double (*t)[3] = points[s];
+         double ux = t[1][0] - t[0][0], uy = t[1][1] - t[0][1], uz = t[1][2] - t[0][2];
+         double vx = t[2][0] - t[0][0], vy = t[2][1] - t[0][1], vz = t[2][2] - t[0][2];
+         normals[s][0] = uy*vz - uz*vy;
+         normals[s][1] = uz*vx - ux*vz;
+         normals[s][2] = ux*vy - uy*vx;
+      }
+      if (!(before[0]*after[0] + before[1]*after[1] + before[2]*after[2] > 0))
+         return true;
+   }
+   return false;
+}
+
+void Simplifier::neighbors(unsigned int v, vector<unsigned int> &out) const
+{
+   out.clear();
+   const vector<unsigned int> &faces = vertexFaces[v];
+   for (size_t n = 0; n < faces.size(); ++n)
+   {
+      for (int k = 0; k < 3; ++k)
+      {
+         unsigned int i = indices[3*faces[n] + k];
+         if (i != v)
+            out.push_back(i);
+      }
+   }
+   sort(out.begin(), out.end());
+   out.erase(unique(out.begin(), out.end()), out.end());
+}
+
+// Collapsing u-v keeps the surface manifold if u and v have no neighbors in
+// common other than the far corners of the faces on the edge
+bool Simplifier::manifold(unsigned int u, unsigned int v) const
+{
+   vector<unsigned int> nu, nv, common;
+   neighbors(u, nu);
+   neighbors(v, nv);
+   set_intersection(nu.begin(), nu.end(), nv.begin(), nv.end(), back_inserter(common));
+
+   size_t shared = 0;
+   const vector<unsigned int> &faces = vertexFaces[u];
+   for (size_t n = 0; n < faces.size(); ++n)
+   {
+      const unsigned int *index = &indices[3*faces[n]];
+      if (index[0] == v || index[1] == v || index[2] == v)
+         ++shared;
+   }
+   return common.size() <= shared;
+}
+
+float Simplifier::run(unsigned int targetFaces)
+{
+   vector<unsigned int> around;
+
+   while (faceCount > targetFaces && !queue.empty())
+   {
+      Collapse c = queue.top();
+      queue.pop();
+      unsigned int u = c.keep;
+      unsigned int v = c.remove;
+      if (stamps[u] != c.keepStamp || stamps[v] != c.removeStamp || vertexFaces[u].empty() || vertexFaces[v].empty())
+         continue;
+      if (!manifold(u, v) || flips(u, v, c.x, c.y, c.z) || flips(v, u, c.x, c.y, c.z))
+         continue;
+
+      // v goes into u; the faces on the edge go away
+      px[u] = c.x;
+      py[u] = c.y;
+      pz[u] = c.z;
+      quadrics[u].add(quadrics[v]);
+
+      vector<unsigned int> &uFaces = vertexFaces[u];
+      const vector<unsigned int> &vFaces = vertexFaces[v];
+      vector<unsigned int> corners;
+      for (size_t n = 0; n < vFaces.size(); ++n)
+      {
+         unsigned int f = vFaces[n];
+         unsigned int *index = &indices[3*f];
+         if (index[0] == u || index[1] == u || index[2] == u)
+         {
+            faceAlive[f] = false;
+            --faceCount;
+            for (int k = 0; k < 3; ++k)
+               corners.push_back(index[k]);
+            continue;
+         }
+         for (int k = 0; k < 3; ++k)
+         {
+            if (index[k] == v)
+               index[k] = u;
+         }
+         uFaces.push_back(f);
+      }
+      vertexFaces[v].clear();
+
+      // the faces that went away are gone from their other corners too
+      for (size_t n = 0; n < corners.size(); ++n)
+      {
+         if (corners[n] == v)
+            continue;
+         vector<unsigned int> &faces = vertexFaces[corners[n]];
+         size_t alive = 0;
+         for (size_t m = 0; m < faces.size(); ++m)
+         {
+            if (faceAlive[faces[m]])
+               faces[alive++] = faces[m];
+         }
+         faces.resize(alive);
+      }
+
+      neighbors(u, around);
+      ++stamps[u];
+      ++stamps[v];
+      worst = max(worst, c.distance);
+      for (size_t n = 0; n < around.size(); ++n)
+         push(u, around[n]);
+   }
+
+   return (float)worst;
+}
+
+void Simplifier::output(Mesh &out) const
+{
+   unsigned int vertexCount = mesh.vertexCount();
+   vector<unsigned int> remap(vertexCount, 0xffffffffu);
+   unsigned int outVertices = 0;
+   for (unsigned int v = 0; v < vertexCount; ++v)
+   {
+      if (!vertexFaces[v].empty())
+         remap[v] = outVertices++;
+   }
+
+   out.resize(outVertices, faceCount);
+   for (unsigned int v = 0; v < vertexCount; ++v)
+   {
+      if (remap[v] == 0xffffffffu)
+         continue;
+      out.x[remap[v]] = px[v];
+      out.y[remap[v]] = py[v];
+      out.z[remap[v]] = pz[v];
+   }
+
+   unsigned int f = 0;
+   for (unsigned int g = 0; g < mesh.faceCount(); ++g)
+   {
+      if (!faceAlive[g])
+         continue;
+
+      for (int k = 0; k < 3; ++k)
+         out.indices[3*f + k] = remap[indices[3*g + k]];
+      out.red[f] = mesh.red[g];
+      out.green[f] = mesh.green[g];
+      out.blue[f] = mesh.blue[g];
+      ++f;
+   }
+
+   // normals like MeshParser: unit face normals, summed at the vertices
+   for (f = 0; f < faceCount; ++f)
+   {
+      const unsigned int *index = &out.indices[3 * f];
+      Vector3 v1(out.x[index[0]], out.y[index[0]], out.z[index[0]]);
+      Vector3 v2(out.x[index[1]], out.y[index[1]], out.z[index[1]]);
+      Vector3 v3(out.x[index[2]], out.y[index[2]], out.z[index[2]]);
+
+      Vector3 vCp1(v2.x - v1.x, v2.y - v1.y, v2.z - v1.z);
+      Vector3 vCp2(v3.x - v1.x, v3.y - v1.y, v3.z - v1.z);
+      Vector3 normalV = vCp1.crossP(vCp2);
+
+      float normalizingFactor = sqrtf(normalV.dotP(normalV));
+      if (normalizingFactor > 0)
+      {
+         out.faceNx[f] = normalV.x/normalizingFactor;
+         out.faceNy[f] = normalV.y/normalizingFactor;
+         out.faceNz[f] = normalV.z/normalizingFactor;
+      }
+
+      for (int k = 0; k < 3; ++k)
+      {
+         out.nx[index[k]] += out.faceNx[f];
+         out.ny[index[k]] += out.faceNy[f];
+         out.nz[index[k]] += out.faceNz[f];
+      }
+   }
+}
+
+void simplifyMesh(const Mesh &mesh, int levels, unsigned int minFaces, vector<Mesh> &out, vector<float> &errors)
+{
+   out.clear();
+   errors.clear();
+
+   Simplifier simplifier(mesh);
+   unsigned int faceCount = mesh.faceCount();
+   for (int level = 0; level < levels; ++level)
+   {
+      unsigned int target = faceCount / 2;
+      if (target < minFaces)
+         break;
+
+      float error = simplifier.run(target);
+      Mesh simplified;
+      simplifier.output(simplified);
+      if (simplified.faceCount() >= faceCount)
+         break;
+
+      faceCount = simplified.faceCount();
+      out.push_back(simplified);
+      errors.push_back(error);
+   }
+}
@@ -0,0 +1,31 @@
+#if !defined MESH_SIMPLIFIER_H
+#define MESH_SIMPLIFIER_H
+
+#include <vector>
+
+#include "Mesh.h"
+
+// Simplifies mesh by quadric error edge collapse (Garland and Heckbert) into
+// a chain of up to levels coarser meshes, each with about half the faces of
+// the one before, stopping before one would have fewer than minFaces.
+//
+// Every vertex carries the sum of the squared distances to the planes of its
+// original faces (its quadric). The edge whose endpoints can be merged at the
+// point of least summed distance is collapsed first, and the merged vertex
+// keeps both quadrics. Open edges (the holes of a scanned model) get planes
+// of their own at right angles to their face, so they stay in place.
+// Collapses that would fold a face over, or make the surface non-manifold,
+// are skipped. The levels are snapshots of one run, so every level is
+// measured against the original faces.
+//
+// Faces keep their colors; the face and vertex normals of each level are
+// calculated again like the parser does.
+//
+// out: Receives the levels, finest first
+// errors: Receives for each level the largest distance of any collapse so
+//         far: the root mean square distance from the merged vertex to the
+//         planes of the original faces it replaces, in model units
+void simplifyMesh(const Mesh &mesh, int levels, unsigned int minFaces,
+                  std::vector<Mesh> &out, std::vector<float> &errors);
+
+#endif
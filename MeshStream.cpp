@@ -0,0 +1,96 @@
+#include "MeshStream.h"
+
+#include <string.h>
+
+#include <algorithm>
+
+#include "MeshParser.h"
+
+using namespace std;
+
+MeshStream::MeshStream() :
+   nextFace(0), center(0, 0, 0), min_z(0), max_z(0)
+{
+}
+
+void MeshStream::open(const string &filename)
+{
+   if (!cache.open(filename))
+   {
+      streamMeshFile(filename);
+      if (!cache.open(filename))
+         throw("Could not read the mesh cache of file ");
+   }
+
+   nextFace = 0;
+   computeBounds();
+}
+
+// Like BasicModel::computeBounds, without holding the mesh
+void MeshStream::computeBounds()
+{
+   max_z = 1.1754E-38F;
+   min_z = 1.1754E+38F;
+
+   double sumX = 0, sumY = 0, sumZ = 0;
+   unsigned int n = cache.vertexCount;
+   const float *x = cache.vertexArrays[0];
+   const float *y = cache.vertexArrays[1];
+   const float *z = cache.vertexArrays[2];
+   for (unsigned int i = 0; i < n; ++i)
+   {
+      sumX += x[i];
+      sumY += y[i];
+      sumZ += z[i];
+
+      if (z[i] > max_z) max_z = z[i];
+      if (z[i] < min_z) min_z = z[i];
+   }
+
+   center.x = sumX / n;
+   center.y = sumY / n;
+   center.z = sumZ / n;
+}
+
+bool MeshStream::readChunk(unsigned int maxFaces, Mesh &chunk)
+{
+   unsigned int first = nextFace;
+   if (first >= cache.faceCount || maxFaces == 0)
+      return false;
+   unsigned int faceCount = min(maxFaces, cache.faceCount - first);
+   unsigned int last = first + faceCount;
+
+   // the vertices the faces use, each once
+   const unsigned int *indices = cache.indices + (size_t)first * 3;
+   size_t indexCount = (size_t)faceCount * 3;
+   vertices.assign(indices, indices + indexCount);
+   sort(vertices.begin(), vertices.end());
+   vertices.erase(unique(vertices.begin(), vertices.end()), vertices.end());
+   if (vertices.back() >= cache.vertexCount)
+      throw("Face refers to a missing vertex in the mesh cache ");
+   unsigned int vertexCount = vertices.size();
+
+   chunk.resize(vertexCount, faceCount);
+
+   vector<float> *vertexArrays[] = {&chunk.x, &chunk.y, &chunk.z, &chunk.nx, &chunk.ny, &chunk.nz};
+   for (int a = 0; a < MESH_CACHE_VERTEX_ARRAYS; ++a)
+   {
+      const float *from = cache.vertexArrays[a];
+      float *to = vertexArrays[a]->data();
+      for (unsigned int v = 0; v < vertexCount; ++v)
+         to[v] = from[vertices[v]];
+   }
+
+   for (size_t i = 0; i < indexCount; ++i)
+      chunk.indices[i] = lower_bound(vertices.begin(), vertices.end(), indices[i]) - vertices.begin();
+
+   vector<float> *faceArrays[] = {&chunk.red, &chunk.green, &chunk.blue, &chunk.faceNx, &chunk.faceNy, &chunk.faceNz};
+   for (int a = 0; a < MESH_CACHE_FACE_ARRAYS; ++a)
+      memcpy(faceArrays[a]->data(), cache.faceArrays[a] + first, faceCount * sizeof(float));
+
+   // they won't be read again unless the stream is rewound
+   cache.dropFaces(first, last);
+
+   nextFace = last;
+   return true;
+}
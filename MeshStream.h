@@ -0,0 +1,63 @@
+#if !defined MESH_STREAM_H
+#define MESH_STREAM_H
+
+#include <string>
+#include <vector>
+
+#include "Mesh.h"
+#include "MeshCache.h"
+#include "utils.h"
+
+// Faces per chunk drawStream reads when it isn't told
+#define MESH_STREAM_CHUNK_FACES (1 << 18)
+
+// Reads a mesh too large to hold in memory a chunk of faces at a time.
+//
+// open() memory-maps the mesh's cache file (see MeshCache), converting the
+// .m file into one with streamMeshFile first if there isn't a current one,
+// and works out the bounds in one pass over the vertex positions. Each
+// readChunk() then copies the next faces, and just the vertices they use,
+// into a small Mesh that can be shaded and drawn like any other. The pages
+// of faces already read are dropped, so what stays in memory is about a
+// chunk, plus the vertices recent chunks used, which the system can page
+// out again. A cache written by BasicModel is optimized (see optimizeMesh),
+// so the vertices of a chunk are close together there as well.
+class MeshStream
+{
+public:
+   MeshStream();
+
+   // Throws a string (like BasicModel) if the file can't be read or
+   // converted.
+   void open(const std::string &filename);
+
+   unsigned int vertexCount() const { return cache.vertexCount; }
+   unsigned int faceCount() const { return cache.faceCount; }
+
+   // the same center and depth range a BasicModel of the file would have
+   Vector3 getCenter() const { return center; }
+   float getMinZ() const { return min_z; }
+   float getMaxZ() const { return max_z; }
+
+   // Copies up to maxFaces faces after those read so far into chunk, with
+   // the vertices they use renumbered from 0. Returns false when there are
+   // no faces left.
+   bool readChunk(unsigned int maxFaces, Mesh &chunk);
+
+   // Starts reading from the first face again
+   void rewind() { nextFace = 0; }
+
+private:
+   void computeBounds();
+
+   MeshCache cache;
+   unsigned int nextFace;
+   Vector3 center;
+   float min_z;
+   float max_z;
+
+   // the vertices of the chunk being read, in order
+   std::vector<unsigned int> vertices;
+};
+
+#endif
@@ -0,0 +1,996 @@
+#ifndef RASTERIZER_H
+#define RASTERIZER_H
+
+#include "utils.h"
+#include "Transform.h"
+#include "Triangle.h"
+
+// Rasterization core shared by the CPU path and the CUDA kernels.
+
+// Default window (screen) dimensions
+#define DEFAULT_WIDTH 2000
+#define DEFAULT_HEIGHT 2000
+
+// Default world coordinates bounding box
+#define DEFAULT_X_MIN_WORLD -1
+#define DEFAULT_X_MAX_WORLD 1
+#define DEFAULT_Y_MIN_WORLD -1
+#define DEFAULT_Y_MAX_WORLD 1
+
+// Camera is at origin looking down negative Z, so further away = smaller Z.
+// Default depth of an empty pixel.
+#define DEFAULT_MIN_Z -10000
+
+// Default perspective camera: the default world box fills the image, seen
+// from +z
+#define DEFAULT_CAMERA_DISTANCE 4
+#define DEFAULT_CAMERA_FOV 28
+#define DEFAULT_CAMERA_NEAR 0.1f
+#define DEFAULT_CAMERA_FAR 100
+
+// A perspective camera at eye, looking at target, with up pointing up on
+// the screen. It sees fovY degrees from the bottom of the image to the top,
+// and what is between zNear and zFar in front of it.
+typedef struct Camera
+{
+	Vector3 eye;
+	Vector3 target;
+	Vector3 up;
+	float fovY;
+	float zNear;
+	float zFar;
+} Camera;
+
+// What to render: the image size, the part of the world it shows, and the
+// depth an empty pixel has (nothing at or below it is ever drawn). Color and
+// depth buffers for a viewport are row-major, width * height pixels.
+//
+// The world is shown either straight on, the window (xMinWorld...) filling
+// the image and depth being world z, or through a perspective camera (see
+// setCamera), depth then being 1/w: the reciprocal of the distance along
+// the camera's axis.
+typedef struct Viewport
+{
+	int width;
+	int height;
+	float xMinWorld;
+	float xMaxWorld;
+	float yMinWorld;
+	float yMaxWorld;
+	float minZ;
+	bool perspective;	// seen through camera rather than the window
+	Camera camera;
+} Viewport;
+
+inline HOST_DEVICE Camera makeCamera()
+{
+	Camera c;
+	c.eye = Vector3(0, 0, DEFAULT_CAMERA_DISTANCE);
+	c.target = Vector3(0, 0, 0);
+	c.up = Vector3(0, 1, 0);
+	c.fovY = DEFAULT_CAMERA_FOV;
+	c.zNear = DEFAULT_CAMERA_NEAR;
+	c.zFar = DEFAULT_CAMERA_FAR;
+	return c;
+}
+
+// A width x height viewport with the default world box and depth
+inline HOST_DEVICE Viewport makeViewport(int width, int height)
+{
+	Viewport v;
+	v.width = width;
+	v.height = height;
+	v.xMinWorld = DEFAULT_X_MIN_WORLD;
+	v.xMaxWorld = DEFAULT_X_MAX_WORLD;
+	v.yMinWorld = DEFAULT_Y_MIN_WORLD;
+	v.yMaxWorld = DEFAULT_Y_MAX_WORLD;
+	v.minZ = DEFAULT_MIN_Z;
+	v.perspective = false;
+	v.camera = makeCamera();
+	return v;
+}
+
+/*
+* Show the world through a perspective camera. Nothing beyond its far plane
+* is drawn: minZ becomes 1/c.zFar.
+*/
+inline HOST_DEVICE void setCamera(Viewport &v, const Camera &c)
+{
+	v.perspective = true;
+	v.camera = c;
+	v.minZ = 1 / c.zFar;
+}
+
+/*
+* The view and projection matrices of a perspective viewport in one: world
+* coordinates to clip space.
+*/
+inline HOST_DEVICE Matrix4 cameraMatrix(const Viewport &v)
+{
+	const Camera &c = v.camera;
+	Matrix4 projection = perspectiveMatrix(c.fovY * (float)M_PI / 180, (float)v.width / v.height, c.zNear, c.zFar);
+	return multiplyMatrices(projection, lookAtMatrix(c.eye, c.target, c.up));
+}
+
+// Unit direction from the camera's target to the camera
+inline HOST_DEVICE Vector3 cameraViewer(const Camera &c)
+{
+	Vector3 d(c.eye.x - c.target.x, c.eye.y - c.target.y, c.eye.z - c.target.z);
+	float length = d.length();
+	return length > 0 ? Vector3(d.x / length, d.y / length, d.z / length) : Vector3(0, 0, 1);
+}
+
+// Color and depth planes for the rasterizer to write to. They may cover just
+// part of the screen: pixel (x, y) is at index planeIndex(p, x, y) of each.
+// Multisampled planes hold one such plane per sample, sample after sample.
+typedef struct PixelPlanes
+{
+	float *r;
+	float *g;
+	float *b;
+	float *z;
+	int originX;	// the pixel at index 0
+	int originY;
+	int stride;		// pixels per row
+	int sampleStride;	// multisampled planes: distance from one sample's plane to the next
+} PixelPlanes;
+
+inline HOST_DEVICE int planeIndex(const PixelPlanes &p, int x, int y)
+{
+	return (y - p.originY) * p.stride + (x - p.originX);
+}
+
+// A visibility buffer keeps, for each pixel (sample), the depth and the ID
+// of the triangle drawn there instead of its color; the colors are worked
+// out afterwards, once per pixel. The IDs are stored bit for bit in the
+// float r plane of PixelPlanes. Pixels with no triangle hold this ID.
+#define VISIBILITY_NONE 0xffffffffu
+
+// Most samples per pixel rasterizeTriangleMSAA supports
+#define MSAA_MAX_SAMPLES 8
+
+// Where a pixel's samples are, relative to the point (x, y) single-sampled
+// rasterization tests. Every offset is within half a pixel, and a whole
+// number of subpixels (see RASTER_SUBPIXELS).
+typedef struct SamplePattern
+{
+	int count;
+	float x[MSAA_MAX_SAMPLES];
+	float y[MSAA_MAX_SAMPLES];
+} SamplePattern;
+
+/*
+* The standard 2x, 4x and 8x multisample patterns (the ones D3D and Vulkan
+* guarantee): rotated grids that give near and nearly horizontal or
+* vertical edges as many distinct coverage levels as there are samples.
+*
+* count: 2, 4 or 8; anything else gives the single sample at (0, 0)
+*/
+inline HOST_DEVICE SamplePattern makeSamplePattern(int count)
+{
+	// in 1/16 pixel
+	const int pattern2[2][2] = {{4, 4}, {-4, -4}};
+	const int pattern4[4][2] = {{-2, -6}, {6, -2}, {-6, 2}, {2, 6}};
+	const int pattern8[8][2] = {{1, -3}, {-1, 3}, {5, 1}, {-3, -5}, {-5, 5}, {-7, -1}, {3, 7}, {7, -7}};
+
+	SamplePattern p;
+	const int (*offsets)[2];
+	switch (count)
+	{
+	case 2: offsets = pattern2; break;
+	case 4: offsets = pattern4; break;
+	case 8: offsets = pattern8; break;
+	default:
+		p.count = 1;
+		p.x[0] = 0;
+		p.y[0] = 0;
+		return p;
+	}
+
+	p.count = count;
+	for (int k = 0; k < count; ++k)
+	{
+		p.x[k] = offsets[k][0] / 16.0f;
+		p.y[k] = offsets[k][1] / 16.0f;
+	}
+	return p;
+}
+
+// A mesh that is ready to rasterize: vertex positions already converted to
+// screen coordinates and one shaded color per face, or for smooth shading
+// one color per face and the light reaching each vertex, the highlights
+// apart (see lightPoints). Plain pointers so the same struct works for host
+// arrays and device arrays.
+//
+// Seen through a perspective camera, the mesh keeps its vertices in clip
+// space as well, for the faces that cross the near plane (see
+// assembleClippedTriangles); z on the screen is then 1/w.
+typedef struct ScreenMesh
+{
+	const float *x;
+	const float *y;
+	const float *z;
+	const unsigned int *indices;	// three vertex indices per face
+	const float *red;
+	const float *green;
+	const float *blue;
+	const float *vertexRed;		// NULL for flat shading
+	const float *vertexGreen;
+	const float *vertexBlue;
+	const float *vertexSpecularRed;	// NULL for flat shading or without highlights
+	const float *vertexSpecularGreen;
+	const float *vertexSpecularBlue;
+	const float *clipX;			// NULL unless seen through a perspective camera
+	const float *clipY;
+	const float *clipZ;
+	const float *clipW;
+	int faceCount;
+} ScreenMesh;
+
+/*
+* Convert a world X/Y coordinate to screen coordinates.
+*/
+inline HOST_DEVICE float worldToScreenX(const Viewport &v, float x)
+{
+	return ((x - v.xMinWorld) * v.width) / (v.xMaxWorld - v.xMinWorld);
+}
+
+inline HOST_DEVICE float worldToScreenY(const Viewport &v, float y)
+{
+	return ((y - v.yMinWorld) * v.height) / (v.yMaxWorld - v.yMinWorld);
+}
+
+/*
+* Convert the provided point from world coordinates to screen coordinates.
+*
+* v: The viewport
+* coords: The vertex coordinates we want to convert
+*
+* returns: The vertex converted to screen coordinates
+*/
+inline HOST_DEVICE Vector3 convertVertexTo2D(const Viewport &v, Vector3 coords)
+{
+	// Z will be used later for depth interpolation and Z buffer tests
+	coords.x = worldToScreenX(v, coords.x);
+	coords.y = worldToScreenY(v, coords.y);
+
+	return coords;
+}
+
+// calculate bounding box for the triangle (in screen coordinates)
+inline HOST_DEVICE void computeBoundingBox(Triangle &t)
+{
+	t.minX = fminf(t.v1.position.x, fminf(t.v2.position.x, t.v3.position.x));
+	t.maxX = fmaxf(t.v1.position.x, fmaxf(t.v2.position.x, t.v3.position.x));
+	t.minY = fminf(t.v1.position.y, fminf(t.v2.position.y, t.v3.position.y));
+	t.maxY = fmaxf(t.v1.position.y, fmaxf(t.v2.position.y, t.v3.position.y));
+}
+
+/*
+* Given a Triangle with vertices specified in world coordinates,
+* convert the triangle to 2D (screen) coordinates.
+*
+* v: The viewport
+* t: The triangle in world coordinates
+*
+* returns: The triangle converted to screen coordinates
+*/
+inline HOST_DEVICE Triangle convertTriTo2D(const Viewport &v, Triangle t)
+{
+	Triangle converted = t;
+
+	// convert the vertices to screen space
+	converted.v1.position = convertVertexTo2D(v, t.v1.position);
+	converted.v2.position = convertVertexTo2D(v, t.v2.position);
+	converted.v3.position = convertVertexTo2D(v, t.v3.position);
+
+	computeBoundingBox(converted);
+
+	return converted;
+}
+
+/*
+* Gather one face of a ScreenMesh into a Triangle for rasterization. With
+* per-vertex light, each vertex gets the face's color lit by its own light,
+* plus its highlights, so the colors are interpolated across the face.
+*
+* m: The mesh (already in screen coordinates)
+* face: Index of the face
+*
+* returns: The face as a screen space Triangle, bounding box included
+*/
+inline HOST_DEVICE Triangle assembleTriangle(const ScreenMesh &m, int face)
+{
+	unsigned int i1 = m.indices[3*face];
+	unsigned int i2 = m.indices[3*face + 1];
+	unsigned int i3 = m.indices[3*face + 2];
+	Vector3 color(m.red[face], m.green[face], m.blue[face]);
+
+	Triangle t;
+	t.v1.position = Vector3(m.x[i1], m.y[i1], m.z[i1]);
+	t.v2.position = Vector3(m.x[i2], m.y[i2], m.z[i2]);
+	t.v3.position = Vector3(m.x[i3], m.y[i3], m.z[i3]);
+	if (m.vertexRed != NULL)
+	{
+		t.v1.rgb = Vector3(color.x * m.vertexRed[i1], color.y * m.vertexGreen[i1], color.z * m.vertexBlue[i1]);
+		t.v2.rgb = Vector3(color.x * m.vertexRed[i2], color.y * m.vertexGreen[i2], color.z * m.vertexBlue[i2]);
+		t.v3.rgb = Vector3(color.x * m.vertexRed[i3], color.y * m.vertexGreen[i3], color.z * m.vertexBlue[i3]);
+		if (m.vertexSpecularRed != NULL)
+		{
+			t.v1.rgb = Vector3(t.v1.rgb.x + m.vertexSpecularRed[i1], t.v1.rgb.y + m.vertexSpecularGreen[i1],
+				t.v1.rgb.z + m.vertexSpecularBlue[i1]);
+			t.v2.rgb = Vector3(t.v2.rgb.x + m.vertexSpecularRed[i2], t.v2.rgb.y + m.vertexSpecularGreen[i2],
+				t.v2.rgb.z + m.vertexSpecularBlue[i2]);
+			t.v3.rgb = Vector3(t.v3.rgb.x + m.vertexSpecularRed[i3], t.v3.rgb.y + m.vertexSpecularGreen[i3],
+				t.v3.rgb.z + m.vertexSpecularBlue[i3]);
+		}
+	}
+	else
+	{
+		t.v1.rgb = color;
+		t.v2.rgb = color;
+		t.v3.rgb = color;
+	}
+	t.perspective = m.clipW != NULL;
+
+	computeBoundingBox(t);
+
+	return t;
+}
+
+/*
+* Gather one face of a ScreenMesh into triangles for rasterization, like
+* assembleTriangle, but seen through a perspective camera, clipping the face
+* against the near plane: the part of it with z >= -w in clip space is kept.
+* That is the whole face, nothing, or a triangle or a quadrilateral, which
+* is split in two along a diagonal.
+*
+* Where an edge crosses the plane is worked out from its end inside to its
+* end outside, so the faces on either side of the edge get exactly the same
+* point and still meet without a gap. Colors are interpolated in clip space,
+* where they are linear.
+*
+* m: The mesh (already in screen coordinates)
+* v: The viewport
+* face: Index of the face
+* out: Receives the triangles, bounding boxes included
+*
+* returns: The number of triangles, 0 to 2
+*/
+inline HOST_DEVICE int assembleClippedTriangles(const ScreenMesh &m, const Viewport &v, int face, Triangle out[2])
+{
+	Triangle t = assembleTriangle(m, face);
+	if (m.clipW == NULL)
+	{
+		out[0] = t;
+		return 1;
+	}
+
+	unsigned int index[3] = {m.indices[3*face], m.indices[3*face + 1], m.indices[3*face + 2]};
+	Vertex vertex[3] = {t.v1, t.v2, t.v3};
+	float d[3];		// distance in front of the near plane, in clip space
+	int insideCount = 0;
+	for (int k = 0; k < 3; ++k)
+	{
+		d[k] = m.clipZ[index[k]] + m.clipW[index[k]];
+		insideCount += d[k] >= 0;
+	}
+	if (insideCount == 3)
+	{
+		out[0] = t;
+		return 1;
+	}
+	if (insideCount == 0)
+		return 0;
+
+	Vertex polygon[4];
+	int count = 0;
+	for (int k = 0; k < 3; ++k)
+	{
+		int next = (k + 1) % 3;
+		if (d[k] >= 0)
+			polygon[count++] = vertex[k];
+		if ((d[k] >= 0) == (d[next] >= 0))
+			continue;
+
+		int in = d[k] >= 0 ? k : next;
+		int outside = d[k] >= 0 ? next : k;
+		unsigned int a = index[in];
+		unsigned int b = index[outside];
+		float s = d[in] / (d[in] - d[outside]);
+		float x = m.clipX[a] + (m.clipX[b] - m.clipX[a]) * s;
+		float y = m.clipY[a] + (m.clipY[b] - m.clipY[a]) * s;
+		float w = m.clipW[a] + (m.clipW[b] - m.clipW[a]) * s;
+
+		Vertex &p = polygon[count++];
+		projectPoint(v.width * 0.5f, v.height * 0.5f, x, y, w, p.position.x, p.position.y, p.position.z);
+		Vector3 ca = vertex[in].rgb;
+		Vector3 cb = vertex[outside].rgb;
+		p.rgb = Vector3(ca.x + (cb.x - ca.x) * s, ca.y + (cb.y - ca.y) * s, ca.z + (cb.z - ca.z) * s);
+	}
+
+	for (int k = 0; k + 2 < count; ++k)
+	{
+		out[k] = t;
+		out[k].v1 = polygon[0];
+		out[k].v2 = polygon[k + 1];
+		out[k].v3 = polygon[k + 2];
+		computeBoundingBox(out[k]);
+	}
+	return count - 2;
+}
+
+// Vertex positions are snapped to a grid of this many bits below the pixel
+// (28.4 fixed point: a 16th of a pixel) before rasterizing, and which pixels
+// and samples a triangle covers is decided with integer edge functions on
+// the snapped positions. That is exact, so the answer can't depend on the
+// order or the precision things were computed in: triangles that share an
+// edge split the pixels along it with no gaps or overlaps, the same on every
+// kernel and on the GPU.
+#define RASTER_SUBPIXEL_BITS 4
+#define RASTER_SUBPIXELS (1 << RASTER_SUBPIXEL_BITS)
+
+// How far from the screen origin, in pixels, a vertex may be and still be
+// rasterized. Snapped coordinates then fit 28 bits, and edge functions
+// (products of two coordinate differences, plus a few of those) 64.
+// Triangles reaching further are dropped as off screen.
+#define RASTER_GUARD_BAND (1 << 23)
+
+// A triangle's vertices on the subpixel grid, and twice its signed area in
+// square subpixels. Counterclockwise triangles (x to the right, y up) are
+// positive.
+typedef struct FixedTriangle
+{
+	int x[3];
+	int y[3];
+	long long area;
+} FixedTriangle;
+
+/*
+* Snap a screen coordinate to the nearest point of the subpixel grid.
+*/
+inline HOST_DEVICE int snapToSubpixel(float v)
+{
+	return (int)floorf(v * RASTER_SUBPIXELS + 0.5f);
+}
+
+/*
+* Snap a triangle's vertices to the subpixel grid.
+*
+* t: The triangle, in screen coordinates
+* f: Receives the snapped triangle
+*
+* returns: false if a vertex is past the guard band (or not a number)
+*/
+inline HOST_DEVICE bool snapTriangle(const Triangle &t, FixedTriangle &f)
+{
+	Vector3 v[3] = {t.v1.position, t.v2.position, t.v3.position};
+	for (int i = 0; i < 3; ++i)
+	{
+		// also catches NaN
+		if (!(fabsf(v[i].x) <= RASTER_GUARD_BAND && fabsf(v[i].y) <= RASTER_GUARD_BAND))
+			return false;
+		f.x[i] = snapToSubpixel(v[i].x);
+		f.y[i] = snapToSubpixel(v[i].y);
+	}
+
+	f.area = (long long)(f.x[1] - f.x[0]) * (f.y[2] - f.y[0]) - (long long)(f.x[2] - f.x[0]) * (f.y[1] - f.y[0]);
+	return true;
+}
+
+// floor(a / b) and ceil(a / b) for b > 0
+inline HOST_DEVICE long long floorDiv(long long a, long long b)
+{
+	return a >= 0 ? a / b : -((b - 1 - a) / b);
+}
+
+inline HOST_DEVICE long long ceilDiv(long long a, long long b)
+{
+	return -floorDiv(-a, b);
+}
+
+/*
+* The pixels a triangle can cover: its bounding box once snapped, which is
+* exact, as a pixel range. Only for triangles within the guard band (see
+* cullTriangle).
+*
+* t: The triangle, in screen coordinates, bounding box included
+* pad: Pixels to widen the range by on every side (1 for
+*      rasterizeTriangleMSAA, whose samples are up to half a pixel off)
+* xStart, yStart, xEnd, yEnd: Receive the range xStart <= x < xEnd,
+*                             yStart <= y < yEnd, clamped to what they held
+*                             on input. Empty if nothing is left.
+*/
+inline HOST_DEVICE void pixelBounds(const Triangle &t, int pad, int &xStart, int &yStart, int &xEnd, int &yEnd)
+{
+	// snapping never changes which coordinate is the smallest or largest
+	int x0 = (int)ceilDiv(snapToSubpixel(t.minX), RASTER_SUBPIXELS) - pad;
+	int y0 = (int)ceilDiv(snapToSubpixel(t.minY), RASTER_SUBPIXELS) - pad;
+	int x1 = (int)floorDiv(snapToSubpixel(t.maxX), RASTER_SUBPIXELS) + 1 + pad;
+	int y1 = (int)floorDiv(snapToSubpixel(t.maxY), RASTER_SUBPIXELS) + 1 + pad;
+	if (x0 > xStart) xStart = x0;
+	if (y0 > yStart) yStart = y0;
+	if (x1 < xEnd) xEnd = x1;
+	if (y1 < yEnd) yEnd = y1;
+}
+
+// Which way facing triangles the culling stage drops. A face is front
+// facing when its normal points towards the camera (+Z). Meshes wind their
+// faces counterclockwise around the normal, and world to screen conversion
+// keeps the directions of x and y, so front faces have a positive signed
+// area on screen.
+enum FaceCulling
+{
+	CULL_NONE,
+	CULL_BACK,
+	CULL_FRONT
+};
+
+// Why cullTriangle dropped a triangle, if it did
+enum CullResult
+{
+	CULL_KEPT,
+	CULL_OFF_SCREEN,	// the bounding box misses the screen, or reaches past the guard band
+	CULL_TOO_FAR,		// no nearer than an empty pixel anywhere
+	CULL_DEGENERATE,	// no area once snapped: covers no pixels
+	CULL_FACING			// faces the way that is culled
+};
+
+/*
+* The culling stage: decide whether a triangle can draw any pixel before it
+* is binned or rasterized. Off screen and too far triangles are tested on
+* the snapped bounding box (see pixelBounds) and vertex depths; the signed
+* area of the snapped triangle, which is what the rasterizer draws, then
+* tells degenerate and culled facing triangles apart.
+*
+* t: The triangle, in screen coordinates, bounding box included
+* v: The viewport
+* culling: Which facing triangles to drop
+* pad: How far past its bounding box the rasterizer looks, in pixels (1 for
+*      rasterizeTriangleMSAA)
+*
+* returns: CULL_KEPT if the triangle is to be rasterized
+*/
+inline HOST_DEVICE CullResult cullTriangle(const Triangle &t, const Viewport &v, FaceCulling culling, int pad)
+{
+	FixedTriangle f;
+	if (!snapTriangle(t, f))
+		return CULL_OFF_SCREEN;
+
+	int x0 = 0, y0 = 0, x1 = v.width, y1 = v.height;
+	pixelBounds(t, pad, x0, y0, x1, y1);
+	if (x0 >= x1 || y0 >= y1)
+		return CULL_OFF_SCREEN;
+
+	if (!(fmaxf(t.v1.position.z, fmaxf(t.v2.position.z, t.v3.position.z)) > v.minZ))
+		return CULL_TOO_FAR;
+
+	if (f.area == 0)
+		return CULL_DEGENERATE;
+
+	if ((culling == CULL_BACK && f.area < 0) || (culling == CULL_FRONT && f.area > 0))
+		return CULL_FACING;
+
+	return CULL_KEPT;
+}
+
+// Per-triangle constants for edge-function rasterization.
+//
+// Coverage is decided in fixed point (see RASTER_SUBPIXEL_BITS). At the
+// subpixel grid point (X, Y),
+//
+//   edgeA[i]*(X - fixedX) + edgeB[i]*(Y - fixedY) + edgeC[i] >= 0
+//
+// when the point is on the inner side of the edge opposite vertex i+1, or
+// on the edge itself and the edge is a top or left one. That is the top-left
+// fill rule: of two triangles sharing an edge, exactly one owns the points
+// on it, so every point is drawn once. Without the fill rule bias folded
+// into edgeC, the edge function divided by the triangle's (doubled) area is
+// vertex i+1's barycentric coordinate.
+//
+// A, B and E0 are the same edge functions in floats and in pixels, relative
+// to (refX, refY), for code that only needs them approximately (see
+// HierarchicalZ). Depth and color are affine in x and y as well. Attribute
+// k (z, red, green, blue) at (x, y) is
+// attr0[k] + attrDx[k]*(x - refX) + attrDy[k]*(y - refY). For a
+// perspective triangle, z is 1/w and the colors are over w, and a pixel's
+// colors are its attributes divided by its z (see pixelColor).
+//
+// Everything is relative to vertex 1 rather than the screen origin, which
+// keeps the magnitudes (and so the rounding errors) small. refX and refY
+// are vertex 1 snapped, so the planes are those of the triangle drawn.
+typedef struct TriangleSetup
+{
+	int fixedX;
+	int fixedY;
+	long long edgeA[3];
+	long long edgeB[3];
+	long long edgeC[3];
+	bool perspective;
+	float refX;
+	float refY;
+	float A[3];
+	float B[3];
+	float E0[3];
+	float attr0[4];
+	float attrDx[4];
+	float attrDy[4];
+} TriangleSetup;
+
+/*
+* Compute the edge functions and attribute planes of a triangle.
+*
+* t: The triangle (in screen coordinates)
+* s: Receives the setup
+*
+* returns: false if the snapped triangle has no area and can't cover any
+*          pixels, or if it reaches past the guard band
+*/
+inline HOST_DEVICE bool setupTriangle(const Triangle &t, TriangleSetup &s)
+{
+	FixedTriangle f;
+	if (!snapTriangle(t, f) || f.area == 0)
+		return false;
+
+	// flip the edge functions of clockwise triangles so that inside is
+	// always positive
+	long long sign = f.area > 0 ? 1 : -1;
+
+	s.fixedX = f.x[0];
+	s.fixedY = f.y[0];
+	for (int i = 0; i < 3; ++i)
+	{
+		// edge i joins the two vertices other than vertex i+1
+		int j = (i + 1) % 3;
+		int k = (i + 2) % 3;
+		s.edgeA[i] = sign * (f.y[j] - f.y[k]);
+		s.edgeB[i] = sign * (f.x[k] - f.x[j]);
+
+		// Inside is to the right of a left edge, and below a top one (y
+		// is up). Points on any other edge belong to the triangle across.
+		bool topLeft = s.edgeA[i] > 0 || (s.edgeA[i] == 0 && s.edgeB[i] < 0);
+		s.edgeC[i] = topLeft ? 0 : -1;
+	}
+	s.edgeC[0] += sign * f.area;	// alpha is 1 at vertex 1, beta and gamma 0
+
+	const float subpixel = 1.0f / RASTER_SUBPIXELS;
+	s.refX = f.x[0] * subpixel;
+	s.refY = f.y[0] * subpixel;
+	for (int i = 0; i < 3; ++i)
+	{
+		s.A[i] = s.edgeA[i] * subpixel;
+		s.B[i] = s.edgeB[i] * subpixel;
+		s.E0[i] = 0;
+	}
+	s.E0[0] = (sign * f.area) * (subpixel * subpixel);
+
+	// the only division for the whole triangle
+	float invArea = 1.0f / s.E0[0];
+
+	float a1[4] = {t.v1.position.z, t.v1.rgb.x, t.v1.rgb.y, t.v1.rgb.z};
+	float a2[4] = {t.v2.position.z, t.v2.rgb.x, t.v2.rgb.y, t.v2.rgb.z};
+	float a3[4] = {t.v3.position.z, t.v3.rgb.x, t.v3.rgb.y, t.v3.rgb.z};
+	s.perspective = t.perspective;
+	if (s.perspective)
+	{
+		// colors over w are affine on the screen, like 1/w itself
+		for (int k = 1; k < 4; ++k)
+		{
+			a1[k] *= a1[0];
+			a2[k] *= a2[0];
+			a3[k] *= a3[0];
+		}
+	}
+	for (int k = 0; k < 4; ++k)
+	{
+		s.attr0[k] = a1[k];
+		s.attrDx[k] = (s.A[0]*a1[k] + s.A[1]*a2[k] + s.A[2]*a3[k]) * invArea;
+		s.attrDy[k] = (s.B[0]*a1[k] + s.B[1]*a2[k] + s.B[2]*a3[k]) * invArea;
+	}
+
+	return true;
+}
+
+/*
+* Find the pixels of row y that the triangle covers, by solving each
+* integer edge function for x. This is exact: every pixel in the range is
+* covered and no other pixel of the row is, so the row loops need no
+* coverage test of their own.
+*
+* s: The triangle setup
+* y: The row
+* sampleX, sampleY: Where the point tested is relative to the pixel, in
+*                   subpixels: 0, 0 for single-sampled rasterization, the
+*                   sample's offset for multisampled
+* xStart, xEnd: Receive the covered range [xStart, xEnd), clamped to what
+*               they held on input. Empty if the row misses the triangle.
+*/
+inline HOST_DEVICE void rowSpan(const TriangleSetup &s, int y, int sampleX, int sampleY, int &xStart, int &xEnd)
+{
+	long long x0 = xStart;
+	long long x1 = xEnd;
+	long long dx = sampleX - s.fixedX;
+	long long dy = (long long)y * RASTER_SUBPIXELS + sampleY - s.fixedY;
+
+	for (int i = 0; i < 3 && x0 < x1; ++i)
+	{
+		// the edge function at pixel x is step*x + atZero
+		long long step = s.edgeA[i] * RASTER_SUBPIXELS;
+		long long atZero = s.edgeA[i]*dx + s.edgeB[i]*dy + s.edgeC[i];
+
+		if (step == 0)
+		{
+			// the edge is horizontal; the whole row is on one side of it
+			if (atZero < 0)
+				x1 = x0;
+		}
+		else if (step > 0)
+		{
+			// inside is right of the crossing
+			long long first = ceilDiv(-atZero, step);
+			if (first > x0)
+				x0 = first;
+		}
+		else
+		{
+			// inside is left of the crossing
+			long long last = floorDiv(atZero, -step);
+			if (last + 1 < x1)
+				x1 = last + 1;
+		}
+	}
+
+	if (x0 >= x1)
+		xEnd = xStart;
+	else
+	{
+		xStart = (int)x0;
+		xEnd = (int)x1;
+	}
+}
+
+/*
+* Evaluate a triangle's attributes at a pixel.
+*
+* s: The triangle setup
+* x, y: The pixel
+* attr: Receives z, red, green and blue
+*/
+inline HOST_DEVICE void evaluateAt(const TriangleSetup &s, int x, int y, float attr[4])
+{
+	float dx = x - s.refX;
+	float dy = y - s.refY;
+
+	for (int k = 0; k < 4; ++k)
+		attr[k] = s.attr0[k] + s.attrDx[k]*dx + s.attrDy[k]*dy;
+}
+
+/*
+* A pixel's colors from its attributes: themselves, or for a perspective
+* triangle divided by its 1/w.
+*/
+inline HOST_DEVICE void pixelColor(const TriangleSetup &s, const float attr[4], float &r, float &g, float &b)
+{
+	r = attr[1];
+	g = attr[2];
+	b = attr[3];
+	if (s.perspective)
+	{
+		r /= attr[0];
+		g /= attr[0];
+		b /= attr[0];
+	}
+}
+
+/*
+* Rasterize a run of covered pixels along one row (see rowSpan).
+*
+* The values at the n-th pixel of the run are attr + n*attrDx. Computing
+* them from n rather than summing steps keeps rounding errors from piling
+* up, and it is what the vectorized kernels in RasterizerSIMD.cpp do lane by
+* lane, so they produce exactly the same image. Multisampled, a sample's
+* colors are divided by the sample's own 1/w (see pixelColor).
+*
+* s: The triangle setup
+* attr: The attributes at the first pixel (see evaluateAt)
+* count: The number of pixels
+* r, g, b, z: The buffers, pointing at the first pixel
+*
+* returns: The number of pixels written
+*/
+inline HOST_DEVICE int rasterizeRow(const TriangleSetup &s, const float attr[4], int count,
+	float *r, float *g, float *b, float *z)
+{
+	int written = 0;
+	for (int n = 0; n < count; ++n)
+	{
+		float fn = n;
+		float pz = attr[0] + s.attrDx[0]*fn;
+
+		// Z buffer test.
+		// The camera is at the origin (0, 0, 0) looking down the negative Z axis.
+		// This means closer to the camera = greater Z value.
+		if (pz > z[n])
+		{
+			// write the pixel's color components to our color arrays
+			float pixel[4] = {pz, attr[1] + s.attrDx[1]*fn, attr[2] + s.attrDx[2]*fn, attr[3] + s.attrDx[3]*fn};
+			pixelColor(s, pixel, r[n], g[n], b[n]);
+
+			// update the Z buffer
+			z[n] = pz;
+			++written;
+		}
+	}
+	return written;
+}
+
+/*
+* Rasterize the part of a triangle that falls inside a clip rectangle.
+* Rasterizing a triangle piece by piece over rectangles that cover the
+* screen writes exactly the same pixels as rasterizing it in one go.
+*
+* Each row's covered span is found exactly (see rowSpan) and the attributes
+* are evaluated directly at its start; rasterizeRow takes it from there.
+*
+* This is the scalar reference; rasterizeTriangleSIMD (RasterizerSIMD.h) is
+* the same thing several pixels at a time for the CPU.
+*
+* t: The triangle to rasterize (should already be converted to screen coordinates)
+* clipX0, clipY0, clipX1, clipY1: Pixels x0 <= x < x1, y0 <= y < y1 may be written.
+*                                 They must be inside the planes.
+* p: The color and depth planes to write to
+*
+* returns: The number of pixels that passed the depth test and were written
+*/
+inline HOST_DEVICE int rasterizeTriangleClipped(Triangle t, int clipX0, int clipY0, int clipX1, int clipY1,
+	const PixelPlanes &p)
+{
+	TriangleSetup s;
+	if (!setupTriangle(t, s))
+		return 0;
+
+	int xStart = clipX0, yStart = clipY0, xEnd = clipX1, yEnd = clipY1;
+	pixelBounds(t, 0, xStart, yStart, xEnd, yEnd);
+
+	// iterate over each row of the triangle's bounding box
+	int written = 0;
+	for (int y = yStart; y < yEnd; ++y)
+	{
+		int x0 = xStart;
+		int x1 = xEnd;
+		rowSpan(s, y, 0, 0, x0, x1);
+		if (x0 >= x1)
+			continue;
+
+		float attr[4];
+		evaluateAt(s, x0, y, attr);
+		int i = planeIndex(p, x0, y);
+		written += rasterizeRow(s, attr, x1 - x0, &p.r[i], &p.g[i], &p.b[i], &p.z[i]);
+	}
+	return written;
+}
+
+/*
+* Per-triangle constants for multisampling: each sample's position in
+* subpixels, and its depth relative to its pixel's.
+*
+* s: The triangle setup
+* pattern: Where the samples are
+* sampleX, sampleY, zOffset: Receive the offsets, pattern.count of each
+*/
+inline HOST_DEVICE void setupSamples(const TriangleSetup &s, const SamplePattern &pattern,
+	int sampleX[], int sampleY[], float zOffset[])
+{
+	for (int k = 0; k < pattern.count; ++k)
+	{
+		sampleX[k] = (int)(pattern.x[k] * RASTER_SUBPIXELS);
+		sampleY[k] = (int)(pattern.y[k] * RASTER_SUBPIXELS);
+		zOffset[k] = s.attrDx[0]*pattern.x[k] + s.attrDy[0]*pattern.y[k];
+	}
+}
+
+/*
+* Rasterize the part of a triangle that falls inside a clip rectangle into
+* multisampled planes.
+*
+* Every sample of a pixel gets its own coverage and depth test. The color
+* is worked out at the pixel's own position, not the sample's, so an
+* edge pixel averages the colors of the triangles it is split between
+* rather than sampling them off center.
+*
+* Each sample is rasterized on its own, row by row, into its own plane:
+* rowSpan with the sample's offset gives the pixels whose sample is covered,
+* and its depth is the pixel's plus the offset's. So every sample row is
+* just another run for rasterizeRow (or one of the vectorized kernels),
+* which is how rasterizeTriangleMSAASIMD works.
+*
+* t: The triangle to rasterize (should already be converted to screen coordinates)
+* clipX0, clipY0, clipX1, clipY1: Pixels x0 <= x < x1, y0 <= y < y1 may be written.
+*                                 They must be inside the planes.
+* p: The multisampled color and depth planes to write to, pattern.count samples
+* pattern: Where the samples are
+*
+* returns: The number of samples that passed the depth test and were written
+*/
+inline HOST_DEVICE int rasterizeTriangleMSAA(Triangle t, int clipX0, int clipY0, int clipX1, int clipY1,
+	const PixelPlanes &p, const SamplePattern &pattern)
+{
+	TriangleSetup s;
+	if (!setupTriangle(t, s))
+		return 0;
+
+	// Samples are up to half a pixel from their pixel, so a pixel next to
+	// the bounding box can still have a sample inside it
+	int xStart = clipX0, yStart = clipY0, xEnd = clipX1, yEnd = clipY1;
+	pixelBounds(t, 1, xStart, yStart, xEnd, yEnd);
+
+	int sampleX[MSAA_MAX_SAMPLES];
+	int sampleY[MSAA_MAX_SAMPLES];
+	float zOffset[MSAA_MAX_SAMPLES];
+	setupSamples(s, pattern, sampleX, sampleY, zOffset);
+
+	int written = 0;
+	for (int y = yStart; y < yEnd; ++y)
+	{
+		for (int k = 0; k < pattern.count; ++k)
+		{
+			int x0 = xStart;
+			int x1 = xEnd;
+			rowSpan(s, y, sampleX[k], sampleY[k], x0, x1);
+			if (x0 >= x1)
+				continue;
+
+			float attr[4];
+			evaluateAt(s, x0, y, attr);
+			attr[0] += zOffset[k];
+			int i = planeIndex(p, x0, y) + k * p.sampleStride;
+			written += rasterizeRow(s, attr, x1 - x0, &p.r[i], &p.g[i], &p.b[i], &p.z[i]);
+		}
+	}
+	return written;
+}
+
+/*
+* Average each pixel's samples into single-sampled planes (the MSAA resolve).
+*
+* sr, sg, sb: Multisampled color planes
+* count: Samples per pixel
+* sampleStride: Distance from one sample's plane to the next
+* pixels: Pixels to resolve
+* r, g, b: Receive the resolved colors, pixels of them
+*/
+inline HOST_DEVICE void resolveSamples(const float *sr, const float *sg, const float *sb, int count, int sampleStride,
+	int pixels, float *r, float *g, float *b)
+{
+	float weight = 1.0f / count;
+	for (int i = 0; i < pixels; ++i)
+	{
+		float red = 0, green = 0, blue = 0;
+		for (int k = 0; k < count; ++k)
+		{
+			red += sr[i + k*sampleStride];
+			green += sg[i + k*sampleStride];
+			blue += sb[i + k*sampleStride];
+		}
+		r[i] = red * weight;
+		g[i] = green * weight;
+		b[i] = blue * weight;
+	}
+}
+
+/*
+* Rasterize a triangle.
+*
+* t: The triangle to rasterize (should already be converted to screen coordinates)
+* v: The viewport
+* r, g, b, z: The color and depth buffers to write to (see Viewport)
+*
+* returns: The number of pixels written
+*/
+inline HOST_DEVICE int rasterizeTriangle(Triangle t, const Viewport &v, float *r, float *g, float *b, float *z)
+{
+	PixelPlanes p = {r, g, b, z, 0, 0, v.width, v.width * v.height};
+	return rasterizeTriangleClipped(t, 0, 0, v.width, v.height, p);
+}
+
+#endif
@@ -0,0 +1,309 @@
+#include "RasterizerCheck.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "Framebuffer.h"
+#include "Rasterizer.h"
+#include "RasterizerSIMD.h"
+#include "RenderTargetPool.h"
+#include "ThreadPool.h"
+
+using namespace std;
+
+/*
+* Draw the model, both as one bunny and tiled and without and with 4x MSAA,
+* then as one bunny through a perspective camera so close that the near
+* plane cuts it, with the scalar rasterizer and with each SIMD kernel the
+* CPU supports, and compare the framebuffers bit for bit.
+*
+* returns: 0 if every kernel matched the scalar rasterizer, 1 otherwise
+*/
+int checkSimd(const BasicModel *model, const vector<ShadedMesh> &shaded, const Viewport &viewport, int threadCount)
+{
+	ThreadPool pool(threadCount);
+	RenderTargetPool targets;
+	SimdLevel supported = detectSimdLevel();
+	size_t pixels = (size_t)viewport.width * viewport.height;
+	int failures = 0;
+
+	for (int run = 0; run < 6; ++run)
+	{
+		bool perspective = run >= 4;
+		bool tiled = !perspective && (run & 1) != 0;
+		int samples = run < 2 || run == 4 ? 1 : 4;
+		vector<Instance> instances;
+		layoutBunnies(tiled, instances);
+
+		Viewport runViewport = viewport;
+		if (perspective)
+		{
+			Camera camera = makeCamera();
+			camera.eye = Vector3(0, 0, 0.9f);
+			camera.target = Vector3(0, 0, -1);
+			camera.zNear = 0.5f;
+			setCamera(runViewport, camera);
+		}
+
+		// z, red, green, blue for each level
+		vector<vector<float> > buffers(4 * (supported + 1));
+		for (int level = SIMD_SCALAR; level <= supported; ++level)
+		{
+			vector<float> *fb = &buffers[4 * level];
+			for (int k = 0; k < 4; ++k)
+				fb[k].resize(pixels);
+
+			Framebuffer *framebuffer = targets.acquire(runViewport, COLOR_RGB32F, DEPTH_32F, samples);
+			setSimdLevel((SimdLevel)level);
+			drawInstances(model, shaded, instances, *framebuffer, pool);
+			framebuffer->readDepth(fb[0].data());
+			framebuffer->readColor(fb[1].data(), fb[2].data(), fb[3].data());
+			targets.release(framebuffer);
+
+			if (level == SIMD_SCALAR)
+				continue;
+
+			size_t mismatches = 0;
+			for (size_t i = 0; i < pixels; ++i)
+			{
+				for (int k = 0; k < 4; ++k)
+				{
+					if (memcmp(&fb[k][i], &buffers[k][i], sizeof(float)) != 0)
+					{
+						++mismatches;
+						break;
+					}
+				}
+			}
+
+			printf("%-6s %-6s %dx: %s", simdLevelName((SimdLevel)level), tiled ? "tiled" : perspective ? "camera" : "single", samples,
+				mismatches == 0 ? "matches scalar" : "MISMATCH");
+			if (mismatches != 0)
+			{
+				printf(" (%lu pixels differ)", (unsigned long)mismatches);
+				++failures;
+			}
+			printf("\n");
+		}
+	}
+
+	setSimdLevel(supported);
+	return failures == 0 ? 0 : 1;
+}
+
+// The rectangle -checkwatertight's meshes cover, in pixels. Its sides are
+// halfway between pixels and don't fall on any sample either, so which
+// pixels and samples are inside is clear.
+#define WATERTIGHT_SIZE 64
+#define WATERTIGHT_MIN 4.5f
+#define WATERTIGHT_MAX 59.5f
+
+// A number in [0, 1) from a simple generator, so the meshes are the same every run
+static float nextRandom(unsigned int &seed)
+{
+	seed = seed * 1664525u + 1013904223u;
+	return (seed >> 8) / 16777216.0f;
+}
+
+static Triangle makeFlatTriangle(float x1, float y1, float x2, float y2, float x3, float y3)
+{
+	Triangle t;
+	t.v1.position = Vector3(x1, y1, 0);
+	t.v2.position = Vector3(x2, y2, 0);
+	t.v3.position = Vector3(x3, y3, 0);
+	t.v1.rgb = t.v2.rgb = t.v3.rgb = Vector3(1, 1, 1);
+	t.perspective = false;
+	computeBoundingBox(t);
+	return t;
+}
+
+/*
+* Triangulate a grid of (n+1) x (n+1) vertices over the watertight
+* rectangle. Inner vertices are moved by offset pixels and then by up to
+* jitter pixels more, and quads are split along either diagonal and wound
+* either way, at random.
+*/
+static void gridMesh(int n, float offset, float jitter, unsigned int seed, vector<Triangle> &triangles)
+{
+	vector<float> xs((n + 1) * (n + 1));
+	vector<float> ys((n + 1) * (n + 1));
+	float step = (WATERTIGHT_MAX - WATERTIGHT_MIN) / n;
+	for (int j = 0; j <= n; ++j)
+	{
+		for (int i = 0; i <= n; ++i)
+		{
+			float x = i == n ? WATERTIGHT_MAX : WATERTIGHT_MIN + i * step;
+			float y = j == n ? WATERTIGHT_MAX : WATERTIGHT_MIN + j * step;
+			if (i > 0 && i < n && j > 0 && j < n)
+			{
+				x += offset + (2 * nextRandom(seed) - 1) * jitter;
+				y += offset + (2 * nextRandom(seed) - 1) * jitter;
+			}
+			xs[j * (n + 1) + i] = x;
+			ys[j * (n + 1) + i] = y;
+		}
+	}
+
+	for (int j = 0; j < n; ++j)
+	{
+		for (int i = 0; i < n; ++i)
+		{
+			int a = j * (n + 1) + i;
+			int b = a + 1;
+			int c = a + n + 1;
+			int d = c + 1;
+			int quad[2][3];
+			if (nextRandom(seed) < 0.5f)
+			{
+				int split[2][3] = {{a, b, d}, {a, d, c}};
+				memcpy(quad, split, sizeof(quad));
+			}
+			else
+			{
+				int split[2][3] = {{a, b, c}, {b, d, c}};
+				memcpy(quad, split, sizeof(quad));
+			}
+
+			for (int k = 0; k < 2; ++k)
+			{
+				int *v = quad[k];
+				if (nextRandom(seed) < 0.5f)
+					swap(v[1], v[2]);
+				triangles.push_back(makeFlatTriangle(xs[v[0]], ys[v[0]], xs[v[1]], ys[v[1]], xs[v[2]], ys[v[2]]));
+			}
+		}
+	}
+}
+
+/*
+* A fan of long thin triangles from a point inside the watertight rectangle
+* to points all around its sides.
+*/
+static void fanMesh(int perSide, float centerX, float centerY, vector<Triangle> &triangles)
+{
+	vector<float> xs;
+	vector<float> ys;
+	float size = WATERTIGHT_MAX - WATERTIGHT_MIN;
+	for (int side = 0; side < 4; ++side)
+	{
+		for (int i = 0; i < perSide; ++i)
+		{
+			float f = size * i / perSide;
+			float x[4] = {WATERTIGHT_MIN + f, WATERTIGHT_MAX, WATERTIGHT_MAX - f, WATERTIGHT_MIN};
+			float y[4] = {WATERTIGHT_MIN, WATERTIGHT_MIN + f, WATERTIGHT_MAX, WATERTIGHT_MAX - f};
+			xs.push_back(x[side]);
+			ys.push_back(y[side]);
+		}
+	}
+
+	for (size_t i = 0; i < xs.size(); ++i)
+	{
+		size_t j = (i + 1) % xs.size();
+		triangles.push_back(makeFlatTriangle(centerX, centerY, xs[i], ys[i], xs[j], ys[j]));
+	}
+}
+
+/*
+* Rasterize meshes that cover a rectangle without gaps or overlaps one
+* triangle at a time, and count how many of the triangles write each pixel
+* (each sample, multisampled): every one inside the rectangle must be
+* written exactly once, and none outside it. The meshes have vertices off
+* the subpixel grid, vertices and edges right on pixel centers, and long
+* thin triangles. Each is drawn with the scalar rasterizer and with each
+* SIMD kernel the CPU supports, single-sampled and with 4x and 8x MSAA.
+*
+* returns: 0 if every mesh was drawn watertight, 1 otherwise
+*/
+int checkWatertight()
+{
+	const char *meshNames[4] = {"jittered", "centers", "fan", "edges"};
+	vector<Triangle> meshes[4];
+	gridMesh(11, 0, 2.0f, 1, meshes[0]);
+	gridMesh(11, 0.5f, 0, 2, meshes[1]);	// inner vertices 5 pixels apart, on pixel centers
+	fanMesh(40, 31.3f, 27.8f, meshes[2]);
+	fanMesh(55, 32, 32, meshes[3]);	// the diagonals and more run through pixel centers
+
+	const int pixels = WATERTIGHT_SIZE * WATERTIGHT_SIZE;
+	const int sampleCounts[3] = {1, 4, 8};
+	SimdLevel supported = detectSimdLevel();
+	int failures = 0;
+
+	for (int m = 0; m < 4; ++m)
+	{
+		for (int c = 0; c < 3; ++c)
+		{
+			int samples = sampleCounts[c];
+			SamplePattern pattern = makeSamplePattern(samples);
+			vector<float> r(pixels * samples), g(pixels * samples), b(pixels * samples);
+			vector<float> z(pixels * samples, -INFINITY);
+			PixelPlanes planes = {r.data(), g.data(), b.data(), z.data(), 0, 0, WATERTIGHT_SIZE, pixels};
+
+			for (int level = SIMD_SCALAR; level <= supported; ++level)
+			{
+				setSimdLevel((SimdLevel)level);
+
+				// how many triangles wrote each sample
+				vector<int> writes(pixels * samples, 0);
+				for (size_t i = 0; i < meshes[m].size(); ++i)
+				{
+					const Triangle &t = meshes[m][i];
+					if (samples > 1)
+						rasterizeTriangleMSAASIMD(t, 0, 0, WATERTIGHT_SIZE, WATERTIGHT_SIZE, planes, pattern);
+					else
+						rasterizeTriangleSIMD(t, 0, 0, WATERTIGHT_SIZE, WATERTIGHT_SIZE, planes);
+
+					// every triangle is at depth 0, so it passes the depth test
+					// wherever it covers; clear what it wrote for the next one
+					for (int k = 0; k < pixels * samples; ++k)
+					{
+						if (z[k] != -INFINITY)
+						{
+							++writes[k];
+							z[k] = -INFINITY;
+						}
+					}
+				}
+
+				int missed = 0;
+				int twice = 0;
+				int outside = 0;
+				for (int k = 0; k < samples; ++k)
+				{
+					for (int y = 0; y < WATERTIGHT_SIZE; ++y)
+					{
+						for (int x = 0; x < WATERTIGHT_SIZE; ++x)
+						{
+							float sx = x + pattern.x[k];
+							float sy = y + pattern.y[k];
+							bool inside = sx > WATERTIGHT_MIN && sx < WATERTIGHT_MAX && sy > WATERTIGHT_MIN &&
+								sy < WATERTIGHT_MAX;
+							int count = writes[k * pixels + y * WATERTIGHT_SIZE + x];
+							if (!inside)
+								outside += count != 0;
+							else if (count == 0)
+								++missed;
+							else if (count > 1)
+								++twice;
+						}
+					}
+				}
+
+				printf("%-6s %-8s %dx: ", simdLevelName((SimdLevel)level), meshNames[m], samples);
+				if (missed == 0 && twice == 0 && outside == 0)
+					printf("every sample written once\n");
+				else
+				{
+					printf("FAILED (%d missed, %d written more than once, %d outside)\n", missed, twice, outside);
+					++failures;
+				}
+			}
+		}
+	}
+
+	setSimdLevel(supported);
+	return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,32 @@
+#ifndef RASTERIZER_CHECK_H
+#define RASTERIZER_CHECK_H
+
+// Self-checks of the rasterizer, run by the drivers' -check options and by
+// make check. They print a line per case and return 0 if every case
+// passed, 1 otherwise.
+
+#include <vector>
+
+#include "BasicModel.h"
+#include "Renderer.h"
+
+/*
+* Draw the model in a few ways with the scalar rasterizer and with each
+* SIMD kernel the CPU supports, and compare the framebuffers bit for bit.
+*
+* shaded: The model's shaded colors (see shadeModel)
+* viewport: The image size and the part of the world shown
+* threadCount: Threads to draw with; 0 for one per core
+*/
+int checkSimd(const BasicModel *model, const std::vector<ShadedMesh> &shaded, const Viewport &viewport,
+	int threadCount);
+
+/*
+* Rasterize meshes that cover a rectangle without gaps or overlaps one
+* triangle at a time, and check that every pixel (sample) inside it is
+* written exactly once and none outside it, with the scalar rasterizer and
+* with each SIMD kernel the CPU supports.
+*/
+int checkWatertight();
+
+#endif
@@ -0,0 +1,462 @@
+#include "RasterizerSIMD.h"
+
+#include <string.h>
+
+#include "Rasterizer.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_X86_SIMD 1
+#include <immintrin.h>
+#endif
+
+// Rasterizes count covered pixels along a row, like rasterizeRow in
+// Rasterizer.h. The kernels below take a visibility template argument: if
+// it is true, r is a visibility plane and attr[1] holds the bits of the ID to
+// write to it, and g and b are left alone (see
+// rasterizeTriangleVisibilitySIMD). With the perspective argument, they
+// divide the colors by the depth, for triangles seen through a perspective
+// camera (see pixelColor).
+typedef int (*RowFunc)(const TriangleSetup &s, const float attr[4], int count,
+	float *r, float *g, float *b, float *z);
+
+/*
+* The part of rasterizeTriangleClipped around the row loop, with the row
+* itself done by rasterizeRowSIMD, or rasterizeRowPerspective for a
+* perspective triangle. With visibility, the row gets the bits of id in
+* place of the red channel.
+*/
+template <RowFunc rasterizeRowSIMD, RowFunc rasterizeRowPerspective, bool visibility>
+static int rasterizeTriangleWith(const Triangle &t, unsigned int id, int clipX0, int clipY0, int clipX1, int clipY1,
+	const PixelPlanes &p)
+{
+	TriangleSetup s;
+	if (!setupTriangle(t, s))
+		return 0;
+
+	int xStart = clipX0, yStart = clipY0, xEnd = clipX1, yEnd = clipY1;
+	pixelBounds(t, 0, xStart, yStart, xEnd, yEnd);
+	RowFunc rasterizeRow = s.perspective ? rasterizeRowPerspective : rasterizeRowSIMD;
+
+	int written = 0;
+	for (int y = yStart; y < yEnd; ++y)
+	{
+		int x0 = xStart;
+		int x1 = xEnd;
+		rowSpan(s, y, 0, 0, x0, x1);
+		if (x0 >= x1)
+			continue;
+
+		float attr[4];
+		evaluateAt(s, x0, y, attr);
+		if (visibility)
+			memcpy(&attr[1], &id, sizeof(id));
+		int i = planeIndex(p, x0, y);
+		written += rasterizeRow(s, attr, x1 - x0, &p.r[i], &p.g[i], &p.b[i], &p.z[i]);
+	}
+	return written;
+}
+
+/*
+* rasterizeTriangleMSAA with each sample's row done by rasterizeRowSIMD or
+* rasterizeRowPerspective.
+*/
+template <RowFunc rasterizeRowSIMD, RowFunc rasterizeRowPerspective, bool visibility>
+static int rasterizeTriangleMSAAWith(const Triangle &t, unsigned int id, int clipX0, int clipY0, int clipX1, int clipY1,
+	const PixelPlanes &p, const SamplePattern &pattern)
+{
+	TriangleSetup s;
+	if (!setupTriangle(t, s))
+		return 0;
+
+	int xStart = clipX0, yStart = clipY0, xEnd = clipX1, yEnd = clipY1;
+	pixelBounds(t, 1, xStart, yStart, xEnd, yEnd);
+	RowFunc rasterizeRow = s.perspective ? rasterizeRowPerspective : rasterizeRowSIMD;
+
+	int sampleX[MSAA_MAX_SAMPLES];
+	int sampleY[MSAA_MAX_SAMPLES];
+	float zOffset[MSAA_MAX_SAMPLES];
+	setupSamples(s, pattern, sampleX, sampleY, zOffset);
+
+	int written = 0;
+	for (int y = yStart; y < yEnd; ++y)
+	{
+		for (int k = 0; k < pattern.count; ++k)
+		{
+			int x0 = xStart;
+			int x1 = xEnd;
+			rowSpan(s, y, sampleX[k], sampleY[k], x0, x1);
+			if (x0 >= x1)
+				continue;
+
+			float attr[4];
+			evaluateAt(s, x0, y, attr);
+			attr[0] += zOffset[k];
+			if (visibility)
+				memcpy(&attr[1], &id, sizeof(id));
+			int i = planeIndex(p, x0, y) + k * p.sampleStride;
+			written += rasterizeRow(s, attr, x1 - x0, &p.r[i], &p.g[i], &p.b[i], &p.z[i]);
+		}
+	}
+	return written;
+}
+
+static int rasterizeScalar(const Triangle &t, unsigned int, int clipX0, int clipY0, int clipX1, int clipY1,
+	const PixelPlanes &p)
+{
+	return rasterizeTriangleClipped(t, clipX0, clipY0, clipX1, clipY1, p);
+}
+
+static int rasterizeMSAAScalar(const Triangle &t, unsigned int, int clipX0, int clipY0, int clipX1, int clipY1,
+	const PixelPlanes &p, const SamplePattern &pattern)
+{
+	return rasterizeTriangleMSAA(t, clipX0, clipY0, clipX1, clipY1, p, pattern);
+}
+
+/*
+* rasterizeRow for visibility planes: the same pixels pass, and get the ID
+* and the depth.
+*/
+static int rasterizeRowVisibilityScalar(const TriangleSetup &s, const float attr[4], int count,
+	float *r, float *, float *, float *z)
+{
+	int written = 0;
+	for (int n = 0; n < count; ++n)
+	{
+		float pz = attr[0] + s.attrDx[0]*(float)n;
+		if (pz > z[n])
+		{
+			r[n] = attr[1];
+			z[n] = pz;
+			++written;
+		}
+	}
+	return written;
+}
+
+#if HAVE_X86_SIMD
+
+/*
+* SSE2 is part of x86-64, so this kernel needs no special compiler options.
+* There are no masked stores: a 4-pixel group writes back the old values of
+* the pixels that fail the depth test. The group never reaches past the end
+* of the run, so those pixels are still in this tile and no other thread
+* touches them. The last count % 4 pixels are done one at a time.
+*/
+template <bool visibility, bool perspective>
+static int rasterizeRowSSE2(const TriangleSetup &s, const float attr[4], int count,
+	float *r, float *g, float *b, float *z)
+{
+	const __m128 lane = _mm_setr_ps(0, 1, 2, 3);
+	__m128 z0 = _mm_set1_ps(attr[0]), dz = _mm_set1_ps(s.attrDx[0]);
+	__m128 r0 = _mm_set1_ps(attr[1]), dr = _mm_set1_ps(s.attrDx[1]);
+	__m128 g0 = _mm_set1_ps(attr[2]), dg = _mm_set1_ps(s.attrDx[2]);
+	__m128 bl0 = _mm_set1_ps(attr[3]), db = _mm_set1_ps(s.attrDx[3]);
+
+	int written = 0;
+	int n = 0;
+	for (; n + 4 <= count; n += 4)
+	{
+		__m128 fn = _mm_add_ps(_mm_set1_ps((float)n), lane);
+
+		__m128 pz = _mm_add_ps(z0, _mm_mul_ps(dz, fn));
+		__m128 oldZ = _mm_loadu_ps(z + n);
+		__m128 write = _mm_cmpgt_ps(pz, oldZ);
+		int writeMask = _mm_movemask_ps(write);
+		if (writeMask == 0)
+			continue;
+		written += __builtin_popcount(writeMask);
+
+		if (visibility)
+		{
+			// r0 is the ID; nothing is interpolated
+			_mm_storeu_ps(r + n, _mm_or_ps(_mm_and_ps(write, r0), _mm_andnot_ps(write, _mm_loadu_ps(r + n))));
+		}
+		else
+		{
+			__m128 pr = _mm_add_ps(r0, _mm_mul_ps(dr, fn));
+			__m128 pg = _mm_add_ps(g0, _mm_mul_ps(dg, fn));
+			__m128 pb = _mm_add_ps(bl0, _mm_mul_ps(db, fn));
+			if (perspective)
+			{
+				pr = _mm_div_ps(pr, pz);
+				pg = _mm_div_ps(pg, pz);
+				pb = _mm_div_ps(pb, pz);
+			}
+			_mm_storeu_ps(r + n, _mm_or_ps(_mm_and_ps(write, pr), _mm_andnot_ps(write, _mm_loadu_ps(r + n))));
+			_mm_storeu_ps(g + n, _mm_or_ps(_mm_and_ps(write, pg), _mm_andnot_ps(write, _mm_loadu_ps(g + n))));
+			_mm_storeu_ps(b + n, _mm_or_ps(_mm_and_ps(write, pb), _mm_andnot_ps(write, _mm_loadu_ps(b + n))));
+		}
+		_mm_storeu_ps(z + n, _mm_or_ps(_mm_and_ps(write, pz), _mm_andnot_ps(write, oldZ)));
+	}
+
+	for (; n < count; ++n)
+	{
+		float fn = n;
+		float pz = attr[0] + s.attrDx[0]*fn;
+		if (pz > z[n])
+		{
+			if (visibility)
+				r[n] = attr[1];
+			else
+			{
+				float pixel[4] = {pz, attr[1] + s.attrDx[1]*fn, attr[2] + s.attrDx[2]*fn, attr[3] + s.attrDx[3]*fn};
+				pixelColor(s, pixel, r[n], g[n], b[n]);
+			}
+			z[n] = pz;
+			++written;
+		}
+	}
+	return written;
+}
+
+/*
+* AVX2 kernel. Masked loads and stores handle the end of the run, and
+* pixels outside the mask are never written.
+*/
+template <bool visibility, bool perspective>
+__attribute__((target("avx2")))
+static int rasterizeRowAVX2(const TriangleSetup &s, const float attr[4], int count,
+	float *r, float *g, float *b, float *z)
+{
+	const __m256 lane = _mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7);
+	const __m256i laneIndex = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+	__m256 z0 = _mm256_set1_ps(attr[0]), dz = _mm256_set1_ps(s.attrDx[0]);
+	__m256 r0 = _mm256_set1_ps(attr[1]), dr = _mm256_set1_ps(s.attrDx[1]);
+	__m256 g0 = _mm256_set1_ps(attr[2]), dg = _mm256_set1_ps(s.attrDx[2]);
+	__m256 bl0 = _mm256_set1_ps(attr[3]), db = _mm256_set1_ps(s.attrDx[3]);
+
+	int written = 0;
+	for (int n = 0; n < count; n += 8)
+	{
+		__m256 fn = _mm256_add_ps(_mm256_set1_ps((float)n), lane);
+
+		// lanes past the end of the run
+		__m256 inRun = _mm256_castsi256_ps(_mm256_cmpgt_epi32(_mm256_set1_epi32(count - n), laneIndex));
+
+		__m256 pz = _mm256_add_ps(z0, _mm256_mul_ps(dz, fn));
+		__m256 oldZ = _mm256_maskload_ps(z + n, _mm256_castps_si256(inRun));
+		__m256 write = _mm256_and_ps(inRun, _mm256_cmp_ps(pz, oldZ, _CMP_GT_OQ));
+		int writeMask = _mm256_movemask_ps(write);
+		if (writeMask == 0)
+			continue;
+		written += __builtin_popcount(writeMask);
+
+		__m256i mask = _mm256_castps_si256(write);
+		if (visibility)
+			_mm256_maskstore_ps(r + n, mask, r0);
+		else
+		{
+			__m256 pr = _mm256_add_ps(r0, _mm256_mul_ps(dr, fn));
+			__m256 pg = _mm256_add_ps(g0, _mm256_mul_ps(dg, fn));
+			__m256 pb = _mm256_add_ps(bl0, _mm256_mul_ps(db, fn));
+			if (perspective)
+			{
+				pr = _mm256_div_ps(pr, pz);
+				pg = _mm256_div_ps(pg, pz);
+				pb = _mm256_div_ps(pb, pz);
+			}
+			_mm256_maskstore_ps(r + n, mask, pr);
+			_mm256_maskstore_ps(g + n, mask, pg);
+			_mm256_maskstore_ps(b + n, mask, pb);
+		}
+		_mm256_maskstore_ps(z + n, mask, pz);
+	}
+	return written;
+}
+
+/*
+* AVX-512 kernel, with the depth test in mask registers.
+*/
+template <bool visibility, bool perspective>
+__attribute__((target("avx512f")))
+static int rasterizeRowAVX512(const TriangleSetup &s, const float attr[4], int count,
+	float *r, float *g, float *b, float *z)
+{
+	const __m512 lane = _mm512_setr_ps(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+	__m512 z0 = _mm512_set1_ps(attr[0]), dz = _mm512_set1_ps(s.attrDx[0]);
+	__m512 r0 = _mm512_set1_ps(attr[1]), dr = _mm512_set1_ps(s.attrDx[1]);
+	__m512 g0 = _mm512_set1_ps(attr[2]), dg = _mm512_set1_ps(s.attrDx[2]);
+	__m512 bl0 = _mm512_set1_ps(attr[3]), db = _mm512_set1_ps(s.attrDx[3]);
+
+	int written = 0;
+	for (int n = 0; n < count; n += 16)
+	{
+		__m512 fn = _mm512_add_ps(_mm512_set1_ps((float)n), lane);
+		__mmask16 inRun = count - n >= 16 ? (__mmask16)0xFFFF : (__mmask16)((1u << (count - n)) - 1);
+
+		__m512 pz = _mm512_add_ps(z0, _mm512_mul_ps(dz, fn));
+		__mmask16 write = _mm512_mask_cmp_ps_mask(inRun, pz, _mm512_maskz_loadu_ps(inRun, z + n), _CMP_GT_OQ);
+		if (write == 0)
+			continue;
+		written += __builtin_popcount(write);
+
+		if (visibility)
+			_mm512_mask_storeu_ps(r + n, write, r0);
+		else
+		{
+			__m512 pr = _mm512_add_ps(r0, _mm512_mul_ps(dr, fn));
+			__m512 pg = _mm512_add_ps(g0, _mm512_mul_ps(dg, fn));
+			__m512 pb = _mm512_add_ps(bl0, _mm512_mul_ps(db, fn));
+			if (perspective)
+			{
+				pr = _mm512_div_ps(pr, pz);
+				pg = _mm512_div_ps(pg, pz);
+				pb = _mm512_div_ps(pb, pz);
+			}
+			_mm512_mask_storeu_ps(r + n, write, pr);
+			_mm512_mask_storeu_ps(g + n, write, pg);
+			_mm512_mask_storeu_ps(b + n, write, pb);
+		}
+		_mm512_mask_storeu_ps(z + n, write, pz);
+	}
+	return written;
+}
+
+#endif
+
+typedef int (*RasterizeFunc)(const Triangle &t, unsigned int id, int clipX0, int clipY0, int clipX1, int clipY1,
+	const PixelPlanes &p);
+
+// Indexed by SimdLevel. Levels this build can't do fall back to the one below.
+static const RasterizeFunc rasterizeFuncs[SIMD_LEVEL_COUNT] =
+{
+	rasterizeScalar,
+#if HAVE_X86_SIMD
+	rasterizeTriangleWith<rasterizeRowSSE2<false, false>, rasterizeRowSSE2<false, true>, false>,
+	rasterizeTriangleWith<rasterizeRowAVX2<false, false>, rasterizeRowAVX2<false, true>, false>,
+	rasterizeTriangleWith<rasterizeRowAVX512<false, false>, rasterizeRowAVX512<false, true>, false>
+#else
+	rasterizeScalar,
+	rasterizeScalar,
+	rasterizeScalar
+#endif
+};
+
+static const RasterizeFunc rasterizeVisibilityFuncs[SIMD_LEVEL_COUNT] =
+{
+	rasterizeTriangleWith<rasterizeRowVisibilityScalar, rasterizeRowVisibilityScalar, true>,
+#if HAVE_X86_SIMD
+	rasterizeTriangleWith<rasterizeRowSSE2<true, false>, rasterizeRowSSE2<true, false>, true>,
+	rasterizeTriangleWith<rasterizeRowAVX2<true, false>, rasterizeRowAVX2<true, false>, true>,
+	rasterizeTriangleWith<rasterizeRowAVX512<true, false>, rasterizeRowAVX512<true, false>, true>
+#else
+	rasterizeTriangleWith<rasterizeRowVisibilityScalar, rasterizeRowVisibilityScalar, true>,
+	rasterizeTriangleWith<rasterizeRowVisibilityScalar, rasterizeRowVisibilityScalar, true>,
+	rasterizeTriangleWith<rasterizeRowVisibilityScalar, rasterizeRowVisibilityScalar, true>
+#endif
+};
+
+typedef int (*RasterizeMSAAFunc)(const Triangle &t, unsigned int id, int clipX0, int clipY0, int clipX1, int clipY1,
+	const PixelPlanes &p, const SamplePattern &pattern);
+
+static const RasterizeMSAAFunc rasterizeMSAAFuncs[SIMD_LEVEL_COUNT] =
+{
+	rasterizeMSAAScalar,
+#if HAVE_X86_SIMD
+	rasterizeTriangleMSAAWith<rasterizeRowSSE2<false, false>, rasterizeRowSSE2<false, true>, false>,
+	rasterizeTriangleMSAAWith<rasterizeRowAVX2<false, false>, rasterizeRowAVX2<false, true>, false>,
+	rasterizeTriangleMSAAWith<rasterizeRowAVX512<false, false>, rasterizeRowAVX512<false, true>, false>
+#else
+	rasterizeMSAAScalar,
+	rasterizeMSAAScalar,
+	rasterizeMSAAScalar
+#endif
+};
+
+static const RasterizeMSAAFunc rasterizeVisibilityMSAAFuncs[SIMD_LEVEL_COUNT] =
+{
+	rasterizeTriangleMSAAWith<rasterizeRowVisibilityScalar, rasterizeRowVisibilityScalar, true>,
+#if HAVE_X86_SIMD
+	rasterizeTriangleMSAAWith<rasterizeRowSSE2<true, false>, rasterizeRowSSE2<true, false>, true>,
+	rasterizeTriangleMSAAWith<rasterizeRowAVX2<true, false>, rasterizeRowAVX2<true, false>, true>,
+	rasterizeTriangleMSAAWith<rasterizeRowAVX512<true, false>, rasterizeRowAVX512<true, false>, true>
+#else
+	rasterizeTriangleMSAAWith<rasterizeRowVisibilityScalar, rasterizeRowVisibilityScalar, true>,
+	rasterizeTriangleMSAAWith<rasterizeRowVisibilityScalar, rasterizeRowVisibilityScalar, true>,
+	rasterizeTriangleMSAAWith<rasterizeRowVisibilityScalar, rasterizeRowVisibilityScalar, true>
+#endif
+};
+
+static const char *simdLevelNames[SIMD_LEVEL_COUNT] = {"scalar", "sse2", "avx2", "avx512"};
+
+SimdLevel detectSimdLevel()
+{
+#if HAVE_X86_SIMD
+	// __builtin_cpu_supports reads CPUID once at startup, and also checks
+	// that the OS saves the AVX / AVX-512 registers (XGETBV).
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f"))
+		return SIMD_AVX512;
+	if (__builtin_cpu_supports("avx2"))
+		return SIMD_AVX2;
+	if (__builtin_cpu_supports("sse2"))
+		return SIMD_SSE2;
+#endif
+	return SIMD_SCALAR;
+}
+
+static SimdLevel currentLevel = detectSimdLevel();
+static RasterizeFunc currentFunc = rasterizeFuncs[currentLevel];
+static RasterizeMSAAFunc currentMSAAFunc = rasterizeMSAAFuncs[currentLevel];
+static RasterizeFunc currentVisibilityFunc = rasterizeVisibilityFuncs[currentLevel];
+static RasterizeMSAAFunc currentVisibilityMSAAFunc = rasterizeVisibilityMSAAFuncs[currentLevel];
+
+SimdLevel getSimdLevel()
+{
+	return currentLevel;
+}
+
+void setSimdLevel(SimdLevel level)
+{
+	SimdLevel supported = detectSimdLevel();
+	if (level > supported)
+		level = supported;
+
+	currentLevel = level;
+	currentFunc = rasterizeFuncs[level];
+	currentMSAAFunc = rasterizeMSAAFuncs[level];
+	currentVisibilityFunc = rasterizeVisibilityFuncs[level];
+	currentVisibilityMSAAFunc = rasterizeVisibilityMSAAFuncs[level];
+}
+
+const char *simdLevelName(SimdLevel level)
+{
+	return simdLevelNames[level];
+}
+
+bool parseSimdLevel(const char *name, SimdLevel &level)
+{
+	for (int i = 0; i < SIMD_LEVEL_COUNT; ++i)
+	{
+		if (strcmp(name, simdLevelNames[i]) == 0)
+		{
+			level = (SimdLevel)i;
+			return true;
+		}
+	}
+	return false;
+}
+
+int rasterizeTriangleSIMD(const Triangle &t, int clipX0, int clipY0, int clipX1, int clipY1,
+	const PixelPlanes &p)
+{
+	return currentFunc(t, 0, clipX0, clipY0, clipX1, clipY1, p);
+}
+
+int rasterizeTriangleMSAASIMD(const Triangle &t, int clipX0, int clipY0, int clipX1, int clipY1,
+	const PixelPlanes &p, const SamplePattern &pattern)
+{
+	return currentMSAAFunc(t, 0, clipX0, clipY0, clipX1, clipY1, p, pattern);
+}
+
+int rasterizeTriangleVisibilitySIMD(const Triangle &t, unsigned int id, int clipX0, int clipY0, int clipX1, int clipY1,
+	const PixelPlanes &p)
+{
+	return currentVisibilityFunc(t, id, clipX0, clipY0, clipX1, clipY1, p);
+}
+
+int rasterizeTriangleVisibilityMSAASIMD(const Triangle &t, unsigned int id, int clipX0, int clipY0, int clipX1,
+	int clipY1, const PixelPlanes &p, const SamplePattern &pattern)
+{
+	return currentVisibilityMSAAFunc(t, id, clipX0, clipY0, clipX1, clipY1, p, pattern);
+}
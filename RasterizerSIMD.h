@@ -0,0 +1,54 @@
+#ifndef RASTERIZER_SIMD_H
+#define RASTERIZER_SIMD_H
+
+#include "Rasterizer.h"
+
+// Vectorized versions of rasterizeTriangleClipped and rasterizeTriangleMSAA
+// (see Rasterizer.h) for the CPU. Coverage is worked out a row at a time
+// as in the scalar version; the depth test, color interpolation and the
+// stores are then done for 4, 8 or 16 pixels (or samples) of the row at once,
+// and the pixels written and the values written are exactly those of the
+// scalar version.
+//
+// The kernel is picked at run time from what CPUID reports, so one binary
+// runs everywhere and uses AVX-512 where it is available.
+
+enum SimdLevel
+{
+	SIMD_SCALAR,	// rasterizeTriangleClipped itself
+	SIMD_SSE2,		// 4 pixels at a time
+	SIMD_AVX2,		// 8 pixels at a time
+	SIMD_AVX512,	// 16 pixels at a time
+	SIMD_LEVEL_COUNT
+};
+
+// The widest level this CPU and OS support
+SimdLevel detectSimdLevel();
+
+// The level rasterizeTriangleSIMD uses. It starts out as detectSimdLevel();
+// setting a level the CPU doesn't support selects the widest one it does.
+// Not thread safe: set it before rendering.
+SimdLevel getSimdLevel();
+void setSimdLevel(SimdLevel level);
+
+// "scalar", "sse2", "avx2" or "avx512"
+const char *simdLevelName(SimdLevel level);
+bool parseSimdLevel(const char *name, SimdLevel &level);
+
+// Same arguments and result as rasterizeTriangleClipped
+int rasterizeTriangleSIMD(const Triangle &t, int clipX0, int clipY0, int clipX1, int clipY1,
+	const PixelPlanes &p);
+
+// Same arguments and result as rasterizeTriangleMSAA
+int rasterizeTriangleMSAASIMD(const Triangle &t, int clipX0, int clipY0, int clipX1, int clipY1,
+	const PixelPlanes &p, const SamplePattern &pattern);
+
+// Visibility buffer versions: the same pixels (samples) pass the depth test,
+// but instead of colors they get id, stored bit for bit in p.r (see
+// VISIBILITY_NONE). p.g and p.b aren't touched.
+int rasterizeTriangleVisibilitySIMD(const Triangle &t, unsigned int id, int clipX0, int clipY0, int clipX1, int clipY1,
+	const PixelPlanes &p);
+int rasterizeTriangleVisibilityMSAASIMD(const Triangle &t, unsigned int id, int clipX0, int clipY0, int clipX1,
+	int clipY1, const PixelPlanes &p, const SamplePattern &pattern);
+
+#endif
@@ -0,0 +1,874 @@
+#include "RenderServer.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <math.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <exception>
+#include <list>
+#include <unordered_map>
+
+#include "BasicModel.h"
+#include "Blur.h"
+#include "Renderer.h"
+
+using namespace std;
+
+// Deepest nesting of arrays and objects a job may have
+#define JSON_MAX_DEPTH 16
+
+// A parsed JSON value
+struct JsonValue
+{
+	enum Type { NUL, BOOLEAN, NUMBER, STRING, ARRAY, OBJECT };
+
+	Type type;
+	bool boolean;
+	double number;
+	string text;
+	vector<JsonValue> items;
+	vector<pair<string, JsonValue> > members;
+
+	JsonValue() : type(NUL), boolean(false), number(0) {}
+
+	// The member called key of an object, or NULL
+	const JsonValue *get(const char *key) const
+	{
+		for (size_t i = 0; i < members.size(); ++i)
+		{
+			if (members[i].first == key)
+				return &members[i].second;
+		}
+		return NULL;
+	}
+};
+
+static void skipSpace(const char *&p)
+{
+	while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')
+		++p;
+}
+
+static void putUtf8(unsigned int code, string &out)
+{
+	if (code < 0x80)
+		out += (char)code;
+	else if (code < 0x800)
+	{
+		out += (char)(0xc0 | code >> 6);
+		out += (char)(0x80 | (code & 0x3f));
+	}
+	else if (code < 0x10000)
+	{
+		out += (char)(0xe0 | code >> 12);
+		out += (char)(0x80 | (code >> 6 & 0x3f));
+		out += (char)(0x80 | (code & 0x3f));
+	}
+	else
+	{
+		out += (char)(0xf0 | code >> 18);
+		out += (char)(0x80 | (code >> 12 & 0x3f));
+		out += (char)(0x80 | (code >> 6 & 0x3f));
+		out += (char)(0x80 | (code & 0x3f));
+	}
+}
+
+static bool parseHex4(const char *&p, unsigned int &code)
+{
+	code = 0;
+	for (int i = 0; i < 4; ++i, ++p)
+	{
+		char c = *p;
+		int digit = c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 :
+			c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1;
+		if (digit < 0)
+			return false;
+		code = code << 4 | digit;
+	}
+	return true;
+}
+
+// p is just past the opening quote
+static bool parseJsonString(const char *&p, string &out)
+{
+	out.clear();
+	while (*p != '"')
+	{
+		if ((unsigned char)*p < 0x20)
+			return false;
+		if (*p != '\\')
+		{
+			out += *p++;
+			continue;
+		}
+
+		++p;
+		char c = *p++;
+		switch (c)
+		{
+		case '"': case '\\': case '/': out += c; break;
+		case 'b': out += '\b'; break;
+		case 'f': out += '\f'; break;
+		case 'n': out += '\n'; break;
+		case 'r': out += '\r'; break;
+		case 't': out += '\t'; break;
+		case 'u':
+		{
+			unsigned int code;
+			if (!parseHex4(p, code))
+				return false;
+			// a surrogate pair is one character
+			unsigned int low;
+			if (code >= 0xd800 && code < 0xdc00 && p[0] == '\\' && p[1] == 'u')
+			{
+				p += 2;
+				if (!parseHex4(p, low) || low < 0xdc00 || low >= 0xe000)
+					return false;
+				code = 0x10000 + ((code - 0xd800) << 10) + (low - 0xdc00);
+			}
+			putUtf8(code, out);
+			break;
+		}
+		default:
+			return false;
+		}
+	}
+	++p;
+	return true;
+}
+
+static bool parseJson(const char *&p, JsonValue &value, int depth)
+{
+	skipSpace(p);
+	if (depth > JSON_MAX_DEPTH)
+		return false;
+
+	if (*p == '{')
+	{
+		value.type = JsonValue::OBJECT;
+		++p;
+		skipSpace(p);
+		if (*p == '}')
+		{
+			++p;
+			return true;
+		}
+		while (true)
+		{
+			skipSpace(p);
+			string key;
+			if (*p++ != '"' || !parseJsonString(p, key))
+				return false;
+			skipSpace(p);
+			if (*p++ != ':')
+				return false;
+			value.members.push_back(make_pair(key, JsonValue()));
+			if (!parseJson(p, value.members.back().second, depth + 1))
+				return false;
+			skipSpace(p);
+			if (*p == '}')
+			{
+				++p;
+				return true;
+			}
+			if (*p++ != ',')
+				return false;
+		}
+	}
+
+	if (*p == '[')
+	{
+		value.type = JsonValue::ARRAY;
+		++p;
+		skipSpace(p);
+		if (*p == ']')
+		{
+			++p;
+			return true;
+		}
+		while (true)
+		{
+			value.items.push_back(JsonValue());
+			if (!parseJson(p, value.items.back(), depth + 1))
+				return false;
+			skipSpace(p);
+			if (*p == ']')
+			{
+				++p;
+				return true;
+			}
+			if (*p++ != ',')
+				return false;
+		}
+	}
+
+	if (*p == '"')
+	{
+		value.type = JsonValue::STRING;
+		++p;
+		return parseJsonString(p, value.text);
+	}
+
+	if (strncmp(p, "true", 4) == 0 || strncmp(p, "false", 5) == 0)
+	{
+		value.type = JsonValue::BOOLEAN;
+		value.boolean = *p == 't';
+		p += value.boolean ? 4 : 5;
+		return true;
+	}
+
+	if (strncmp(p, "null", 4) == 0)
+	{
+		value.type = JsonValue::NUL;
+		p += 4;
+		return true;
+	}
+
+	char *end;
+	value.type = JsonValue::NUMBER;
+	value.number = strtod(p, &end);
+	if (end == p || !isfinite(value.number))
+		return false;
+	p = end;
+	return true;
+}
+
+static void putJsonString(const string &s, string &out)
+{
+	out += '"';
+	for (size_t i = 0; i < s.size(); ++i)
+	{
+		unsigned char c = s[i];
+		if (c == '"' || c == '\\')
+		{
+			out += '\\';
+			out += c;
+		}
+		else if (c == '\n')
+			out += "\\n";
+		else if (c < 0x20)
+		{
+			char escaped[8];
+			snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+			out += escaped;
+		}
+		else
+			out += c;
+	}
+	out += '"';
+}
+
+static void putJson(const JsonValue &value, string &out)
+{
+	char number[32];
+	switch (value.type)
+	{
+	case JsonValue::NUL: out += "null"; break;
+	case JsonValue::BOOLEAN: out += value.boolean ? "true" : "false"; break;
+	case JsonValue::NUMBER:
+		snprintf(number, sizeof(number), "%.17g", value.number);
+		out += number;
+		break;
+	case JsonValue::STRING: putJsonString(value.text, out); break;
+	case JsonValue::ARRAY:
+		out += '[';
+		for (size_t i = 0; i < value.items.size(); ++i)
+		{
+			if (i > 0)
+				out += ", ";
+			putJson(value.items[i], out);
+		}
+		out += ']';
+		break;
+	case JsonValue::OBJECT:
+		out += '{';
+		for (size_t i = 0; i < value.members.size(); ++i)
+		{
+			if (i > 0)
+				out += ", ";
+			putJsonString(value.members[i].first, out);
+			out += ": ";
+			putJson(value.members[i].second, out);
+		}
+		out += '}';
+		break;
+	}
+}
+
+static void putBase64(const vector<unsigned char> &data, string &out)
+{
+	static const char digits[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+	out.reserve(out.size() + (data.size() + 2) / 3 * 4);
+	size_t i = 0;
+	for (; i + 3 <= data.size(); i += 3)
+	{
+		unsigned int v = data[i] << 16 | data[i + 1] << 8 | data[i + 2];
+		out += digits[v >> 18];
+		out += digits[v >> 12 & 63];
+		out += digits[v >> 6 & 63];
+		out += digits[v & 63];
+	}
+	if (i < data.size())
+	{
+		bool two = i + 1 < data.size();
+		unsigned int v = data[i] << 16 | (two ? data[i + 1] << 8 : 0);
+		out += digits[v >> 18];
+		out += digits[v >> 12 & 63];
+		out += two ? digits[v >> 6 & 63] : '=';
+		out += '=';
+	}
+}
+
+// A number member of a job, or fallback if it isn't there. Throws a string
+// if it isn't a number, or with integer, a whole one.
+static double jobNumber(const JsonValue &job, const char *key, double fallback, bool integer = false)
+{
+	const JsonValue *value = job.get(key);
+	if (value == NULL)
+		return fallback;
+	if (value->type != JsonValue::NUMBER ||
+		(integer && (value->number != floor(value->number) || fabs(value->number) > INT_MAX)))
+		throw(string("bad ") + key);
+	return value->number;
+}
+
+// A model loaded for jobs, and its shaded colors. Loaded by the first job
+// that needs it; others wait for that under mutex.
+struct CachedModel
+{
+	std::mutex mutex;
+	bool loaded;
+	string error;
+	struct timespec modified;	// of the file it was loaded from
+	off_t size;
+	unique_ptr<BasicModel> model;
+	vector<ShadedMesh> shaded[2];	// flat and smooth, unturned, as they are first needed
+	bool shadedReady[2];
+
+	CachedModel() : loaded(false), size(0)
+	{
+		shadedReady[0] = shadedReady[1] = false;
+	}
+};
+
+// Loaded models by path, the least recently used dropped first
+class ModelCache
+{
+public:
+	ModelCache(size_t capacity, int lodLevels) : capacity(capacity), lodLevels(lodLevels) {}
+
+	/*
+	* The model at path, loaded if it isn't or if the file has changed since
+	* it was.
+	*
+	* returns: the model, which stays loaded while it is held even if it is
+	*          dropped from the cache; throws a string if it can't be loaded
+	*/
+	shared_ptr<CachedModel> get(const string &path)
+	{
+		struct stat info;
+		if (stat(path.c_str(), &info) != 0)
+			throw(string("Could not open file ") + path);
+
+		shared_ptr<CachedModel> entry;
+		{
+			lock_guard<std::mutex> lock(mutex);
+			auto found = byPath.find(path);
+			if (found != byPath.end())
+			{
+				shared_ptr<CachedModel> cached = found->second->second;
+				if (cached->size == info.st_size && cached->modified.tv_sec == info.st_mtim.tv_sec &&
+					cached->modified.tv_nsec == info.st_mtim.tv_nsec)
+				{
+					recent.splice(recent.begin(), recent, found->second);
+					entry = cached;
+				}
+				else
+				{
+					recent.erase(found->second);
+					byPath.erase(found);
+				}
+			}
+
+			if (!entry)
+			{
+				entry = make_shared<CachedModel>();
+				entry->modified = info.st_mtim;
+				entry->size = info.st_size;
+				recent.push_front(make_pair(path, entry));
+				byPath[path] = recent.begin();
+				while (recent.size() > capacity)
+				{
+					byPath.erase(recent.back().first);
+					recent.pop_back();
+				}
+			}
+		}
+
+		lock_guard<std::mutex> lock(entry->mutex);
+		if (!entry->loaded && entry->error.empty())
+		{
+			try
+			{
+				entry->model.reset(new BasicModel(path));
+				if (lodLevels > 0)
+					entry->model->setLOD(lodLevels);
+				entry->loaded = true;
+			}
+			catch (const char *message)
+			{
+				entry->error = string(message) + path;
+			}
+		}
+
+		if (!entry->loaded)
+		{
+			// let the next job try again
+			lock_guard<std::mutex> cacheLock(mutex);
+			auto found = byPath.find(path);
+			if (found != byPath.end() && found->second->second == entry)
+			{
+				recent.erase(found->second);
+				byPath.erase(found);
+			}
+			throw(entry->error);
+		}
+		return entry;
+	}
+
+private:
+	typedef list<pair<string, shared_ptr<CachedModel> > > RecentList;
+
+	std::mutex mutex;
+	size_t capacity;
+	int lodLevels;
+	RecentList recent;		// most recently used first
+	unordered_map<string, RecentList::iterator> byPath;
+};
+
+// Where the answers to one stream's jobs go
+class RenderConnection
+{
+public:
+	RenderConnection(int out) : out(out), pending(0), broken(false) {}
+
+	void answer(const string &line)
+	{
+		lock_guard<std::mutex> lock(mutex);
+		size_t done = 0;
+		while (!broken && done < line.size())
+		{
+			ssize_t n = ::write(out, line.data() + done, line.size() - done);
+			if (n < 0 && errno == EINTR)
+				continue;
+			// the client has gone; its other jobs are still drawn
+			broken = n <= 0;
+			done += n > 0 ? n : 0;
+		}
+	}
+
+	void started()
+	{
+		lock_guard<std::mutex> lock(mutex);
+		++pending;
+	}
+
+	void finished()
+	{
+		lock_guard<std::mutex> lock(mutex);
+		if (--pending == 0)
+			idle.notify_all();
+	}
+
+	// Wait until every started job has finished
+	void waitIdle()
+	{
+		unique_lock<std::mutex> lock(mutex);
+		idle.wait(lock, [this] { return pending == 0; });
+	}
+
+private:
+	int out;
+	std::mutex mutex;
+	std::condition_variable idle;
+	int pending;
+	bool broken;
+};
+
+RenderServer::RenderServer(const RenderServerSettings &settings) :
+	settings(settings), models(new ModelCache(max((size_t)1, settings.cachedModels), settings.lodLevels)),
+	stopping(false)
+{
+	// a client that goes away mustn't take the server with it
+	signal(SIGPIPE, SIG_IGN);
+
+	for (int i = 0; i < max(1, settings.workers); ++i)
+		workers.push_back(thread(&RenderServer::workerLoop, this));
+}
+
+RenderServer::~RenderServer()
+{
+	{
+		lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	wake.notify_all();
+	for (size_t i = 0; i < workers.size(); ++i)
+		workers[i].join();
+}
+
+void RenderServer::serveStream(int in, int out)
+{
+	shared_ptr<RenderConnection> connection = make_shared<RenderConnection>(out);
+	string line;
+	bool tooLong = false;
+	char buffer[65536];
+
+	auto submit = [&]()
+	{
+		if (tooLong)
+			connection->answer("{\"id\": null, \"ok\": false, \"error\": \"line too long\"}\n");
+		else if (line.find_first_not_of(" \t\r") != string::npos)
+		{
+			connection->started();
+			lock_guard<std::mutex> lock(mutex);
+			Job job = {connection, line};
+			jobs.push_back(job);
+			wake.notify_one();
+		}
+		line.clear();
+		tooLong = false;
+	};
+
+	while (true)
+	{
+		ssize_t n = read(in, buffer, sizeof(buffer));
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+
+		for (ssize_t i = 0; i < n; ++i)
+		{
+			if (buffer[i] == '\n')
+				submit();
+			else if (line.size() < RENDER_SERVER_MAX_LINE)
+				line += buffer[i];
+			else
+				tooLong = true;
+		}
+	}
+	submit();
+
+	connection->waitIdle();
+}
+
+bool RenderServer::serveSocket(const char *path)
+{
+	struct sockaddr_un address;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(address.sun_path))
+	{
+		printf("Socket path too long: %s\n", path);
+		return false;
+	}
+	strcpy(address.sun_path, path);
+
+	int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listener < 0)
+	{
+		perror("socket");
+		return false;
+	}
+
+	// a socket left behind by an earlier server is in the way
+	struct stat info;
+	if (stat(path, &info) == 0 && S_ISSOCK(info.st_mode))
+		unlink(path);
+
+	if (bind(listener, (struct sockaddr *)&address, sizeof(address)) != 0 || listen(listener, 16) != 0)
+	{
+		perror(path);
+		close(listener);
+		return false;
+	}
+
+	while (true)
+	{
+		int client = accept(listener, NULL, NULL);
+		if (client < 0)
+		{
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			perror("accept");
+			close(listener);
+			return false;
+		}
+
+		thread([this, client]()
+		{
+			serveStream(client, client);
+			close(client);
+		}).detach();
+	}
+}
+
+void RenderServer::workerLoop()
+{
+	ThreadPool pool(settings.threadsPerWorker);
+	vector<float> planes[3];
+	vector<unsigned char> file;
+
+	while (true)
+	{
+		Job job;
+		{
+			unique_lock<std::mutex> lock(mutex);
+			wake.wait(lock, [this] { return stopping || !jobs.empty(); });
+			if (jobs.empty())
+				return;
+			job = jobs.front();
+			jobs.pop_front();
+		}
+
+		job.connection->answer(runJob(job.line, pool, planes, file));
+		job.connection->finished();
+	}
+}
+
+/*
+* Draw one job (see RenderServer) and write or encode its image.
+*
+* line: The job
+* pool: Threads to draw and encode on
+* planes: Color planes to read the image into, kept from job to job
+* file: Buffer to encode the image into, likewise
+*
+* returns: the answer, a line of JSON
+*/
+string RenderServer::runJob(const string &line, ThreadPool &pool, vector<float> *planes, vector<unsigned char> &file)
+{
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	JsonValue job;
+	string answer = "{\"id\": ";
+
+	const char *p = line.c_str();
+	bool parsed = parseJson(p, job, 0);
+	skipSpace(p);
+	const JsonValue *id = parsed ? job.get("id") : NULL;
+	if (id != NULL)
+		putJson(*id, answer);
+	else
+		answer += "null";
+
+	try
+	{
+		if (!parsed || *p != '\0' || job.type != JsonValue::OBJECT)
+			throw("not a JSON object");
+
+		const JsonValue *modelPath = job.get("model");
+		if (modelPath == NULL || modelPath->type != JsonValue::STRING)
+			throw("no model");
+		const JsonValue *output = job.get("output");
+		if (output != NULL && output->type != JsonValue::STRING)
+			throw("output is not a string");
+
+		Viewport viewport = settings.viewport;
+		viewport.width = jobNumber(job, "width", viewport.width, true);
+		viewport.height = jobNumber(job, "height", viewport.height, true);
+		if (viewport.width <= 0 || viewport.height <= 0 || viewport.width > 0xffff || viewport.height > 0xffff ||
+			(size_t)viewport.width * viewport.height > RENDER_SERVER_MAX_PIXELS)
+			throw("bad image size");
+
+		const JsonValue *window = job.get("window");
+		if (window != NULL)
+		{
+			if (window->type != JsonValue::ARRAY || window->items.size() != 4)
+				throw("bad window");
+			float *bounds[4] = {&viewport.xMinWorld, &viewport.xMaxWorld, &viewport.yMinWorld, &viewport.yMaxWorld};
+			for (int i = 0; i < 4; ++i)
+			{
+				if (window->items[i].type != JsonValue::NUMBER)
+					throw("bad window");
+				*bounds[i] = window->items[i].number;
+			}
+			if (!(viewport.xMaxWorld > viewport.xMinWorld && viewport.yMaxWorld > viewport.yMinWorld))
+				throw("bad window");
+		}
+
+		Camera camera = viewport.camera;
+		const JsonValue *cameraPoints = job.get("camera");
+		if (cameraPoints != NULL)
+		{
+			if (cameraPoints->type != JsonValue::ARRAY || cameraPoints->items.size() != 6)
+				throw("bad camera");
+			float *coords[6] = {&camera.eye.x, &camera.eye.y, &camera.eye.z, &camera.target.x, &camera.target.y,
+				&camera.target.z};
+			for (int i = 0; i < 6; ++i)
+			{
+				if (cameraPoints->items[i].type != JsonValue::NUMBER)
+					throw("bad camera");
+				*coords[i] = cameraPoints->items[i].number;
+			}
+		}
+		camera.fovY = jobNumber(job, "fov", camera.fovY);
+		camera.zNear = jobNumber(job, "near", camera.zNear);
+		camera.zFar = jobNumber(job, "far", camera.zFar);
+		if (!(camera.fovY > 0 && camera.fovY < 180 && camera.zNear > 0 && camera.zFar > camera.zNear))
+			throw("bad camera (0 < fov < 180 and 0 < near < far)");
+		if (cameraPoints != NULL || viewport.perspective)
+			setCamera(viewport, camera);
+
+		int samples = jobNumber(job, "samples", settings.samples, true);
+		if (makeSamplePattern(samples).count != samples)
+			throw("bad sample count (1, 2, 4 or 8)");
+
+		ImageFormat format = settings.imageFormat;
+		const JsonValue *formatName = job.get("format");
+		if (formatName != NULL && (formatName->type != JsonValue::STRING || !parseImageFormat(formatName->text.c_str(), format)))
+			throw("unknown image format");
+
+		bool smooth = settings.smooth;
+		const JsonValue *smoothValue = job.get("smooth");
+		if (smoothValue != NULL)
+		{
+			if (smoothValue->type != JsonValue::BOOLEAN)
+				throw("smooth is not true or false");
+			smooth = smoothValue->boolean;
+		}
+
+		int blurPasses = jobNumber(job, "blur", settings.blurPasses, true);
+		if (blurPasses < 0)
+			throw("bad blur");
+		float turn = jobNumber(job, "turn", 0) * M_PI / 180;
+
+		vector<Instance> instances;
+		const JsonValue *list = job.get("instances");
+		if (list != NULL)
+		{
+			if (list->type != JsonValue::ARRAY)
+				throw("bad instances");
+			for (size_t i = 0; i < list->items.size(); ++i)
+			{
+				const JsonValue &item = list->items[i];
+				if (item.type != JsonValue::ARRAY || item.items.size() != 3 || item.items[0].type != JsonValue::NUMBER ||
+					item.items[1].type != JsonValue::NUMBER || item.items[2].type != JsonValue::NUMBER)
+					throw("bad instances");
+				Instance instance = {(float)item.items[0].number, (float)item.items[1].number,
+					(float)item.items[2].number, turn};
+				instances.push_back(instance);
+			}
+		}
+		else
+		{
+			Instance instance = {0, 0, 10, turn};
+			instances.push_back(instance);
+		}
+
+		shared_ptr<CachedModel> entry = models->get(modelPath->text);
+		const BasicModel *model = entry->model.get();
+		Vector3 center = model->getCenter();
+
+		// unturned shading is kept with the model; the server's camera, if
+		// it has one, is the viewer it is shaded for
+		vector<ShadedMesh> turned;
+		const vector<ShadedMesh> *shaded = &turned;
+		Lighting lighting = settings.lighting;
+		if (viewport.perspective)
+			lighting.viewer = cameraViewer(viewport.camera);
+		if (turn == 0 && cameraPoints == NULL)
+		{
+			lock_guard<std::mutex> lock(entry->mutex);
+			if (!entry->shadedReady[smooth])
+			{
+				shadeModel(model, settings.lighting, smooth, entry->shaded[smooth]);
+				entry->shadedReady[smooth] = true;
+			}
+			shaded = &entry->shaded[smooth];
+		}
+		else
+			shadeModel(model, turnLighting(lighting, turn, center), smooth, turned);
+
+		// the framebuffer goes back to the pool as soon as the image is read,
+		// or if drawing throws
+		size_t pixels = (size_t)viewport.width * viewport.height;
+		{
+			PooledFramebuffer framebuffer(targets, viewport, settings.colorFormat, settings.depthFormat, samples);
+			if (viewport.perspective)
+				framebuffer->setDepthRange(viewport.minZ, 1 / viewport.camera.zNear);
+			else if (turn == 0)
+				framebuffer->setDepthRange(model->getMinZ(), model->getMaxZ());
+			else
+				framebuffer->setDepthRange(min(model->getMinZ(), center.z - model->getTurnRadius()),
+					max(model->getMaxZ(), center.z + model->getTurnRadius()));
+			drawInstances(model, *shaded, instances, *framebuffer, pool);
+
+			for (int i = 0; i < 3; ++i)
+				planes[i].resize(pixels);
+			framebuffer->readColor(planes[0].data(), planes[1].data(), planes[2].data());
+		}
+
+		if (blurPasses > 0)
+			blurImage(planes[0].data(), planes[1].data(), planes[2].data(), viewport.width, viewport.height,
+				blurPasses, pool);
+		encodeImage(planes[0].data(), planes[1].data(), planes[2].data(), viewport.width, viewport.height, format,
+			pool, file);
+
+		if (output != NULL && !writeFile(output->text.c_str(), file))
+			throw(string("could not write ") + output->text);
+
+		double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+		char numbers[64];
+		snprintf(numbers, sizeof(numbers), ", \"bytes\": %lu, \"ms\": %.1f", (unsigned long)file.size(), ms);
+		answer += ", \"ok\": true";
+		if (output != NULL)
+		{
+			answer += ", \"output\": ";
+			putJsonString(output->text, answer);
+			answer += numbers;
+		}
+		else
+		{
+			answer += ", \"format\": \"";
+			answer += imageFormatExtension(format);
+			answer += "\"";
+			answer += numbers;
+			answer += ", \"image\": \"";
+			putBase64(file, answer);
+			answer += "\"";
+		}
+	}
+	catch (const char *message)
+	{
+		answer += ", \"ok\": false, \"error\": ";
+		putJsonString(message, answer);
+	}
+	catch (const string &message)
+	{
+		answer += ", \"ok\": false, \"error\": ";
+		putJsonString(message, answer);
+	}
+	catch (const exception &e)
+	{
+		// out of memory, most likely, for a job too big; the server carries on
+		answer += ", \"ok\": false, \"error\": ";
+		putJsonString(e.what(), answer);
+	}
+	catch (...)
+	{
+		answer += ", \"ok\": false, \"error\": \"failed\"";
+	}
+
+	answer += "}\n";
+	return answer;
+}
@@ -0,0 +1,125 @@
+#ifndef RENDER_SERVER_H
+#define RENDER_SERVER_H
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Framebuffer.h"
+#include "ImageWriter.h"
+#include "Lighting.h"
+#include "RenderTargetPool.h"
+
+// A long-running renderer that takes jobs as JSON lines.
+//
+// Each line a client sends is one job, an object such as
+//
+//   {"id": 7, "model": "bunny.m", "output": "bunny.png", "width": 800,
+//    "height": 600, "samples": 4, "format": "png", "turn": 30,
+//    "instances": [[0, 0, 10]]}
+//
+// Every key but "model" is optional:
+//
+//   id                  anything; it is echoed in the answer
+//   model               path of the model file
+//   output              path to write the image to. Without it, the image
+//                       file is sent back in the answer, base64 encoded.
+//   width, height       image size in pixels
+//   window              [xmin, xmax, ymin, ymax], the part of the world shown
+//   samples             1, 2, 4 or 8 (multisample anti-aliasing)
+//   format              "tga", "tgarle", "qoi" or "png" (see parseImageFormat)
+//   smooth              true for smooth (Gouraud) shading
+//   blur                passes of the 9-tap blur (see Blur.h)
+//   turn                degrees about the vertical axis (see Instance)
+//   camera              [ex, ey, ez, tx, ty, tz]: look from eye e at target t
+//                       through a perspective camera rather than show window
+//   fov, near, far      the camera's vertical field of view in degrees and
+//                       the distances to its near and far planes
+//   instances           [[x, y, scale], ...]; one instance at [0, 0, 10]
+//                       if not given
+//
+// Anything a job doesn't give comes from RenderServerSettings, so from the
+// command line. Each job is answered with one line:
+//
+//   {"id": 7, "ok": true, "output": "bunny.png", "bytes": 51234, "ms": 21.5}
+//   {"id": 7, "ok": true, "format": "png", "bytes": 51234, "ms": 21.5, "image": "iVBORw0..."}
+//   {"id": 7, "ok": false, "error": "..."}
+//
+// Jobs are drawn by a fixed set of workers, each with a thread pool of its
+// own, so as many jobs as there are workers are drawn at once; answers come
+// in the order the jobs finish. Parsed models stay loaded, up to a number of
+// them, least recently used first out, keyed by path and reloaded when the
+// file changes; framebuffers are pooled (see RenderTargetPool). What a job
+// costs is then mostly drawing it.
+//
+// Clients are trusted: a job can read and write any file the server can.
+
+// Jobs bigger than this many pixels are refused
+#define RENDER_SERVER_MAX_PIXELS ((size_t)1 << 26)
+
+// Longest line a client may send
+#define RENDER_SERVER_MAX_LINE (1 << 20)
+
+typedef struct RenderServerSettings
+{
+	Viewport viewport;			// image size and part of the world shown
+	int samples;
+	ColorFormat colorFormat;
+	DepthFormat depthFormat;
+	ImageFormat imageFormat;
+	bool smooth;
+	int blurPasses;
+	int lodLevels;				// simplified levels to build of each model (see BasicModel::setLOD)
+	Lighting lighting;
+	int workers;				// jobs drawn at once
+	int threadsPerWorker;		// see ThreadPool
+	size_t cachedModels;		// models kept loaded
+} RenderServerSettings;
+
+class ModelCache;
+class RenderConnection;
+
+class RenderServer
+{
+public:
+	RenderServer(const RenderServerSettings &settings);
+	~RenderServer();
+
+	// Serve the jobs read from in, answering on out, until in ends. Returns
+	// when every job has been answered.
+	void serveStream(int in, int out);
+
+	// Listen on a Unix socket at path and serve each connection as a stream
+	// (see serveStream) on a thread of its own. Doesn't return unless the
+	// socket can't be made.
+	//
+	// returns: false, having printed why
+	bool serveSocket(const char *path);
+
+private:
+	struct Job
+	{
+		std::shared_ptr<RenderConnection> connection;
+		std::string line;
+	};
+
+	void workerLoop();
+	std::string runJob(const std::string &line, ThreadPool &pool, std::vector<float> *planes,
+		std::vector<unsigned char> &file);
+
+	RenderServerSettings settings;
+	std::unique_ptr<ModelCache> models;
+	RenderTargetPool targets;
+
+	std::mutex mutex;
+	std::condition_variable wake;
+	std::deque<Job> jobs;
+	bool stopping;
+	std::vector<std::thread> workers;
+};
+
+#endif
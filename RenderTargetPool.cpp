@@ -0,0 +1,81 @@
+#include "RenderTargetPool.h"
+
+using namespace std;
+
+RenderTargetPool::RenderTargetPool(size_t maxIdleBytes) :
+	idleBytes(0), maxIdleBytes(maxIdleBytes)
+{
+}
+
+RenderTargetPool::~RenderTargetPool()
+{
+	trim(0);
+}
+
+Framebuffer *RenderTargetPool::acquire(const Viewport &viewport, ColorFormat colorFormat, DepthFormat depthFormat,
+	int samples)
+{
+	Framebuffer *framebuffer = NULL;
+
+	{
+		lock_guard<std::mutex> lock(mutex);
+
+		// the most recently released match is the most likely to still be in cache
+		for (size_t i = idle.size(); i-- > 0; )
+		{
+			Framebuffer *f = idle[i];
+			if (f->getWidth() == viewport.width && f->getHeight() == viewport.height &&
+				f->getColorFormat() == colorFormat && f->getDepthFormat() == depthFormat &&
+				f->getSamples() == samples)
+			{
+				idle.erase(idle.begin() + i);
+				idleBytes -= f->sizeInBytes();
+				framebuffer = f;
+				break;
+			}
+		}
+	}
+
+	if (framebuffer == NULL)
+		return new Framebuffer(viewport, colorFormat, depthFormat, samples);
+
+	framebuffer->setViewport(viewport);
+	framebuffer->setDepthRange(-1, 1);
+	framebuffer->clear();
+	return framebuffer;
+}
+
+void RenderTargetPool::release(Framebuffer *framebuffer)
+{
+	if (framebuffer == NULL)
+		return;
+
+	lock_guard<std::mutex> lock(mutex);
+	idle.push_back(framebuffer);
+	idleBytes += framebuffer->sizeInBytes();
+	trimLocked(maxIdleBytes);
+}
+
+void RenderTargetPool::trim(size_t maxIdleBytes)
+{
+	lock_guard<std::mutex> lock(mutex);
+	trimLocked(maxIdleBytes);
+}
+
+void RenderTargetPool::trimLocked(size_t maxIdleBytes)
+{
+	size_t freed = 0;
+	while (freed < idle.size() && idleBytes > maxIdleBytes)
+	{
+		idleBytes -= idle[freed]->sizeInBytes();
+		delete idle[freed];
+		++freed;
+	}
+	idle.erase(idle.begin(), idle.begin() + freed);
+}
+
+size_t RenderTargetPool::getIdleBytes()
+{
+	lock_guard<std::mutex> lock(mutex);
+	return idleBytes;
+}
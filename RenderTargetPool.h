@@ -0,0 +1,85 @@
+#ifndef RENDER_TARGET_POOL_H
+#define RENDER_TARGET_POOL_H
+
+#include <mutex>
+#include <vector>
+
+#include "Framebuffer.h"
+
+// Released framebuffers are kept up to this many bytes by default
+#define RENDER_TARGET_POOL_DEFAULT_BYTES ((size_t)1 << 30)
+
+// Framebuffers to render into, recycled between images.
+//
+// A 2000x2000 float framebuffer is 64 MB and an 8K one over 500 MB, so
+// allocating (and page faulting) a fresh one per image costs as much as
+// drawing a simple one. acquire() hands out a released framebuffer of the
+// same size, formats and sample count when there is one. Released
+// framebuffers beyond the byte budget are freed, least recently released
+// first, so a run that renders a few sizes over and over keeps one of each
+// and no more.
+//
+// All methods may be called from any thread.
+class RenderTargetPool
+{
+public:
+	RenderTargetPool(size_t maxIdleBytes = RENDER_TARGET_POOL_DEFAULT_BYTES);
+	~RenderTargetPool();
+
+	// A cleared framebuffer for viewport. Give it back with release().
+	Framebuffer *acquire(const Viewport &viewport, ColorFormat colorFormat = COLOR_RGB32F,
+		DepthFormat depthFormat = DEPTH_32F, int samples = 1);
+	void release(Framebuffer *framebuffer);
+
+	// Free released framebuffers until at most maxIdleBytes are kept
+	void trim(size_t maxIdleBytes);
+
+	size_t getIdleBytes();
+
+private:
+	// caller holds mutex
+	void trimLocked(size_t maxIdleBytes);
+
+	std::mutex mutex;
+	std::vector<Framebuffer *> idle;	// least recently released first
+	size_t idleBytes;
+	size_t maxIdleBytes;
+};
+
+// A framebuffer acquired from a RenderTargetPool and released to it when
+// this goes out of scope, exception or not
+class PooledFramebuffer
+{
+public:
+	PooledFramebuffer(RenderTargetPool &pool, const Viewport &viewport, ColorFormat colorFormat = COLOR_RGB32F,
+		DepthFormat depthFormat = DEPTH_32F, int samples = 1) :
+		pool(pool), framebuffer(pool.acquire(viewport, colorFormat, depthFormat, samples))
+	{
+	}
+
+	~PooledFramebuffer()
+	{
+		// if the pool has no room to keep it, it isn't kept
+		try
+		{
+			pool.release(framebuffer);
+		}
+		catch (...)
+		{
+			delete framebuffer;
+		}
+	}
+
+	Framebuffer *get() const { return framebuffer; }
+	Framebuffer *operator->() const { return framebuffer; }
+	Framebuffer &operator*() const { return *framebuffer; }
+
+private:
+	PooledFramebuffer(const PooledFramebuffer &);
+	PooledFramebuffer &operator=(const PooledFramebuffer &);
+
+	RenderTargetPool &pool;
+	Framebuffer *framebuffer;
+};
+
+#endif
@@ -0,0 +1,1019 @@
+#include "Renderer.h"
+
+#include <float.h>
+#include <limits.h>
+#include <math.h>
+#include <string.h>
+
+#include <algorithm>
+#include <mutex>
+
+#include "RasterizerSIMD.h"
+
+using namespace std;
+
+// Triangles are binned by 32 bit index (face + instance * faces), so
+// drawMesh draws no more than this many at a time
+#define MAX_DRAW_TRIANGLES UINT_MAX
+
+static bool hierarchicalZEnabled = false;
+
+bool getHierarchicalZ()
+{
+	return hierarchicalZEnabled;
+}
+
+void setHierarchicalZ(bool enabled)
+{
+	hierarchicalZEnabled = enabled;
+}
+
+static bool frontToBack = false;
+
+bool getFrontToBack()
+{
+	return frontToBack;
+}
+
+void setFrontToBack(bool enabled)
+{
+	frontToBack = enabled;
+}
+
+static bool visibilityBufferEnabled = false;
+
+bool getVisibilityBuffer()
+{
+	return visibilityBufferEnabled;
+}
+
+void setVisibilityBuffer(bool enabled)
+{
+	visibilityBufferEnabled = enabled;
+}
+
+static FaceCulling faceCulling = CULL_BACK;
+static const char *faceCullingNames[] = {"none", "back", "front"};
+
+FaceCulling getFaceCulling()
+{
+	return faceCulling;
+}
+
+void setFaceCulling(FaceCulling culling)
+{
+	faceCulling = culling;
+}
+
+static float lodThreshold = 1;
+
+float getLODThreshold()
+{
+	return lodThreshold;
+}
+
+void setLODThreshold(float pixels)
+{
+	lodThreshold = pixels;
+}
+
+bool parseFaceCulling(const char *name, FaceCulling &culling)
+{
+	for (int i = 0; i <= CULL_FRONT; ++i)
+	{
+		if (strcmp(name, faceCullingNames[i]) == 0)
+		{
+			culling = (FaceCulling)i;
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+* Calculates colors (RGB) for some faces of a mesh (flat shading). All three
+* vertices of a face share its normal and color, so each face is shaded
+* once, at its center.
+*
+* mesh: The mesh. Its face normals and face colors (diffuse reflectance) are used.
+* lighting: The lights (see lightPoints)
+* count: Number of faces
+* faces: The faces, or NULL for the first count faces
+* r, g, b: Receive the faces' colors, in the same order
+*/
+static void lightFaces(const Mesh &mesh, const Lighting &lighting, int count, const unsigned int *faces,
+	float *r, float *g, float *b)
+{
+	// the faces' centers, and their normals if they are picked out
+	vector<float> cx(count);
+	vector<float> cy(count);
+	vector<float> cz(count);
+	vector<float> nx(faces != NULL ? count : 0);
+	vector<float> ny(faces != NULL ? count : 0);
+	vector<float> nz(faces != NULL ? count : 0);
+	const unsigned int *indices = mesh.indices.data();
+	for (int i = 0; i < count; ++i)
+	{
+		unsigned int face = faces != NULL ? faces[i] : i;
+		unsigned int i1 = indices[3*face];
+		unsigned int i2 = indices[3*face + 1];
+		unsigned int i3 = indices[3*face + 2];
+		cx[i] = (mesh.x[i1] + mesh.x[i2] + mesh.x[i3]) / 3;
+		cy[i] = (mesh.y[i1] + mesh.y[i2] + mesh.y[i3]) / 3;
+		cz[i] = (mesh.z[i1] + mesh.z[i2] + mesh.z[i3]) / 3;
+		if (faces != NULL)
+		{
+			nx[i] = mesh.faceNx[face];
+			ny[i] = mesh.faceNy[face];
+			nz[i] = mesh.faceNz[face];
+		}
+	}
+
+	// the highlights, which the faces' colors don't tint
+	bool highlights = lighting.specular > 0;
+	vector<float> sr(highlights ? count : 0);
+	vector<float> sg(highlights ? count : 0);
+	vector<float> sb(highlights ? count : 0);
+	lightPoints(lighting, count, cx.data(), cy.data(), cz.data(),
+		faces != NULL ? nx.data() : mesh.faceNx.data(),
+		faces != NULL ? ny.data() : mesh.faceNy.data(),
+		faces != NULL ? nz.data() : mesh.faceNz.data(), r, g, b,
+		highlights ? sr.data() : NULL, highlights ? sg.data() : NULL, highlights ? sb.data() : NULL);
+
+	const float *red = mesh.red.data();
+	const float *green = mesh.green.data();
+	const float *blue = mesh.blue.data();
+	for (int i = 0; i < count; ++i)
+	{
+		unsigned int face = faces != NULL ? faces[i] : i;
+		r[i] = red[face] * r[i];
+		g[i] = green[face] * g[i];
+		b[i] = blue[face] * b[i];
+	}
+	if (!highlights)
+		return;
+	for (int i = 0; i < count; ++i)
+	{
+		r[i] += sr[i];
+		g[i] += sg[i];
+		b[i] += sb[i];
+	}
+}
+
+/*
+* Calculates colors (RGB) for every face of a mesh (flat shading, see
+* lightFaces).
+*
+* mesh: The mesh. Its face normals and face colors (diffuse reflectance) are used.
+* lighting: The lights (see lightPoints)
+* shaded: Receives the faces' colors
+*/
+void shadeFaces(const Mesh &mesh, const Lighting &lighting, ShadedMesh &shaded)
+{
+	int faceCount = mesh.faceCount();
+	shaded.red.resize(faceCount);
+	shaded.green.resize(faceCount);
+	shaded.blue.resize(faceCount);
+	lightFaces(mesh, lighting, faceCount, NULL, shaded.red.data(), shaded.green.data(), shaded.blue.data());
+
+	shaded.vertexRed.clear();
+	shaded.vertexGreen.clear();
+	shaded.vertexBlue.clear();
+	shaded.vertexSpecularRed.clear();
+	shaded.vertexSpecularGreen.clear();
+	shaded.vertexSpecularBlue.clear();
+	shaded.deferred = false;
+}
+
+/*
+* Leaves flat shading until a mesh is drawn through the visibility buffer
+* (see setVisibilityBuffer): only the faces left visible in each tile are
+* lit, by resolveVisibility. If the mesh is drawn without it after all, all
+* of its faces are lit then.
+*
+* lighting: The lights (see lightPoints)
+* shaded: Receives the lights, and no colors
+*/
+void deferFaces(const Lighting &lighting, ShadedMesh &shaded)
+{
+	shaded.red.clear();
+	shaded.green.clear();
+	shaded.blue.clear();
+	shaded.vertexRed.clear();
+	shaded.vertexGreen.clear();
+	shaded.vertexBlue.clear();
+	shaded.vertexSpecularRed.clear();
+	shaded.vertexSpecularGreen.clear();
+	shaded.vertexSpecularBlue.clear();
+	shaded.deferred = true;
+	shaded.lighting = lighting;
+}
+
+/*
+* Calculates the light reaching every vertex of a mesh, for smooth (Gouraud)
+* shading. A vertex's normal is the normalized sum of its faces' normals, so
+* each vertex is shaded once however many faces share it, and the faces'
+* colors are interpolated between their vertices.
+*
+* mesh: The mesh. Its vertex normals and face colors (diffuse reflectance) are used.
+* lighting: The lights (see lightPoints)
+* shaded: Receives the faces' colors and the vertices' light
+*/
+void shadeVertices(const Mesh &mesh, const Lighting &lighting, ShadedMesh &shaded)
+{
+	shaded.red = mesh.red;
+	shaded.green = mesh.green;
+	shaded.blue = mesh.blue;
+
+	int vertexCount = mesh.vertexCount();
+	shaded.vertexRed.resize(vertexCount);
+	shaded.vertexGreen.resize(vertexCount);
+	shaded.vertexBlue.resize(vertexCount);
+
+	vector<float> nx(vertexCount);
+	vector<float> ny(vertexCount);
+	vector<float> nz(vertexCount);
+	for (int i = 0; i < vertexCount; ++i)
+	{
+		float length = sqrtf(mesh.nx[i]*mesh.nx[i] + mesh.ny[i]*mesh.ny[i] + mesh.nz[i]*mesh.nz[i]);
+		float scale = length > 0 ? 1 / length : 0;
+		nx[i] = mesh.nx[i] * scale;
+		ny[i] = mesh.ny[i] * scale;
+		nz[i] = mesh.nz[i] * scale;
+	}
+
+	bool highlights = lighting.specular > 0;
+	shaded.vertexSpecularRed.resize(highlights ? vertexCount : 0);
+	shaded.vertexSpecularGreen.resize(highlights ? vertexCount : 0);
+	shaded.vertexSpecularBlue.resize(highlights ? vertexCount : 0);
+
+	lightPoints(lighting, vertexCount, mesh.x.data(), mesh.y.data(), mesh.z.data(),
+		nx.data(), ny.data(), nz.data(), shaded.vertexRed.data(), shaded.vertexGreen.data(), shaded.vertexBlue.data(),
+		highlights ? shaded.vertexSpecularRed.data() : NULL, highlights ? shaded.vertexSpecularGreen.data() : NULL,
+		highlights ? shaded.vertexSpecularBlue.data() : NULL);
+	shaded.deferred = false;
+}
+
+/*
+* Shade every level of detail of a model (see BasicModel::setLOD), flat
+* (shadeFaces, or deferFaces with setVisibilityBuffer) or smooth
+* (shadeVertices).
+*
+* model: The model
+* lighting: The lights (see lightPoints)
+* smooth: Shade each vertex rather than each face
+* shaded: Receives one ShadedMesh per level, full detail first
+*/
+void shadeModel(const BasicModel *model, const Lighting &lighting, bool smooth, vector<ShadedMesh> &shaded)
+{
+	shaded.resize(model->getLODCount());
+	for (int level = 0; level < model->getLODCount(); ++level)
+	{
+		if (smooth)
+			shadeVertices(model->getLOD(level), lighting, shaded[level]);
+		else if (visibilityBufferEnabled)
+			deferFaces(lighting, shaded[level]);
+		else
+			shadeFaces(model->getLOD(level), lighting, shaded[level]);
+	}
+}
+
+/*
+* Convert the provided vertices from world coordinates to screen coordinates,
+* in place. Z is left alone; it is used for depth interpolation and Z buffer tests.
+*
+* viewport: The screen and the part of the world it shows
+* count: Number of vertices
+* x, y: The vertex coordinates
+*/
+void convertVerticesTo2D(const Viewport &viewport, int count, float *x, float *y)
+{
+	for (int i = 0; i < count; ++i)
+		x[i] = worldToScreenX(viewport, x[i]);
+	for (int i = 0; i < count; ++i)
+		y[i] = worldToScreenY(viewport, y[i]);
+}
+
+/*
+* One pass of a least significant digit radix sort: stably order triangles
+* by the byte of their depth keys at shift.
+*/
+static void radixPass(const vector<unsigned int> &from, const unsigned short *keys, int shift,
+	vector<unsigned int> &to)
+{
+	size_t count[257] = {};
+	for (size_t i = 0; i < from.size(); ++i)
+		++count[((keys[from[i]] >> shift) & 0xff) + 1];
+	for (int digit = 0; digit < 256; ++digit)
+		count[digit + 1] += count[digit];
+
+	to.resize(from.size());
+	for (size_t i = 0; i < from.size(); ++i)
+		to[count[(keys[from[i]] >> shift) & 0xff]++] = from[i];
+}
+
+/*
+* Sort triangles by their 16 bit depth keys, low byte then high byte.
+* Triangles with the same key keep their order.
+*
+* triangles: The triangles to sort, in place
+* keys: Every triangle's key, indexed by triangle
+* scratch: Room for a copy of triangles
+*/
+static void sortByDepth(vector<unsigned int> &triangles, const unsigned short *keys, vector<unsigned int> &scratch)
+{
+	radixPass(triangles, keys, 0, scratch);
+	radixPass(scratch, keys, 8, triangles);
+}
+
+/*
+* The second pass of the visibility buffer: color every pixel (sample) of a
+* tile that a triangle was drawn to. With flat shading, the color is the
+* shaded color of the triangle's face; if the shading was deferred (see
+* deferFaces), the faces the tile shows are lit first, each once. With
+* smooth shading, the triangle is set up again and its colors evaluated at
+* the pixel, only when the ID changes from one pixel to the next. Pixels
+* nothing was drawn to keep theirs.
+*
+* ids: The tile's visibility planes, laid out like its color planes
+* faceMask: The bits of an ID that hold the face
+* mesh: The mesh drawn (to light its faces)
+* shaded: The mesh's shaded colors
+* triangleOf: Gives the screen space Triangle with an ID (smooth shading only)
+* tile: The tile to color
+*/
+template <typename TriangleOf>
+static void resolveVisibility(const float *ids, unsigned int faceMask, const Mesh &mesh, const ShadedMesh &shaded,
+	TriangleOf triangleOf, FramebufferTile &tile)
+{
+	bool smooth = !shaded.vertexRed.empty();
+	TriangleSetup setup;
+	unsigned int setupId = VISIBILITY_NONE;
+
+	const float *red = shaded.red.data();
+	const float *green = shaded.green.data();
+	const float *blue = shaded.blue.data();
+	static thread_local vector<unsigned int> faces;
+	static thread_local vector<float> faceRed;
+	static thread_local vector<float> faceGreen;
+	static thread_local vector<float> faceBlue;
+	if (shaded.deferred)
+	{
+		faces.clear();
+		unsigned int lastFace = VISIBILITY_NONE;
+		for (int k = 0; k < tile.samples; ++k)
+		{
+			for (int y = 0; y < tile.height; ++y)
+			{
+				size_t row = (size_t)k * FRAMEBUFFER_TILE_PIXELS + y * FRAMEBUFFER_TILE_SIZE;
+				for (int x = 0; x < tile.width; ++x)
+				{
+					unsigned int id;
+					memcpy(&id, &ids[row + x], sizeof(id));
+					if (id == VISIBILITY_NONE || (id & faceMask) == lastFace)
+						continue;
+					lastFace = id & faceMask;
+					faces.push_back(lastFace);
+				}
+			}
+		}
+		sort(faces.begin(), faces.end());
+		faces.erase(unique(faces.begin(), faces.end()), faces.end());
+
+		faceRed.resize(faces.size());
+		faceGreen.resize(faces.size());
+		faceBlue.resize(faces.size());
+		lightFaces(mesh, shaded.lighting, (int)faces.size(), faces.data(), faceRed.data(), faceGreen.data(), faceBlue.data());
+		red = faceRed.data();
+		green = faceGreen.data();
+		blue = faceBlue.data();
+	}
+	unsigned int foundFace = VISIBILITY_NONE;
+	unsigned int found = 0;
+
+	for (int k = 0; k < tile.samples; ++k)
+	{
+		for (int y = 0; y < tile.height; ++y)
+		{
+			size_t row = (size_t)k * FRAMEBUFFER_TILE_PIXELS + y * FRAMEBUFFER_TILE_SIZE;
+			for (int x = 0; x < tile.width; ++x)
+			{
+				unsigned int id;
+				memcpy(&id, &ids[row + x], sizeof(id));
+				if (id == VISIBILITY_NONE)
+					continue;
+
+				if (smooth)
+				{
+					if (id != setupId)
+					{
+						setupTriangle(triangleOf(id), setup);
+						setupId = id;
+					}
+					float attr[4];
+					evaluateAt(setup, tile.x0 + x, tile.y0 + y, attr);
+					pixelColor(setup, attr, tile.r[row + x], tile.g[row + x], tile.b[row + x]);
+					continue;
+				}
+
+				// the color of a deferred face is where it is among the tile's faces
+				unsigned int face = id & faceMask;
+				if (shaded.deferred)
+				{
+					if (face != foundFace)
+					{
+						found = lower_bound(faces.begin(), faces.end(), face) - faces.begin();
+						foundFace = face;
+					}
+					face = found;
+				}
+				tile.r[row + x] = red[face];
+				tile.g[row + x] = green[face];
+				tile.b[row + x] = blue[face];
+			}
+		}
+	}
+}
+
+/*
+* Where an instance puts the model in the world, as a matrix for a
+* perspective viewport: the model's center goes to (xOffset, yOffset, 0),
+* turned and scaled about it. Unlike BasicModel::transformMesh, which only
+* scales x and y for the window, the scale is the same along all three axes.
+*/
+static Matrix4 instanceMatrix(Vector3 center, const Instance &instance)
+{
+	Matrix4 m = translationMatrix(-center.x, -center.y, -center.z);
+	m = multiplyMatrices(rotationYMatrix(instance.turn), m);
+	m = multiplyMatrices(scaleMatrix(instance.scale, instance.scale, instance.scale), m);
+	return multiplyMatrices(translationMatrix(instance.xOffset, instance.yOffset, 0), m);
+}
+
+/*
+* Draw several instances of a model. Each instance only costs a vertex
+* transform plus rasterization; shading and the index buffer are shared.
+*
+* Through a perspective viewport (see setCamera), each instance's vertices
+* go to clip space in one SIMD batch (see transformPoints), with the
+* instance's matrix and the camera's in one, and are then projected to the
+* screen. Faces that cross the near plane are clipped as they are assembled
+* (see assembleClippedTriangles), into up to two triangles that are binned
+* and drawn together.
+*
+* Triangles that can't draw anything are culled first (see cullTriangle and
+* setFaceCulling). The screen is split into TILE_SIZE x TILE_SIZE tiles. Every
+* other triangle is binned into the tiles its bounding box, clamped to the
+* screen, touches, then the tiles are rasterized in parallel. A tile belongs
+* to a single thread, so z-tests and color writes need no locking, and each
+* tile sees its triangles in submission order, so the image is the same for
+* any number of threads. With setFrontToBack, each tile sorts its triangles
+* nearest first instead (by a key worked out while binning), which is just as
+* deterministic. A tile is unpacked from the framebuffer once, rasterized
+* while it sits in cache and packed back (see Framebuffer.h). Triangles are
+* rasterized with rasterizeTriangleSIMD, at the SIMD level set with
+* setSimdLevel, or with rasterizeTriangleMSAASIMD if the framebuffer is
+* multisampled. If setHierarchicalZ is on, each one is first tested against
+* the tile's HierarchicalZ, which skips triangles, or parts of them, hidden
+* behind what the tile already holds. With setVisibilityBuffer, they are
+* rasterized into the tile's visibility planes instead, and resolveVisibility
+* colors the tile afterwards.
+*
+* mesh: The mesh to draw: a level of detail of a model, or a chunk of one
+* center: The center of the model (see BasicModel::transformMesh)
+* shaded: The mesh's shaded colors (see shadeFaces, shadeVertices and deferFaces)
+* instances: Where to put each copy of the model
+* framebuffer: Where to draw. Its viewport maps the world to the screen.
+* pool: Threads to run on
+* stats: If not NULL, the counters are added to it
+*/
+static void drawMesh(const Mesh &mesh, Vector3 center, const ShadedMesh &shaded, const vector<Instance> &instances,
+	Framebuffer &framebuffer, ThreadPool &pool, RenderStats *stats)
+{
+	const Viewport &viewport = framebuffer.getViewport();
+	int vertexCount = mesh.vertexCount();
+	int faceCount = mesh.faceCount();
+	int instanceCount = instances.size();
+
+	// Too many triangles to index: draw the instances a group at a time,
+	// which each tile sees in the same order (with setFrontToBack, sorted
+	// within each group)
+	long long groupSize = faceCount > 0 ? MAX_DRAW_TRIANGLES / faceCount : instanceCount;
+	if (instanceCount > groupSize)
+	{
+		for (long long first = 0; first < instanceCount; first += groupSize)
+		{
+			vector<Instance> group(instances.begin() + first, instances.begin() + min(first + groupSize, (long long)instanceCount));
+			drawMesh(mesh, center, shaded, group, framebuffer, pool, stats);
+		}
+		return;
+	}
+
+	// screen space vertices for all instances, instance after instance
+	vector<float> x((size_t)vertexCount * instanceCount);
+	vector<float> y((size_t)vertexCount * instanceCount);
+	vector<float> z((size_t)vertexCount * instanceCount);
+
+	// and in clip space, through a perspective camera
+	bool perspective = viewport.perspective;
+	size_t clipCount = perspective ? (size_t)vertexCount * instanceCount : 0;
+	vector<float> clipX(clipCount);
+	vector<float> clipY(clipCount);
+	vector<float> clipZ(clipCount);
+	vector<float> clipW(clipCount);
+	Matrix4 camera = perspective ? cameraMatrix(viewport) : identityMatrix();
+
+	// Move each instance into place and convert its vertices to screen
+	// coordinates once. Faces share vertices through the index buffer.
+	pool.parallelFor(instanceCount, [&](int i)
+	{
+		size_t first = (size_t)i * vertexCount;
+		if (perspective)
+		{
+			Matrix4 m = multiplyMatrices(camera, instanceMatrix(center, instances[i]));
+			transformPoints(m, vertexCount, mesh.x.data(), mesh.y.data(), mesh.z.data(),
+				&clipX[first], &clipY[first], &clipZ[first], &clipW[first]);
+			projectPoints(vertexCount, viewport.width * 0.5f, viewport.height * 0.5f,
+				&clipX[first], &clipY[first], &clipW[first], &x[first], &y[first], &z[first]);
+			return;
+		}
+		BasicModel::transformMesh(mesh, center, instances[i], &x[first], &y[first], &z[first]);
+		convertVerticesTo2D(viewport, vertexCount, &x[first], &y[first]);
+	});
+
+	// With setVisibilityBuffer, a triangle's ID is its instance in the high
+	// bits and its face in the low faceBits. If there are too many of them
+	// to tell apart in 32 bits, they are drawn in color after all, and faces
+	// whose shading was deferred are all lit now.
+	int faceBits = 0;
+	while ((1LL << faceBits) < faceCount)
+		++faceBits;
+	bool deferred = visibilityBufferEnabled && ((long long)instanceCount << faceBits) <= VISIBILITY_NONE;
+	ShadedMesh lit;
+	const ShadedMesh *colors = &shaded;
+	if (shaded.deferred && !deferred)
+	{
+		shadeFaces(mesh, shaded.lighting, lit);
+		colors = &lit;
+	}
+
+	// Deferred faces have no colors yet; the visibility buffer doesn't use
+	// them, so the triangles carry the faces' own.
+	ScreenMesh screen;
+	screen.indices = mesh.indices.data();
+	bool unlit = colors->deferred;
+	screen.red = unlit ? mesh.red.data() : colors->red.data();
+	screen.green = unlit ? mesh.green.data() : colors->green.data();
+	screen.blue = unlit ? mesh.blue.data() : colors->blue.data();
+	bool smooth = !shaded.vertexRed.empty();
+	screen.vertexRed = smooth ? shaded.vertexRed.data() : NULL;
+	screen.vertexGreen = smooth ? shaded.vertexGreen.data() : NULL;
+	screen.vertexBlue = smooth ? shaded.vertexBlue.data() : NULL;
+	bool highlights = !shaded.vertexSpecularRed.empty();
+	screen.vertexSpecularRed = highlights ? shaded.vertexSpecularRed.data() : NULL;
+	screen.vertexSpecularGreen = highlights ? shaded.vertexSpecularGreen.data() : NULL;
+	screen.vertexSpecularBlue = highlights ? shaded.vertexSpecularBlue.data() : NULL;
+	screen.clipX = NULL;
+	screen.clipY = NULL;
+	screen.clipZ = NULL;
+	screen.clipW = NULL;
+	screen.faceCount = faceCount;
+
+	// Triangle i is face i % faceCount of instance i / faceCount; clipped,
+	// it can be up to two triangles
+	auto trianglesAt = [&](ScreenMesh &s, long long i, Triangle out[2]) -> int
+	{
+		size_t offset = (size_t)(i / faceCount) * vertexCount;
+		s.x = &x[offset];
+		s.y = &y[offset];
+		s.z = &z[offset];
+		if (!perspective)
+		{
+			out[0] = assembleTriangle(s, i % faceCount);
+			return 1;
+		}
+		s.clipX = &clipX[offset];
+		s.clipY = &clipY[offset];
+		s.clipZ = &clipZ[offset];
+		s.clipW = &clipW[offset];
+		return assembleClippedTriangles(s, viewport, i % faceCount, out);
+	};
+
+	int width = framebuffer.getWidth();
+	int height = framebuffer.getHeight();
+	bool multisampled = framebuffer.getSamples() > 1;
+	const SamplePattern &pattern = framebuffer.getSamplePattern();
+	int tilesX = framebuffer.getTilesX();
+	int tilesY = framebuffer.getTilesY();
+	int tileCount = tilesX * tilesY;
+	long long triangleCount = (long long)faceCount * instanceCount;
+	int chunkCount = pool.size() * 4;
+	if (chunkCount > triangleCount)
+		chunkCount = triangleCount > 0 ? triangleCount : 1;
+
+	FaceCulling culling = faceCulling;
+	int pad = multisampled ? 1 : 0;
+	mutex statsMutex;
+
+	// With setFrontToBack, every triangle gets a depth key: the depth of its
+	// nearest vertex, quantized to 16 bits over the depths there are, 0 for
+	// the nearest. Through a camera, the depths that can be drawn are those
+	// between the near and far planes; vertices behind the camera have
+	// meaningless ones.
+	bool sorted = frontToBack;
+	vector<unsigned short> depthKeys(sorted ? triangleCount : 0);
+	float zMax = -FLT_MAX;
+	float keyScale = 0;
+	if (sorted && perspective)
+	{
+		zMax = 1 / viewport.camera.zNear;
+		keyScale = 65535 / (zMax - viewport.minZ);
+	}
+	else if (sorted)
+	{
+		float zMin = FLT_MAX;
+		for (size_t i = 0; i < z.size(); ++i)
+		{
+			zMin = min(zMin, z[i]);
+			zMax = max(zMax, z[i]);
+		}
+		keyScale = zMax > zMin ? 65535 / (zMax - zMin) : 0;
+	}
+
+	// Bin the triangles. Each chunk of consecutive triangles is binned into
+	// its own lists, so concatenating the chunks' lists keeps submission
+	// order.
+	vector<vector<unsigned int> > bins((size_t)chunkCount * tileCount);
+
+	pool.parallelFor(chunkCount, [&](int chunk)
+	{
+		long long first = triangleCount * chunk / chunkCount;
+		long long last = triangleCount * (chunk + 1) / chunkCount;
+		vector<unsigned int> *chunkBins = &bins[(size_t)chunk * tileCount];
+		ScreenMesh s = screen;
+		long long culled[CULL_FACING + 1] = {};
+
+		for (long long i = first; i < last; ++i)
+		{
+			Triangle pieces[2];
+			int pieceCount = trianglesAt(s, i, pieces);
+
+			// A clipped face is kept if any of its pieces is, and binned
+			// into the tiles any of them touches
+			CullResult result = CULL_OFF_SCREEN;
+			int x0 = width, y0 = height, x1 = 0, y1 = 0;
+			float nearest = -FLT_MAX;
+			for (int k = 0; k < pieceCount; ++k)
+			{
+				const Triangle &t = pieces[k];
+				CullResult pieceResult = cullTriangle(t, viewport, culling, pad);
+				if (pieceResult != CULL_KEPT)
+				{
+					if (k == 0)
+						result = pieceResult;
+					continue;
+				}
+
+				// the pixels the triangle can cover, clamped to the screen
+				int px0 = 0, py0 = 0, px1 = width, py1 = height;
+				pixelBounds(t, pad, px0, py0, px1, py1);
+				if (px0 >= px1 || py0 >= py1)
+					continue;
+
+				result = CULL_KEPT;
+				x0 = min(x0, px0);
+				y0 = min(y0, py0);
+				x1 = max(x1, px1);
+				y1 = max(y1, py1);
+				nearest = fmaxf(nearest, fmaxf(t.v1.position.z, fmaxf(t.v2.position.z, t.v3.position.z)));
+			}
+			++culled[result];
+			if (result != CULL_KEPT)
+				continue;
+
+			if (sorted)
+			{
+				float key = (zMax - nearest) * keyScale;
+				depthKeys[i] = key < 65535 ? (unsigned short)key : 65535;
+			}
+
+			for (int ty = y0 / TILE_SIZE; ty <= (y1 - 1) / TILE_SIZE; ++ty)
+			{
+				for (int tx = x0 / TILE_SIZE; tx <= (x1 - 1) / TILE_SIZE; ++tx)
+				{
+					chunkBins[ty * tilesX + tx].push_back((unsigned int)i);
+				}
+			}
+		}
+
+		if (stats != NULL)
+		{
+			lock_guard<mutex> lock(statsMutex);
+			stats->cull.triangles += last - first;
+			stats->cull.offScreen += culled[CULL_OFF_SCREEN];
+			stats->cull.tooFar += culled[CULL_TOO_FAR];
+			stats->cull.degenerate += culled[CULL_DEGENERATE];
+			stats->cull.facing += culled[CULL_FACING];
+		}
+	});
+
+	// Start with the busiest tiles so the stragglers at the end are cheap ones
+	vector<int> tileOrder(tileCount);
+	vector<size_t> tileLoad(tileCount, 0);
+	for (int tile = 0; tile < tileCount; ++tile)
+	{
+		tileOrder[tile] = tile;
+		for (int chunk = 0; chunk < chunkCount; ++chunk)
+			tileLoad[tile] += bins[(size_t)chunk * tileCount + tile].size();
+	}
+	stable_sort(tileOrder.begin(), tileOrder.end(), [&](int a, int b) { return tileLoad[a] > tileLoad[b]; });
+
+	bool cull = hierarchicalZEnabled;
+
+	pool.parallelFor(tileCount, [&](int n)
+	{
+		int tile = tileOrder[n];
+		if (tileLoad[tile] == 0)
+			return;
+
+		// Rasterize into an unpacked copy of the tile that stays in cache.
+		// Each thread keeps its copy's planes from tile to tile.
+		static thread_local FramebufferTile fbTile;
+		static thread_local HierarchicalZ hiZ;
+		framebuffer.loadTile(tile % tilesX, tile / tilesX, fbTile);
+		if (cull)
+			hiZ.reset(fbTile);
+		HiZStats hiZStats = {};
+		long long fragments = 0;
+		PixelPlanes planes = fbTile.planes();
+		static thread_local vector<float> ids;
+		if (deferred)
+		{
+			// all VISIBILITY_NONE
+			ids.resize((size_t)FRAMEBUFFER_TILE_PIXELS * fbTile.samples);
+			memset(ids.data(), 0xff, ids.size() * sizeof(float));
+			planes.r = ids.data();
+			planes.g = NULL;
+			planes.b = NULL;
+		}
+		int clipX0 = fbTile.x0;
+		int clipY0 = fbTile.y0;
+		int clipX1 = fbTile.x0 + fbTile.width;
+		int clipY1 = fbTile.y0 + fbTile.height;
+		ScreenMesh s = screen;
+
+		// The chunks' lists one after the other, or with setFrontToBack all of
+		// them in one list, nearest first
+		static thread_local vector<unsigned int> sortedBin;
+		static thread_local vector<unsigned int> sortScratch;
+		if (sorted)
+		{
+			sortedBin.clear();
+			for (int chunk = 0; chunk < chunkCount; ++chunk)
+			{
+				const vector<unsigned int> &bin = bins[(size_t)chunk * tileCount + tile];
+				sortedBin.insert(sortedBin.end(), bin.begin(), bin.end());
+			}
+			sortByDepth(sortedBin, depthKeys.data(), sortScratch);
+		}
+
+		for (int list = 0; list < (sorted ? 1 : chunkCount); ++list)
+		{
+			const vector<unsigned int> &bin = sorted ? sortedBin : bins[(size_t)list * tileCount + tile];
+			for (size_t k = 0; k < bin.size(); ++k)
+			{
+				unsigned int i = bin[k];
+				Triangle pieces[2];
+				int pieceCount = trianglesAt(s, i, pieces);
+				for (int piece = 0; piece < pieceCount; ++piece)
+				{
+					const Triangle &t = pieces[piece];
+					int x0 = clipX0;
+					int y0 = clipY0;
+					int x1 = clipX1;
+					int y1 = clipY1;
+					if (cull && !hiZ.test(t, multisampled, x0, y0, x1, y1, hiZStats))
+						continue;
+
+					if (deferred)
+					{
+						unsigned int id = (i / faceCount) << faceBits | (i % faceCount);
+						if (multisampled)
+							fragments += rasterizeTriangleVisibilityMSAASIMD(t, id, x0, y0, x1, y1, planes, pattern);
+						else
+							fragments += rasterizeTriangleVisibilitySIMD(t, id, x0, y0, x1, y1, planes);
+					}
+					else if (multisampled)
+						fragments += rasterizeTriangleMSAASIMD(t, x0, y0, x1, y1, planes, pattern);
+					else
+						fragments += rasterizeTriangleSIMD(t, x0, y0, x1, y1, planes);
+
+					if (cull)
+						hiZ.drawn();
+				}
+			}
+		}
+
+		if (deferred)
+		{
+			unsigned int faceMask = (1u << faceBits) - 1;
+			// The pieces of a clipped face lie in the same plane, so any of
+			// them that covers pixels gives its colors
+			auto triangleOf = [&](unsigned int id) -> Triangle
+			{
+				Triangle pieces[2];
+				int pieceCount = trianglesAt(s, (long long)(id >> faceBits) * faceCount + (id & faceMask), pieces);
+				FixedTriangle f;
+				if (pieceCount > 1 && !(snapTriangle(pieces[0], f) && f.area != 0))
+					return pieces[1];
+				return pieces[0];
+			};
+			resolveVisibility(ids.data(), faceMask, mesh, shaded, triangleOf, fbTile);
+		}
+
+		framebuffer.storeTile(fbTile);
+
+		if (stats != NULL)
+		{
+			lock_guard<mutex> lock(statsMutex);
+			stats->fragments += fragments;
+			stats->hiZ.tested += hiZStats.tested;
+			stats->hiZ.tileCulled += hiZStats.tileCulled;
+			stats->hiZ.tileCulledPixels += hiZStats.tileCulledPixels;
+			stats->hiZ.blockCulled += hiZStats.blockCulled;
+			stats->hiZ.blockCulledPixels += hiZStats.blockCulledPixels;
+		}
+	});
+}
+
+/*
+* The coarsest level of detail of a model whose surface strays no more than
+* setLODThreshold pixels from the full model's, as an instance is drawn:
+* instances only scale x and y, so an error in model units is as many pixels
+* as the instance's scale times the viewport's pixels per world unit.
+* Through a perspective camera, a world unit is as many pixels as it is
+* where the instance comes nearest the camera (see instanceMatrix).
+*/
+static int chooseLevel(const BasicModel *model, int levels, const Instance &instance, const Viewport &viewport)
+{
+	float pixelsPerUnit = fmaxf(viewport.width / (viewport.xMaxWorld - viewport.xMinWorld),
+		viewport.height / (viewport.yMaxWorld - viewport.yMinWorld));
+	if (viewport.perspective)
+	{
+		const Camera &c = viewport.camera;
+		Vector3 toInstance(instance.xOffset - c.eye.x, instance.yOffset - c.eye.y, 0 - c.eye.z);
+		float distance = fmaxf(c.zNear, toInstance.length() - 0.5f * model->getExtent() * fabsf(instance.scale));
+		pixelsPerUnit = viewport.height / (2 * tanf(c.fovY * (float)M_PI / 360) * distance);
+	}
+	float scale = fabsf(instance.scale) * pixelsPerUnit;
+
+	int level = 0;
+	while (level + 1 < levels && model->getLODError(level + 1) * scale <= lodThreshold)
+		++level;
+	return level;
+}
+
+/*
+* Count the pixels (samples) of a framebuffer holding something, for
+* RenderStats::covered. Done once the whole frame is drawn, as a pixel can
+* be drawn by several calls of drawMesh.
+*/
+static long long countCovered(const Framebuffer &framebuffer, ThreadPool &pool)
+{
+	float minZ = framebuffer.getViewport().minZ;
+	int tilesX = framebuffer.getTilesX();
+	int tileCount = tilesX * framebuffer.getTilesY();
+	vector<long long> covered(tileCount, 0);
+
+	pool.parallelFor(tileCount, [&](int tile)
+	{
+		static thread_local FramebufferTile fbTile;
+		framebuffer.loadTile(tile % tilesX, tile / tilesX, fbTile);
+		long long count = 0;
+		for (int k = 0; k < fbTile.samples; ++k)
+		{
+			const float *tz = &fbTile.z[(size_t)k * FRAMEBUFFER_TILE_PIXELS];
+			for (int ty = 0; ty < fbTile.height; ++ty)
+			{
+				for (int tx = 0; tx < fbTile.width; ++tx)
+					count += tz[ty * FRAMEBUFFER_TILE_SIZE + tx] > minZ;
+			}
+		}
+		covered[tile] = count;
+	});
+
+	long long total = 0;
+	for (int tile = 0; tile < tileCount; ++tile)
+		total += covered[tile];
+	return total;
+}
+
+/*
+* Draw several instances of a model, each at the level of detail its size on
+* screen calls for (see chooseLevel and BasicModel::setLOD). The instances
+* drawn at each level are drawn together, finest level first, as described
+* at drawMesh. Without levels of detail, that is every instance at once.
+*
+* model: The model to draw
+* shaded: The shaded colors of each of its levels, full detail first (see
+*         shadeModel). Levels past the end of it aren't used.
+* instances: Where to put each copy of the model
+* framebuffer: Where to draw. Its viewport maps the world to the screen.
+* pool: Threads to run on
+* stats: If not NULL, the counters are added to it
+*/
+void drawInstances(const BasicModel *model, const vector<ShadedMesh> &shaded, const vector<Instance> &instances,
+	Framebuffer &framebuffer, ThreadPool &pool, RenderStats *stats)
+{
+	int levels = min((int)shaded.size(), model->getLODCount());
+	if (levels <= 1)
+	{
+		drawMesh(model->mesh, model->getCenter(), shaded[0], instances, framebuffer, pool, stats);
+		if (stats != NULL)
+			stats->covered += countCovered(framebuffer, pool);
+		return;
+	}
+
+	vector<vector<Instance> > byLevel(levels);
+	for (size_t i = 0; i < instances.size(); ++i)
+		byLevel[chooseLevel(model, levels, instances[i], framebuffer.getViewport())].push_back(instances[i]);
+
+	for (int level = 0; level < levels; ++level)
+	{
+		if (byLevel[level].empty())
+			continue;
+		drawMesh(model->getLOD(level), model->getCenter(), shaded[level], byLevel[level], framebuffer, pool, stats);
+		if (stats != NULL)
+			stats->lodInstances[min(level, RENDER_STATS_LOD_LEVELS - 1)] += byLevel[level].size();
+	}
+	if (stats != NULL)
+		stats->covered += countCovered(framebuffer, pool);
+}
+
+/*
+* Draw several instances of a model that is read a chunk of faces at a time
+* (see MeshStream), so it never has to be in memory as a whole. Each chunk is
+* shaded, then drawn into the framebuffer like a whole model (see drawMesh)
+* before the next one is read; only the chunk, its shaded colors and its
+* screen space vertices are held at a time.
+*
+* With a single instance, the image is the same as drawInstances draws from
+* the whole model. With several, each tile sees the chunks one after the
+* other rather than the instances, so triangles at exactly the same depth can
+* come out the other way around.
+*
+* stream: The model. It is rewound first.
+* chunkFaces: Faces to read at a time
+* lighting: The lights (see lightPoints)
+* smooth: Shade each vertex rather than each face (see shadeModel)
+* instances: Where to put each copy of the model
+* framebuffer: Where to draw. Its viewport maps the world to the screen.
+* pool: Threads to run on
+* stats: If not NULL, the counters are added to it
+*/
+void drawStream(MeshStream &stream, unsigned int chunkFaces, const Lighting &lighting, bool smooth,
+	const vector<Instance> &instances, Framebuffer &framebuffer, ThreadPool &pool, RenderStats *stats)
+{
+	Mesh chunk;
+	ShadedMesh shaded;
+	stream.rewind();
+	while (stream.readChunk(chunkFaces, chunk))
+	{
+		if (smooth)
+			shadeVertices(chunk, lighting, shaded);
+		else if (visibilityBufferEnabled)
+			deferFaces(lighting, shaded);
+		else
+			shadeFaces(chunk, lighting, shaded);
+		drawMesh(chunk, stream.getCenter(), shaded, instances, framebuffer, pool, stats);
+	}
+	if (stats != NULL)
+		stats->covered += countCovered(framebuffer, pool);
+}
+
+/*
+* Where to draw the bunnies: one big one in the middle, or a 5x5 grid of
+* small ones.
+*/
+void layoutBunnies(bool tileBunnies, vector<Instance> &instances)
+{
+	float xOffsets[5] = {-0.66, -0.33, 0, 0.33, 0.66};
+	float yOffsets[5] = {-0.66, -0.33, 0, 0.33, 0.66};
+
+	instances.clear();
+	if (tileBunnies)
+	{
+		for (int yIndex = 0; yIndex < 5; ++yIndex)
+		{
+			for (int xIndex = 0; xIndex < 5; ++xIndex)
+			{
+				Instance instance = {xOffsets[xIndex], yOffsets[yIndex], 3, 0};
+				instances.push_back(instance);
+			}
+		}
+	}
+	else
+	{
+		Instance instance = {0, 0, 10, 0};
+		instances.push_back(instance);
+	}
+}
@@ -0,0 +1,115 @@
+#ifndef RENDERER_H
+#define RENDERER_H
+
+#include <vector>
+
+#include "BasicModel.h"
+#include "Framebuffer.h"
+#include "HierarchicalZ.h"
+#include "Lighting.h"
+#include "MeshStream.h"
+#include "Rasterizer.h"
+#include "ThreadPool.h"
+
+// CPU rendering pipeline shared by SWRasterizer.cpp and the CPU path of
+// SWRasterizer.cu.
+
+// Screen tiles are TILE_SIZE x TILE_SIZE pixels, the framebuffer's tiles
+#define TILE_SIZE FRAMEBUFFER_TILE_SIZE
+
+// A model's faces after lighting. Shading only depends on the normals and
+// the lights, so it is done once and reused for every instance. Flat shading
+// (shadeFaces) lights each face; smooth shading (shadeVertices) lights each
+// vertex and leaves the faces their own color. Through the visibility buffer,
+// flat shading can wait until the faces that are seen are known (deferFaces).
+typedef struct ShadedMesh
+{
+	std::vector<float> red;		// empty if deferred
+	std::vector<float> green;
+	std::vector<float> blue;
+	std::vector<float> vertexRed;	// light reaching each vertex, empty for flat shading
+	std::vector<float> vertexGreen;
+	std::vector<float> vertexBlue;
+	std::vector<float> vertexSpecularRed;	// highlights at each vertex, empty for flat shading or without highlights
+	std::vector<float> vertexSpecularGreen;
+	std::vector<float> vertexSpecularBlue;
+	bool deferred;			// flat shading left to drawInstances, with these lights
+	Lighting lighting;
+} ShadedMesh;
+
+// What the culling stage dropped before binning (see cullTriangle)
+typedef struct CullStats
+{
+	long long triangles;	// triangles submitted
+	long long offScreen;
+	long long tooFar;
+	long long degenerate;
+	long long facing;		// dropped by setFaceCulling
+} CullStats;
+
+// Levels of detail RenderStats counts the instances of separately
+#define RENDER_STATS_LOD_LEVELS 8
+
+// Counters drawInstances can fill in. fragments / covered is the overdraw.
+typedef struct RenderStats
+{
+	CullStats cull;
+	HiZStats hiZ;
+	long long fragments;	// pixels (samples, if multisampled) that passed the depth test and were written
+	long long covered;		// pixels (samples) holding something once the frame is drawn
+	long long lodInstances[RENDER_STATS_LOD_LEVELS];	// instances drawn at each level of detail, the last also counting coarser ones (only counted with levels of detail)
+} RenderStats;
+
+void shadeFaces(const Mesh &mesh, const Lighting &lighting, ShadedMesh &shaded);
+void shadeVertices(const Mesh &mesh, const Lighting &lighting, ShadedMesh &shaded);
+void deferFaces(const Lighting &lighting, ShadedMesh &shaded);
+void shadeModel(const BasicModel *model, const Lighting &lighting, bool smooth, std::vector<ShadedMesh> &shaded);
+void convertVerticesTo2D(const Viewport &viewport, int count, float *x, float *y);
+void drawInstances(const BasicModel *model, const std::vector<ShadedMesh> &shaded, const std::vector<Instance> &instances,
+	Framebuffer &framebuffer, ThreadPool &pool, RenderStats *stats = NULL);
+void drawStream(MeshStream &stream, unsigned int chunkFaces, const Lighting &lighting, bool smooth,
+	const std::vector<Instance> &instances, Framebuffer &framebuffer, ThreadPool &pool, RenderStats *stats = NULL);
+void layoutBunnies(bool tileBunnies, std::vector<Instance> &instances);
+
+// Whether drawInstances culls with a HierarchicalZ. It draws the same image
+// either way. Off by default: unless they are sorted (setFrontToBack),
+// triangles arrive in no particular depth order, and the per-pixel depth test
+// on a tile in cache is cheap, so the tests and updates cost about as much as
+// they save. Not thread safe: set it before rendering.
+bool getHierarchicalZ();
+void setHierarchicalZ(bool enabled);
+
+// Whether drawInstances draws triangles front to back rather than in
+// submission order, so the depth test rejects more of what is hidden before
+// it is written. Off by default: where triangles have exactly the same depth,
+// the first one drawn wins, so the image can differ in a few pixels. Not
+// thread safe: set it before rendering.
+bool getFrontToBack();
+void setFrontToBack(bool enabled);
+
+// Whether drawInstances draws through a visibility buffer (see
+// VISIBILITY_NONE): triangles write only their depth and ID, and each tile
+// is colored in a second pass, once per pixel whatever the overdraw. With
+// flat shading, only the faces left visible in a tile are lit (see
+// deferFaces, which shadeModel then uses). Off by default. Not thread safe:
+// set it before rendering.
+bool getVisibilityBuffer();
+void setVisibilityBuffer(bool enabled);
+
+// Which facing triangles drawInstances drops. CULL_BACK by default: the
+// back faces of a closed mesh are hidden behind its front faces. Not thread
+// safe: set it before rendering.
+FaceCulling getFaceCulling();
+void setFaceCulling(FaceCulling culling);
+
+// How far, in pixels, the surface of the level of detail drawInstances
+// picks for an instance may stray from the full model's (see
+// BasicModel::setLOD). 1 by default. Not thread safe: set it before
+// rendering.
+float getLODThreshold();
+void setLODThreshold(float pixels);
+
+// "none", "back" or "front"
+bool parseFaceCulling(const char *name, FaceCulling &culling);
+
+#endif
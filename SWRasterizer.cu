@@ -1,5 +1,6 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <math.h>
 #include <cuda.h>
 #include <cuda_runtime_api.h>
@@ -10,278 +11,823 @@
 #include <iostream>
 #include <fstream>
 #include <vector>
+#include <chrono>
 
 #include "BasicModel.h"
 #include "Model.h"
 #include "Triangle.h"
-
-// Window (screen) dimensions
-#define WindowWidth 2000
-#define WindowHeight 2000
-
-// World coordinates bounding box
-#define XMinWorld -1
-#define XMaxWorld 1
-#define YMinWorld -1
-#define YMaxWorld 1
-
-// Camera is at origin looking down negative Z, so further away = smaller Z
-#define MinZ -10000
+#include "Rasterizer.h"
+#include "Renderer.h"
+#include "ImageWriter.h"
+#include "FrameList.h"
+#include "RenderServer.h"
+#include "RasterizerSIMD.h"
+#include "Framebuffer.h"
+#include "RenderTargetPool.h"
+#include "Blur.h"
+#include "RasterizerCheck.h"
 
 #define BLOCK_WIDTH 32
 
 using namespace std;
 
-void init();
-void test();
-Triangle convertTriTo2D(Triangle);
-Vector3 convertVertexTo2D(Vector3);
-__device__ __host__ void rasterizeTriangle(Triangle t, float *r, float *g, float *b, float *z);
-VectorThree barycentricCoords(Vector3, Vector3, Vector3, VectorThree, float);
-void WriteTga(char* outfile);
-Vector3 diffuseShadeVertex(Vector3, Vector3);
-__global__ void Rasterize(Triangle *d_tris, float *d_zbuf, float *d_red, float *d_green, float *d_blue);
-void processTriangles(BasicModel*, float*, float*, float*, float*, bool);
-void gaussianBlurCPU(int);
-VectorThree horizontalBlur(int, int, float*, float*, float*, float*);
-VectorThree verticalBlur(int, int, float*, float*, float*, float*);
-void gaussianGPU(int passes, float *r, float *g, float *b);
+// A model's mesh and shaded colors in device memory
+typedef struct DeviceMesh
+{
+	float *x;
+	float *y;
+	float *z;
+	unsigned int *indices;
+	float *red;
+	float *green;
+	float *blue;
+	float *vertexRed;	// NULL for flat shading
+	float *vertexGreen;
+	float *vertexBlue;
+	float *vertexSpecularRed;	// NULL for flat shading or without highlights
+	float *vertexSpecularGreen;
+	float *vertexSpecularBlue;
+	int vertexCount;
+	int faceCount;
+	float centerX;	// 0 - model center, see BasicModel::transformVertices
+	float centerY;
+} DeviceMesh;
+
+void init(const Viewport &viewport);
+void test(const Viewport &viewport);
+int renderBatch(const BasicModel *model, const vector<FramePose> &frames, bool tileBunnies, bool smoothShading,
+	int blurPasses, const Viewport &viewport, ColorFormat colorFormat, DepthFormat depthFormat, int samples,
+	ImageFormat imageFormat, ThreadPool &pool, RenderStats *stats);
+void printRenderStats(const BasicModel *model, const RenderStats &stats);
+DeviceMesh uploadMesh(const BasicModel*, const ShadedMesh&);
+void freeDeviceMesh(DeviceMesh&);
+void drawInstancesCUDA(const DeviceMesh&, const vector<Instance>&, const Viewport&, const SamplePattern&, float*, float*, float*, float*);
+__global__ void TransformInstances(DeviceMesh d_mesh, const Instance *d_instances, int instanceCount, Viewport viewport, float *d_x, float *d_y);
+__global__ void Rasterize(DeviceMesh d_mesh, const float *d_x, const float *d_y, int instanceCount, Viewport viewport, SamplePattern pattern, FaceCulling culling, float *d_zbuf, float *d_red, float *d_green, float *d_blue);
+__global__ void ResolveSamples(int pixels, int samples, float *d_red, float *d_green, float *d_blue);
+__global__ void FillPlanes(size_t count, float value, float *d_planes);
+void gaussianGPU(int passes, int width, int height, float *r, float *g, float *b);
 __global__ void beginGauss(float*, float*, float*, float*, float*, float*, float*);
 
-float zbuffer[WindowWidth][WindowHeight];
-float red[WindowWidth][WindowHeight];
-float green[WindowWidth][WindowHeight];
-float blue[WindowWidth][WindowHeight];
-float blurredRed[WindowWidth][WindowHeight];
-float blurredGreen[WindowWidth][WindowHeight];
-float blurredBlue[WindowWidth][WindowHeight];
-Vector3 directionToLight;
-Vector3 lightColor;
-float gaussianBlurWeights[5] = {70.0f/256.0f, 56.0f/256.0f, 28.0f/256.0f, 8.0f/256.0f, 1.0f/256.0f};
+// Row-major framebuffer, sized by init()
+vector<float> zbuffer;
+vector<float> red;
+vector<float> green;
+vector<float> blue;
+Lighting lighting;
 
 int main(int argc, char** argv)
 {
 	bool tileBunnies = false;
 	bool useCUDA = false;
-	bool useBlurring = false;
+	int blurPasses = 0;
+	bool checkSimdKernels = false;
+	bool checkWatertightness = false;
+	bool printStats = false;
+	bool smoothShading = false;
+	const char *lightsFile = NULL;
+	int lodLevels = 0;
+	unsigned int streamFaces = 0;
+	ImageFormat imageFormat = IMAGE_TGA;
+	const char *frameListFile = NULL;
+	int turntableFrameCount = 0;
+	bool serveStdin = false;
+	const char *socketPath = NULL;
+	int serverWorkers = 2;
+	int cachedModels = 8;
+	int threadCount = 0;
+	int samples = 1;
+	ColorFormat colorFormat = COLOR_RGB32F;
+	DepthFormat depthFormat = DEPTH_32F;
+	Viewport viewport = makeViewport(DEFAULT_WIDTH, DEFAULT_HEIGHT);
+	bool useCamera = false;
+	Camera camera = makeCamera();
 	string filename;
 
 	// -t --> make an image with 25 tiled bunnies. else draw just one bunny.
 	// -c --> run with CUDA. else run on CPU.
-	// -b --> enable Gaussian blurring.
+	// -b --> blur the image (a Gaussian post-process; it doesn't anti-alias, -msaa does). same as -blur 100.
+	// -blur <passes> --> blur as much as that many passes of the 9-tap kernel would.
+	// -msaa <1|2|4|8> --> samples per pixel for multisample anti-aliasing. default is 1 (off).
+	// -j <n> --> use n CPU threads. default is one per core.
+	// -simd <scalar|sse2|avx2|avx512> --> CPU rasterizer kernel. default is the widest the CPU has.
+	// -checksimd --> check that every SIMD kernel draws the same images as the scalar one.
+	// -checkwatertight --> check that meshes are drawn without gaps or overlaps, every pixel once.
+	// -color <rgb32f|rgba8|rgb16f> --> CPU framebuffer color format. default is rgb32f.
+	// -depth <32f|24> --> CPU framebuffer depth format. default is 32f.
+	// -size <w>x<h> --> image size in pixels. default is 2000x2000.
+	// -window <xmin> <xmax> <ymin> <ymax> --> part of the world the image shows. default is -1 1 -1 1.
+	// -minz <z> --> depth the z buffer is cleared to. default is -10000.
+	// -camera <ex> <ey> <ez> <tx> <ty> <tz> --> look from eye e at target t through a perspective camera rather than show the window (CPU only).
+	// -fov <degrees> --> the camera's vertical field of view. default is 28.
+	// -near <z> --> distance from the camera to its near plane; nearer parts of triangles are clipped. default is 0.1.
+	// -far <z> --> distance from the camera to its far plane; nothing farther is drawn. default is 100.
+	// -hiz --> cull hidden triangles with a hierarchical Z buffer (CPU only).
+	// -cull <none|back|front> --> which facing triangles to drop. default is back.
+	// -sort --> draw triangles front to back (CPU only).
+	// -vis --> draw through a visibility buffer and color each pixel once (CPU only).
+	// -smooth --> shade each vertex and interpolate the colors (Gouraud). else shade each face.
+	// -lights <file> --> light the model as the scene description says (see loadLighting). default is one white light from +z.
+	// -lod <levels> --> build up to that many simplified levels of the model and draw each instance at the coarsest that looks the same (CPU only).
+	// -stream <faces> --> read and draw the model that many faces at a time, for models larger than memory (CPU only, 0 picks a size).
+	// -format <tga|tgarle|qoi|png> --> image file format, written to image.<tga|qoi|png>. default is tga.
+	// -frames <file> --> draw a frame for each line of the file (see loadFrameList), written to frame0000.<ext> and on (CPU only).
+	// -turntable <frames> --> draw that many frames of the model turning a whole turn, written likewise (CPU only).
+	// -serve --> run as a render server taking jobs as JSON lines on stdin and answering on stdout (see RenderServer.h, CPU only).
+	// -socket <path> --> likewise, serving the connections to a Unix socket at path.
+	// -workers <n> --> jobs the server draws at once, each on its share of the -j threads. default is 2.
+	// -cache <models> --> models the server keeps loaded. default is 8.
+	// -stats --> print what the CPU renderer culled and how much it overdrew.
 	for (int i = 0; i < argc; ++i)
 	{
 		if (strcmp("-t", argv[i]) == 0) tileBunnies = true;
 		else if (strcmp("-c", argv[i]) == 0) useCUDA = true;
-		else if (strcmp("-b", argv[i]) == 0) useBlurring = true;
+		else if (strcmp("-b", argv[i]) == 0) blurPasses = 100;
+		else if (strcmp("-blur", argv[i]) == 0 && i + 1 < argc) blurPasses = max(0, atoi(argv[++i]));
+		else if (strcmp("-j", argv[i]) == 0 && i + 1 < argc) threadCount = atoi(argv[++i]);
+		else if (strcmp("-msaa", argv[i]) == 0 && i + 1 < argc)
+		{
+			samples = atoi(argv[++i]);
+			if (makeSamplePattern(samples).count != samples)
+			{
+				printf("Bad sample count %s (1, 2, 4 or 8)\n", argv[i]);
+				return 1;
+			}
+		}
+		else if (strcmp("-simd", argv[i]) == 0 && i + 1 < argc)
+		{
+			SimdLevel level;
+			if (!parseSimdLevel(argv[++i], level))
+			{
+				printf("Unknown SIMD level %s\n", argv[i]);
+				return 1;
+			}
+			setSimdLevel(level);
+		}
+		else if (strcmp("-checksimd", argv[i]) == 0) checkSimdKernels = true;
+		else if (strcmp("-checkwatertight", argv[i]) == 0) checkWatertightness = true;
+		else if (strcmp("-color", argv[i]) == 0 && i + 1 < argc)
+		{
+			if (!Framebuffer::parseColorFormat(argv[++i], colorFormat))
+			{
+				printf("Unknown color format %s\n", argv[i]);
+				return 1;
+			}
+		}
+		else if (strcmp("-depth", argv[i]) == 0 && i + 1 < argc)
+		{
+			if (!Framebuffer::parseDepthFormat(argv[++i], depthFormat))
+			{
+				printf("Unknown depth format %s\n", argv[i]);
+				return 1;
+			}
+		}
+		else if (strcmp("-size", argv[i]) == 0 && i + 1 < argc)
+		{
+			if (sscanf(argv[++i], "%dx%d", &viewport.width, &viewport.height) != 2 ||
+				viewport.width <= 0 || viewport.height <= 0 || viewport.width > 0xffff || viewport.height > 0xffff)
+			{
+				printf("Bad image size %s\n", argv[i]);
+				return 1;
+			}
+		}
+		else if (strcmp("-window", argv[i]) == 0 && i + 4 < argc)
+		{
+			viewport.xMinWorld = atof(argv[++i]);
+			viewport.xMaxWorld = atof(argv[++i]);
+			viewport.yMinWorld = atof(argv[++i]);
+			viewport.yMaxWorld = atof(argv[++i]);
+			if (!(viewport.xMaxWorld > viewport.xMinWorld && viewport.yMaxWorld > viewport.yMinWorld))
+			{
+				printf("Bad window %s %s %s %s\n", argv[i - 3], argv[i - 2], argv[i - 1], argv[i]);
+				return 1;
+			}
+		}
+		else if (strcmp("-minz", argv[i]) == 0 && i + 1 < argc) viewport.minZ = atof(argv[++i]);
+		else if (strcmp("-camera", argv[i]) == 0 && i + 6 < argc)
+		{
+			camera.eye.x = atof(argv[++i]);
+			camera.eye.y = atof(argv[++i]);
+			camera.eye.z = atof(argv[++i]);
+			camera.target.x = atof(argv[++i]);
+			camera.target.y = atof(argv[++i]);
+			camera.target.z = atof(argv[++i]);
+			useCamera = true;
+		}
+		else if (strcmp("-fov", argv[i]) == 0 && i + 1 < argc) camera.fovY = atof(argv[++i]);
+		else if (strcmp("-near", argv[i]) == 0 && i + 1 < argc) camera.zNear = atof(argv[++i]);
+		else if (strcmp("-far", argv[i]) == 0 && i + 1 < argc) camera.zFar = atof(argv[++i]);
+		else if (strcmp("-hiz", argv[i]) == 0) setHierarchicalZ(true);
+		else if (strcmp("-cull", argv[i]) == 0 && i + 1 < argc)
+		{
+			FaceCulling culling;
+			if (!parseFaceCulling(argv[++i], culling))
+			{
+				printf("Unknown face culling %s\n", argv[i]);
+				return 1;
+			}
+			setFaceCulling(culling);
+		}
+		else if (strcmp("-sort", argv[i]) == 0) setFrontToBack(true);
+		else if (strcmp("-vis", argv[i]) == 0) setVisibilityBuffer(true);
+		else if (strcmp("-smooth", argv[i]) == 0) smoothShading = true;
+		else if (strcmp("-lights", argv[i]) == 0 && i + 1 < argc) lightsFile = argv[++i];
+		else if (strcmp("-lod", argv[i]) == 0 && i + 1 < argc) lodLevels = max(0, atoi(argv[++i]));
+		else if (strcmp("-stream", argv[i]) == 0 && i + 1 < argc)
+		{
+			int faces = atoi(argv[++i]);
+			streamFaces = faces > 0 ? faces : MESH_STREAM_CHUNK_FACES;
+		}
+		else if (strcmp("-format", argv[i]) == 0 && i + 1 < argc)
+		{
+			if (!parseImageFormat(argv[++i], imageFormat))
+			{
+				printf("Unknown image format %s\n", argv[i]);
+				return 1;
+			}
+		}
+		else if (strcmp("-frames", argv[i]) == 0 && i + 1 < argc) frameListFile = argv[++i];
+		else if (strcmp("-turntable", argv[i]) == 0 && i + 1 < argc)
+		{
+			turntableFrameCount = atoi(argv[++i]);
+			if (turntableFrameCount <= 0)
+			{
+				printf("Bad frame count %s\n", argv[i]);
+				return 1;
+			}
+		}
+		else if (strcmp("-serve", argv[i]) == 0) serveStdin = true;
+		else if (strcmp("-socket", argv[i]) == 0 && i + 1 < argc) socketPath = argv[++i];
+		else if (strcmp("-workers", argv[i]) == 0 && i + 1 < argc) serverWorkers = max(1, atoi(argv[++i]));
+		else if (strcmp("-cache", argv[i]) == 0 && i + 1 < argc) cachedModels = max(1, atoi(argv[++i]));
+		else if (strcmp("-stats", argv[i]) == 0) printStats = true;
 		else
 		   filename = argv[i];
 	}
 
-	init();
+	if (checkWatertightness)
+		return checkWatertight();
+
+	if (streamFaces > 0 && (useCUDA || checkSimdKernels || lodLevels > 0))
+	{
+		printf("-stream can't be used with -c, -checksimd or -lod\n");
+		return 1;
+	}
+
+	if (!(camera.fovY > 0 && camera.fovY < 180 && camera.zNear > 0 && camera.zFar > camera.zNear))
+	{
+		printf("Bad camera: -fov must be between 0 and 180 and 0 < -near < -far\n");
+		return 1;
+	}
+	if (useCamera && useCUDA)
+	{
+		printf("-camera can't be used with -c\n");
+		return 1;
+	}
+	if (getVisibilityBuffer() && useCUDA)
+	{
+		printf("-vis can't be used with -c\n");
+		return 1;
+	}
+	// frame lists can look through a camera too, with these planes
+	viewport.camera = camera;
+	if (useCamera)
+		setCamera(viewport, camera);
+
+	bool batch = frameListFile != NULL || turntableFrameCount > 0;
+	if (batch && (useCUDA || checkSimdKernels || streamFaces > 0))
+	{
+		printf("-frames and -turntable can't be used with -c, -checksimd or -stream\n");
+		return 1;
+	}
+	if (frameListFile != NULL && turntableFrameCount > 0)
+	{
+		printf("-frames and -turntable can't be used together\n");
+		return 1;
+	}
+
+	init(viewport);
+	if (lightsFile != NULL && !loadLighting(lightsFile, lighting))
+		return 1;
+	if (useCamera)
+		lighting.viewer = cameraViewer(camera);
+
+	if (serveStdin || socketPath != NULL)
+	{
+		if (batch || useCUDA || checkSimdKernels || streamFaces > 0)
+		{
+			printf("-serve and -socket can't be used with -frames, -turntable, -c, -checksimd or -stream\n");
+			return 1;
+		}
+
+		RenderServerSettings settings;
+		settings.viewport = viewport;
+		settings.samples = samples;
+		settings.colorFormat = colorFormat;
+		settings.depthFormat = depthFormat;
+		settings.imageFormat = imageFormat;
+		settings.smooth = smoothShading;
+		settings.blurPasses = blurPasses;
+		settings.lodLevels = lodLevels;
+		settings.lighting = lighting;
+		settings.workers = serverWorkers;
+		int threads = threadCount > 0 ? threadCount : (int)thread::hardware_concurrency();
+		settings.threadsPerWorker = max(1, threads / serverWorkers);
+		settings.cachedModels = cachedModels;
+
+		RenderServer server(settings);
+		if (socketPath != NULL)
+			return server.serveSocket(socketPath) ? 0 : 1;
+		server.serveStream(0, 1);
+		return 0;
+	}
+
+	vector<FramePose> frames;
+	if (frameListFile != NULL && !loadFrameList(frameListFile, frames))
+		return 1;
+	if (turntableFrameCount > 0)
+		turntableFrames(turntableFrameCount, frames);
 	
-	float xOffsets[5] = {-0.66, -0.33, 0, 0.33, 0.66};
-	float yOffsets[5] = {-0.66, -0.33, 0, 0.33, 0.66};
-	int scaleFactor;
+	vector<Instance> instances;
 	
 	//Pointers to device memory for rgb and zbuffer arrays
 	float *d_zbuf, *d_red, *d_green, *d_blue;
 
-	// Parse the model file
-	cout << "Reading model file...";
-	BasicModel* model = new BasicModel(filename);
+	// Parse the model file, or with -stream just open it
+	BasicModel* model = NULL;
+	MeshStream stream;
+	if (streamFaces > 0)
+	{
+		cout << "Opening model file...";
+		stream.open(filename);
+	}
+	else
+	{
+		cout << "Reading model file...";
+		model = new BasicModel(filename);
+	}
 	cout << " done." << endl;
 
-	int arrSize = model->TriangleStructs.size();
-	int a2 = WindowWidth*WindowHeight*sizeof(float);
+	if (lodLevels > 0)
+	{
+		cout << "Simplifying...";
+		model->setLOD(lodLevels);
+		cout << " done." << endl;
+	}
+
+	size_t a2 = (size_t)viewport.width*viewport.height*sizeof(float);
 
 	if (useCUDA)
 	{
-		//Allocate memory on device for zbuffer and RGB
-		cudaMalloc((void **)&d_zbuf, a2);
-		cudaMemset(d_zbuf, MinZ, a2);
-		cudaMalloc((void **)&d_red, a2);
-		cudaMemset(d_red, 0, a2);
-		cudaMalloc((void **)&d_green, a2);
-		cudaMemset(d_green, 0, a2);
-		cudaMalloc((void **)&d_blue, a2);
-		cudaMemset(d_blue, 0, a2);
+		//Allocate memory on device for zbuffer and RGB, a plane per sample
+		// cudaMemset sets bytes, so the depths are filled in by a kernel
+		cudaMalloc((void **)&d_zbuf, a2*samples);
+		size_t depths = a2*samples/sizeof(float);
+		FillPlanes<<< depths/BLOCK_WIDTH+1, BLOCK_WIDTH >>>(depths, viewport.minZ, d_zbuf);
+		cudaMalloc((void **)&d_red, a2*samples);
+		cudaMemset(d_red, 0, a2*samples);
+		cudaMalloc((void **)&d_green, a2*samples);
+		cudaMemset(d_green, 0, a2*samples);
+		cudaMalloc((void **)&d_blue, a2*samples);
+		cudaMemset(d_blue, 0, a2*samples);
 	}
 	
+	layoutBunnies(tileBunnies, instances);
+
+	// Shade the model once, then draw every instance of it. A streamed model
+	// is shaded a chunk at a time as it is drawn.
+	vector<ShadedMesh> shaded;
+	if (model != NULL && !batch)
+		shadeModel(model, lighting, smoothShading, shaded);
+
+	if (checkSimdKernels)
+		return checkSimd(model, shaded, viewport, threadCount);
+
+	ThreadPool pool(threadCount);
+
+	if (batch)
+	{
+		RenderStats stats = {};
+		int result = renderBatch(model, frames, tileBunnies, smoothShading, blurPasses, viewport, colorFormat,
+			depthFormat, samples, imageFormat, pool, &stats);
+		if (printStats)
+			printRenderStats(model, stats);
+		return result;
+	}
+
 	cout << "Rasterizing...";
 	fflush(stdout);
-	if (tileBunnies)
-	{
-		scaleFactor = 3;
-		for (int yIndex = 0; yIndex < 5; ++yIndex)
-		{
-			for (int xIndex = 0; xIndex < 5; ++xIndex)
-			{
-				model->createTriangleStructs(xOffsets[xIndex], yOffsets[yIndex], scaleFactor);
 
-				processTriangles(model, d_zbuf, d_red, d_green, d_blue, useCUDA);
-			}
-		}
+	if (useCUDA)
+	{
+		DeviceMesh d_mesh = uploadMesh(model, shaded[0]);
+		drawInstancesCUDA(d_mesh, instances, viewport, makeSamplePattern(samples), d_zbuf, d_red, d_green, d_blue);
+		freeDeviceMesh(d_mesh);
 	}
 	else
 	{
-		scaleFactor = 10;
-		model->createTriangleStructs(0, 0, scaleFactor);
+		RenderStats stats = {};
+		RenderTargetPool targets;
+		Framebuffer *framebuffer = targets.acquire(viewport, colorFormat, depthFormat, samples);
+		// spend the depth precision on the depths the model can have, or
+		// through a camera on those between its near and far planes
+		if (viewport.perspective)
+			framebuffer->setDepthRange(viewport.minZ, 1 / viewport.camera.zNear);
+		else if (model != NULL)
+			framebuffer->setDepthRange(model->getMinZ(), model->getMaxZ());
+		else
+			framebuffer->setDepthRange(stream.getMinZ(), stream.getMaxZ());
+		if (model != NULL)
+			drawInstances(model, shaded, instances, *framebuffer, pool, &stats);
+		else
+			drawStream(stream, streamFaces, lighting, smoothShading, instances, *framebuffer, pool, &stats);
+		framebuffer->readColor(red.data(), green.data(), blue.data());
+		targets.release(framebuffer);
 
-		processTriangles(model, d_zbuf, d_red, d_green, d_blue, useCUDA);
+		if (printStats)
+		{
+			printf("\n");
+			if (model == NULL)
+				printf("Streamed %u faces, %u at a time\n", stream.faceCount(), streamFaces);
+			printRenderStats(model, stats);
+		}
 	}
 	printf(" done.\n");
 	
 	if (useCUDA)
 	{
-		if(useBlurring)
+		if (blurPasses > 0)
 		{
-			gaussianGPU(100, d_red, d_green, d_blue);
+			gaussianGPU(blurPasses, viewport.width, viewport.height, d_red, d_green, d_blue);
 		}
 		
 		// Copy color buffers back to host memory
-		cudaMemcpy(red, d_red, WindowWidth*WindowHeight*sizeof(float), cudaMemcpyDeviceToHost);
-		cudaMemcpy(green, d_green, WindowWidth*WindowHeight*sizeof(float), cudaMemcpyDeviceToHost);
-		cudaMemcpy(blue, d_blue, WindowWidth*WindowHeight*sizeof(float), cudaMemcpyDeviceToHost);
+		cudaMemcpy(red.data(), d_red, a2, cudaMemcpyDeviceToHost);
+		cudaMemcpy(green.data(), d_green, a2, cudaMemcpyDeviceToHost);
+		cudaMemcpy(blue.data(), d_blue, a2, cudaMemcpyDeviceToHost);
 		
+		cudaFree(d_zbuf);
 		cudaFree(d_red);
 		cudaFree(d_green);
 		cudaFree(d_blue);
 	}
-	else if (useBlurring)
+	else if (blurPasses > 0)
 	{
-		gaussianBlurCPU(100);
+		printf("Blurring...");
+		fflush(stdout);
+		blurImage(red.data(), green.data(), blue.data(), viewport.width, viewport.height, blurPasses, pool);
+		printf(" done.\n");
 	}
 
 	// Output the image
 	cout << "Writing image...";
-	WriteTga("image.tga");
+	string imageFile = string("image.") + imageFormatExtension(imageFormat);
+	if (!writeImage(imageFile.c_str(), red.data(), green.data(), blue.data(), viewport.width, viewport.height,
+		imageFormat, pool))
+		return 1;
 	cout << " done." << endl;
 
 	return 0;
 }
 
-void processTriangles(BasicModel* model, float* d_zbuf, float* d_red, float* d_green, float* d_blue, bool useCUDA)
+/*
+* Print what the CPU renderer counted (see RenderStats) and, unless the
+* model was streamed (model is NULL), what was done to the model.
+*/
+void printRenderStats(const BasicModel *model, const RenderStats &stats)
 {
-	//Pointer to device memory for triangle array
-	Triangle *d_tris;
-
-	int arrSize = model->TriangleStructs.size();
-	
-	// Make an array of our Triangle structs
-	Triangle* tris = new Triangle[model->TriangleStructs.size()];
-	for (int i = 0; i < model->TriangleStructs.size(); ++i)
+	if (model != NULL)
+	{
+		const MeshOptimizeStats &optimized = model->getOptimizeStats();
+		printf("Vertex cache misses per face (ACMR): %.3f in the file, %.3f optimized (%u vertices welded, %u faces dropped)\n",
+			optimized.acmrBefore, optimized.acmrAfter, optimized.weldedVertices, optimized.droppedFaces);
+	}
+	printf("Triangles: %lld\n", stats.cull.triangles);
+	printf("Culled off screen: %lld, too far: %lld, degenerate: %lld, by facing: %lld\n",
+		stats.cull.offScreen, stats.cull.tooFar, stats.cull.degenerate, stats.cull.facing);
+	printf("Fragments written: %lld, covered: %lld (overdraw %.2f)\n", stats.fragments, stats.covered,
+		stats.covered > 0 ? (double)stats.fragments / stats.covered : 0.0);
+	if (model != NULL && model->getLODCount() > 1)
 	{
-		tris[i] = model->TriangleStructs[i];
+		printf("Instances by level of detail:");
+		for (int level = 0; level < min(model->getLODCount(), RENDER_STATS_LOD_LEVELS); ++level)
+			printf(" %lld (%u faces)", stats.lodInstances[level], model->getLOD(level).faceCount());
+		printf("\n");
+	}
+	printf("Triangle / tile pairs: %lld\n", stats.hiZ.tested);
+	printf("Culled by tile depth: %lld (%lld pixels)\n", stats.hiZ.tileCulled, stats.hiZ.tileCulledPixels);
+	printf("Culled by block depth: %lld (%lld pixels, with trimmed blocks)\n", stats.hiZ.blockCulled,
+		stats.hiZ.blockCulledPixels);
+}
 
-		// do diffuse shading on the vertices. These calculated colors will be
-		// linearly interpolated during rasterization.
-		tris[i].v1.rgb = diffuseShadeVertex(tris[i].normal, tris[i].v1.rgb);
-		tris[i].v2.rgb = diffuseShadeVertex(tris[i].normal, tris[i].v2.rgb);
-		tris[i].v3.rgb = diffuseShadeVertex(tris[i].normal, tris[i].v3.rgb);
-		
-		if (!useCUDA)
+/*
+* Draw every frame of a batch run and write frame i to frame<i>.<ext>, four
+* digits or more.
+*
+* Everything that doesn't change from frame to frame is done once: the model
+* is loaded and shaded before the first frame (and shaded again only when the
+* turn or the camera changes, see turnLighting), one framebuffer is drawn into
+* frame after frame and cleared only where the last frame drew (see
+* Framebuffer::clear), and the color planes are reused. Each frame is encoded
+* and written on other threads while the next one is drawn (see
+* BackgroundImageWriter).
+*
+* model: The model, shaded by this
+* frames: The poses of each frame
+* tileBunnies: The instances of frames that don't list any (see layoutBunnies)
+* viewport: The image size and, for frames that don't give a window or a
+*           camera, the part of the world shown or the camera; the planes
+*           and field of view of every camera
+* stats: If not NULL, the counters of every frame are added to it
+*
+* returns: 0, or 1 if a frame couldn't be written
+*/
+int renderBatch(const BasicModel *model, const vector<FramePose> &frames, bool tileBunnies, bool smoothShading,
+	int blurPasses, const Viewport &viewport, ColorFormat colorFormat, DepthFormat depthFormat, int samples,
+	ImageFormat imageFormat, ThreadPool &pool, RenderStats *stats)
+{
+	vector<Instance> layout;
+	layoutBunnies(tileBunnies, layout);
+
+	Vector3 center = model->getCenter();
+	float zNear = model->getMinZ();
+	float zFar = model->getMaxZ();
+	for (size_t i = 0; i < frames.size(); ++i)
+	{
+		if (frames[i].turn != 0)
 		{
-			rasterizeTriangle(convertTriTo2D(tris[i]), *red, *green, *blue, *zbuffer);
+			zNear = min(zNear, center.z - model->getTurnRadius());
+			zFar = max(zFar, center.z + model->getTurnRadius());
+			break;
 		}
 	}
-	
-	if (useCUDA)
+
+	printf("Rendering %u frames...", (unsigned)frames.size());
+	fflush(stdout);
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+	RenderTargetPool targets;
+	BackgroundImageWriter writer(imageFormat, pool.size());
+	vector<ShadedMesh> shaded;
+	bool shadedOnce = false;
+	float shadedTurn = 0;
+	Vector3 shadedViewer = lighting.viewer;
+	vector<float> r, g, b;
+	size_t pixels = (size_t)viewport.width * viewport.height;
+
+	for (size_t i = 0; i < frames.size(); ++i)
 	{
-		//Allocate memory on device for triangles and copy array over
-		cudaMalloc((void **)&d_tris, arrSize*sizeof(Triangle));
-		cudaMemcpy(d_tris, tris, arrSize*sizeof(Triangle), cudaMemcpyHostToDevice);
+		const FramePose &frame = frames[i];
+
+		Viewport frameViewport = viewport;
+		if (frame.hasWindow)
+		{
+			frameViewport.xMinWorld = frame.window.xMinWorld;
+			frameViewport.xMaxWorld = frame.window.xMaxWorld;
+			frameViewport.yMinWorld = frame.window.yMinWorld;
+			frameViewport.yMaxWorld = frame.window.yMaxWorld;
+		}
+		if (frame.hasCamera)
+		{
+			Camera camera = viewport.camera;
+			camera.eye = frame.camera.eye;
+			camera.target = frame.camera.target;
+			setCamera(frameViewport, camera);
+		}
+
+		Lighting frameLighting = lighting;
+		if (frameViewport.perspective)
+			frameLighting.viewer = cameraViewer(frameViewport.camera);
+		Vector3 viewer = frameLighting.viewer;
+		if (!shadedOnce || frame.turn != shadedTurn ||
+			viewer.x != shadedViewer.x || viewer.y != shadedViewer.y || viewer.z != shadedViewer.z)
+		{
+			shadeModel(model, turnLighting(frameLighting, frame.turn, center), smoothShading, shaded);
+			shadedOnce = true;
+			shadedTurn = frame.turn;
+			shadedViewer = viewer;
+		}
 
-		Rasterize<<< arrSize/BLOCK_WIDTH+1, BLOCK_WIDTH >>>(d_tris, d_zbuf, d_red, d_green, d_blue);
+		vector<Instance> instances = frame.instances.empty() ? layout : frame.instances;
+		for (size_t k = 0; k < instances.size(); ++k)
+			instances[k].turn = frame.turn;
 
-		cudaFree(d_tris);
+		Framebuffer *framebuffer = targets.acquire(frameViewport, colorFormat, depthFormat, samples);
+		if (frameViewport.perspective)
+			framebuffer->setDepthRange(frameViewport.minZ, 1 / frameViewport.camera.zNear);
+		else
+			framebuffer->setDepthRange(zNear, zFar);
+		drawInstances(model, shaded, instances, *framebuffer, pool, stats);
+
+		// the writer hands back the planes of a frame it has written
+		r.resize(pixels);
+		g.resize(pixels);
+		b.resize(pixels);
+		framebuffer->readColor(r.data(), g.data(), b.data());
+		targets.release(framebuffer);
+
+		if (blurPasses > 0)
+			blurImage(r.data(), g.data(), b.data(), viewport.width, viewport.height, blurPasses, pool);
+
+		char name[64];
+		snprintf(name, sizeof(name), "frame%04u.%s", (unsigned)i, imageFormatExtension(imageFormat));
+		writer.write(name, viewport.width, viewport.height, r, g, b);
 	}
-	delete tris;
+
+	bool written = writer.finish();
+	double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+	printf(" done.\n");
+	printf("%u frames in %.2f s (%.1f ms per frame)\n", (unsigned)frames.size(), seconds,
+		1000 * seconds / frames.size());
+
+	return written ? 0 : 1;
+}
+
+// Copies a host array to newly allocated device memory
+template <typename T>
+T *copyToDevice(const vector<T> &v)
+{
+	T *d_v;
+	cudaMalloc((void **)&d_v, v.size()*sizeof(T));
+	cudaMemcpy(d_v, v.data(), v.size()*sizeof(T), cudaMemcpyHostToDevice);
+	return d_v;
 }
 
-__global__ void gaussVert(float* red, float* green, float* blue, float* redBlur, float* greenBlur, float* blueBlur, float* gauss)
+/*
+* Upload a model and its shaded colors to the GPU. This happens once
+* per model, however many instances of it are drawn.
+*/
+DeviceMesh uploadMesh(const BasicModel *model, const ShadedMesh &shaded)
+{
+	const Mesh &mesh = model->mesh;
+	Vector3 center = model->getCenter();
+
+	DeviceMesh d_mesh;
+	d_mesh.x = copyToDevice(mesh.x);
+	d_mesh.y = copyToDevice(mesh.y);
+	d_mesh.z = copyToDevice(mesh.z);
+	d_mesh.indices = copyToDevice(mesh.indices);
+	d_mesh.red = copyToDevice(shaded.red);
+	d_mesh.green = copyToDevice(shaded.green);
+	d_mesh.blue = copyToDevice(shaded.blue);
+	bool smooth = !shaded.vertexRed.empty();
+	d_mesh.vertexRed = smooth ? copyToDevice(shaded.vertexRed) : NULL;
+	d_mesh.vertexGreen = smooth ? copyToDevice(shaded.vertexGreen) : NULL;
+	d_mesh.vertexBlue = smooth ? copyToDevice(shaded.vertexBlue) : NULL;
+	bool highlights = !shaded.vertexSpecularRed.empty();
+	d_mesh.vertexSpecularRed = highlights ? copyToDevice(shaded.vertexSpecularRed) : NULL;
+	d_mesh.vertexSpecularGreen = highlights ? copyToDevice(shaded.vertexSpecularGreen) : NULL;
+	d_mesh.vertexSpecularBlue = highlights ? copyToDevice(shaded.vertexSpecularBlue) : NULL;
+	d_mesh.vertexCount = mesh.vertexCount();
+	d_mesh.faceCount = mesh.faceCount();
+	d_mesh.centerX = 0 - center.x;
+	d_mesh.centerY = 0 - center.y;
+
+	return d_mesh;
+}
+
+void freeDeviceMesh(DeviceMesh &d_mesh)
+{
+	cudaFree(d_mesh.x);
+	cudaFree(d_mesh.y);
+	cudaFree(d_mesh.z);
+	cudaFree(d_mesh.indices);
+	cudaFree(d_mesh.red);
+	cudaFree(d_mesh.green);
+	cudaFree(d_mesh.blue);
+	cudaFree(d_mesh.vertexRed);
+	cudaFree(d_mesh.vertexGreen);
+	cudaFree(d_mesh.vertexBlue);
+	cudaFree(d_mesh.vertexSpecularRed);
+	cudaFree(d_mesh.vertexSpecularGreen);
+	cudaFree(d_mesh.vertexSpecularBlue);
+}
+
+/*
+* Draw several instances of an uploaded model on the GPU. One kernel
+* transforms the vertices of every instance, a second one culls (see
+* cullTriangle and setFaceCulling) and rasterizes every face of every
+* instance. With more than one sample per pixel, a third one resolves the
+* samples into the first sample's planes.
+*
+* d_mesh: The model (see uploadMesh)
+* instances: Where to put each copy of the model
+* viewport: The screen and the part of the world it shows
+* pattern: The samples of each pixel
+* d_zbuf, d_red, d_green, d_blue: Device framebuffer, pattern.count planes of
+*                                 viewport.width x viewport.height
+*/
+void drawInstancesCUDA(const DeviceMesh &d_mesh, const vector<Instance> &instances, const Viewport &viewport,
+	const SamplePattern &pattern, float* d_zbuf, float* d_red, float* d_green, float* d_blue)
+{
+	int instanceCount = instances.size();
+	int vertexCount = d_mesh.vertexCount * instanceCount;
+	int faceCount = d_mesh.faceCount * instanceCount;
+
+	// screen space vertices for all instances, instance after instance
+	float *d_x, *d_y;
+	cudaMalloc((void **)&d_x, vertexCount*sizeof(float));
+	cudaMalloc((void **)&d_y, vertexCount*sizeof(float));
+	Instance *d_instances = copyToDevice(instances);
+
+	TransformInstances<<< vertexCount/BLOCK_WIDTH+1, BLOCK_WIDTH >>>(d_mesh, d_instances, instanceCount, viewport, d_x, d_y);
+	Rasterize<<< faceCount/BLOCK_WIDTH+1, BLOCK_WIDTH >>>(d_mesh, d_x, d_y, instanceCount, viewport, pattern, getFaceCulling(), d_zbuf, d_red, d_green, d_blue);
+
+	if (pattern.count > 1)
+	{
+		int pixels = viewport.width * viewport.height;
+		ResolveSamples<<< pixels/BLOCK_WIDTH+1, BLOCK_WIDTH >>>(pixels, pattern.count, d_red, d_green, d_blue);
+	}
+
+	cudaFree(d_x);
+	cudaFree(d_y);
+	cudaFree(d_instances);
+}
+
+__global__ void gaussVert(int width, int height, float* red, float* green, float* blue, float* redBlur, float* greenBlur, float* blueBlur, float* gauss, int radius)
 {
    int x = blockIdx.x*10+threadIdx.x;
    int y = blockIdx.y*10+threadIdx.y;
-   if(x>=WindowWidth || y>=WindowHeight)
+   if(x>=width || y>=height)
       return;
 
    VectorThree temp;
-   temp.x = redBlur[y*WindowWidth+x] * gauss[0];
-   temp.y = greenBlur[y*WindowWidth+x] * gauss[0];
-	temp.z = blueBlur[y*WindowWidth+x] * gauss[0];
-	for (int i = 1; i < 5 && y - i >= 0; ++i)
+   temp.x = redBlur[y*width+x] * gauss[0];
+   temp.y = greenBlur[y*width+x] * gauss[0];
+	temp.z = blueBlur[y*width+x] * gauss[0];
+	for (int i = 1; i <= radius && y - i >= 0; ++i)
 	{
-		temp.x += redBlur[x+WindowWidth*(y-i)]*gauss[i];
-		temp.y += greenBlur[x+WindowWidth*(y-i)]*gauss[i];
-		temp.z += blueBlur[x+WindowWidth*(y-i)]*gauss[i];
+		temp.x += redBlur[x+width*(y-i)]*gauss[i];
+		temp.y += greenBlur[x+width*(y-i)]*gauss[i];
+		temp.z += blueBlur[x+width*(y-i)]*gauss[i];
 	}
 	__syncthreads();
-	for (int i = 1; i < 5 && y + i < WindowWidth; ++i)
+	for (int i = 1; i <= radius && y + i < height; ++i)
 	{
-		temp.x += redBlur[x+WindowWidth*(y+i)] * gauss[i];
-		temp.y += greenBlur[x+WindowWidth*(y+i)] * gauss[i];
-		temp.z += blueBlur[x+WindowWidth*(y+i)] * gauss[i];
+		temp.x += redBlur[x+width*(y+i)] * gauss[i];
+		temp.y += greenBlur[x+width*(y+i)] * gauss[i];
+		temp.z += blueBlur[x+width*(y+i)] * gauss[i];
 	}
 	
-	red[y*WindowWidth+x] = temp.x;
-	green[y*WindowWidth+x] = temp.y;
-	blue[y*WindowWidth+x] = temp.z;
+	red[y*width+x] = temp.x;
+	green[y*width+x] = temp.y;
+	blue[y*width+x] = temp.z;
 	
 	__syncthreads();
 }
 
-__global__ void gaussHoriz(float* red, float* green, float* blue, float* redBlur, float* greenBlur, float* blueBlur, float* gauss)
+__global__ void gaussHoriz(int width, int height, float* red, float* green, float* blue, float* redBlur, float* greenBlur, float* blueBlur, float* gauss, int radius)
 {
    int x = blockIdx.x*10+threadIdx.x;
    int y = blockIdx.y*10+threadIdx.y;
    
-   if(x>=WindowWidth || y>=WindowHeight)
+   if(x>=width || y>=height)
       return;
 
    VectorThree temp;
-   temp.x = red[y*WindowWidth+x] * gauss[0];
-   temp.y = green[y*WindowWidth+x] * gauss[0];
-	temp.z = blue[y*WindowWidth+x] * gauss[0];
-	for (int i = 1; i < 5 && x - i >= 0; ++i)
+   temp.x = red[y*width+x] * gauss[0];
+   temp.y = green[y*width+x] * gauss[0];
+	temp.z = blue[y*width+x] * gauss[0];
+	for (int i = 1; i <= radius && x - i >= 0; ++i)
 	{
-		temp.x += red[x-i+WindowWidth*y] * gauss[i];
-		temp.y += green[x-i+WindowWidth*y] * gauss[i];
-		temp.z += blue[x-i+WindowWidth*y] * gauss[i];
+		temp.x += red[x-i+width*y] * gauss[i];
+		temp.y += green[x-i+width*y] * gauss[i];
+		temp.z += blue[x-i+width*y] * gauss[i];
 	}
 	__syncthreads();
-	for (int i = 1; i < 5 && x + i < WindowWidth; ++i)
+	for (int i = 1; i <= radius && x + i < width; ++i)
 	{
-		temp.x += red[x+i+WindowWidth*y] * gauss[i];
-		temp.y += green[x+i+WindowWidth*y] * gauss[i];
-		temp.z += blue[x+i+WindowWidth*y] * gauss[i];
+		temp.x += red[x+i+width*y] * gauss[i];
+		temp.y += green[x+i+width*y] * gauss[i];
+		temp.z += blue[x+i+width*y] * gauss[i];
 	}
-	redBlur[y*WindowWidth+x] = temp.x;
-	greenBlur[y*WindowWidth+x] = temp.y;
-	blueBlur[y*WindowWidth+x] = temp.z;
+	redBlur[y*width+x] = temp.x;
+	greenBlur[y*width+x] = temp.y;
+	blueBlur[y*width+x] = temp.z;
 	__syncthreads();
 }
 
-void gaussianGPU(int passes, float *r, float *g, float *b)
+void gaussianGPU(int passes, int width, int height, float *r, float *g, float *b)
 {
-	printf("Anti-Aliasing...");
+	printf("Blurring...");
 	fflush(stdout);
 	
+	// all the passes as one kernel, see Blur.h
+	vector<float> weights;
+	int radius = collapsedBlurKernel(passes, weights);
+
 	float *gauss, *rBlur, *bBlur, *gBlur;
 	
-	cudaMalloc((void **)&gauss, 5*sizeof(float));
-	cudaMemcpy(gauss, gaussianBlurWeights, 5*sizeof(float), cudaMemcpyHostToDevice);
-	cudaMalloc((void **)&rBlur, WindowWidth*WindowHeight*sizeof(float));
-	cudaMalloc((void **)&gBlur, WindowWidth*WindowHeight*sizeof(float));
-	cudaMalloc((void **)&bBlur, WindowWidth*WindowHeight*sizeof(float));
+	cudaMalloc((void **)&gauss, weights.size()*sizeof(float));
+	cudaMemcpy(gauss, weights.data(), weights.size()*sizeof(float), cudaMemcpyHostToDevice);
+	cudaMalloc((void **)&rBlur, (size_t)width*height*sizeof(float));
+	cudaMalloc((void **)&gBlur, (size_t)width*height*sizeof(float));
+	cudaMalloc((void **)&bBlur, (size_t)width*height*sizeof(float));
 	
-	dim3 grid (200, 200), block(10, 10);
+	dim3 grid ((width+9)/10, (height+9)/10), block(10, 10);
 	
-	for(int i=0;i<passes;++i)
-	{
-	   gaussHoriz<<< grid, block >>>(r, g, b, rBlur, gBlur, bBlur, gauss);
-	   gaussVert<<< grid, block >>> (r, g, b, rBlur, gBlur, bBlur, gauss);
-	}
+	gaussHoriz<<< grid, block >>>(width, height, r, g, b, rBlur, gBlur, bBlur, gauss, radius);
+	gaussVert<<< grid, block >>> (width, height, r, g, b, rBlur, gBlur, bBlur, gauss, radius);
 	
 	cudaFree(gauss);
 	cudaFree(rBlur);
@@ -291,377 +837,100 @@ void gaussianGPU(int passes, float *r, float *g, float *b)
 	printf(" done.\n");
 }
 
-/*
-* Applies Gaussian blurring for a given pixel coordinate
-* using neighboring pixels on the same row.
-*
-* x, y: Pixel coordinates for the point to blur.
-*/
-__device__ __host__ VectorThree horizontalBlur(int x, int y, float *r, float *g, float *b, float *gauss)
-{
-	VectorThree blurredColors; // x = red, y = green, z = blue
-
-	blurredColors.x = r[y*WindowWidth+x] * gauss[0];
-	blurredColors.y = g[y*WindowWidth+x] * gauss[0];
-	blurredColors.z = b[y*WindowWidth+x] * gauss[0];
-
-	for (int i = 1; i < 5 && x - i >= 0; ++i)
-	{
-		blurredColors.x += r[x-i+WindowWidth*y] * gauss[i];
-		blurredColors.y += g[x-i+WindowWidth*y] * gauss[i];
-		blurredColors.z += b[x-i+WindowWidth*y] * gauss[i];
-	}
-	for (int i = 1; i < 5 && x + i < WindowWidth; ++i)
-	{
-		blurredColors.x += r[x+i+WindowWidth*y] * gauss[i];
-		blurredColors.y += g[x+i+WindowWidth*y] * gauss[i];
-		blurredColors.z += b[x+i+WindowWidth*y] * gauss[i];
-	}
-
-	return blurredColors;
-}
-
-/*
-* Applies Gaussian blurring for a given pixel coordinate
-* using neighboring pixels on the same column.
-*
-* NOTE: This Gaussian blur implementation is designed to use
-* the results of horizontal blurring as input for the vertical
-* blurring pass. Therefore, the blurredRed/blurredGreen/blurredBlue
-* arrays MUST be fully populated with horizontally blurred colors
-* before this function is called.
-* 
-* x, y: Pixel coordinates for the point to blur.
-*/
-__device__ __host__ VectorThree verticalBlur(int x, int y, float *r, float *g, float *b, float *gauss)
+void init(const Viewport &viewport)
 {
-	VectorThree blurredColors; // x = red, y = green, z = blue
-
-	blurredColors.x = r[y*WindowWidth+x] * gauss[0];
-	blurredColors.y = g[y*WindowWidth+x] * gauss[0];
-	blurredColors.z = b[y*WindowWidth+x] * gauss[0];
-
-	for (int i = 1; i < 5 && y - i >= 0; ++i)
-	{
-		blurredColors.x += r[x+WindowWidth*y-i] * gauss[i];
-		blurredColors.y += g[x+WindowWidth*y-i] * gauss[i];
-		blurredColors.z += b[x+WindowWidth*y-i] * gauss[i];
-	}
-	for (int i = 1; i < 5 && y + i < WindowHeight; ++i)
-	{
-		blurredColors.x += r[x+WindowWidth*y+i] * gauss[i];
-		blurredColors.y += g[x+WindowWidth*y+i] * gauss[i];
-		blurredColors.z += b[x+WindowWidth*y+i] * gauss[i];
-	}
-
-	return blurredColors;
+	size_t pixels = (size_t)viewport.width * viewport.height;
+	zbuffer.assign(pixels, viewport.minZ);
+	red.assign(pixels, 0);
+	green.assign(pixels, 0);
+	blue.assign(pixels, 0);
+
+	// white light, always coming from positive Z
+	lighting = defaultLighting();
 }
 
 /*
-* CPU implementation of Gaussian blurring (anti-aliasing).
-* 
-* numPasses: How many times the image should be blurred
+* Transform the vertices of every instance to screen coordinates. Uses the
+* same arithmetic as BasicModel::transformVertices and convertVerticesTo2D.
 */
-void gaussianBlurCPU(int numPasses)
+__global__ void TransformInstances(DeviceMesh d_mesh, const Instance *d_instances, int instanceCount, Viewport viewport, float *d_x, float *d_y)
 {
-	cout << "Anti-Aliasing... " << endl;
-	for (int i = 0; i < numPasses; ++i)
-	{
-		// Do just horizontal blurring first. Use the blurredRed, 
-		// blurredGreen, and blurredBlue arrays to hold the results
-		// of this blurring pass.
-		for (int x = 0; x < WindowWidth; ++x)
-		{
-			for (int y = 0; y < WindowHeight; ++y)
-			{
-				VectorThree hBlur = horizontalBlur(x, y, (float *)red, (float *)green, (float *)blue, (float *)gaussianBlurWeights);
-
-				blurredRed[x][y] = hBlur.x;
-				blurredGreen[x][y] = hBlur.y;
-				blurredBlue[x][y] = hBlur.z;
-			}
-		}
-
-		// Do vertical blurring next, using the results
-		// of the horizontal blurring. The final blurred
-		// colors are written back into the primary
-		// red/green/blue arrays.
-		for (int x = 0; x < WindowWidth; ++x)
-		{
-			for (int y = 0; y < WindowHeight; ++y)
-			{
-				VectorThree vBlur = verticalBlur(x, y, (float *)blurredRed, (float *)blurredGreen, (float *)blurredBlue, (float *)gaussianBlurWeights);
-
-				red[x][y] = vBlur.x;
-				green[x][y] = vBlur.y;
-				blue[x][y] = vBlur.z;
-			}
-		}
-	}
-	cout << "done." << endl;
-}
-
-void init()
-{
-	for (int i = 0; i < WindowWidth; ++i)
-	{
-		for (int j = 0; j < WindowHeight; ++j)
-		{
-			zbuffer[i][j] = MinZ;
-			red[i][j] = 0;
-			green[i][j] = 0;
-			blue[i][j] = 0;
-		}
-	}
+   int idx = blockIdx.x*BLOCK_WIDTH+threadIdx.x;
+   if (idx >= d_mesh.vertexCount*instanceCount)
+      return;
 
-	// set light to always come from positive Z
-	directionToLight.x = 0;
-	directionToLight.y = 0;
-	directionToLight.z = 1;
+   Instance instance = d_instances[idx / d_mesh.vertexCount];
+   int v = idx % d_mesh.vertexCount;
 
-	// white light
-	lightColor.x = 1;
-	lightColor.y = 1;
-	lightColor.z = 1;
+   d_x[idx] = worldToScreenX(viewport, (d_mesh.x[v] + d_mesh.centerX) * instance.scale + instance.xOffset);
+   d_y[idx] = worldToScreenY(viewport, (d_mesh.y[v] + d_mesh.centerY) * instance.scale + instance.yOffset);
 }
 
 /*
-* Calculates colors (RGB) for a vertex using diffuse reflectance.
-*
-* normal: The vertex's normal vector
-* diffuseReflectance: how much diffuse light the vertex reflects (red, green, and blue components)
-*
-* returns: The vertex's diffuse color represented as an RGB triplet.
+* Cull, then rasterize, one face of one instance per thread.
 */
-Vector3 diffuseShadeVertex(Vector3 normal, Vector3 diffuseReflectance)
+__global__ void Rasterize(DeviceMesh d_mesh, const float *d_x, const float *d_y, int instanceCount, Viewport viewport, SamplePattern pattern, FaceCulling culling, float *d_zbuf, float *d_red, float *d_green, float *d_blue)
 {
-	Vector3 diffuseColor;
-	float nDotL = normal.dotP(directionToLight);
-
-	// red
-	diffuseColor.x = diffuseReflectance.x * nDotL * lightColor.x;
-
-	// green
-	diffuseColor.y = diffuseReflectance.y * nDotL * lightColor.y;
-
-	// blue
-	diffuseColor.z = diffuseReflectance.z * nDotL * lightColor.z;
+   int idx = blockIdx.x*BLOCK_WIDTH+threadIdx.x;
+   if (idx >= d_mesh.faceCount*instanceCount)
+      return;
 
-	return diffuseColor;
-}
+   int instance = idx / d_mesh.faceCount;
+
+   ScreenMesh screen;
+   screen.x = d_x + instance*d_mesh.vertexCount;
+   screen.y = d_y + instance*d_mesh.vertexCount;
+   screen.z = d_mesh.z;
+   screen.indices = d_mesh.indices;
+   screen.red = d_mesh.red;
+   screen.green = d_mesh.green;
+   screen.blue = d_mesh.blue;
+   screen.vertexRed = d_mesh.vertexRed;
+   screen.vertexGreen = d_mesh.vertexGreen;
+   screen.vertexBlue = d_mesh.vertexBlue;
+   screen.vertexSpecularRed = d_mesh.vertexSpecularRed;
+   screen.vertexSpecularGreen = d_mesh.vertexSpecularGreen;
+   screen.vertexSpecularBlue = d_mesh.vertexSpecularBlue;
+   screen.clipX = NULL;
+   screen.clipY = NULL;
+   screen.clipZ = NULL;
+   screen.clipW = NULL;
+   screen.faceCount = d_mesh.faceCount;
+
+   Triangle t = assembleTriangle(screen, idx % d_mesh.faceCount);
+   if (cullTriangle(t, viewport, culling, pattern.count > 1 ? 1 : 0) != CULL_KEPT)
+      return;
 
-/*
-* Given a Triangle with vertices specified in world coordinates,
-* convert the triangle to 2D (screen) coordinates.
-*
-* t: The triangle in world coordinates
-* 
-* returns: The triangle converted to screen coordinates
-*/
-__device__ __host__ Triangle convertTriTo2D(Triangle t)
-{
-	Triangle converted = t;
-
-	// convert the vertices to screen space
-	Vector3 convertedV1 = convertVertexTo2D(t.v1.position);
-	Vector3 convertedV2 = convertVertexTo2D(t.v2.position);
-	Vector3 convertedV3 = convertVertexTo2D(t.v3.position);
-	converted.v1.position = convertedV1;
-	converted.v2.position = convertedV2;
-	converted.v3.position = convertedV3;
-
-	// calculate bounding box for the triangle (in screen coordinates)
-	converted.minX = min(convertedV1.x, min(convertedV2.x, convertedV3.x));
-	converted.maxX = max(convertedV1.x, max(convertedV2.x, convertedV3.x));
-	converted.minY = min(convertedV1.y, min(convertedV2.y, convertedV3.y));
-	converted.maxY = max(convertedV1.y, max(convertedV2.y, convertedV3.y));
-
-	return converted;
+   if (pattern.count > 1)
+   {
+      PixelPlanes planes = {d_red, d_green, d_blue, d_zbuf, 0, 0, viewport.width, viewport.width*viewport.height};
+      rasterizeTriangleMSAA(t, 0, 0, viewport.width, viewport.height, planes, pattern);
+   }
+   else
+      rasterizeTriangle(t, viewport, d_red, d_green, d_blue, d_zbuf);
 }
 
 /*
-* Convert the provided point from world coordinates to screen coordinates.
-*
-* coords: The vertex coordinates we want to convert
-* 
-* returns: The vertex converted to screen coordinates
+* Average each pixel's samples into the first sample's planes, one pixel
+* per thread.
 */
-__device__ __host__ Vector3 convertVertexTo2D(Vector3 coords)
+__global__ void ResolveSamples(int pixels, int samples, float *d_red, float *d_green, float *d_blue)
 {
-	coords.x = ((coords.x - XMinWorld) * WindowWidth) / (XMaxWorld - XMinWorld);
-	coords.y = ((coords.y - YMinWorld) * WindowHeight) / (YMaxWorld - YMinWorld);
-	
-	return coords;
-}
+   int idx = blockIdx.x*BLOCK_WIDTH+threadIdx.x;
+   if (idx >= pixels)
+      return;
 
-/*
-* Rasterize a triangle.
-*
-* t: The triangle to rasterize (should already be converted to screen coordinates)
-*/
-__device__ __host__ void rasterizeTriangle(Triangle t, float *r, float *g, float *b, float *z)
-{
-	Vector3 v1Color = t.v1.rgb;
-	Vector3 v2Color = t.v2.rgb;
-	Vector3 v3Color = t.v3.rgb;
-	float v1Z = t.v1.position.z;
-	float v2Z = t.v2.position.z;
-	float v3Z = t.v3.position.z;
-
-	// denominator for barycentric coords calculation = (v1.x*v2.y) - (v1.x*v3.y) - (v2.x*v1.y) + (v2.x*v3.y) + (v3.x*v1.y) - (v3.x*v2.y)
-	// calculate this once for the triangle
-	float denom = (t.v1.position.x * t.v2.position.y) -
-		(t.v1.position.x * t.v3.position.y) -
-		(t.v2.position.x * t.v1.position.y) +
-		(t.v2.position.x * t.v3.position.y) +
-		(t.v3.position.x * t.v1.position.y) -
-		(t.v3.position.x * t.v2.position.y);
-	
-	// iterate over each point (pixel) in the triangle's bounding box
-	for (int x = t.minX; x < t.maxX; ++x)
-	{
-		for (int y = t.minY; y < t.maxY; ++y)
-		{
-			if (x < 0 || x >= WindowWidth || y < 0 || y >= WindowHeight)
-				continue;
-		
-			Vertex2 p;
-			p.position.x = x;
-			p.position.y = y;
-
-			// get barycentric coordinates for p (the current X/Y position)
-			// See utils.h for VectorThree
-			VectorThree baryCoords = barycentricCoords(t.v1.position, t.v2.position, t.v3.position, p.position, denom);
-
-			// Test the pixel to see if it's inside the triangle. All three
-			// barycentric coordinates must be between 0 and 1 for the pixel
-			// to be inside the triangle.
-			if (baryCoords.x > 0 && baryCoords.x < 1		// check alpha
-				&& baryCoords.y > 0 && baryCoords.y < 1		// check beta
-				&& baryCoords.z > 0 && baryCoords.z < 1)	// check gamma
-			{
-				// linearly interpolate the point's color
-				p.rgb.x = baryCoords.x*v1Color.x + baryCoords.y*v2Color.x + baryCoords.z*v3Color.x;	// red
-				p.rgb.y = baryCoords.x*v1Color.y + baryCoords.y*v2Color.y + baryCoords.z*v3Color.y;	// green
-				p.rgb.z = baryCoords.x*v1Color.z + baryCoords.y*v3Color.z + baryCoords.z*v3Color.z;	// blue
-
-				// linearly interpolate the point's depth
-				p.position.z = baryCoords.x*v1Z + baryCoords.y*v2Z + baryCoords.z*v3Z;
-
-				// Z buffer test.
-				// The camera is at the origin (0, 0, 0) looking down the negative Z axis.
-				// This means closer to the camera = greater Z value.
-				if (p.position.z > z[x*WindowWidth+y])
-				{
-					// write the pixel's color components to our color arrays
-					r[x*WindowWidth+y] = p.rgb.x;
-					g[x*WindowWidth+y] = p.rgb.y;
-					b[x*WindowWidth+y] = p.rgb.z;
-
-					// update the Z buffer
-					z[x*WindowWidth+y] = p.position.z;
-				}
-			}
-		}
-	}
+   resolveSamples(d_red + idx, d_green + idx, d_blue + idx, samples, pixels, 1, d_red + idx, d_green + idx, d_blue + idx);
 }
 
 /*
-* Calculate the barycentric coordinates for a point with respect to the provided
-* vertex positions.
-*
-* v1, v2, v3: The triangle's vertices
-* p: The point to get the barycentric coordinates for (may be inside or outside the triangle)
-*
-* returns: p's corresponding barycentric coordinates as a Vector3 struct. (x = alpha, y = beta, z = gamma)
+* Set count floats to value, one per thread.
 */
-__device__ __host__ VectorThree barycentricCoords(Vector3 v1, Vector3 v2, Vector3 v3, VectorThree p, float denom)
+__global__ void FillPlanes(size_t count, float value, float *d_planes)
 {
-	// NOTE: these formulas found at http://crackthecode.us/barycentric/barycentric_coordinates.html
-	//float denom = (v1.x*v2.y) - (v1.x*v3.y) - (v2.x*v1.y) + (v2.x*v3.y) + (v3.x*v1.y) - (v3.x*v2.y);
-
-	// ((X4 * Y2) - (X4 * Y3) - (X2 * Y4) + (X2 * Y3) + (X3 * Y4) - (X3 * Y2)) 
-	float alpha = ((p.x*v2.y) - (p.x*v3.y) - (v2.x*p.y) + (v2.x*v3.y) + (v3.x*p.y) - (v3.x*v2.y)) / denom;
-
-	// ((X1 * Y4) - (X1 * Y3) - (X4 * Y1) + (X4 * Y3) + (X3 * Y1) - (X3 * Y4)) 
-	float beta = ((v1.x*p.y) - (v1.x*v3.y) - (p.x*v1.y) + (p.x*v3.y) + (v3.x*v1.y) - (v3.x*p.y)) / denom;
-
-	// ((X1 * Y2) - (X1 * Y4) - (X2 * Y1) + (X2 * Y4) + (X4 * Y1) - (X4 * Y2))
-	float gamma = ((v1.x*v2.y) - (v1.x*p.y) - (v2.x*v1.y) + (v2.x*p.y) + (p.x*v1.y) - (p.x*v2.y)) / denom;
-
-   // See utils.h for VectorThree
-	VectorThree baryCoords;
-	baryCoords.x = alpha;
-	baryCoords.y = beta;
-	baryCoords.z = gamma;
-
-	return baryCoords;
-}
-
-void WriteTga(char *outfile)
-{
-    FILE *fp = fopen(outfile, "wb"); // originally was just "w"
-    if (fp == NULL)
-    {
-        perror("ERROR: Image::WriteTga() failed to open file for writing!\n");
-        exit(EXIT_FAILURE);
-    }
-    
-    // write 24-bit uncompressed targa header
-    // thanks to Paul Bourke (http://local.wasp.uwa.edu.au/~pbourke/dataformats/tga/)
-    putc(0, fp);
-    putc(0, fp);
-    
-    putc(2, fp); // type is uncompressed RGB
-    
-    putc(0, fp);
-    putc(0, fp);
-    putc(0, fp);
-    putc(0, fp);
-    putc(0, fp);
-    
-    putc(0, fp); // x origin, low byte
-    putc(0, fp); // x origin, high byte
-    
-    putc(0, fp); // y origin, low byte
-    putc(0, fp); // y origin, high byte
-
-    putc(WindowWidth & 0xff, fp); // width, low byte
-    putc((WindowWidth & 0xff00) >> 8, fp); // width, high byte
-
-    putc(WindowHeight & 0xff, fp); // height, low byte
-    putc((WindowHeight & 0xff00) >> 8, fp); // height, high byte
-
-    putc(24, fp); // 24-bit color depth
-
-    putc(0, fp);
-
-    // write the raw pixel data in groups of 3 bytes (BGR order)
-    for (int y = 0; y < WindowHeight; y++)
-    {
-        for (int x = 0; x < WindowWidth; x++)
-        {
-            // if color scaling is on, scale 0.0 -> _max as a 0 -> 255 unsigned byte
-            unsigned char rbyte, gbyte, bbyte;
-            double r = (red[x][y] > 1.0) ? 1.0 : red[x][y];
-            double g = (green[x][y] > 1.0) ? 1.0 : green[x][y];
-            double b = (blue[x][y] > 1.0) ? 1.0 : blue[x][y];
-            rbyte = (unsigned char)(r * 255);
-            gbyte = (unsigned char)(g * 255);
-            bbyte = (unsigned char)(b * 255);
-
-            putc(bbyte, fp);
-            putc(gbyte, fp);
-            putc(rbyte, fp);
-        }
-    }
-
-    fclose(fp);
-}
+   size_t idx = (size_t)blockIdx.x*BLOCK_WIDTH+threadIdx.x;
+   if (idx >= count)
+      return;
 
-__global__ void Rasterize(Triangle *d_tris, float *d_zbuf, float *d_red, float *d_green, float *d_blue)
-{
-   int idx = blockIdx.x*BLOCK_WIDTH+threadIdx.x;
-   
-   rasterizeTriangle(convertTriTo2D(d_tris[idx]), d_red, d_green, d_blue, d_zbuf);
+   d_planes[idx] = value;
 }
@@ -0,0 +1,106 @@
+#include "ThreadPool.h"
+
+using namespace std;
+
+ThreadPool::ThreadPool(int threadCount) :
+	generation(0), busyWorkers(0), stopping(false), task(0), taskCount(0), nextTask(0)
+{
+	if (threadCount <= 0)
+		threadCount = thread::hardware_concurrency();
+	if (threadCount <= 0)
+		threadCount = 1;
+
+	for (int i = 1; i < threadCount; ++i)
+		workers.push_back(thread(&ThreadPool::workerLoop, this));
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	wake.notify_all();
+
+	for (size_t i = 0; i < workers.size(); ++i)
+		workers[i].join();
+}
+
+void ThreadPool::parallelFor(int count, const function<void(int)> &t)
+{
+	if (count <= 0)
+		return;
+
+	// not worth waking anybody up
+	if (count == 1 || workers.empty())
+	{
+		for (int i = 0; i < count; ++i)
+			t(i);
+		return;
+	}
+
+	{
+		lock_guard<std::mutex> lock(mutex);
+		task = &t;
+		taskCount = count;
+		nextTask = 0;
+		busyWorkers = workers.size();
+		++generation;
+	}
+	wake.notify_all();
+
+	// the calling thread helps out
+	runTasks();
+
+	unique_lock<std::mutex> lock(mutex);
+	done.wait(lock, [this] { return busyWorkers == 0; });
+	task = 0;
+	exception_ptr thrown = error;
+	error = NULL;
+	lock.unlock();
+	if (thrown)
+		rethrow_exception(thrown);
+}
+
+void ThreadPool::runTasks()
+{
+	for (int i = nextTask++; i < taskCount; i = nextTask++)
+	{
+		try
+		{
+			(*task)(i);
+		}
+		catch (...)
+		{
+			// the rest are skipped
+			lock_guard<std::mutex> lock(mutex);
+			if (!error)
+				error = current_exception();
+			nextTask = taskCount;
+		}
+	}
+}
+
+void ThreadPool::workerLoop()
+{
+	unsigned long seen = 0;
+
+	for (;;)
+	{
+		{
+			unique_lock<std::mutex> lock(mutex);
+			wake.wait(lock, [&] { return stopping || generation != seen; });
+			if (stopping)
+				return;
+			seen = generation;
+		}
+
+		runTasks();
+
+		{
+			lock_guard<std::mutex> lock(mutex);
+			--busyWorkers;
+		}
+		done.notify_one();
+	}
+}
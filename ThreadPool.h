@@ -0,0 +1,52 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed set of worker threads for data-parallel loops.
+//
+// parallelFor hands out loop indices one at a time from a shared counter,
+// so a thread that finishes early just picks up the next index; uneven
+// work items balance out without any per-item scheduling.
+class ThreadPool
+{
+public:
+	// threadCount <= 0 uses one thread per core. The calling thread counts
+	// as one of them, so threadCount - 1 workers are started.
+	ThreadPool(int threadCount = 0);
+	~ThreadPool();
+
+	int size() const { return workers.size() + 1; }
+
+	// Runs task(i) for every i in [0, count) and returns when all are done.
+	// If a task throws, no more are started, and the first exception is
+	// rethrown once the ones running have finished.
+	// Not reentrant: task must not call parallelFor on the same pool.
+	void parallelFor(int count, const std::function<void(int)> &task);
+
+private:
+	void workerLoop();
+	void runTasks();
+
+	std::vector<std::thread> workers;
+
+	std::mutex mutex;
+	std::condition_variable wake;
+	std::condition_variable done;
+	unsigned long generation;	// bumped for every parallelFor call
+	int busyWorkers;
+	bool stopping;
+
+	const std::function<void(int)> *task;
+	int taskCount;
+	std::atomic<int> nextTask;
+	std::exception_ptr error;	// the first task that threw, this call
+};
+
+#endif
@@ -0,0 +1,141 @@
+#include "Transform.h"
+
+#include "RasterizerSIMD.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_X86_SIMD 1
+#include <immintrin.h>
+#endif
+
+/*
+* Transform points [first, count) one at a time. Each output is summed in
+* the same order as in the vectorized versions, so they agree exactly.
+*/
+static void transformPointsScalar(const Matrix4 &m, int first, int count, const float *x, const float *y,
+	const float *z, float *outX, float *outY, float *outZ, float *outW)
+{
+	float *out[4] = {outX, outY, outZ, outW};
+	for (int row = 0; row < 4; ++row)
+	{
+		const float *r = m.m[row];
+		float *o = out[row];
+		for (int i = first; i < count; ++i)
+			o[i] = ((r[0]*x[i] + r[1]*y[i]) + r[2]*z[i]) + r[3];
+	}
+}
+
+static void projectPointsScalar(int first, int count, float halfWidth, float halfHeight, const float *x,
+	const float *y, const float *w, float *outX, float *outY, float *outZ)
+{
+	for (int i = first; i < count; ++i)
+		projectPoint(halfWidth, halfHeight, x[i], y[i], w[i], outX[i], outY[i], outZ[i]);
+}
+
+#if HAVE_X86_SIMD
+
+static void transformPointsSSE2(const Matrix4 &m, int count, const float *x, const float *y, const float *z,
+	float *outX, float *outY, float *outZ, float *outW)
+{
+	float *out[4] = {outX, outY, outZ, outW};
+	int n = 0;
+	for (; n + 4 <= count; n += 4)
+	{
+		__m128 px = _mm_loadu_ps(x + n);
+		__m128 py = _mm_loadu_ps(y + n);
+		__m128 pz = _mm_loadu_ps(z + n);
+		for (int row = 0; row < 4; ++row)
+		{
+			const float *r = m.m[row];
+			__m128 v = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(r[0]), px), _mm_mul_ps(_mm_set1_ps(r[1]), py));
+			v = _mm_add_ps(_mm_add_ps(v, _mm_mul_ps(_mm_set1_ps(r[2]), pz)), _mm_set1_ps(r[3]));
+			_mm_storeu_ps(out[row] + n, v);
+		}
+	}
+	transformPointsScalar(m, n, count, x, y, z, outX, outY, outZ, outW);
+}
+
+__attribute__((target("avx2")))
+static void transformPointsAVX2(const Matrix4 &m, int count, const float *x, const float *y, const float *z,
+	float *outX, float *outY, float *outZ, float *outW)
+{
+	float *out[4] = {outX, outY, outZ, outW};
+	int n = 0;
+	for (; n + 8 <= count; n += 8)
+	{
+		__m256 px = _mm256_loadu_ps(x + n);
+		__m256 py = _mm256_loadu_ps(y + n);
+		__m256 pz = _mm256_loadu_ps(z + n);
+		for (int row = 0; row < 4; ++row)
+		{
+			const float *r = m.m[row];
+			__m256 v = _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(r[0]), px), _mm256_mul_ps(_mm256_set1_ps(r[1]), py));
+			v = _mm256_add_ps(_mm256_add_ps(v, _mm256_mul_ps(_mm256_set1_ps(r[2]), pz)), _mm256_set1_ps(r[3]));
+			_mm256_storeu_ps(out[row] + n, v);
+		}
+	}
+	transformPointsScalar(m, n, count, x, y, z, outX, outY, outZ, outW);
+}
+
+static void projectPointsSSE2(int count, float halfWidth, float halfHeight, const float *x, const float *y,
+	const float *w, float *outX, float *outY, float *outZ)
+{
+	const __m128 one = _mm_set1_ps(1);
+	__m128 hw = _mm_set1_ps(halfWidth);
+	__m128 hh = _mm_set1_ps(halfHeight);
+	int n = 0;
+	for (; n + 4 <= count; n += 4)
+	{
+		__m128 invW = _mm_div_ps(one, _mm_loadu_ps(w + n));
+		_mm_storeu_ps(outX + n, _mm_mul_ps(_mm_add_ps(_mm_mul_ps(_mm_loadu_ps(x + n), invW), one), hw));
+		_mm_storeu_ps(outY + n, _mm_mul_ps(_mm_add_ps(_mm_mul_ps(_mm_loadu_ps(y + n), invW), one), hh));
+		_mm_storeu_ps(outZ + n, invW);
+	}
+	projectPointsScalar(n, count, halfWidth, halfHeight, x, y, w, outX, outY, outZ);
+}
+
+__attribute__((target("avx2")))
+static void projectPointsAVX2(int count, float halfWidth, float halfHeight, const float *x, const float *y,
+	const float *w, float *outX, float *outY, float *outZ)
+{
+	const __m256 one = _mm256_set1_ps(1);
+	__m256 hw = _mm256_set1_ps(halfWidth);
+	__m256 hh = _mm256_set1_ps(halfHeight);
+	int n = 0;
+	for (; n + 8 <= count; n += 8)
+	{
+		__m256 invW = _mm256_div_ps(one, _mm256_loadu_ps(w + n));
+		_mm256_storeu_ps(outX + n, _mm256_mul_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(x + n), invW), one), hw));
+		_mm256_storeu_ps(outY + n, _mm256_mul_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(y + n), invW), one), hh));
+		_mm256_storeu_ps(outZ + n, invW);
+	}
+	projectPointsScalar(n, count, halfWidth, halfHeight, x, y, w, outX, outY, outZ);
+}
+
+#endif
+
+void transformPoints(const Matrix4 &m, int count, const float *x, const float *y, const float *z,
+	float *outX, float *outY, float *outZ, float *outW)
+{
+	// same level switch as the rasterizer
+#if HAVE_X86_SIMD
+	if (getSimdLevel() >= SIMD_AVX2)
+		transformPointsAVX2(m, count, x, y, z, outX, outY, outZ, outW);
+	else if (getSimdLevel() == SIMD_SSE2)
+		transformPointsSSE2(m, count, x, y, z, outX, outY, outZ, outW);
+	else
+#endif
+		transformPointsScalar(m, 0, count, x, y, z, outX, outY, outZ, outW);
+}
+
+void projectPoints(int count, float halfWidth, float halfHeight, const float *x, const float *y, const float *w,
+	float *outX, float *outY, float *outZ)
+{
+#if HAVE_X86_SIMD
+	if (getSimdLevel() >= SIMD_AVX2)
+		projectPointsAVX2(count, halfWidth, halfHeight, x, y, w, outX, outY, outZ);
+	else if (getSimdLevel() == SIMD_SSE2)
+		projectPointsSSE2(count, halfWidth, halfHeight, x, y, w, outX, outY, outZ);
+	else
+#endif
+		projectPointsScalar(0, count, halfWidth, halfHeight, x, y, w, outX, outY, outZ);
+}
@@ -0,0 +1,169 @@
+#ifndef TRANSFORM_H
+#define TRANSFORM_H
+
+#include "utils.h"
+
+// Homogeneous 4x4 transforms, and the vertex stage of the perspective
+// pipeline: model, view and projection matrices take a mesh's vertices to
+// clip space in one batch, and the perspective divide takes them on to the
+// screen (see drawMesh in Renderer.cpp).
+//
+// Vertices are kept as a struct of arrays, as in Mesh, so the batch
+// functions run 4 or 8 vertices at a time at the rasterizer's SIMD level
+// (see setSimdLevel), with exactly the results of the scalar version.
+
+// Row major, for column vectors: a point p goes to m * (p.x, p.y, p.z, 1).
+// The product a * b applies b first.
+typedef struct Matrix4
+{
+	float m[4][4];
+} Matrix4;
+
+inline HOST_DEVICE Matrix4 identityMatrix()
+{
+	Matrix4 r;
+	for (int i = 0; i < 4; ++i)
+	{
+		for (int j = 0; j < 4; ++j)
+			r.m[i][j] = i == j ? 1.0f : 0.0f;
+	}
+	return r;
+}
+
+inline HOST_DEVICE Matrix4 multiplyMatrices(const Matrix4 &a, const Matrix4 &b)
+{
+	Matrix4 r;
+	for (int i = 0; i < 4; ++i)
+	{
+		for (int j = 0; j < 4; ++j)
+			r.m[i][j] = a.m[i][0]*b.m[0][j] + a.m[i][1]*b.m[1][j] + a.m[i][2]*b.m[2][j] + a.m[i][3]*b.m[3][j];
+	}
+	return r;
+}
+
+inline HOST_DEVICE Matrix4 translationMatrix(float x, float y, float z)
+{
+	Matrix4 r = identityMatrix();
+	r.m[0][3] = x;
+	r.m[1][3] = y;
+	r.m[2][3] = z;
+	return r;
+}
+
+inline HOST_DEVICE Matrix4 scaleMatrix(float x, float y, float z)
+{
+	Matrix4 r = identityMatrix();
+	r.m[0][0] = x;
+	r.m[1][1] = y;
+	r.m[2][2] = z;
+	return r;
+}
+
+// Turns by angle radians about the y axis, from +z towards +x (like Instance)
+inline HOST_DEVICE Matrix4 rotationYMatrix(float angle)
+{
+	float c = cosf(angle);
+	float s = sinf(angle);
+	Matrix4 r = identityMatrix();
+	r.m[0][0] = c;
+	r.m[0][2] = s;
+	r.m[2][0] = -s;
+	r.m[2][2] = c;
+	return r;
+}
+
+/*
+* The view matrix of a camera at eye looking at target: it moves eye to the
+* origin and turns the world so the camera looks down -z, with up pointing
+* along +y as near as it can.
+*
+* returns: The matrix; the identity if eye and target are the same point or
+*          up is along the line between them
+*/
+inline HOST_DEVICE Matrix4 lookAtMatrix(Vector3 eye, Vector3 target, Vector3 up)
+{
+	Vector3 back(eye.x - target.x, eye.y - target.y, eye.z - target.z);
+	Vector3 right = up.crossP(back);
+	float backLength = back.length();
+	float rightLength = right.length();
+	if (!(backLength > 0 && rightLength > 0))
+		return identityMatrix();
+
+	back = Vector3(back.x / backLength, back.y / backLength, back.z / backLength);
+	right = Vector3(right.x / rightLength, right.y / rightLength, right.z / rightLength);
+	Vector3 trueUp = back.crossP(right);
+
+	Matrix4 r = identityMatrix();
+	Vector3 axes[3] = {right, trueUp, back};
+	for (int i = 0; i < 3; ++i)
+	{
+		r.m[i][0] = axes[i].x;
+		r.m[i][1] = axes[i].y;
+		r.m[i][2] = axes[i].z;
+		r.m[i][3] = -axes[i].dotP(eye);
+	}
+	return r;
+}
+
+/*
+* A perspective projection, as glFrustum / gluPerspective make it: a camera
+* at the origin looking down -z sees fovY radians from the bottom of the
+* image to the top. A point in front of it gets w = its distance along -z,
+* and -w <= z <= w in clip space when it is between zNear and zFar.
+*
+* aspect: The image's width over its height
+*/
+inline HOST_DEVICE Matrix4 perspectiveMatrix(float fovY, float aspect, float zNear, float zFar)
+{
+	float f = 1 / tanf(fovY / 2);
+	Matrix4 r;
+	for (int i = 0; i < 4; ++i)
+	{
+		for (int j = 0; j < 4; ++j)
+			r.m[i][j] = 0;
+	}
+	r.m[0][0] = f / aspect;
+	r.m[1][1] = f;
+	r.m[2][2] = (zFar + zNear) / (zNear - zFar);
+	r.m[2][3] = 2 * zFar * zNear / (zNear - zFar);
+	r.m[3][2] = -1;
+	return r;
+}
+
+/*
+* Transform count points by m, to homogeneous coordinates.
+*
+* m: The transform
+* x, y, z: The points
+* outX, outY, outZ, outW: Receive the transformed points; they must not
+*                         overlap the input
+*/
+void transformPoints(const Matrix4 &m, int count, const float *x, const float *y, const float *z,
+	float *outX, float *outY, float *outZ, float *outW);
+
+/*
+* The perspective divide and viewport transform: take count points from
+* clip space to the screen. (-w, -w) goes to the bottom left corner of the
+* image, (w, w) to the top right, and z gets 1/w, which is affine in screen
+* x and y and larger for nearer points, so it serves as the depth (see
+* Viewport). Points with w <= 0 get no useful position; triangles with such
+* a vertex are clipped first (see assembleClippedTriangles).
+*
+* halfWidth, halfHeight: Half the image size in pixels
+* x, y, w: The points in clip space
+* outX, outY, outZ: Receive the points on the screen
+*/
+void projectPoints(int count, float halfWidth, float halfHeight, const float *x, const float *y, const float *w,
+	float *outX, float *outY, float *outZ);
+
+// One point of projectPoints
+inline HOST_DEVICE void projectPoint(float halfWidth, float halfHeight, float x, float y, float w,
+	float &outX, float &outY, float &outZ)
+{
+	float invW = 1 / w;
+	outX = (x * invW + 1) * halfWidth;
+	outY = (y * invW + 1) * halfHeight;
+	outZ = invW;
+}
+
+#endif
@@ -24,6 +24,10 @@ typedef struct Triangle
 	Vertex v3; // third vertex
 	Vector3 normal; // normal for this face (calculated during file parsing)
 
+	// Seen through a perspective camera: the vertices' z is 1/w (see
+	// projectPoints) and the colors are interpolated perspective correct
+	bool perspective;
+
 	// bounding box
 	float minX;
 	float maxX;
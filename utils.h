@@ -4,6 +4,14 @@
 
 #include <math.h>
 
+// Functions marked HOST_DEVICE are compiled for the CPU and, when the file
+// is built by nvcc, for the GPU as well.
+#if defined(__CUDACC__)
+#define HOST_DEVICE __device__ __host__
+#else
+#define HOST_DEVICE
+#endif
+
 // Class to store 3d points
 class Vector3 {
 
@@ -13,23 +21,23 @@ class Vector3 {
       float z;
 
       // Constructor
-      Vector3(float in_x, float in_y, float in_z) :
+      HOST_DEVICE Vector3(float in_x, float in_y, float in_z) :
          x(in_x), y(in_y), z(in_z) {}
 
-      Vector3() {}
+      HOST_DEVICE Vector3() {}
 
       // Utility methods
-      Vector3 crossP(Vector3 const &v) const
+      HOST_DEVICE Vector3 crossP(Vector3 const &v) const
       {
          return Vector3(y*v.z - v.y*z, v.x*z - x*v.z, x*v.y - v.x*y);
       }
 
-      float dotP(Vector3 const &v) const
+      HOST_DEVICE float dotP(Vector3 const &v) const
       {
          return x*v.x + y*v.y + z*v.z;
       }
 
-      float length() const
+      HOST_DEVICE float length() const
       {
          return sqrtf(x*x + y*y + z*z);
       }